@@ -0,0 +1,343 @@
+/// \file analysisbench.cpp
+/// \brief Standalone program to benchmark the revamb analysis passes on the
+///        modules saved with `revamb --dump-pre-harvest`
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// LLVM includes
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/SourceMgr.h"
+
+// Local includes
+#include "argparse.h"
+#include "binaryfile.h"
+#include "functionboundariesdetection.h"
+#include "ir-helpers.h"
+#include "jumptargetmanager.h"
+#include "osra.h"
+#include "reachingdefinitions.h"
+#include "set.h"
+#include "simplifycomparisons.h"
+
+using namespace llvm;
+
+/// Number of allocations performed through operator new
+static std::atomic<uint64_t> AllocationsCount(0);
+/// Total size of the allocations performed through operator new
+static std::atomic<uint64_t> AllocatedBytes(0);
+
+void *operator new(size_t Size) {
+  AllocationsCount++;
+  AllocatedBytes += Size;
+  if (void *Result = malloc(Size == 0 ? 1 : Size))
+    return Result;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *Pointer) noexcept {
+  free(Pointer);
+}
+
+struct ProgramParameters {
+  const char *InputPath;
+  const char *BinaryPath;
+  const char *PassName;
+  int Iterations;
+  int UseSections;
+  int TimePasses;
+};
+
+/// \brief The passes which can be benchmarked
+static const char *const PassNames[] = {
+  "set",         ///< SETPass, without OSRA
+  "set-osra",    ///< SETPass, using OSRA
+  "osra",        ///< OSRAPass on the whole function
+  "sliced-osra", ///< OSRAPass on the backward slices of the stores to the PC
+  "rdp",         ///< ReachingDefinitionsPass
+  "rlp",         ///< ReachedLoadsPass
+  "crdp",        ///< ConditionalReachingDefinitionsPass
+  "crlp",        ///< ConditionalReachedLoadsPass
+  "scp",         ///< SimplifyComparisonsPass
+  "fbd",         ///< FunctionBoundariesDetectionPass
+};
+
+static const char *const Usage[] = {
+  "revamb-analysis-bench [options] --pass PASS INFILE",
+  nullptr,
+};
+
+static bool parseArgs(int Argc, const char *Argv[], ProgramParameters &Result) {
+  // Initialize argument parser
+  struct argparse Arguments;
+  struct argparse_option Options[] = {
+    OPT_HELP(),
+    OPT_STRING('p', "pass",
+               &Result.PassName,
+               "pass to run: set, set-osra, osra, sliced-osra, rdp, rlp, crdp, "
+               "crlp, scp or fbd."),
+    OPT_INTEGER('i', "iterations",
+                &Result.Iterations,
+                "how many times the pass should be run (default: 10)."),
+    OPT_STRING('b', "binary",
+               &Result.BinaryPath,
+               "path of the input binary, by default the one recorded in the "
+               "module."),
+    OPT_BOOLEAN('S', "use-sections",
+                &Result.UseSections,
+                "use section information, if available, as revamb does with "
+                "the same option."),
+    OPT_BOOLEAN(0, "time-passes",
+                &Result.TimePasses,
+                "at exit, also report the time spent in each pass, including "
+                "the analyses required by the benchmarked one."),
+    OPT_END(),
+  };
+
+  argparse_init(&Arguments, Options, Usage, 0);
+  argparse_describe(&Arguments, "\nrevamb-analysis-bench.",
+                    "\nRun one of the revamb analysis passes repeatedly on a "
+                    "module saved with revamb --dump-pre-harvest.\n");
+  Argc = argparse_parse(&Arguments, Argc, Argv);
+
+  // Handle positional arguments
+  if (Argc != 1) {
+    fprintf(stderr, "Please specify one and only one input file.\n");
+    return false;
+  }
+
+  Result.InputPath = Argv[0];
+
+  if (Result.PassName == nullptr
+      || std::find_if(std::begin(PassNames),
+                      std::end(PassNames),
+                      [&Result] (const char *Name) {
+                        return strcmp(Name, Result.PassName) == 0;
+                      }) == std::end(PassNames)) {
+    fprintf(stderr, "Please specify a valid pass (--pass).\n");
+    return false;
+  }
+
+  if (Result.Iterations <= 0) {
+    fprintf(stderr, "The number of iterations (--iterations) must be"
+                    " positive.\n");
+    return false;
+  }
+
+  return true;
+}
+
+/// \brief Create the pass called \p Name
+static Pass *createPass(StringRef Name,
+                        JumpTargetManager &JTM,
+                        SmallPtrSetImpl<BasicBlock *> &Visited) {
+  if (Name == "set")
+    return new SETPass(&JTM, false, &Visited);
+  else if (Name == "set-osra")
+    return new SETPass(&JTM, true, &Visited);
+  else if (Name == "osra")
+    return new OSRAPass();
+  else if (Name == "sliced-osra")
+    return new OSRAPass(JTM.pcReg());
+  else if (Name == "rdp")
+    return new ReachingDefinitionsPass();
+  else if (Name == "rlp")
+    return new ReachedLoadsPass();
+  else if (Name == "crdp")
+    return new ConditionalReachingDefinitionsPass();
+  else if (Name == "crlp")
+    return new ConditionalReachedLoadsPass();
+  else if (Name == "scp")
+    return new SimplifyComparisonsPass();
+  else if (Name == "fbd")
+    return new FunctionBoundariesDetectionPass(&JTM, "");
+
+  assert(false && "Unknown pass");
+  return nullptr;
+}
+
+/// \brief Load the module at \p Path and find its root function and PC
+///
+/// \return the module, or nullptr in case of error.
+static std::unique_ptr<Module> loadModule(const char *Path,
+                                          LLVMContext &Context,
+                                          Function *&Root,
+                                          GlobalVariable *&PCReg) {
+  SMDiagnostic Errors;
+  std::unique_ptr<Module> TheModule = parseIRFile(Path, Errors, Context);
+  if (!TheModule) {
+    fprintf(stderr, "Couldn't load the LLVM IR.\n");
+    return nullptr;
+  }
+
+  Root = TheModule->getFunction("root");
+  NamedMDNode *InputArchMD;
+  InputArchMD = TheModule->getNamedMetadata("revamb.input.architecture");
+  if (Root == nullptr || Root->empty() || InputArchMD == nullptr) {
+    fprintf(stderr, "The input doesn't look like a module produced by"
+                    " revamb.\n");
+    return nullptr;
+  }
+
+  QuickMetadata QMD(Context);
+  auto *Tuple = cast<MDTuple>(InputArchMD->getOperand(0));
+  PCReg = TheModule->getGlobalVariable(QMD.extract<StringRef>(Tuple, 1));
+  if (PCReg == nullptr) {
+    fprintf(stderr, "Couldn't find the PC.\n");
+    return nullptr;
+  }
+
+  return TheModule;
+}
+
+/// \brief Time, allocations and allocated bytes of an iteration
+struct Measurement {
+  double Milliseconds;
+  uint64_t Allocations;
+  uint64_t Bytes;
+};
+
+/// \brief Run the pass once on a fresh copy of the module
+///
+/// Loading the module and rebuilding the JumpTargetManager are not measured,
+/// the analyses required by the pass are.
+static bool runIteration(const ProgramParameters &Parameters,
+                         const BinaryFile &Binary,
+                         Measurement &Result) {
+  LLVMContext Context;
+  Function *Root = nullptr;
+  GlobalVariable *PCReg = nullptr;
+  std::unique_ptr<Module> TheModule = loadModule(Parameters.InputPath,
+                                                 Context,
+                                                 Root,
+                                                 PCReg);
+  if (!TheModule)
+    return false;
+
+  // Bring the module in the state harvest keeps it while analyzing it. The
+  // function boundaries detection runs on the SemanticPreservingCFG form and
+  // switches form by itself.
+  StringRef Name = Parameters.PassName;
+  JumpTargetManager JTM(Root, PCReg, Binary, true);
+  if (Name == "set-osra")
+    JTM.noReturn().registerSyscalls(Root);
+  if (Name != "fbd")
+    JTM.setCFGForm(JumpTargetManager::RecoveredOnlyCFG);
+
+  SmallPtrSet<BasicBlock *, 16> Visited;
+  legacy::FunctionPassManager FPM(TheModule.get());
+  FPM.add(createPass(Name, JTM, Visited));
+  FPM.doInitialization();
+
+  uint64_t StartAllocations = AllocationsCount;
+  uint64_t StartBytes = AllocatedBytes;
+  auto Start = std::chrono::steady_clock::now();
+
+  FPM.run(*Root);
+
+  auto End = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::milli> Elapsed = End - Start;
+  Result.Milliseconds = Elapsed.count();
+  Result.Allocations = AllocationsCount - StartAllocations;
+  Result.Bytes = AllocatedBytes - StartBytes;
+
+  FPM.doFinalization();
+
+  return true;
+}
+
+int main(int argc, const char *argv[]) {
+  ProgramParameters Parameters = { nullptr, nullptr, nullptr, 10, 0, 0 };
+
+  if (!parseArgs(argc, argv, Parameters))
+    return EXIT_FAILURE;
+
+  TimePassesIsEnabled = Parameters.TimePasses != 0;
+
+  // Find out the input binary from the module, unless specified
+  std::string BinaryPath;
+  {
+    LLVMContext Context;
+    Function *Root = nullptr;
+    GlobalVariable *PCReg = nullptr;
+    std::unique_ptr<Module> TheModule = loadModule(Parameters.InputPath,
+                                                   Context,
+                                                   Root,
+                                                   PCReg);
+    if (!TheModule)
+      return EXIT_FAILURE;
+
+    NamedMDNode *PreHarvestMD;
+    PreHarvestMD = TheModule->getNamedMetadata("revamb.pre-harvest");
+    if (Parameters.BinaryPath != nullptr) {
+      BinaryPath = Parameters.BinaryPath;
+    } else if (PreHarvestMD != nullptr && PreHarvestMD->getNumOperands() > 0) {
+      QuickMetadata QMD(Context);
+      auto *Tuple = cast<MDTuple>(PreHarvestMD->getOperand(0));
+      BinaryPath = QMD.extract<StringRef>(Tuple, 0).str();
+    } else {
+      fprintf(stderr, "The module has not been saved with"
+                      " --dump-pre-harvest, please specify the input binary"
+                      " (--binary).\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  BinaryFile Binary(BinaryPath, Parameters.UseSections != 0);
+
+  std::vector<Measurement> Measurements;
+  for (int I = 0; I < Parameters.Iterations; I++) {
+    Measurement Result;
+    if (!runIteration(Parameters, Binary, Result))
+      return EXIT_FAILURE;
+    Measurements.push_back(Result);
+  }
+
+  // Report the distribution of the times and the average allocations
+  std::vector<double> Times;
+  double Total = 0;
+  uint64_t Allocations = 0;
+  uint64_t Bytes = 0;
+  for (const Measurement &M : Measurements) {
+    Times.push_back(M.Milliseconds);
+    Total += M.Milliseconds;
+    Allocations += M.Allocations;
+    Bytes += M.Bytes;
+  }
+  std::sort(Times.begin(), Times.end());
+  uint64_t Count = Measurements.size();
+
+  printf("pass: %s\n", Parameters.PassName);
+  printf("iterations: %d\n", Parameters.Iterations);
+  printf("time-ms.min: %.3f\n", Times.front());
+  printf("time-ms.median: %.3f\n", Times[Times.size() / 2]);
+  printf("time-ms.mean: %.3f\n", Total / Times.size());
+  printf("time-ms.max: %.3f\n", Times.back());
+  printf("allocations: %llu\n",
+         static_cast<unsigned long long>(Allocations / Count));
+  printf("allocated-bytes: %llu\n",
+         static_cast<unsigned long long>(Bytes / Count));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/// \file binaryartifact.cpp
+/// \brief Implementation of the ArtifactWriter
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+// Local includes
+#include "binaryartifact.h"
+
+static uint64_t alignTo8(uint64_t Offset) {
+  return (Offset + 7) & ~uint64_t(7);
+}
+
+/// \brief Append \p Size bytes at \p Data to \p Buffer
+static void append(std::vector<char> &Buffer, const void *Data, size_t Size) {
+  const char *Start = static_cast<const char *>(Data);
+  Buffer.insert(Buffer.end(), Start, Start + Size);
+}
+
+bool ArtifactWriter::write(const std::string &Path) const {
+  // Compute the layout: header, table descriptors, column descriptors and
+  // finally the values
+  uint64_t Offset = sizeof(ArtifactHeader)
+    + Tables.size() * sizeof(ArtifactTable);
+
+  std::vector<ArtifactTable> TableDescriptors;
+  for (const PendingTable &Table : Tables) {
+    uint64_t Rows = Table.Columns.empty() ? 0 : Table.Columns[0].Values.size();
+    TableDescriptors.push_back({
+      static_cast<uint32_t>(Table.ID),
+      static_cast<uint32_t>(Table.Columns.size()),
+      Rows,
+      Offset
+    });
+    Offset += Table.Columns.size() * sizeof(ArtifactColumn);
+  }
+
+  std::vector<ArtifactColumn> ColumnDescriptors;
+  for (const PendingTable &Table : Tables) {
+    for (const PendingColumn &Column : Table.Columns) {
+      assert(Column.Values.size() == Table.Columns[0].Values.size());
+      assert(Column.ElementSize == 1
+             || Column.ElementSize == 2
+             || Column.ElementSize == 4
+             || Column.ElementSize == 8);
+      Offset = alignTo8(Offset);
+      ColumnDescriptors.push_back({ Offset, Column.ElementSize, 0 });
+      Offset += Column.Values.size() * Column.ElementSize;
+    }
+  }
+
+  // Serialize everything
+  std::vector<char> Buffer;
+  Buffer.reserve(Offset);
+
+  ArtifactHeader Header;
+  memcpy(Header.Magic, ArtifactMagic, sizeof(ArtifactMagic));
+  Header.Version = ArtifactVersion;
+  Header.TablesCount = Tables.size();
+  append(Buffer, &Header, sizeof(Header));
+
+  for (const ArtifactTable &Descriptor : TableDescriptors)
+    append(Buffer, &Descriptor, sizeof(Descriptor));
+
+  for (const ArtifactColumn &Descriptor : ColumnDescriptors)
+    append(Buffer, &Descriptor, sizeof(Descriptor));
+
+  unsigned ColumnIndex = 0;
+  for (const PendingTable &Table : Tables) {
+    for (const PendingColumn &Column : Table.Columns) {
+      Buffer.resize(ColumnDescriptors[ColumnIndex++].Offset, 0);
+      for (uint64_t Value : Column.Values) {
+        // Truncate keeping the least significant bytes
+        switch (Column.ElementSize) {
+        case 1: {
+          uint8_t Element = Value;
+          append(Buffer, &Element, sizeof(Element));
+          break;
+        }
+        case 2: {
+          uint16_t Element = Value;
+          append(Buffer, &Element, sizeof(Element));
+          break;
+        }
+        case 4: {
+          uint32_t Element = Value;
+          append(Buffer, &Element, sizeof(Element));
+          break;
+        }
+        default:
+          append(Buffer, &Value, sizeof(Value));
+          break;
+        }
+      }
+    }
+  }
+
+  std::ofstream Output(Path, std::ios::binary | std::ios::trunc);
+  if (!Output)
+    return false;
+
+  Output.write(Buffer.data(), Buffer.size());
+  Output.close();
+  return !Output.fail();
+}
@@ -0,0 +1,304 @@
+#ifndef _BINARYARTIFACT_H
+#define _BINARYARTIFACT_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// System includes
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// \file binaryartifact.h
+/// \brief Layout of the binary analysis artifact and a reader for it
+///
+/// The artifact collects in a single file the tables produced by revamb about
+/// the input binary. It starts with an ArtifactHeader followed by one
+/// ArtifactTable descriptor for each table, each one pointing to the
+/// ArtifactColumn descriptors of its columns. The values of each column are
+/// stored contiguously, in the host endianess, aligned to 8 bytes, so that
+/// they can be used directly from a memory mapping of the file.
+///
+/// This header has no dependency: tools consuming the artifact can simply
+/// include it and use ArtifactReader.
+
+/// \brief The tables in the artifact, and their columns
+enum class ArtifactTableID : uint32_t {
+  /// Address (8 bytes), Reasons (4 bytes, a JTReason bitmask)
+  JumpTargets = 1,
+  /// Address (8 bytes), Size (4 bytes), IsJumpTarget (1 byte)
+  Coverage = 2,
+  /// Start (8 bytes), End (8 bytes), FileOffset (8 bytes), FileSize (8 bytes),
+  /// Flags (1 byte, ArtifactSegmentFlags)
+  Segments = 3,
+  /// Function entry address (8 bytes), basic block address (8 bytes)
+  FunctionBoundaries = 4,
+  /// Basic block address (8 bytes)
+  Noreturn = 5
+};
+
+/// \brief Flags in the Flags column of the Segments table
+enum ArtifactSegmentFlags : uint8_t {
+  SegmentReadable = 1,
+  SegmentWriteable = 2,
+  SegmentExecutable = 4
+};
+
+struct ArtifactHeader {
+  char Magic[8]; ///< "RVARTFCT"
+  uint32_t Version;
+  uint32_t TablesCount;
+};
+
+struct ArtifactTable {
+  uint32_t ID; ///< an ArtifactTableID
+  uint32_t ColumnsCount;
+  uint64_t RowsCount;
+  uint64_t ColumnsOffset; ///< offset of the first ArtifactColumn
+};
+
+struct ArtifactColumn {
+  uint64_t Offset; ///< offset of the first value
+  uint32_t ElementSize; ///< size of each value: 1, 2, 4 or 8 bytes
+  uint32_t Reserved;
+};
+
+static const char ArtifactMagic[8] = { 'R', 'V', 'A', 'R', 'T', 'F', 'C', 'T' };
+static const uint32_t ArtifactVersion = 1;
+
+/// \brief Read-only view of an artifact, mapped in memory
+class ArtifactReader {
+public:
+  /// \brief A column of a table, its values are read in place
+  class Column {
+  public:
+    Column() : Data(nullptr), Size(0), ElementSize(0) { }
+    Column(const uint8_t *Data, uint64_t Size, uint32_t ElementSize) :
+      Data(Data),
+      Size(Size),
+      ElementSize(ElementSize) { }
+
+    uint64_t size() const { return Size; }
+    uint32_t elementSize() const { return ElementSize; }
+    const void *data() const { return Data; }
+
+    /// \brief Return the \p Index-th value, zero-extended
+    uint64_t operator[](uint64_t Index) const {
+      const uint8_t *Element = Data + Index * ElementSize;
+      switch (ElementSize) {
+      case 1:
+        return *Element;
+      case 2: {
+        uint16_t Result;
+        memcpy(&Result, Element, sizeof(Result));
+        return Result;
+      }
+      case 4: {
+        uint32_t Result;
+        memcpy(&Result, Element, sizeof(Result));
+        return Result;
+      }
+      default: {
+        uint64_t Result;
+        memcpy(&Result, Element, sizeof(Result));
+        return Result;
+      }
+      }
+    }
+
+  private:
+    const uint8_t *Data;
+    uint64_t Size;
+    uint32_t ElementSize;
+  };
+
+public:
+  ArtifactReader() : Mapping(nullptr), MappingSize(0) { }
+  ArtifactReader(const ArtifactReader &) = delete;
+  ArtifactReader &operator=(const ArtifactReader &) = delete;
+  ~ArtifactReader() { close(); }
+
+  /// \brief Map the artifact at \p Path
+  ///
+  /// \return false if the file can't be mapped or it's not a valid artifact
+  ///         of the supported version.
+  bool open(const std::string &Path) {
+    close();
+
+    int FD = ::open(Path.c_str(), O_RDONLY);
+    if (FD == -1)
+      return false;
+
+    struct stat Stat;
+    if (fstat(FD, &Stat) != 0
+        || static_cast<uint64_t>(Stat.st_size) < sizeof(ArtifactHeader)) {
+      ::close(FD);
+      return false;
+    }
+
+    void *Result = mmap(nullptr, Stat.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+    ::close(FD);
+    if (Result == MAP_FAILED)
+      return false;
+
+    Mapping = static_cast<const uint8_t *>(Result);
+    MappingSize = Stat.st_size;
+
+    if (!validate()) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (Mapping != nullptr)
+      munmap(const_cast<uint8_t *>(Mapping), MappingSize);
+    Mapping = nullptr;
+    MappingSize = 0;
+  }
+
+  /// \brief Return the descriptor of the table \p ID, or nullptr
+  const ArtifactTable *table(ArtifactTableID ID) const {
+    for (const ArtifactTable &Table : tables())
+      if (Table.ID == static_cast<uint32_t>(ID))
+        return &Table;
+    return nullptr;
+  }
+
+  /// \brief Return the number of rows of the table \p ID, 0 if it's missing
+  uint64_t rows(ArtifactTableID ID) const {
+    const ArtifactTable *Table = table(ID);
+    return Table != nullptr ? Table->RowsCount : 0;
+  }
+
+  /// \brief Return the \p Index-th column of the table \p ID, an empty one if
+  ///        it's missing
+  Column column(ArtifactTableID ID, unsigned Index) const {
+    const ArtifactTable *Table = table(ID);
+    if (Table == nullptr || Index >= Table->ColumnsCount)
+      return Column();
+
+    ArtifactColumn Descriptor;
+    memcpy(&Descriptor,
+           Mapping + Table->ColumnsOffset + Index * sizeof(ArtifactColumn),
+           sizeof(Descriptor));
+    return Column(Mapping + Descriptor.Offset,
+                  Table->RowsCount,
+                  Descriptor.ElementSize);
+  }
+
+private:
+  struct TableRange {
+    const ArtifactTable *Begin;
+    const ArtifactTable *End;
+    const ArtifactTable *begin() const { return Begin; }
+    const ArtifactTable *end() const { return End; }
+  };
+
+  const ArtifactHeader *header() const {
+    return reinterpret_cast<const ArtifactHeader *>(Mapping);
+  }
+
+  TableRange tables() const {
+    if (Mapping == nullptr)
+      return { nullptr, nullptr };
+
+    auto *Begin = reinterpret_cast<const ArtifactTable *>(header() + 1);
+    return { Begin, Begin + header()->TablesCount };
+  }
+
+  /// \brief Check that all the descriptors and the columns are in the file
+  bool validate() const {
+    const ArtifactHeader *Header = header();
+    if (memcmp(Header->Magic, ArtifactMagic, sizeof(ArtifactMagic)) != 0
+        || Header->Version != ArtifactVersion)
+      return false;
+
+    uint64_t TablesEnd = sizeof(ArtifactHeader)
+      + Header->TablesCount * uint64_t(sizeof(ArtifactTable));
+    if (TablesEnd > MappingSize)
+      return false;
+
+    // The offsets come from the file, check them without overflowing
+    auto Fits = [this] (uint64_t Offset, uint64_t Count, uint64_t Size) {
+      return Offset <= MappingSize && Count <= (MappingSize - Offset) / Size;
+    };
+
+    for (const ArtifactTable &Table : tables()) {
+      if (!Fits(Table.ColumnsOffset,
+                Table.ColumnsCount,
+                sizeof(ArtifactColumn)))
+        return false;
+
+      for (unsigned I = 0; I < Table.ColumnsCount; I++) {
+        ArtifactColumn Descriptor;
+        memcpy(&Descriptor,
+               Mapping + Table.ColumnsOffset + I * sizeof(ArtifactColumn),
+               sizeof(Descriptor));
+        uint32_t Size = Descriptor.ElementSize;
+        if ((Size != 1 && Size != 2 && Size != 4 && Size != 8)
+            || !Fits(Descriptor.Offset, Table.RowsCount, Size))
+          return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  const uint8_t *Mapping;
+  uint64_t MappingSize;
+};
+
+/// \brief Build an artifact in memory and write it to a file
+///
+/// The values of each column are collected as 64-bit integers and truncated to
+/// the size of the column when written.
+class ArtifactWriter {
+public:
+  /// \brief Add a table, return its index to use with addColumn
+  unsigned addTable(ArtifactTableID ID) {
+    Tables.push_back({ ID, { } });
+    return Tables.size() - 1;
+  }
+
+  /// \brief Add a column of \p ElementSize bytes with \p Values to the table
+  ///        \p Table
+  ///
+  /// All the columns of a table must have the same number of values.
+  void addColumn(unsigned Table,
+                 uint32_t ElementSize,
+                 std::vector<uint64_t> Values) {
+    Tables[Table].Columns.push_back({ ElementSize, std::move(Values) });
+  }
+
+  /// \brief Write the artifact to \p Path
+  ///
+  /// \return false in case of error.
+  bool write(const std::string &Path) const;
+
+private:
+  struct PendingColumn {
+    uint32_t ElementSize;
+    std::vector<uint64_t> Values;
+  };
+
+  struct PendingTable {
+    ArtifactTableID ID;
+    std::vector<PendingColumn> Columns;
+  };
+
+  std::vector<PendingTable> Tables;
+};
+
+#endif // _BINARYARTIFACT_H
@@ -6,7 +6,10 @@
 //
 
 // Standard includes
+#include <algorithm>
+#include <set>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 
@@ -33,7 +36,9 @@ using namespace llvm;
 
 using std::make_pair;
 
-BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
+BinaryFile::BinaryFile(std::string FilePath, bool UseSections) :
+  FilePath(FilePath)
+{
   auto BinaryOrErr = object::createBinary(FilePath);
   assert(BinaryOrErr && "Couldn't open the input file");
 
@@ -45,6 +50,7 @@ BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
   unsigned InstructionAlignment = 0;
   StringRef SyscallHelper = "";
   StringRef SyscallNumberRegister = "";
+  StringRef SyscallResultRegister = "";
   ArrayRef<uint64_t> NoReturnSyscalls = { };
   unsigned DelaySlotSize = 0;
   switch (TheBinary->getArch()) {
@@ -52,6 +58,7 @@ BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
     InstructionAlignment = 1;
     SyscallHelper = "helper_syscall";
     SyscallNumberRegister = "rax";
+    SyscallResultRegister = "rax";
     NoReturnSyscalls = {
       0xe7, // exit_group
       0x3c, // exit
@@ -62,6 +69,7 @@ BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
     InstructionAlignment = 4;
     SyscallHelper = "helper_exception_with_syndrome";
     SyscallNumberRegister = "r7";
+    SyscallResultRegister = "r0";
     NoReturnSyscalls = {
       0xf8, // exit_group
       0x1, // exit
@@ -72,6 +80,7 @@ BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
     InstructionAlignment = 4;
     SyscallHelper = "helper_raise_exception";
     SyscallNumberRegister = "v0";
+    SyscallResultRegister = "v0";
     NoReturnSyscalls = {
       0x1096, // exit_group
       0xfa1, // exit
@@ -90,6 +99,7 @@ BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
                                  TheBinary->getBytesInAddress() * 8,
                                  SyscallHelper,
                                  SyscallNumberRegister,
+                                 SyscallResultRegister,
                                  NoReturnSyscalls,
                                  DelaySlotSize);
 
@@ -111,6 +121,35 @@ BinaryFile::BinaryFile(std::string FilePath, bool UseSections) {
   } else {
     assert("Unexpect address size");
   }
+
+  buildAddressIndex();
+}
+
+void BinaryFile::buildAddressIndex() {
+  auto CompareStart = [] (const SegmentInfo &A, const SegmentInfo &B) {
+    return A.StartVirtualAddress < B.StartVirtualAddress;
+  };
+  std::stable_sort(Segments.begin(), Segments.end(), CompareStart);
+
+  using Range = std::pair<uint64_t, uint64_t>;
+  std::vector<Range> Ranges;
+  for (SegmentInfo &Segment : Segments)
+    Segment.insertExecutableRanges(std::back_inserter(Ranges));
+  std::sort(Ranges.begin(), Ranges.end());
+
+  // Merge overlapping ranges (e.g., the same section registered by multiple
+  // segments), so that lookups can simply use a binary search
+  ExecutableRanges.clear();
+  for (Range &R : Ranges) {
+    if (R.first >= R.second)
+      continue;
+
+    if (!ExecutableRanges.empty() && R.first < ExecutableRanges.back().second)
+      ExecutableRanges.back().second = std::max(ExecutableRanges.back().second,
+                                                R.second);
+    else
+      ExecutableRanges.push_back(R);
+  }
 }
 
 template<typename T>
@@ -143,8 +182,17 @@ void BinaryFile::parseELF(object::ObjectFile *TheBinary, bool UseSections) {
     }
   }
 
-  // If we found a symbol table
-  if (SymtabShdr != nullptr && SymtabShdr->sh_link != 0) {
+  // If we found a symbol table, parse it the first time it's requested. The
+  // ELFFile is recreated, the section headers point to the input file anyway.
+  StringRef ELFData = TheBinary->getData();
+  ParseSymbols = [ELFData, SymtabShdr] (BinaryFile &Binary) {
+    if (SymtabShdr == nullptr || SymtabShdr->sh_link == 0)
+      return;
+
+    std::error_code EC;
+    object::ELFFile<T> TheELF(ELFData, EC);
+    assert(!EC && "Error while loading the ELF file");
+
     // Obtain a reference to the string table
     auto *Strtab = TheELF.getSection(SymtabShdr->sh_link).get();
     auto StrtabArray = TheELF.getSectionContents(Strtab).get();
@@ -153,13 +201,13 @@ void BinaryFile::parseELF(object::ObjectFile *TheBinary, bool UseSections) {
 
     // Collect symbol names
     for (auto &Symbol : TheELF.symbols(SymtabShdr)) {
-      Symbols.push_back({
+      Binary.Symbols.push_back({
         Symbol.getName(StrtabContent).get(),
         Symbol.st_value,
         Symbol.st_size
       });
     }
-  }
+  };
 
   const auto *ElfHeader = TheELF.getHeader();
   EntryPoint = static_cast<uint64_t>(ElfHeader->e_entry);
@@ -185,6 +233,7 @@ void BinaryFile::parseELF(object::ObjectFile *TheBinary, bool UseSections) {
 
         auto ActualAddress = TheELF.base() + ProgramHeader.p_offset;
         Segment.Data = ArrayRef<uint8_t>(ActualAddress, ProgramHeader.p_filesz);
+        Segment.FileOffset = ProgramHeader.p_offset;
 
         // If it's an executable segment, and we've been asked so, register
         // which sections actually contain code
@@ -223,21 +272,27 @@ void BinaryFile::parseELF(object::ObjectFile *TheBinary, bool UseSections) {
 
   }
 
-  Optional<uint64_t> FDEsCount;
-  if (EHFrameHdrAddress) {
-    uint64_t Address;
+  // Collect the landing pads the first time they're requested
+  ParseLandingPads = [EHFrameAddress, EHFrameSize, EHFrameHdrAddress]
+    (BinaryFile &Binary) {
+    Optional<uint64_t> Address = EHFrameAddress;
+    Optional<uint64_t> FDEsCount;
+    std::vector<uint64_t> FDEs;
+    if (EHFrameHdrAddress) {
+      uint64_t HdrAddress;
+
+      std::tie(HdrAddress, FDEsCount) =
+        Binary.ehFrameFromEhFrameHdr<T>(*EHFrameHdrAddress, FDEs);
+      if (Address) {
+        assert(*Address == HdrAddress);
+      }
 
-    std::tie(Address, FDEsCount) = ehFrameFromEhFrameHdr<T>(*EHFrameHdrAddress);
-    if (EHFrameAddress) {
-      assert(*EHFrameAddress == Address);
+      Address = HdrAddress;
     }
 
-    EHFrameAddress = Address;
-  }
-
-  if (EHFrameAddress)
-    parseEHFrame<T>(*EHFrameAddress, FDEsCount, EHFrameSize);
-
+    if (Address)
+      Binary.parseEHFrame<T>(*Address, FDEsCount, EHFrameSize, FDEs);
+  };
 }
 
 //
@@ -344,7 +399,9 @@ private:
 
     if (Value != 0) {
       int EncodingRelative = Encoding & 0x70;
-      assert(EncodingRelative == 0 || EncodingRelative == 0x10);
+      assert(EncodingRelative == 0
+             || EncodingRelative == dwarf::DW_EH_PE_pcrel
+             || EncodingRelative == dwarf::DW_EH_PE_datarel);
 
       Result = Base;
       if (std::numeric_limits<T>::is_signed)
@@ -371,9 +428,11 @@ template<> bool DwarfReader<object::ELF32LE>::is64() const { return false; }
 template<> bool DwarfReader<object::ELF64BE>::is64() const { return true; }
 template<> bool DwarfReader<object::ELF64LE>::is64() const { return true; }
 
+
 template<typename T>
 std::pair<uint64_t, uint64_t>
-BinaryFile::ehFrameFromEhFrameHdr(uint64_t EHFrameHdrAddress) {
+BinaryFile::ehFrameFromEhFrameHdr(uint64_t EHFrameHdrAddress,
+                                  std::vector<uint64_t> &FDEs) {
   auto R = getAddressData(EHFrameHdrAddress);
   assert(R && ".eh_frame_hdr section not available in any segment");
   llvm::ArrayRef<uint8_t> EHFrameHdr = *R;
@@ -390,30 +449,66 @@ BinaryFile::ehFrameFromEhFrameHdr(uint64_t EHFrameHdrAddress) {
   unsigned FDEsCountEncoding = EHFrameHdrReader.readNextU8();
 
   // LookupTableEncoding
-  EHFrameHdrReader.readNextU8();
+  unsigned LookupTableEncoding = EHFrameHdrReader.readNextU8();
 
   Pointer EHFramePointer = EHFrameHdrReader.readPointer(ExceptionFrameEncoding);
   Pointer FDEsCountPointer = EHFrameHdrReader.readPointer(FDEsCountEncoding);
+  uint64_t FDEsCount = getPointer<T>(FDEsCountPointer);
+
+  // The binary search table is a list of (initial location, FDE address)
+  // pairs, usually relative to the start of .eh_frame_hdr
+  unsigned Relative = LookupTableEncoding & 0x70;
+  if (LookupTableEncoding != dwarf::DW_EH_PE_omit
+      && (LookupTableEncoding & dwarf::DW_EH_PE_indirect) == 0
+      && (Relative == dwarf::DW_EH_PE_absptr
+          || Relative == dwarf::DW_EH_PE_datarel)) {
+    FDEs.reserve(FDEsCount);
+    for (uint64_t I = 0; I < FDEsCount; I++) {
+      // InitialLocation
+      EHFrameHdrReader.readPointer(LookupTableEncoding, EHFrameHdrAddress);
+
+      Pointer FDE = EHFrameHdrReader.readPointer(LookupTableEncoding,
+                                                 EHFrameHdrAddress);
+      FDEs.push_back(FDE.value());
+    }
+  }
 
-  return { getPointer<T>(EHFramePointer), getPointer<T>(FDEsCountPointer) };
+  return { getPointer<T>(EHFramePointer), FDEsCount };
 }
 
+/// \brief Parser for the entries of an .eh_frame section, collecting the
+///        landing pads
+///
+/// Each instance caches the CIEs it meets, therefore multiple instances can
+/// parse different FDEs of the same section concurrently.
 template<typename T>
-void BinaryFile::parseEHFrame(uint64_t EHFrameAddress,
-                              Optional<uint64_t> FDEsCount,
-                              Optional<uint64_t> EHFrameSize) {
-  assert(FDEsCount || EHFrameSize);
-
-  auto R = getAddressData(EHFrameAddress);
-
-  // Sometimes the .eh_frame section is present but not mapped in memory. This
-  // means it cannot be used at runtime, therefore we can ignore it.
-  if (!R)
-    return;
-  llvm::ArrayRef<uint8_t> EHFrame = *R;
+class EHFrameParser {
+public:
+  EHFrameParser(const BinaryFile &Binary,
+                ArrayRef<uint8_t> EHFrame,
+                uint64_t EHFrameAddress,
+                std::set<uint64_t> &LandingPads) :
+    Binary(Binary),
+    EHFrame(EHFrame),
+    EHFrameAddress(EHFrameAddress),
+    LandingPads(LandingPads) { }
+
+  /// \brief Parse the CIE or the FDE at \p StartOffset
+  ///
+  /// \param IsFDE if not nullptr, where to store whether it was an FDE.
+  ///
+  /// \return the offset of the next entry.
+  uint64_t parseEntry(uint64_t StartOffset, bool *IsFDE = nullptr);
 
-  DwarfReader<T> EHFrameReader(EHFrame, EHFrameAddress);
+private:
+  /// \brief Parse an LSDA to collect its landing pads
+  ///
+  /// \param FDEStart the start address of the FDE to which this LSDA is
+  ///        associated
+  /// \param LSDAAddress the address of the target LSDA
+  void parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress);
 
+private:
   // A few fields of the CIE are used when decoding the FDE's.  This struct
   // will cache those fields we need so that we don't have to decode it
   // repeatedly for each FDE that references it.
@@ -423,161 +518,167 @@ void BinaryFile::parseEHFrame(uint64_t EHFrameAddress,
     bool hasAugmentationLength;
   };
 
-  // Map from the start offset of the CIE to the cached data for that CIE.
+  const BinaryFile &Binary;
+  ArrayRef<uint8_t> EHFrame;
+  uint64_t EHFrameAddress;
+  std::set<uint64_t> &LandingPads;
+
+  /// Map from the start offset of the CIE to the cached data for that CIE
   DenseMap<uint64_t, DecodedCIE> CachedCIEs;
-  unsigned FDEIndex = 0;
+};
 
-  while (!EHFrameReader.eof()
-         && ((FDEsCount && FDEIndex < *FDEsCount)
-             || (EHFrameSize && EHFrameReader.offset() < *EHFrameSize))) {
+template<typename T>
+uint64_t EHFrameParser<T>::parseEntry(uint64_t StartOffset, bool *IsFDE) {
+  DwarfReader<T> EHFrameReader(EHFrame, EHFrameAddress);
+  EHFrameReader.moveTo(StartOffset);
 
-    uint64_t StartOffset = EHFrameReader.offset();
+  if (IsFDE != nullptr)
+    *IsFDE = false;
 
-    // Read the length of the entry
-    uint64_t Length = EHFrameReader.readNextU32();
-    if (Length == 0xffffffff)
-      Length = EHFrameReader.readNextU64();
+  // Read the length of the entry
+  uint64_t Length = EHFrameReader.readNextU32();
+  if (Length == 0xffffffff)
+    Length = EHFrameReader.readNextU64();
 
-    // Compute the end offset of the entry
-    uint64_t OffsetAfterLength = EHFrameReader.offset();
-    uint64_t EndOffset = OffsetAfterLength + Length;
+  // Compute the end offset of the entry
+  uint64_t OffsetAfterLength = EHFrameReader.offset();
+  uint64_t EndOffset = OffsetAfterLength + Length;
 
-    // Zero-sized entry, skip it
-    if (Length == 0) {
-      assert(EHFrameReader.offset() == EndOffset);
-      continue;
-    }
+  // Zero-sized entry, skip it
+  if (Length == 0)
+    return EndOffset;
 
-    // Get the entry ID, 0 means it's a CIE, otherwise it's a FDE
-    uint32_t ID = EHFrameReader.readNextU32();
-    if (ID == 0) {
-      // This is a CIE
-      DBG("ehframe", dbg << "New CIE\n");
-
-      // Ensure the version is the one we expect
-      uint32_t Version = EHFrameReader.readNextU8();
-      assert(Version == 1);
-
-      // Parse a null terminated augmentation string
-      SmallString<8> AugmentationString;
-      for (uint8_t Char = EHFrameReader.readNextU8();
-           Char != 0;
-           Char = EHFrameReader.readNextU8())
-        AugmentationString.push_back(Char);
-
-      // Optionally parse the EH data if the augmentation string says it's
-      // there
-      if (StringRef(AugmentationString).count("eh") != 0)
-        EHFrameReader.readNextU();
-
-      // CodeAlignmentFactor
-      EHFrameReader.readULEB128();
+  // Get the entry ID, 0 means it's a CIE, otherwise it's a FDE
+  uint32_t ID = EHFrameReader.readNextU32();
+  if (ID == 0) {
+    // This is a CIE
+    DBG("ehframe", dbg << "New CIE\n");
 
-      // DataAlignmentFactor
-      EHFrameReader.readULEB128();
+    // Ensure the version is the one we expect
+    uint32_t Version = EHFrameReader.readNextU8();
+    assert(Version == 1);
 
-      // ReturnAddressRegister
-      EHFrameReader.readNextU8();
-
-      Optional<uint64_t> AugmentationLength;
-      Optional<uint32_t> LSDAPointerEncoding;
-      Optional<uint32_t> PersonalityEncoding;
-      Optional<uint32_t> FDEPointerEncoding;
-      if (!AugmentationString.empty() && AugmentationString.front() == 'z') {
-        AugmentationLength = EHFrameReader.readULEB128();
-
-        // Walk the augmentation string to get all the augmentation data.
-        for (unsigned i = 1, e = AugmentationString.size(); i != e; ++i) {
-          char Char = AugmentationString[i];
-          switch (Char) {
-            case 'e':
-              assert((i + 1) != e && AugmentationString[i + 1] == 'h' &&
-                     "Expected 'eh' in augmentation string");
-              break;
-            case 'L':
-              // This is the only information we really care about, all the rest
-              // is processed just so we can get here
-              assert(!LSDAPointerEncoding && "Duplicate LSDA encoding");
-              LSDAPointerEncoding = EHFrameReader.readNextU8();
-              break;
-            case 'P': {
-              assert(!PersonalityEncoding && "Duplicate personality");
-              PersonalityEncoding = EHFrameReader.readNextU8();
-              // Personality
-              Pointer Personality;
-              Personality = EHFrameReader.readPointer(*PersonalityEncoding);
-              uint64_t PersonalityPtr = getPointer<T>(Personality);
-              DBG("ehframe", {
-                  dbg << "Personality function: " << PersonalityPtr << "\n";
-                });
-              // TODO: technically this is not a landing pad
-              LandingPads.insert(PersonalityPtr);
-              break;
-            }
-            case 'R':
-              assert(!FDEPointerEncoding && "Duplicate FDE encoding");
-              FDEPointerEncoding = EHFrameReader.readNextU8();
-              break;
-            case 'z':
-              llvm_unreachable("'z' must be first in the augmentation string");
+    // Parse a null terminated augmentation string
+    SmallString<8> AugmentationString;
+    for (uint8_t Char = EHFrameReader.readNextU8();
+         Char != 0;
+         Char = EHFrameReader.readNextU8())
+      AugmentationString.push_back(Char);
+
+    // Optionally parse the EH data if the augmentation string says it's there
+    if (StringRef(AugmentationString).count("eh") != 0)
+      EHFrameReader.readNextU();
+
+    // CodeAlignmentFactor
+    EHFrameReader.readULEB128();
+
+    // DataAlignmentFactor
+    EHFrameReader.readULEB128();
+
+    // ReturnAddressRegister
+    EHFrameReader.readNextU8();
+
+    Optional<uint64_t> AugmentationLength;
+    Optional<uint32_t> LSDAPointerEncoding;
+    Optional<uint32_t> PersonalityEncoding;
+    Optional<uint32_t> FDEPointerEncoding;
+    if (!AugmentationString.empty() && AugmentationString.front() == 'z') {
+      AugmentationLength = EHFrameReader.readULEB128();
+
+      // Walk the augmentation string to get all the augmentation data.
+      for (unsigned i = 1, e = AugmentationString.size(); i != e; ++i) {
+        char Char = AugmentationString[i];
+        switch (Char) {
+          case 'e':
+            assert((i + 1) != e && AugmentationString[i + 1] == 'h' &&
+                   "Expected 'eh' in augmentation string");
+            break;
+          case 'L':
+            // This is the only information we really care about, all the rest
+            // is processed just so we can get here
+            assert(!LSDAPointerEncoding && "Duplicate LSDA encoding");
+            LSDAPointerEncoding = EHFrameReader.readNextU8();
+            break;
+          case 'P': {
+            assert(!PersonalityEncoding && "Duplicate personality");
+            PersonalityEncoding = EHFrameReader.readNextU8();
+            // Personality
+            Pointer Personality;
+            Personality = EHFrameReader.readPointer(*PersonalityEncoding);
+            uint64_t PersonalityPtr = Binary.getPointer<T>(Personality);
+            DBG("ehframe", {
+                dbg << "Personality function: " << PersonalityPtr << "\n";
+              });
+            // TODO: technically this is not a landing pad
+            LandingPads.insert(PersonalityPtr);
+            break;
           }
+          case 'R':
+            assert(!FDEPointerEncoding && "Duplicate FDE encoding");
+            FDEPointerEncoding = EHFrameReader.readNextU8();
+            break;
+          case 'z':
+            llvm_unreachable("'z' must be first in the augmentation string");
         }
       }
+    }
 
-      // Cache this entry
-      CachedCIEs[StartOffset] = {
-        FDEPointerEncoding,
-        LSDAPointerEncoding,
-        AugmentationLength.hasValue()
-      };
+    // Cache this entry
+    CachedCIEs[StartOffset] = {
+      FDEPointerEncoding,
+      LSDAPointerEncoding,
+      AugmentationLength.hasValue()
+    };
 
-    } else {
-      // This is an FDE
-      FDEIndex++;
-
-      // The CIE pointer for an FDE is the same location as the ID which we
-      // already read
-      uint64_t CIEOffset = OffsetAfterLength - ID;
-
-      // Ensure we already met this CIE
-      auto CIEIt = CachedCIEs.find(CIEOffset);
-      assert(CIEIt != CachedCIEs.end()
-             && "Couldn't find CIE at offset in to __eh_frame section");
-
-      // Ensure we have at least the pointer encoding
-      const DecodedCIE &CIE = CIEIt->getSecond();
-      assert(CIE.FDEPointerEncoding &&
-             "FDE references CIE which did not set pointer encoding");
-
-      // PCBegin
-      auto PCBeginPointer = EHFrameReader.readPointer(*CIE.FDEPointerEncoding);
-      uint64_t PCBegin = getPointer<T>(PCBeginPointer);
-      DBG("ehframe", dbg << "PCBegin: " << std::hex << PCBegin << "\n");
-
-      // PCRange
-      EHFrameReader.readPointer(*CIE.FDEPointerEncoding);
-
-      if (CIE.hasAugmentationLength)
-        EHFrameReader.readULEB128();
-
-      // Decode the LSDA if the CIE augmentation string said we should.
-      if (CIE.LSDAPointerEncoding) {
-        auto LSDAPointer = EHFrameReader.readPointer(*CIE.LSDAPointerEncoding);
-        parseLSDA<T>(PCBegin, getPointer<T>(LSDAPointer));
-      }
+  } else {
+    // This is an FDE
+    if (IsFDE != nullptr)
+      *IsFDE = true;
+
+    // The CIE pointer for an FDE is the same location as the ID which we
+    // already read
+    uint64_t CIEOffset = OffsetAfterLength - ID;
+
+    // Parse the CIE, unless we already met it
+    auto CIEIt = CachedCIEs.find(CIEOffset);
+    if (CIEIt == CachedCIEs.end()) {
+      parseEntry(CIEOffset);
+      CIEIt = CachedCIEs.find(CIEOffset);
     }
+    assert(CIEIt != CachedCIEs.end()
+           && "Couldn't find CIE at offset in to __eh_frame section");
+
+    // Ensure we have at least the pointer encoding
+    DecodedCIE CIE = CIEIt->getSecond();
+    assert(CIE.FDEPointerEncoding &&
+           "FDE references CIE which did not set pointer encoding");
+
+    // PCBegin
+    auto PCBeginPointer = EHFrameReader.readPointer(*CIE.FDEPointerEncoding);
+    uint64_t PCBegin = Binary.getPointer<T>(PCBeginPointer);
+    DBG("ehframe", dbg << "PCBegin: " << std::hex << PCBegin << "\n");
+
+    // PCRange
+    EHFrameReader.readPointer(*CIE.FDEPointerEncoding);
+
+    if (CIE.hasAugmentationLength)
+      EHFrameReader.readULEB128();
 
-    // Skip all the remaining parts
-    EHFrameReader.moveTo(EndOffset);
+    // Decode the LSDA if the CIE augmentation string said we should.
+    if (CIE.LSDAPointerEncoding) {
+      auto LSDAPointer = EHFrameReader.readPointer(*CIE.LSDAPointerEncoding);
+      parseLSDA(PCBegin, Binary.getPointer<T>(LSDAPointer));
+    }
   }
 
+  return EndOffset;
 }
 
 template<typename T>
-void BinaryFile::parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress) {
+void EHFrameParser<T>::parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress) {
   DBG("ehframe", dbg << "LSDAAddress: " << std::hex << LSDAAddress << "\n");
 
-  auto R = getAddressData(LSDAAddress);
+  auto R = Binary.getAddressData(LSDAAddress);
   assert(R && "LSDA not available in any segment");
   llvm::ArrayRef<uint8_t> LSDA = *R;
 
@@ -587,7 +688,7 @@ void BinaryFile::parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress) {
   uint64_t LandingPadBase = 0;
   if (LandingPadBaseEncoding != dwarf::DW_EH_PE_omit) {
     auto LandingPadBasePointer = LSDAReader.readPointer(LandingPadBaseEncoding);
-    LandingPadBase = getPointer<T>(LandingPadBasePointer);
+    LandingPadBase = Binary.getPointer<T>(LandingPadBasePointer);
   } else {
     LandingPadBase = FDEStart;
   }
@@ -613,7 +714,7 @@ void BinaryFile::parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress) {
     // LandingPad
     Pointer LandingPadPointer = LSDAReader.readPointer(CallSiteTableEncoding,
                                                        LandingPadBase);
-    uint64_t LandingPad = getPointer<T>(LandingPadPointer);
+    uint64_t LandingPad = Binary.getPointer<T>(LandingPadPointer);
 
     // Action
     LSDAReader.readULEB128();
@@ -627,3 +728,75 @@ void BinaryFile::parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress) {
     }
   }
 }
+
+template<typename T>
+void BinaryFile::parseEHFrame(uint64_t EHFrameAddress,
+                              Optional<uint64_t> FDEsCount,
+                              Optional<uint64_t> EHFrameSize,
+                              const std::vector<uint64_t> &FDEs) {
+  assert(FDEsCount || EHFrameSize);
+
+  auto R = getAddressData(EHFrameAddress);
+
+  // Sometimes the .eh_frame section is present but not mapped in memory. This
+  // means it cannot be used at runtime, therefore we can ignore it.
+  if (!R)
+    return;
+  llvm::ArrayRef<uint8_t> EHFrame = *R;
+
+  // Without the list of the FDEs, walk all the entries in order
+  if (FDEs.empty()) {
+    EHFrameParser<T> Parser(*this, EHFrame, EHFrameAddress, LandingPads);
+    uint64_t Offset = 0;
+    unsigned FDEIndex = 0;
+    while (Offset < EHFrame.size()
+           && ((FDEsCount && FDEIndex < *FDEsCount)
+               || (EHFrameSize && Offset < *EHFrameSize))) {
+      bool IsFDE;
+      Offset = Parser.parseEntry(Offset, &IsFDE);
+      if (IsFDE)
+        FDEIndex++;
+    }
+
+    return;
+  }
+
+  // Split the FDEs in chunks parsed in parallel, each one collecting its own
+  // set of landing pads. Debug output from multiple threads would be
+  // interleaved, and small sets of FDEs are not worth the threads.
+  const size_t MinFDEsPerJob = 1024;
+  size_t Jobs = DebuggingEnabled ? 1 : std::thread::hardware_concurrency();
+  Jobs = std::min(Jobs, (FDEs.size() + MinFDEsPerJob - 1) / MinFDEsPerJob);
+  Jobs = std::max<size_t>(Jobs, 1);
+  size_t ChunkSize = (FDEs.size() + Jobs - 1) / Jobs;
+
+  std::vector<std::set<uint64_t>> ChunksLandingPads(Jobs);
+  auto Parse = [this, &FDEs, EHFrame, EHFrameAddress, ChunkSize,
+                &ChunksLandingPads] (size_t Job) {
+    EHFrameParser<T> Parser(*this,
+                            EHFrame,
+                            EHFrameAddress,
+                            ChunksLandingPads[Job]);
+    size_t Begin = std::min(Job * ChunkSize, FDEs.size());
+    size_t End = std::min(Begin + ChunkSize, FDEs.size());
+    for (size_t I = Begin; I < End; I++) {
+      // Ignore FDEs outside the mapped part of .eh_frame
+      if (FDEs[I] < EHFrameAddress
+          || FDEs[I] - EHFrameAddress >= EHFrame.size())
+        continue;
+
+      Parser.parseEntry(FDEs[I] - EHFrameAddress);
+    }
+  };
+
+  std::vector<std::thread> Workers;
+  for (size_t Job = 1; Job < Jobs; Job++)
+    Workers.emplace_back(Parse, Job);
+  Parse(0);
+
+  for (std::thread &Worker : Workers)
+    Worker.join();
+
+  for (std::set<uint64_t> &ChunkLandingPads : ChunksLandingPads)
+    LandingPads.insert(ChunkLandingPads.begin(), ChunkLandingPads.end());
+}
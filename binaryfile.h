@@ -6,6 +6,9 @@
 //
 
 // Standard includes
+#include <algorithm>
+#include <functional>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
@@ -44,6 +47,7 @@ struct SegmentInfo
     bool IsReadable;    // 可读
     std::vector<std::pair<uint64_t, uint64_t>> ExecutableSections;
     llvm::ArrayRef<uint8_t> Data;
+    uint64_t FileOffset;  // Data 在输入文件中的偏移
 
     bool contains(uint64_t Address) const
     {
@@ -208,31 +212,94 @@ public:
     ///        code.
     BinaryFile(std::string FilePath, bool UseSections);
 
+    // The parsing closures and the std::once_flags are bound to this object
+    BinaryFile(const BinaryFile &) = delete;
+    BinaryFile &operator=(const BinaryFile &) = delete;
+
     llvm::Optional<llvm::ArrayRef<uint8_t>>
     getAddressData(uint64_t Address) const
     {
-        for (const SegmentInfo &Segment : Segments)
+        const SegmentInfo *Segment = findSegment(Address);
+        if (Segment != nullptr)
         {
-            if (Segment.contains(Address))
-            {
-                uint64_t Offset = Address - Segment.StartVirtualAddress;
-                uint64_t Size = Segment.size() - Offset;
-                return {llvm::ArrayRef<uint8_t>(Segment.Data.data() + Offset, Size)};
-            }
+            uint64_t Offset = Address - Segment->StartVirtualAddress;
+            uint64_t Size = Segment->size() - Offset;
+            return {llvm::ArrayRef<uint8_t>(Segment->Data.data() + Offset, Size)};
         }
 
         return llvm::Optional<llvm::ArrayRef<uint8_t>>();
     }
 
+    //
+    // Address space lookups, all of them are O(log n) in the number of
+    // segments or executable ranges
+    //
+
+    /// \brief Return the segment containing \p Address, or nullptr
+    const SegmentInfo *findSegment(uint64_t Address) const
+    {
+        // Segments are sorted by start address and do not overlap
+        auto Compare = [] (uint64_t Address, const SegmentInfo &Segment)
+        {
+            return Address < Segment.StartVirtualAddress;
+        };
+        auto It = std::upper_bound(Segments.begin(), Segments.end(),
+                                   Address, Compare);
+        if (It == Segments.begin())
+            return nullptr;
+
+        --It;
+        return It->contains(Address) ? &*It : nullptr;
+    }
+
+    /// \brief Return true if \p Address is in an executable range
+    bool isExecutableAddress(uint64_t Address) const
+    {
+        return findExecutableRange(Address) != nullptr;
+    }
+
+    /// \brief Return true if both \p Start and \p End are in the same
+    ///        executable range
+    bool isExecutableRange(uint64_t Start, uint64_t End) const
+    {
+        auto *Range = findExecutableRange(Start);
+        return Range != nullptr && Range->first <= End && End < Range->second;
+    }
+
+    /// \brief Sorted, non-overlapping, list of the executable ranges
+    ///
+    /// If sections are in use, these are the executable sections, otherwise
+    /// the executable segments.
+    const std::vector<std::pair<uint64_t, uint64_t>> &executableRanges() const
+    {
+        return ExecutableRanges;
+    }
+
     //
     // Accessor methods
     //
 
+    const std::string &path() const { return FilePath; }
     const Architecture &architecture() const { return TheArchitecture; }
     std::vector<SegmentInfo> &segments() { return Segments; }
     const std::vector<SegmentInfo> &segments() const { return Segments; }
-    const std::vector<SymbolInfo> &symbols() const { return Symbols; }
-    const std::set<uint64_t> &landingPads() const { return LandingPads; }
+
+    /// \brief Return the symbols, parsing them the first time
+    const std::vector<SymbolInfo> &symbols() const
+    {
+        std::call_once(SymbolsParsed, ParseSymbols, std::ref(mutableThis()));
+        return Symbols;
+    }
+
+    /// \brief Return the landing pads, parsing .eh_frame the first time
+    const std::set<uint64_t> &landingPads() const
+    {
+        std::call_once(LandingPadsParsed,
+                       ParseLandingPads,
+                       std::ref(mutableThis()));
+        return LandingPads;
+    }
+
     uint64_t entryPoint() const { return EntryPoint; }
 
     //
@@ -259,6 +326,27 @@ public:
     }
 
 private:
+    /// \brief Sort the segments and build the list of executable ranges
+    void buildAddressIndex();
+
+    const std::pair<uint64_t, uint64_t> *
+    findExecutableRange(uint64_t Address) const
+    {
+        using Range = std::pair<uint64_t, uint64_t>;
+        auto Compare = [] (uint64_t Address, const Range &R)
+        {
+            return Address < R.first;
+        };
+        auto It = std::upper_bound(ExecutableRanges.begin(),
+                                   ExecutableRanges.end(),
+                                   Address, Compare);
+        if (It == ExecutableRanges.begin())
+            return nullptr;
+
+        --It;
+        return Address < It->second ? &*It : nullptr;
+    }
+
     //
     // ELF-specific methods
     //
@@ -270,41 +358,56 @@ private:
     /// \brief Parse the .eh_frame_hdr section to obtain the address and the
     ///        number of FDEs in .eh_frame
     ///
+    /// \param FDEs where to store the addresses of the FDEs listed in the
+    ///        binary search table of .eh_frame_hdr, if present.
+    ///
     /// \return a pair containing the pointer to the .eh_frame section and the
     ///         count of FDEs in the .eh_frame_hdr section (which should match the
     ///         number of FDEs in .eh_frame)
     template <typename T>
     std::pair<uint64_t, uint64_t>
-    ehFrameFromEhFrameHdr(uint64_t EHFrameHdrAddress);
+    ehFrameFromEhFrameHdr(uint64_t EHFrameHdrAddress,
+                          std::vector<uint64_t> &FDEs);
 
     /// \brief Parse the .eh_frame section to collect all the landing pads
     ///
+    /// If the addresses of the FDEs are known, they are parsed in parallel,
+    /// otherwise the section is walked sequentially.
+    ///
     /// \param EHFrameAddress the address of the .eh_frame section
     /// \param FDEsCount the count of FDEs in the .eh_frame section
     /// \param EHFrameSize the size of the .eh_frame section
+    /// \param FDEs the addresses of the FDEs, possibly empty
     ///
     /// \note Either \p FDEsCount or \p EHFrameSize have to be specified
     template <typename T>
     void parseEHFrame(uint64_t EHFrameAddress,
                       llvm::Optional<uint64_t> FDEsCount,
-                      llvm::Optional<uint64_t> EHFrameSize);
-
-    /// \brief Parse an LSDA to collect its landing pads
-    ///
-    /// \param FDEStart the start address of the FDE to which this LSDA is
-    ///        associated
-    /// \param LSDAAddress the address of the target LSDA
-    template <typename T>
-    void parseLSDA(uint64_t FDEStart, uint64_t LSDAAddress);
+                      llvm::Optional<uint64_t> EHFrameSize,
+                      const std::vector<uint64_t> &FDEs);
 
 private:
+    std::string FilePath;
     llvm::object::OwningBinary<llvm::object::Binary> BinaryHandle;
     Architecture TheArchitecture;
     std::vector<SymbolInfo> Symbols;
-    std::vector<SegmentInfo> Segments;
+    std::vector<SegmentInfo> Segments; ///< sorted by start address
+    std::vector<std::pair<uint64_t, uint64_t>> ExecutableRanges;
     std::set<uint64_t> LandingPads; ///< the set of the landing pad addresses
                                     ///  collected from .eh_frame
 
+    // The symbol table and .eh_frame are parsed only when first used. The
+    // closures receive the object to fill instead of capturing `this`.
+    std::function<void(BinaryFile &)> ParseSymbols;
+    std::function<void(BinaryFile &)> ParseLandingPads;
+    mutable std::once_flag SymbolsParsed;
+    mutable std::once_flag LandingPadsParsed;
+
+    BinaryFile &mutableThis() const
+    {
+        return *const_cast<BinaryFile *>(this);
+    }
+
     uint64_t EntryPoint; ///< the program's entry point
 
     //
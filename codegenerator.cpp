@@ -12,12 +12,17 @@
 #include <sstream>
 #include <vector>
 #include <fstream>
+#include <map>
 #include <queue>
 #include <set>
 #include <utility>
 
 // LLVM includes
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScopedNoAliasAA.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/TypeBasedAliasAnalysis.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
 #include "llvm/IR/CFG.h"
@@ -28,8 +33,17 @@
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
@@ -39,15 +53,24 @@
 #include <boost/icl/right_open_interval.hpp>
 
 // Local includes
+#include "binaryartifact.h"
 #include "codegenerator.h"
+#include "csvdse.h"
+#include "functionisolation.h"
 #include "debug.h"
 #include "debughelper.h"
 #include "functionboundariesdetection.h"
 #include "instructiontranslator.h"
 #include "jumptargetmanager.h"
+#include "promotecsvs.h"
+#include "ptccache.h"
 #include "ptcinterface.h"
+#include "ptclifter.h"
 #include "revamb.h"
+#include "specializehelpers.h"
+#include "statistics.h"
 #include "variablemanager.h"
+#include "vectorhelpers.h"
 
 using namespace llvm;
 
@@ -62,56 +85,122 @@ make_array(Args&&... args) {
 // Outline the destructor for the sake of privacy in the header
 CodeGenerator::~CodeGenerator() = default;
 
+/// Helpers modules parsed by preloadHelpers, by path
+static std::map<std::string, std::unique_ptr<Module>> PreloadedHelpers;
+
+void CodeGenerator::preloadHelpers(std::string Path) {
+  if (PreloadedHelpers.count(Path) != 0)
+    return;
+
+  // In case of error, the CodeGenerator will try again and report it
+  SMDiagnostic Errors;
+  std::unique_ptr<Module> Helpers = getLazyIRFileModule(Path,
+                                                        Errors,
+                                                        getGlobalContext());
+  if (Helpers) {
+    // The jobs translating for this architecture will reuse the election
+    VariableManager::electCPUStateType(*Helpers);
+    PreloadedHelpers[Path] = std::move(Helpers);
+  }
+}
+
 CodeGenerator::CodeGenerator(BinaryFile &Binary,
                              Architecture& Target,
-                             std::string Output,
-                             std::string Helpers,
-                             DebugInfoType DebugInfo,
-                             std::string Debug,
-                             std::string LinkingInfo,
-                             std::string Coverage,
-                             std::string BBSummary,
-                             bool EnableOSRA,
-                             bool DetectFunctionBoundaries,
-                             bool EnableLinking,
-                             bool ExternalCSVs) :
+                             const CodeGeneratorOptions &Options) :
   TargetArchitecture(Target),
   Context(getGlobalContext()),
   TheModule((new Module("top", Context))),
-  OutputPath(Output),
-  Debug(new DebugHelper(Output, Debug, TheModule.get(), DebugInfo)),
+  OutputPath(Options.Output),
+  Debug(new DebugHelper(Options.Output,
+                        Options.Debug,
+                        TheModule.get(),
+                        Options.DebugInfo)),
   Binary(Binary),
-  EnableOSRA(EnableOSRA),
-  DetectFunctionBoundaries(DetectFunctionBoundaries),
-  EnableLinking(EnableLinking),
-  ExternalCSVs(ExternalCSVs)
+  EnableOSRA(Options.EnableOSRA),
+  DetectFunctionBoundaries(Options.DetectFunctionBoundaries),
+  EnableLinking(Options.EnableLinking),
+  ExternalCSVs(Options.ExternalCSVs),
+  LiftJobs(Options.LiftJobs),
+  PTCCachePath(Options.PTCCache),
+  PTCIndex(Options.PTCIndex),
+  SplitInPlace(Options.SplitInPlace),
+  DispatcherTable(Options.DispatcherTable),
+  InlineCacheTrace(Options.InlineCacheTrace),
+  IncrementalHarvest(Options.IncrementalHarvest),
+  SETDepth(Options.SETDepth),
+  SlicedOSRA(Options.SlicedOSRA),
+  AnalysisMetadata(Options.AnalysisMetadata),
+  Markers(Options.DebugInfo == DebugInfoType::None ?
+          Options.Markers :
+          MarkersMode::Full),
+  ProfilePath(Options.Profile),
+  PromoteCSVs(Options.PromoteCSVs),
+  SpecializeHelpers(Options.SpecializeHelpers),
+  HelpersInlineBudget(Options.HelpersInlineBudget),
+  CSVDSE(Options.CSVDSE),
+  NativeSyscalls(Options.NativeSyscalls),
+  ArtifactPath(Options.Artifact),
+  TimeBudget(Options.TimeBudget),
+  StartTime(std::chrono::steady_clock::now()),
+  PreHarvestPath(Options.PreHarvest),
+  OutOfCorePath(Options.OutOfCore),
+  SeedsPath(Options.Seeds),
+  ShardIndex(Options.ShardIndex),
+  ShardCount(Options.ShardCount),
+  IsolateFunctions(Options.IsolateFunctions),
+  LowerVectorHelpers(Options.LowerVectorHelpers),
+  ShadowStack(Options.ShadowStack),
+  AddressMap(Options.AddressMap),
+  GuestThreads(Options.GuestThreads),
+  ImportJTsPath(Options.ImportJTs),
+  ExportJTsPath(Options.ExportJTs)
 {
   OriginalInstrMDKind = Context.getMDKindID("oi");
   PTCInstrMDKind = Context.getMDKindID("pi");
+  PTCInstrIdMDKind = Context.getMDKindID("pi.id");
   DbgMDKind = Context.getMDKindID("dbg");
 
   SMDiagnostic Errors;
-  HelpersModule = parseIRFile(Helpers, Errors, Context);
+  auto PreloadedIt = PreloadedHelpers.find(Options.Helpers);
+  if (PreloadedIt != PreloadedHelpers.end()) {
+    HelpersModule = std::move(PreloadedIt->second);
+    PreloadedHelpers.erase(PreloadedIt);
+  } else {
+    // If the helpers are in bitcode form, only the bodies of the functions
+    // actually used (i.e., linked, see LinkOnlyNeeded) will be materialized
+    HelpersModule = getLazyIRFileModule(Options.Helpers, Errors, Context);
+  }
 
   if (HelpersModule.get() == nullptr) {
     Errors.print("revamb", dbgs());
     abort();
   }
 
-  if (Coverage.size() == 0)
-    Coverage = Output + ".coverage.csv";
-  this->CoveragePath = Coverage;
+  CoveragePath = Options.Coverage;
+  if (CoveragePath.size() == 0)
+    CoveragePath = OutputPath + ".coverage.csv";
 
-  if (BBSummary.size() == 0)
-    BBSummary = Output + ".bbsummary.csv";
-  this->BBSummaryPath = BBSummary;
+  BBSummaryPath = Options.BBSummary;
+  if (BBSummaryPath.size() == 0)
+    BBSummaryPath = OutputPath + ".bbsummary.csv";
 
   // Prepare the linking info CSV
+  std::string LinkingInfo = Options.LinkingInfo;
   if (LinkingInfo.size() == 0)
     LinkingInfo = OutputPath + ".li.csv";
   std::ofstream LinkingInfoStream(LinkingInfo);
   LinkingInfoStream << "name,start,end" << std::endl;
 
+  // If requested, the segments contents are not part of the module, an
+  // assembly file pulls them directly from the input file. This saves the
+  // cost of handling them as huge constants all the way through LLVM.
+  std::ofstream ExternalSegmentsStream;
+  SmallString<128> InputPath(Binary.path());
+  if (Options.ExternalSegments.size() != 0) {
+    ExternalSegmentsStream.open(Options.ExternalSegments);
+    sys::fs::make_absolute(InputPath);
+  }
+
   auto *Uint8Ty = Type::getInt8Ty(Context);
   auto *ElfHeaderHelper = new GlobalVariable(*TheModule,
                                              Uint8Ty,
@@ -155,7 +244,22 @@ CodeGenerator::CodeGenerator(BinaryFile &Binary,
     auto *DataType = ArrayType::get(Uint8Ty, Segment.size());
 
     Constant *TheData = nullptr;
-    if (Segment.size() == Segment.Data.size()) {
+    if (ExternalSegmentsStream.is_open()) {
+      // Define the segment in the assembly file, the part not present in the
+      // file (typically .bss) is filled with zeros
+      uint64_t Padding = Segment.size() - Segment.Data.size();
+      ExternalSegmentsStream << "  .section " << Name << ",\""
+                             << (Segment.IsWriteable ? "aw" : "a")
+                             << "\",%progbits\n"
+                             << "  .globl " << Name << "\n"
+                             << Name << ":\n";
+      if (Segment.Data.size() != 0)
+        ExternalSegmentsStream << "  .incbin \"" << InputPath.str().str()
+                               << "\"," << std::dec << Segment.FileOffset
+                               << "," << Segment.Data.size() << "\n";
+      if (Padding != 0)
+        ExternalSegmentsStream << "  .zero " << std::dec << Padding << "\n";
+    } else if (Segment.size() == Segment.Data.size()) {
       // Create the array directly from the mmap'd ELF
       TheData = ConstantDataArray::get(Context, Segment.Data);
     } else {
@@ -181,7 +285,8 @@ CodeGenerator::CodeGenerator(BinaryFile &Binary,
 
     // Force alignment to 1 and assign the variable to a specific section
     Segment.Variable->setAlignment(1);
-    Segment.Variable->setSection(Name);
+    if (TheData != nullptr)
+      Segment.Variable->setSection(Name);
 
     // Write the linking info CSV
     LinkingInfoStream << Name
@@ -548,6 +653,269 @@ static void purgeDeadBlocks(Function *F) {
 
 }
 
+/// \brief Store in the revamb.functions named metadata the name of the entry
+///        basic block of each function followed by the names of its members
+///
+/// Functions and members are sorted by PC (and then by name, for the basic
+/// blocks without one), so that the output doesn't depend on the address of
+/// the basic blocks.
+static void createFunctionsMetadata(Module *M,
+                                    JumpTargetManager &JumpTargets,
+                                    const std::map<BasicBlock *,
+                                                   std::vector<BasicBlock *>>
+                                    &Functions) {
+  auto Before = [&JumpTargets] (BasicBlock *A, BasicBlock *B) {
+    auto Key = [&JumpTargets] (BasicBlock *BB) {
+      uint64_t PC = 0;
+      if (!BB->empty() && JumpTargets.isTranslatedBB(BB))
+        PC = JumpTargets.getPC(&*BB->begin()).first;
+      return std::make_pair(PC, BB->getName());
+    };
+    return Key(A) < Key(B);
+  };
+
+  std::vector<BasicBlock *> Entries;
+  for (auto &P : Functions)
+    Entries.push_back(P.first);
+  std::sort(Entries.begin(), Entries.end(), Before);
+
+  LLVMContext &C = M->getContext();
+  NamedMDNode *FunctionsMD = M->getOrInsertNamedMetadata("revamb.functions");
+  for (BasicBlock *Entry : Entries) {
+    std::vector<BasicBlock *> Members = Functions.at(Entry);
+    std::sort(Members.begin(), Members.end(), Before);
+
+    std::vector<Metadata *> Names { MDString::get(C, Entry->getName()) };
+    for (BasicBlock *Member : Members)
+      Names.push_back(MDString::get(C, Member->getName()));
+    FunctionsMD->addOperand(MDTuple::get(C, Names));
+  }
+}
+
+/// \brief Store in named metadata the noreturn basic blocks and the function
+///        calls identified in \p F
+///
+/// Each entry of revamb.noreturn holds the name of a basic block, each entry
+/// of revamb.calls holds the name of the caller, callee and return basic
+/// blocks and the return address.
+static void createCallsMetadata(Function *F) {
+  Module *M = F->getParent();
+  QuickMetadata QMD(M->getContext());
+
+  NamedMDNode *NoreturnMD = M->getOrInsertNamedMetadata("revamb.noreturn");
+  for (BasicBlock &BB : *F)
+    if (!BB.empty() && BB.getTerminator()->getMetadata("noreturn") != nullptr)
+      NoreturnMD->addOperand(QMD.tuple(MDString::get(M->getContext(),
+                                                     BB.getName())));
+
+  NamedMDNode *CallsMD = M->getOrInsertNamedMetadata("revamb.calls");
+  Function *FunctionCall = M->getFunction("function_call");
+  if (FunctionCall == nullptr)
+    return;
+
+  for (User *U : FunctionCall->users()) {
+    auto *Call = dyn_cast<CallInst>(U);
+    if (Call == nullptr || Call->getParent()->getParent() != F)
+      continue;
+
+    auto *Callee = cast<BlockAddress>(Call->getArgOperand(0))->getBasicBlock();
+    auto *Return = cast<BlockAddress>(Call->getArgOperand(1))->getBasicBlock();
+    uint32_t ReturnPC = getLimitedValue(Call->getArgOperand(2));
+    LLVMContext &C = M->getContext();
+    CallsMD->addOperand(QMD.tuple({
+          MDString::get(C, Call->getParent()->getName()),
+          MDString::get(C, Callee->getName()),
+          MDString::get(C, Return->getName()),
+          QMD.get(ReturnPC)
+        }));
+  }
+}
+
+/// \brief Write to \p Path the binary analysis artifact describing the jump
+///        targets, the coverage, the segments, the functions and the
+///        noreturn basic blocks identified in \p F
+///
+/// Basic blocks are identified by the address of their first instruction.
+/// Must be called before the newpc markers are finalized.
+static void writeArtifact(const std::string &Path,
+                          Function *F,
+                          JumpTargetManager &JumpTargets,
+                          BinaryFile &Binary,
+                          const std::map<BasicBlock *,
+                                         std::vector<BasicBlock *>>
+                          &Functions) {
+  ScopedPhase Phase("artifact");
+  ArtifactWriter Writer;
+
+  auto BlockPC = [&JumpTargets] (BasicBlock *BB) -> uint64_t {
+    if (BB->empty() || !JumpTargets.isTranslatedBB(BB))
+      return 0;
+    return JumpTargets.getPC(&*BB->begin()).first;
+  };
+
+  {
+    std::vector<uint64_t> Addresses, Reasons;
+    for (auto &P : JumpTargets) {
+      Addresses.push_back(P.first);
+      Reasons.push_back(P.second.getReasons());
+    }
+    unsigned Table = Writer.addTable(ArtifactTableID::JumpTargets);
+    Writer.addColumn(Table, 8, std::move(Addresses));
+    Writer.addColumn(Table, 4, std::move(Reasons));
+  }
+
+  {
+    std::vector<uint64_t> Addresses, Sizes, IsJT;
+    if (Function *NewPC = F->getParent()->getFunction("newpc")) {
+      for (User *U : NewPC->users()) {
+        auto *Call = dyn_cast<CallInst>(U);
+        if (Call == nullptr || Call->getParent() == nullptr)
+          continue;
+
+        uint64_t PC = getLimitedValue(Call->getArgOperand(0));
+        Addresses.push_back(PC);
+        Sizes.push_back(getLimitedValue(Call->getArgOperand(1)));
+        IsJT.push_back(JumpTargets.isJumpTarget(PC));
+      }
+    }
+    unsigned Table = Writer.addTable(ArtifactTableID::Coverage);
+    Writer.addColumn(Table, 8, std::move(Addresses));
+    Writer.addColumn(Table, 4, std::move(Sizes));
+    Writer.addColumn(Table, 1, std::move(IsJT));
+  }
+
+  {
+    std::vector<uint64_t> Starts, Ends, FileOffsets, FileSizes, Flags;
+    for (auto &Segment : Binary.segments()) {
+      Starts.push_back(Segment.StartVirtualAddress);
+      Ends.push_back(Segment.EndVirtualAddress);
+      FileOffsets.push_back(Segment.FileOffset);
+      FileSizes.push_back(Segment.Data.size());
+      Flags.push_back((Segment.IsReadable ? SegmentReadable : 0)
+                      | (Segment.IsWriteable ? SegmentWriteable : 0)
+                      | (Segment.IsExecutable ? SegmentExecutable : 0));
+    }
+    unsigned Table = Writer.addTable(ArtifactTableID::Segments);
+    Writer.addColumn(Table, 8, std::move(Starts));
+    Writer.addColumn(Table, 8, std::move(Ends));
+    Writer.addColumn(Table, 8, std::move(FileOffsets));
+    Writer.addColumn(Table, 8, std::move(FileSizes));
+    Writer.addColumn(Table, 1, std::move(Flags));
+  }
+
+  {
+    // Sort the rows by entry and member PC, multiple basic blocks can start in
+    // the same instruction
+    std::set<std::pair<uint64_t, uint64_t>> Rows;
+    for (auto &P : Functions) {
+      uint64_t Entry = BlockPC(P.first);
+      if (Entry == 0)
+        continue;
+
+      for (BasicBlock *Member : P.second) {
+        uint64_t PC = BlockPC(Member);
+        if (PC != 0)
+          Rows.insert({ Entry, PC });
+      }
+    }
+
+    std::vector<uint64_t> Entries, Members;
+    for (auto &Row : Rows) {
+      Entries.push_back(Row.first);
+      Members.push_back(Row.second);
+    }
+    unsigned Table = Writer.addTable(ArtifactTableID::FunctionBoundaries);
+    Writer.addColumn(Table, 8, std::move(Entries));
+    Writer.addColumn(Table, 8, std::move(Members));
+  }
+
+  {
+    std::set<uint64_t> Noreturn;
+    for (BasicBlock &BB : *F) {
+      if (BB.empty() || BB.getTerminator()->getMetadata("noreturn") == nullptr)
+        continue;
+
+      uint64_t PC = BlockPC(&BB);
+      if (PC != 0)
+        Noreturn.insert(PC);
+    }
+    unsigned Table = Writer.addTable(ArtifactTableID::Noreturn);
+    Writer.addColumn(Table,
+                     8,
+                     std::vector<uint64_t>(Noreturn.begin(), Noreturn.end()));
+  }
+
+  if (!Writer.write(Path)) {
+    dbg << "Couldn't write the artifact to " << Path << "\n";
+    abort();
+  }
+}
+
+/// \brief Create what the support module needs to run the translated code on
+///        multiple threads
+///
+/// `revamb_save_cpu_state` and `revamb_load_cpu_state` copy the CSVs of the
+/// current thread to and from a buffer of `revamb_cpu_state_size` bytes.
+/// `revamb_start_thread(Stack, Offset)` runs the translated code on the
+/// current thread from `Offset` bytes after the current PC, with a zero in the
+/// register holding the result of the syscalls, as expected by a thread
+/// created by `clone`. The state of the shadow stack, if any, is per thread
+/// too.
+static void createThreadSupport(Module &M,
+                                VariableManager &Variables,
+                                Function *Root,
+                                GlobalVariable *PCReg,
+                                GlobalVariable *ResumePC,
+                                StringRef ResultRegisterName) {
+  LLVMContext &Context = M.getContext();
+
+  Variables.createCPUStateCopy("revamb_save_cpu_state", false);
+  Variables.createCPUStateCopy("revamb_load_cpu_state", true);
+
+  auto *SizeType = Type::getInt64Ty(Context);
+  new GlobalVariable(M,
+                     SizeType,
+                     true,
+                     GlobalValue::ExternalLinkage,
+                     ConstantInt::get(SizeType, Variables.cpuStateSize()),
+                     "revamb_cpu_state_size");
+
+  auto ThreadLocalNames = make_array<const char *>("cpu_loop_exiting",
+                                                   "shadow_stack.pcs",
+                                                   "shadow_stack.targets",
+                                                   "shadow_stack.top");
+  for (auto Name : ThreadLocalNames)
+    if (GlobalVariable *Variable = M.getGlobalVariable(Name, true))
+      Variable->setThreadLocal(true);
+
+  Type *PCType = PCReg->getType()->getPointerElementType();
+  Type *StackType = Root->arg_begin()->getType();
+  auto *StartType = FunctionType::get(Type::getVoidTy(Context),
+                                      { StackType, PCType },
+                                      false);
+  auto *Start = Function::Create(StartType,
+                                 GlobalValue::ExternalLinkage,
+                                 "revamb_start_thread",
+                                 &M);
+
+  IRBuilder<> Builder(BasicBlock::Create(Context, "", Start));
+  auto ArgumentIt = Start->arg_begin();
+  Value *Stack = &*ArgumentIt++;
+  Value *Offset = &*ArgumentIt;
+
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(PCReg), Offset),
+                      ResumePC);
+
+  GlobalVariable *Result = M.getGlobalVariable(ResultRegisterName, true);
+  if (Result != nullptr) {
+    Type *ResultType = Result->getType()->getPointerElementType();
+    Builder.CreateStore(ConstantInt::get(ResultType, 0), Result);
+  }
+
+  Builder.CreateCall(Root, { Stack });
+  Builder.CreateRetVoid();
+}
+
 void CodeGenerator::translate(uint64_t VirtualAddress) {
   using FT = FunctionType;
 
@@ -567,6 +935,19 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   VariableManager Variables(*TheModule, *HelpersModule, TargetArchitecture);
   GlobalVariable *PCReg = Variables.getByEnvOffset(ptc.pc, "pc").first;
   GlobalVariable *SPReg = Variables.getByEnvOffset(ptc.sp, "sp").first;
+  Type *PCType = PCReg->getType()->getPointerElementType();
+
+  // The threads started by the support module set their first PC here
+  GlobalVariable *ResumePC = nullptr;
+  if (GuestThreads) {
+    ResumePC = new GlobalVariable(*TheModule,
+                                  PCType,
+                                  false,
+                                  GlobalValue::ExternalLinkage,
+                                  ConstantInt::get(PCType, 0),
+                                  "revamb_resume_pc");
+    ResumePC->setThreadLocal(true);
+  }
 
   IRBuilder<> Builder(Context);
 
@@ -602,7 +983,37 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   InputArchMD->addOperand(Tuple);
 
   // Create an instance of JumpTargetManager
-  JumpTargetManager JumpTargets(MainFunction, PCReg, Binary, EnableOSRA);
+  JumpTargetManager JumpTargets(MainFunction,
+                                PCReg,
+                                Binary,
+                                EnableOSRA,
+                                SplitInPlace,
+                                IncrementalHarvest,
+                                SETDepth,
+                                SlicedOSRA);
+
+  if (ProfilePath.size() != 0)
+    JumpTargets.loadProfile(ProfilePath);
+
+  // Leave the last quarter of the time budget to translate the jump targets
+  // found so far and to produce the module
+  if (TimeBudget != 0) {
+    uint64_t Milliseconds = static_cast<uint64_t>(TimeBudget) * 750;
+    JumpTargets.setHarvestDeadline(StartTime
+                                   + std::chrono::milliseconds(Milliseconds));
+  }
+
+  if (PreHarvestPath.size() != 0)
+    JumpTargets.dumpPreHarvest(PreHarvestPath);
+
+  if (ShardCount != 0)
+    JumpTargets.setShard(ShardIndex, ShardCount);
+
+  if (ImportJTsPath.size() != 0)
+    JumpTargets.importJumpTargets(ImportJTsPath);
+
+  if (SeedsPath.size() != 0)
+    JumpTargets.loadSeeds(SeedsPath);
 
   if (VirtualAddress == 0) {
     JumpTargets.harvestGlobalData();
@@ -611,8 +1022,13 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   JumpTargets.registerJT(VirtualAddress, JumpTargetManager::GlobalData);
 
   // Initialize the program counter
-  auto *StartPC = ConstantInt::get(PCReg->getType()->getPointerElementType(),
-                                   VirtualAddress);
+  Value *StartPC = ConstantInt::get(PCType, VirtualAddress);
+  if (ResumePC != nullptr) {
+    Value *Resume = Builder.CreateLoad(ResumePC);
+    Value *IsMainThread = Builder.CreateICmpEQ(Resume,
+                                               ConstantInt::get(PCType, 0));
+    StartPC = Builder.CreateSelect(IsMainThread, StartPC, Resume);
+  }
   // Use this instruction as the delimiter for local variables
   auto *Delimiter = Builder.CreateStore(StartPC, PCReg);
   Builder.CreateStore(&*MainFunction->arg_begin(), SPReg);
@@ -626,14 +1042,47 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
 
   std::tie(VirtualAddress, Entry) = JumpTargets.peek();
 
+  std::unique_ptr<PTCCache> Cache;
+  if (PTCCachePath.size() != 0)
+    Cache.reset(new PTCCache(PTCCachePath, Binary));
+
+  // Translate to PTC the next jump targets ahead of time, if requested
+  PTCLifter Lifter(LiftJobs, Cache.get());
+  const unsigned LookAhead = 4 * Lifter.jobs();
+  auto Prefetch = [&Lifter, &JumpTargets, LookAhead] () {
+    for (uint64_t PC : JumpTargets.nextUnexplored(LookAhead))
+      Lifter.prefetch(PC);
+  };
+  Prefetch();
+
   std::vector<BasicBlock *> Blocks;
 
+  // If PTCIndex is enabled, the "pi.id" metadata indexes this vector, which
+  // records translation block and offset of each PTC instruction
+  std::vector<std::pair<uint64_t, unsigned>> PTCInstructions;
+  unsigned PTCMDKind = PTCIndex ? PTCInstrIdMDKind : PTCInstrMDKind;
+
+  // In out-of-core mode, the text of the metadata goes to disk until the end
+  // of the translation
+  if (OutOfCorePath.size() != 0 && !Spill.open(OutOfCorePath))
+    dbg << "Couldn't open " << OutOfCorePath << ", keeping the metadata in"
+        << " memory\n";
+  MetadataSpill *TheSpill = Spill.isOpen() ? &Spill : nullptr;
+
+  VectorHelpers Vectors(Variables, TargetArchitecture.isLittleEndian());
+  VectorHelpers *TheVectors = LowerVectorHelpers ? &Vectors : nullptr;
+
   InstructionTranslator Translator(Builder,
                                    Variables,
                                    JumpTargets,
                                    Blocks,
                                    Binary.architecture(),
-                                   TargetArchitecture);
+                                   TargetArchitecture,
+                                   TheSpill,
+                                   TheVectors);
+
+  // Reused across translation blocks
+  TranslationBlockIndex TBIndex;
 
   while (Entry != nullptr) {
     Builder.SetInsertPoint(Entry);
@@ -642,12 +1091,22 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
     Translator.reset();
 
     // TODO: rename this type
-    PTCInstructionListPtr InstructionList(new PTCInstructionList);
     size_t ConsumedSize = 0;
-
-    ConsumedSize = ptc.translate(VirtualAddress, InstructionList.get());
-    SmallSet<unsigned, 1> ToIgnore;
-    ToIgnore = Translator.preprocess(InstructionList.get());
+    ScopedPhase DecodePhase("ptc-decode");
+    PTCInstructionListPtr InstructionList = Lifter.translate(VirtualAddress,
+                                                             ConsumedSize);
+    DecodePhase.stop();
+
+    ScopedPhase EmissionPhase("ir-emission");
+    incrementCounter("ptc.translation-blocks");
+
+    // Past the memory limit, stop recording the text of the PTC instructions,
+    // unless it's required for the debug information
+    bool DropPTCMetadata = !PTCIndex
+      && Debug->type() != DebugInfoType::PTC
+      && memoryLimitReached();
+    incrementCounter("ptc.instructions", InstructionList->instruction_count);
+    Translator.preprocess(InstructionList.get(), TBIndex);
 
     DBG("ptc", dumpTranslation(dbg, InstructionList.get()));
 
@@ -666,14 +1125,7 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
     // Handle the first PTC_INSTRUCTION_op_debug_insn_start
     {
       PTCInstruction *NextInstruction = nullptr;
-      for (unsigned k = 1; k < InstructionCount; k++) {
-        PTCInstruction *I = &InstructionList->instructions[k];
-        if (I->opc == PTC_INSTRUCTION_op_debug_insn_start
-            && ToIgnore.count(k) == 0) {
-          NextInstruction = I;
-          break;
-        }
-      }
+      NextInstruction = TBIndex.nextInstructionStart(InstructionList.get(), 0);
       PTCInstruction *Instruction = &InstructionList->instructions[j];
       std::tie(Result,
                MDOriginalInstr,
@@ -688,7 +1140,7 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
 
     // TODO: shall we move this whole loop in InstructionTranslator?
     for (; j < InstructionCount && !StopTranslation; j++) {
-      if (ToIgnore.count(j) != 0)
+      if (TBIndex.isIgnored(j))
         continue;
 
       PTCInstruction Instruction = InstructionList->instructions[j];
@@ -705,14 +1157,8 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
         {
           // Find next instruction, if there is one
           PTCInstruction *NextInstruction = nullptr;
-          for (unsigned k = j + 1; k < InstructionCount; k++) {
-            PTCInstruction *I = &InstructionList->instructions[k];
-            if (I->opc == PTC_INSTRUCTION_op_debug_insn_start
-                && ToIgnore.count(k) == 0) {
-              NextInstruction = I;
-              break;
-            }
-          }
+          NextInstruction = TBIndex.nextInstructionStart(InstructionList.get(),
+                                                         j);
 
           std::tie(Result,
                    MDOriginalInstr,
@@ -764,18 +1210,28 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
 
       // Create a new metadata referencing the PTC instruction we have just
       // translated
-      std::stringstream PTCStringStream;
-      dumpInstruction(PTCStringStream, InstructionList.get(), j);
-      std::string PTCString = PTCStringStream.str() + "\n";
-      MDString *MDPTCString = MDString::get(Context, PTCString);
-      MDNode* MDPTCInstr = MDNode::getDistinct(Context, MDPTCString);
+      MDNode* MDPTCInstr = nullptr;
+      if (PTCIndex) {
+        MDPTCInstr = QMD.tuple(static_cast<uint32_t>(PTCInstructions.size()));
+        PTCInstructions.push_back({ VirtualAddress, j });
+      } else if (!DropPTCMetadata) {
+        std::stringstream PTCStringStream;
+        dumpInstruction(PTCStringStream, InstructionList.get(), j);
+        std::string PTCString = PTCStringStream.str() + "\n";
+        Metadata *MDPTCString = nullptr;
+        if (TheSpill != nullptr)
+          MDPTCString = TheSpill->spill(Context, PTCString);
+        else
+          MDPTCString = MDString::get(Context, PTCString);
+        MDPTCInstr = MDNode::getDistinct(Context, MDPTCString);
+      }
 
       // Set metadata for all the new instructions
       for (BasicBlock *Block : Blocks) {
         BasicBlock::iterator I = Block->end();
         while (I != Block->begin() && !(--I)->hasMetadata()) {
           I->setMetadata(OriginalInstrMDKind, MDOriginalInstr);
-          I->setMetadata(PTCInstrMDKind, MDPTCInstr);
+          I->setMetadata(PTCMDKind, MDPTCInstr);
         }
       }
 
@@ -794,10 +1250,22 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
       Builder.CreateUnreachable();
     }
 
+    EmissionPhase.stop();
+
     // Obtain a new program counter to translate
     std::tie(VirtualAddress, Entry) = JumpTargets.peek();
+    Prefetch();
   } // End translations loop
 
+  if (Cache) {
+    DBG("lift", dbg << "PTC cache: " << std::dec << Cache->hits() << " hits, "
+        << Cache->misses() << " misses\n");
+    setCounter("ptc-cache.hits", Cache->hits());
+    setCounter("ptc-cache.misses", Cache->misses());
+  }
+
+  ScopedPhase FinalizationPhase("finalization");
+
   legacy::FunctionPassManager CpuLoopPM(TheModule.get());
   CpuLoopPM.add(new LoopInfoWrapperPass());
   CpuLoopPM.add(new CpuLoopFunctionPass());
@@ -810,17 +1278,20 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   auto NoOpFunctionNames = make_array<const char *>("qemu_log_mask",
                                                     "fprintf",
                                                     "cpu_dump_state",
-                                                    "mmap_lock",
-                                                    "mmap_unlock",
-                                                    "pthread_cond_broadcast",
-                                                    "pthread_mutex_unlock",
-                                                    "pthread_mutex_lock",
-                                                    "pthread_cond_wait",
-                                                    "pthread_cond_signal",
                                                     "cpu_exit",
-                                                    "start_exclusive",
-                                                    "process_pending_signals",
-                                                    "end_exclusive");
+                                                    "process_pending_signals");
+  // Required only if the input program can run on multiple threads
+  auto LockingFunctionNames = make_array<const char *>("mmap_lock",
+                                                       "mmap_unlock",
+                                                       "pthread_cond_broadcast",
+                                                       "pthread_mutex_unlock",
+                                                       "pthread_mutex_lock",
+                                                       "pthread_cond_wait",
+                                                       "pthread_cond_signal");
+  // Implemented by the support module if the input program can run on
+  // multiple threads
+  auto ExclusiveFunctionNames = make_array<const char *>("start_exclusive",
+                                                         "end_exclusive");
   auto AbortFunctionNames = make_array<const char *>("cpu_restore_state",
                                                      "gdb_handlesig",
                                                      "queue_signal",
@@ -848,6 +1319,28 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   for (auto Name : NoOpFunctionNames)
     replaceFunctionWithRet(HelpersModule->getFunction(Name), 0);
 
+  if (!GuestThreads) {
+    for (auto Name : LockingFunctionNames)
+      replaceFunctionWithRet(HelpersModule->getFunction(Name), 0);
+    for (auto Name : ExclusiveFunctionNames)
+      replaceFunctionWithRet(HelpersModule->getFunction(Name), 0);
+  } else {
+    // The exclusive sections (e.g., the emulation of store-exclusive and
+    // store-conditional) must exclude all the threads
+    for (auto Name : ExclusiveFunctionNames) {
+      Function *TheFunction = HelpersModule->getFunction(Name);
+      if (TheFunction != nullptr) {
+        std::string WrapperName = std::string("revamb_") + Name;
+        auto *WrapperType = TheFunction->getFunctionType();
+        Constant *Wrapper = HelpersModule->getOrInsertFunction(WrapperName,
+                                                               WrapperType);
+        BasicBlock *NewBody = replaceFunction(TheFunction);
+        CallInst::Create(Wrapper, { }, "", NewBody);
+        ReturnInst::Create(Context, NewBody);
+      }
+    }
+  }
+
   for (auto Name : AbortFunctionNames) {
     Function *TheFunction = HelpersModule->getFunction(Name);
     if (TheFunction != nullptr) {
@@ -862,6 +1355,23 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   replaceFunctionWithRet(HelpersModule->getFunction("page_get_flags"),
                          0xffffffff);
 
+  // Redirect the calls to the QEMU syscall emulation layer to the support
+  // module, which falls back to it, exported as qemu_do_syscall, for the
+  // syscalls it doesn't handle natively
+  if (NativeSyscalls) {
+    Function *DoSyscall = HelpersModule->getFunction("do_syscall");
+    if (DoSyscall != nullptr) {
+      DoSyscall->setName("qemu_do_syscall");
+      auto *NativeDoSyscall = Function::Create(DoSyscall->getFunctionType(),
+                                               GlobalValue::ExternalLinkage,
+                                               "native_do_syscall",
+                                               HelpersModule.get());
+      DoSyscall->replaceAllUsesWith(NativeDoSyscall);
+      TheModule->getOrInsertFunction("qemu_do_syscall",
+                                     DoSyscall->getFunctionType());
+    }
+  }
+
   // HACK: the LLVM linker does not import non-static functions anymore if
   //       LinkOnlyNeeded is specified. We don't want this so mark all the
   //       non-static symbols not directly imported as static.
@@ -889,48 +1399,347 @@ void CodeGenerator::translate(uint64_t VirtualAddress) {
   }
 
   if (EnableLinking) {
+    ScopedPhase Phase("linking");
     Linker TheLinker(*TheModule);
-    bool Result = TheLinker.linkInModule(std::move(HelpersModule),
-                                         Linker::LinkOnlyNeeded);
-    assert(!Result && "Linking failed");
+    if (TheLinker.linkInModule(std::move(HelpersModule),
+                               Linker::LinkOnlyNeeded)) {
+      dbg << "Couldn't link the helpers module\n";
+      abort();
+    }
   }
 
   Variables.setDataLayout(&TheModule->getDataLayout());
 
-  legacy::PassManager PM;
-  PM.add(createSROAPass());
-  PM.add(new CpuLoopExitPass(&Variables));
-  PM.add(Variables.createCorrectCPUStateUsagePass());
-  PM.add(createDeadCodeEliminationPass());
-  PM.run(*TheModule);
+  {
+    ScopedPhase Phase("cpu-state-correction");
+    legacy::PassManager PM;
+    PM.add(createSROAPass());
+    PM.add(new CpuLoopExitPass(&Variables));
+    PM.add(Variables.createCorrectCPUStateUsagePass());
+    PM.add(createDeadCodeEliminationPass());
+    PM.run(*TheModule);
+  }
 
-  JumpTargets.translateIndirectJumps();
+  JumpTargets.translateIndirectJumps(InlineCacheTrace);
 
   JumpTargets.finalizeJumpTargets();
 
   purgeDeadBlocks(MainFunction);
 
+  JumpTargets.collectStatistics();
+
+  std::map<BasicBlock *, std::vector<BasicBlock *>> Functions;
   if (DetectFunctionBoundaries) {
     legacy::FunctionPassManager FPM(&*TheModule);
-    FPM.add(new FunctionBoundariesDetectionPass(&JumpTargets, ""));
+    auto *FBDP = new FunctionBoundariesDetectionPass(&JumpTargets, "");
+    FPM.add(FBDP);
     FPM.run(*MainFunction);
+
+    if (AnalysisMetadata)
+      createFunctionsMetadata(&*TheModule, JumpTargets, FBDP->functions());
+
+    if (ArtifactPath.size() != 0 || IsolateFunctions)
+      Functions = FBDP->functions();
   }
 
+  if (AnalysisMetadata)
+    createCallsMetadata(MainFunction);
+
+  if (ArtifactPath.size() != 0)
+    writeArtifact(ArtifactPath, MainFunction, JumpTargets, Binary, Functions);
+
   JumpTargets.noReturn().cleanup();
 
-  Translator.finalizeNewPCMarkers(CoveragePath);
+  if (ShadowStack)
+    JumpTargets.createShadowStack();
+
+  if (DispatcherTable)
+    JumpTargets.createDispatcherTable();
+
+  JumpTargets.applyProfile();
 
-  Variables.finalize(ExternalCSVs);
+  Translator.finalizeNewPCMarkers(CoveragePath, Markers);
 
-  Debug->generateDebugInfo();
+  if (AddressMap)
+    JumpTargets.createAddressMap();
+
+  if (IsolateFunctions) {
+    ScopedPhase Phase("function-isolation");
+    legacy::PassManager PM;
+    auto *Isolation = new FunctionIsolationPass(MainFunction,
+                                                &JumpTargets,
+                                                std::move(Functions));
+    PM.add(Isolation);
+    PM.run(*TheModule);
+
+    // The isolated functions need their own debug information
+    for (Function *F : Isolation->isolatedFunctions())
+      Debug->newFunction(F);
+  }
+
+  Variables.finalize(ExternalCSVs, GuestThreads);
+
+  if (GuestThreads)
+    createThreadSupport(*TheModule,
+                        Variables,
+                        MainFunction,
+                        PCReg,
+                        ResumePC,
+                        Binary.architecture().syscallResultRegister());
+
+  // Specialize and inline the helpers first, so that the CPU state accesses
+  // of the inlined ones can be promoted too
+  if (SpecializeHelpers) {
+    ScopedPhase Phase("helpers-specialization");
+    legacy::PassManager PM;
+    PM.add(new SpecializeHelpersPass(MainFunction, HelpersInlineBudget));
+    PM.run(*TheModule);
+  }
+
+  // Remove the dead stores before the promotion, so that they don't get
+  // spilled
+  if (CSVDSE) {
+    ScopedPhase Phase("csv-dse");
+    legacy::PassManager PM;
+    PM.add(new CSVDeadStoreEliminationPass(MainFunction,
+                                           &JumpTargets,
+                                           Variables.cpuStateVariables()));
+    PM.run(*TheModule);
+  }
+
+  if (PromoteCSVs) {
+    ScopedPhase Phase("csv-promotion");
+    legacy::PassManager PM;
+    PM.add(new PromoteCSVsPass(MainFunction, Variables.cpuStateVariables()));
+    PM.run(*TheModule);
+  }
+
+  if (PTCIndex) {
+    std::ofstream PTCIndexStream(OutputPath + ".ptc-index.csv");
+    PTCIndexStream << "id,tb,offset" << std::endl;
+    for (unsigned I = 0; I < PTCInstructions.size(); I++)
+      PTCIndexStream << std::dec << I << ","
+                     << "0x" << std::hex << PTCInstructions[I].first << ","
+                     << std::dec << PTCInstructions[I].second << std::endl;
+
+    Debug->setPTCIndex(std::move(PTCInstructions));
+  }
+
+  // Let the other shards know about the jump targets we found
+  if (ShardCount != 0) {
+    std::string JumpTargetsPath = OutputPath + ".jump-targets";
+    if (!JumpTargets.writeJumpTargets(JumpTargetsPath))
+      dbg << "Couldn't write " << JumpTargetsPath << "\n";
+  }
+
+  // Let the next runs on the same binary start from the jump targets we found
+  if (ExportJTsPath.size() != 0
+      && !JumpTargets.exportJumpTargets(ExportJTsPath))
+    dbg << "Couldn't write " << ExportJTsPath << "\n";
+
+  if (MemoryReportEnabled)
+    JumpTargets.recordMemoryUsage();
+
+  // The analyses are done, bring back the text of the metadata for the
+  // debug information and the output
+  if (Spill.isOpen()) {
+    ScopedPhase Phase("out-of-core-reload");
+    if (!Spill.reload(*TheModule, { OriginalInstrMDKind, PTCInstrMDKind })) {
+      dbg << "Couldn't read back " << OutOfCorePath << "\n";
+      abort();
+    }
+  }
+
+  FinalizationPhase.stop();
+
+  {
+    ScopedPhase Phase("debug-info");
+    Debug->generateDebugInfo();
+  }
 
 }
 
 void CodeGenerator::serialize() {
-  // Ask the debug handler if it already has a good copy of the IR, if not dump
-  // it
-  if (!Debug->copySource()) {
+  ScopedPhase Phase("serialization");
+
+  if (Debug->bitcodeOutput()) {
+    std::ofstream Output(OutputPath, std::ios::binary);
+    Debug->writeBitcode(Output);
+  } else {
     std::ofstream Output(OutputPath);
     Debug->print(Output, false);
   }
 }
+
+/// \brief Optimize a module produced by revamb in a way suitable for its shape
+///
+/// All the translated code is in the root function, where every basic block
+/// can reach every other through the dispatcher, therefore passes whose cost
+/// depends on the CFG as a whole (loop passes, jump threading, GVN with its
+/// non-local memory dependencies) are superlinear there and are skipped. The
+/// other functions (helpers and support code) go through the usual -O2
+/// function pipeline first, then the inliner moves them into root, and finally
+/// root is cleaned up with cheap passes, for the most part working on a basic
+/// block or a dominator tree scope at a time. The alias analyses exploit the
+/// alias scopes VariableManager attaches to the CPU state accesses.
+static void optimizeTranslatedModule(Module &M, TargetMachine &Machine) {
+  auto AddAliasAnalyses = [] (legacy::PassManagerBase &PM) {
+    PM.add(createTypeBasedAAWrapperPass());
+    PM.add(createScopedNoAliasAAWrapperPass());
+  };
+
+  Function *Root = M.getFunction("root");
+
+  // Optimize everything but root
+  {
+    PassManagerBuilder Builder;
+    Builder.OptLevel = 2;
+    legacy::FunctionPassManager FPM(&M);
+    FPM.add(createTargetTransformInfoWrapperPass(Machine.getTargetIRAnalysis()));
+    Builder.populateFunctionPassManager(FPM);
+
+    FPM.doInitialization();
+    for (Function &F : M)
+      if (&F != Root)
+        FPM.run(F);
+    FPM.doFinalization();
+  }
+
+  // Inline the helpers and drop what's no longer used
+  {
+    legacy::PassManager MPM;
+    MPM.add(createTargetTransformInfoWrapperPass(Machine.getTargetIRAnalysis()));
+    AddAliasAnalyses(MPM);
+    MPM.add(createFunctionInliningPass(2, 0));
+    MPM.add(createGlobalDCEPass());
+    MPM.run(M);
+  }
+
+  // Cheap scalar passes on root
+  if (Root != nullptr) {
+    legacy::FunctionPassManager FPM(&M);
+    FPM.add(createTargetTransformInfoWrapperPass(Machine.getTargetIRAnalysis()));
+    AddAliasAnalyses(FPM);
+    FPM.add(createSROAPass());
+    FPM.add(createEarlyCSEPass());
+    FPM.add(createInstructionCombiningPass());
+    FPM.add(createDeadStoreEliminationPass());
+    FPM.add(createSCCPPass());
+    FPM.add(createAggressiveDCEPass());
+    FPM.add(createCFGSimplificationPass());
+
+    FPM.doInitialization();
+    FPM.run(*Root);
+    FPM.doFinalization();
+  }
+}
+
+void CodeGenerator::emitObject(std::string ObjectPath,
+                               std::string SupportPath,
+                               unsigned OptimizationLevel) {
+  {
+    ScopedPhase Phase("support-linking");
+    SMDiagnostic Errors;
+    std::unique_ptr<Module> Support = parseIRFile(SupportPath, Errors, Context);
+
+    if (Support.get() == nullptr) {
+      Errors.print("revamb", dbgs());
+      abort();
+    }
+
+    Linker TheLinker(*TheModule);
+    if (TheLinker.linkInModule(std::move(Support))) {
+      dbg << "Couldn't link the support module " << SupportPath << "\n";
+      abort();
+    }
+  }
+
+  // Create a TargetMachine for the host, as llc would do
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  Triple TheTriple(TheModule->getTargetTriple());
+  if (TheTriple.getTriple().empty())
+    TheTriple.setTriple(sys::getDefaultTargetTriple());
+
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget(TheTriple.getTriple(),
+                                                         Error);
+  if (TheTarget == nullptr) {
+    dbg << Error << "\n";
+    abort();
+  }
+
+  auto CodeGenLevel = OptimizationLevel == 0 ? CodeGenOpt::None
+                                             : CodeGenOpt::Default;
+  std::unique_ptr<TargetMachine> Machine;
+  Machine.reset(TheTarget->createTargetMachine(TheTriple.getTriple(),
+                                               "",
+                                               "",
+                                               TargetOptions(),
+                                               Reloc::Default,
+                                               CodeModel::Default,
+                                               CodeGenLevel));
+  if (!Machine) {
+    dbg << "Couldn't create the TargetMachine for "
+        << TheTriple.getTriple() << "\n";
+    abort();
+  }
+
+  TheModule->setTargetTriple(TheTriple.getTriple());
+  TheModule->setDataLayout(Machine->createDataLayout());
+
+  if (OptimizationLevel == 3) {
+    ScopedPhase Phase("optimization");
+    optimizeTranslatedModule(*TheModule, *Machine);
+  } else if (OptimizationLevel == 2) {
+    ScopedPhase Phase("optimization");
+
+    // Mimic opt -O2
+    PassManagerBuilder Builder;
+    Builder.OptLevel = 2;
+    Builder.Inliner = createFunctionInliningPass(2, 0);
+
+    legacy::FunctionPassManager FPM(&*TheModule);
+    FPM.add(createTargetTransformInfoWrapperPass(Machine->getTargetIRAnalysis()));
+    Builder.populateFunctionPassManager(FPM);
+
+    legacy::PassManager MPM;
+    MPM.add(createTargetTransformInfoWrapperPass(Machine->getTargetIRAnalysis()));
+    Builder.populateModulePassManager(MPM);
+
+    FPM.doInitialization();
+    for (Function &F : *TheModule)
+      FPM.run(F);
+    FPM.doFinalization();
+
+    MPM.run(*TheModule);
+  }
+
+  {
+    ScopedPhase Phase("codegen");
+
+    std::error_code EC;
+    raw_fd_ostream Output(ObjectPath, EC, sys::fs::F_None);
+    if (EC) {
+      dbg << "Couldn't open " << ObjectPath << ": " << EC.message() << "\n";
+      abort();
+    }
+
+    legacy::PassManager PM;
+    if (Machine->addPassesToEmitFile(PM,
+                                     Output,
+                                     TargetMachine::CGFT_ObjectFile)) {
+      dbg << "The target " << TheTriple.getTriple()
+          << " can't emit object files\n";
+      abort();
+    }
+    PM.run(*TheModule);
+
+    Output.close();
+    if (Output.has_error()) {
+      dbg << "Couldn't write " << ObjectPath << "\n";
+      abort();
+    }
+  }
+}
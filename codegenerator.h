@@ -6,6 +6,7 @@
 //
 
 // Standard includes
+#include <chrono>
 #include <cstdint>
 #include <string>
 #include <memory>
@@ -15,6 +16,7 @@
 
 // Local includes
 #include "binaryfile.h"
+#include "metadataspill.h"
 #include "revamb.h"
 
 // Forward declarations
@@ -36,6 +38,149 @@ class ObjectFile;
 
 class DebugHelper;
 
+/// \brief Options of a CodeGenerator
+///
+/// The defaults match the ones of the command line of revamb.
+struct CodeGeneratorOptions {
+  /// Path where the generated LLVM IR must be saved.
+  std::string Output;
+  /// Path of the LLVM IR file containing the QEMU helpers. If it's in bitcode
+  /// form, it's loaded lazily and only the helpers actually used are
+  /// materialized.
+  std::string Helpers;
+  /// Type of debug information to generate.
+  DebugInfoType DebugInfo = DebugInfoType::None;
+  /// Path where the debugging source file must be written. If an empty string,
+  /// the output file name plus ".S", if \p DebugInfo is
+  /// DebugInfoType::OriginalAssembly, or ".ptc", if \p DebugInfo is
+  /// DebugInfoType::PTC.
+  std::string Debug;
+  /// Path where the information about how the linking should be stored. If an
+  /// empty string, the output file name with a ".li.csv" suffix will be used.
+  std::string LinkingInfo;
+  /// Path where the information about instruction coverage should be stored.
+  /// If an empty string, the output file name with a ".coverage.csv" suffix
+  /// will be used.
+  std::string Coverage;
+  /// Path where the summary of the basic blocks should be stored. If an empty
+  /// string, the output file name with a ".bbsummary.csv" suffix will be used.
+  std::string BBSummary;
+  /// Whether OSRA should be used to discover additional jump targets or not.
+  bool EnableOSRA = true;
+  /// Whether the function boundaries should be detected.
+  bool DetectFunctionBoundaries = false;
+  /// Whether linking to QEMU helpers should be performed or not.
+  bool EnableLinking = true;
+  /// Whether the CPU state variables should have external linkage.
+  bool ExternalCSVs = false;
+  /// Number of threads translating the input code to PTC ahead of the LLVM IR
+  /// emission. 0 disables the pipelining.
+  unsigned LiftJobs = 0;
+  /// Path of the directory where the PTC translations should be cached across
+  /// runs. If an empty string, no cache is employed.
+  std::string PTCCache;
+  /// If true, instead of attaching to each instruction the PTC text, only
+  /// attach an identifier and write a PTC instruction identifier ->
+  /// (translation block, offset) index to a side file.
+  bool PTCIndex = false;
+  /// Whether jump targets in the middle of already translated code should
+  /// reuse, if possible, the existing translation instead of translating the
+  /// code again.
+  bool SplitInPlace = false;
+  /// Whether dense areas of jump targets should be dispatched through a table
+  /// instead of the dispatcher switch.
+  bool DispatcherTable = false;
+  /// Path of an execution trace to use to build the inline caches of the
+  /// indirect jumps. If an empty string, no inline cache is emitted.
+  std::string InlineCacheTrace;
+  /// Whether the harvesting of jump targets should only simplify the code
+  /// changed since the previous round, when possible.
+  bool IncrementalHarvest = false;
+  /// Maximum number of basic blocks the Simple Expression Tracker goes
+  /// backward looking for the stores to a variable.
+  unsigned SETDepth = 3;
+  /// Whether OSRA should only analyze the code affecting the stores to the
+  /// program counter.
+  bool SlicedOSRA = false;
+  /// Whether the function boundaries, the noreturn basic blocks and the
+  /// function calls should be stored as named metadata in the output module
+  /// for revamb-dump.
+  bool AnalysisMetadata = false;
+  /// Path of the assembly file defining the segment variables with the
+  /// contents of the input file. If not empty, the segment variables in the
+  /// output module are only declarations.
+  std::string ExternalSegments;
+  /// What to do with the `newpc` markers at the end of the translation.
+  /// Ignored if \p DebugInfo is not DebugInfoType::None, in which case they
+  /// are always kept.
+  MarkersMode Markers = MarkersMode::Full;
+  /// Path of an execution trace to use to prioritize, weight and lay out the
+  /// hot code. If an empty string, no profile is used.
+  std::string Profile;
+  /// Whether the CPU state variables should be kept in local variables of the
+  /// root function, synchronizing them with the global variables only around
+  /// the calls accessing them.
+  bool PromoteCSVs = false;
+  /// Whether the helpers called with constant arguments should be specialized
+  /// and the small ones inlined.
+  bool SpecializeHelpers = false;
+  /// Maximum number of instructions of the helpers inlined if
+  /// \p SpecializeHelpers is true.
+  unsigned HelpersInlineBudget = 32;
+  /// Whether the stores to the CPU state variables which are never read
+  /// should be removed.
+  bool CSVDSE = false;
+  /// Whether the syscalls should go through the `native_do_syscall` function
+  /// of the support module, which can forward them directly to the host.
+  bool NativeSyscalls = false;
+  /// Path where the binary analysis artifact (see binaryartifact.h) should be
+  /// written. If an empty string, it's not written.
+  std::string Artifact;
+  /// Wall time, in seconds, after which the translation should end, if
+  /// possible. Past three quarters of it no more jump targets are searched.
+  /// If 0, there's no time budget.
+  unsigned TimeBudget = 0;
+  /// Path where the module should be saved right before SET runs for the
+  /// first time, if not empty.
+  std::string PreHarvest;
+  /// Path of the file where the text of the `oi` and `pi` metadata should be
+  /// kept until the end of the translation, see MetadataSpill. If empty, it's
+  /// kept in memory.
+  std::string OutOfCore;
+  /// Path of a list of additional jump targets (see
+  /// JumpTargetManager::loadSeeds), if not empty.
+  std::string Seeds;
+  /// The shard of the executable code to translate, see
+  /// JumpTargetManager::setShard.
+  unsigned ShardIndex = 0;
+  /// The number of shards. If 0, all the code is translated. Otherwise, all
+  /// the jump targets found are written to `OUTFILE.jump-targets`.
+  unsigned ShardCount = 0;
+  /// Whether each function identified by the function boundaries detection
+  /// should be moved to its own LLVM function (see FunctionIsolationPass).
+  bool IsolateFunctions = false;
+  /// Whether the calls to the common SSE and NEON helpers should be
+  /// translated to LLVM vector operations (see VectorHelpers).
+  bool LowerVectorHelpers = false;
+  /// Whether the identified calls should push their return address on a
+  /// shadow stack, checked before going to the dispatcher (see
+  /// JumpTargetManager::createShadowStack).
+  bool ShadowStack = false;
+  /// Whether the table mapping the translated code back to the input PCs
+  /// should be emitted (see JumpTargetManager::createAddressMap).
+  bool AddressMap = false;
+  /// Whether the CPU state should be thread-local and the QEMU locking
+  /// primitives kept, so that the support module can run the threads created
+  /// by the input program on host threads.
+  bool GuestThreads = false;
+  /// Path of the jump targets found by a previous run (see
+  /// JumpTargetManager::importJumpTargets), if not empty.
+  std::string ImportJTs;
+  /// Path where the jump targets found should be written (see
+  /// JumpTargetManager::exportJumpTargets), if not empty.
+  std::string ExportJTs;
+};
+
 /// Translator from binary code to LLVM IR.
 class CodeGenerator {
 public:
@@ -45,39 +190,21 @@ public:
   ///
   /// \param Binary reference to a BinaryFile object describing the input.
   /// \param Target target architecture.
-  /// \param Output path where the generate LLVM IR must be saved.
-  /// \param Helpers path of the LLVM IR file containing the QEMU helpers.
-  /// \param DebugInfo type of debug information to generate.
-  /// \param Debug path where the debugging source file must be written. If an
-  ///        empty string, the output file name plus ".S", if \p DebugInfo is
-  ///        DebugInfoType::OriginalAssembly, or ".ptc", if \p DebugInfo is
-  ///        DebugInfoType::PTC.
-  /// \param LinkingInfo path where the information about how the linking should
-  ///        be stored. If an empty string, the output file name with a
-  ///        ".li.csv" suffix will be used.
-  /// \param Coverage path where the information about instruction coverage
-  ///        should be stored. If an empty string, the output file name with a
-  ///        ".coverage.csv" suffix will be used.
-  /// \param EnableOSRA specify whether OSRA should be used to discover
-  ///        additional jump targets or not.
-  /// \param EnableLinking specifying whether linking to QEMU helpers should be
-  ///        performed or not.
+  /// \param Options the paths and the settings of the translation.
   CodeGenerator(BinaryFile &Binary,
                 Architecture &Target,
-                std::string Output,
-                std::string Helpers,
-                DebugInfoType DebugInfo,
-                std::string Debug,
-                std::string LinkingInfo,
-                std::string Coverage,
-                std::string BBSummary,
-                bool EnableOSRA,
-                bool DetectFunctionBoundaries,
-                bool EnableLinking,
-                bool ExternalCSVs);
+                const CodeGeneratorOptions &Options);
 
   ~CodeGenerator();
 
+  /// \brief Parse in advance the helpers module at \p Path
+  ///
+  /// The next CodeGenerator created with \p Path as helpers takes ownership
+  /// of the parsed module instead of parsing it again. This is meant for
+  /// processes forked to run a single translation each (see `--batch`):
+  /// each of them gets its own copy of the pristine module.
+  static void preloadHelpers(std::string Path);
+
   /// \brief Creates an LLVM function for the code in the specified memory area.
   /// If debug information has been requested, the debug source files will be
   /// create in this phase.
@@ -88,6 +215,21 @@ public:
   /// Serialize the generated LLVM IR to the specified output path.
   void serialize();
 
+  /// \brief Produce an object file for the host from the generated module
+  ///
+  /// Links in the support module, optimizes and runs the code generation
+  /// in-process, as `translate` would do through `llvm-link`, `opt` and `llc`.
+  /// The module is modified, therefore this should be the last step.
+  ///
+  /// \param ObjectPath path where the object file should be written.
+  /// \param SupportPath path of the support module to link.
+  /// \param OptimizationLevel 0 for no optimizations, 1 to only optimize in
+  ///        the backend, 2 for optimizations in the mid-end too and 3 to use,
+  ///        in the mid-end, a pipeline tailored to the translated code.
+  void emitObject(std::string ObjectPath,
+                  std::string SupportPath,
+                  unsigned OptimizationLevel);
+
 private:
   /// \brief Parse the ELF headers.
   /// Collect useful information such as the segments' boundaries, their
@@ -114,6 +256,7 @@ private:
 
   unsigned OriginalInstrMDKind;
   unsigned PTCInstrMDKind;
+  unsigned PTCInstrIdMDKind;
   unsigned DbgMDKind;
 
   std::string CoveragePath;
@@ -123,6 +266,39 @@ private:
   bool DetectFunctionBoundaries;
   bool EnableLinking;
   bool ExternalCSVs;
+  unsigned LiftJobs;
+  std::string PTCCachePath;
+  bool PTCIndex;
+  bool SplitInPlace;
+  bool DispatcherTable;
+  std::string InlineCacheTrace;
+  bool IncrementalHarvest;
+  unsigned SETDepth;
+  bool SlicedOSRA;
+  bool AnalysisMetadata;
+  MarkersMode Markers;
+  std::string ProfilePath;
+  bool PromoteCSVs;
+  bool SpecializeHelpers;
+  unsigned HelpersInlineBudget;
+  bool CSVDSE;
+  bool NativeSyscalls;
+  std::string ArtifactPath;
+  unsigned TimeBudget;
+  std::chrono::steady_clock::time_point StartTime;
+  std::string PreHarvestPath;
+  std::string OutOfCorePath;
+  MetadataSpill Spill;
+  std::string SeedsPath;
+  unsigned ShardIndex;
+  unsigned ShardCount;
+  bool IsolateFunctions;
+  bool LowerVectorHelpers;
+  bool ShadowStack;
+  bool AddressMap;
+  bool GuestThreads;
+  std::string ImportJTsPath;
+  std::string ExportJTsPath;
 };
 
 #endif // _CODEGENERATOR_H
@@ -8,6 +8,7 @@
 // LLVM includes
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
 
 // Local includes
 #include "datastructures.h"
@@ -19,14 +20,13 @@ using namespace llvm;
 char CollectCFG::ID = 0;
 static RegisterPass<CollectCFG> X("ccfg", "Collect CFG Pass", true, true);
 
-void CollectCFG::serialize(std::ostream &Output) {
+void CollectCFG::serialize(raw_ostream &Output) {
   Output << "source,destination\n";
   for (auto &P : Result) {
     BasicBlock *Source = P.first;
     std::sort(P.second.begin(), P.second.end(), CompareByName<BasicBlock>());
     for (BasicBlock *Destination : P.second)
-      Output << Source->getName().data() << ","
-             << Destination->getName().data() << "\n";
+      Output << Source->getName() << "," << Destination->getName() << "\n";
   }
 }
 
@@ -43,8 +43,9 @@ bool CollectCFG::isNewInstruction(BasicBlock *BB) {
   return true;
 }
 
-bool CollectCFG::runOnFunction(Function &F) {
+bool CollectCFG::prepare(Function &F) {
   Result.clear();
+  BlackList.clear();
 
   for (BasicBlock &BB : F) {
     if (!isNewInstruction(&BB))
@@ -53,28 +54,37 @@ bool CollectCFG::runOnFunction(Function &F) {
       break;
   }
 
-  // For each basic block
-  for (BasicBlock &BB : F) {
-    if (!isNewInstruction(&BB))
-      continue;
-
-    OnceQueue<BasicBlock *> Queue;
-    Queue.insert(&BB);
-    while (!Queue.empty()) {
-      BasicBlock *ToExplore = Queue.pop();
-      for (BasicBlock *Successor : successors(ToExplore)) {
-
-        // If it's a new instruction register it, otherwise enqueue the basic
-        // block for further processing
-        if (isNewInstruction(Successor)) {
-          Result[&BB].push_back(Successor);
-        } else if (BlackList.count(Successor) == 0) {
-          Queue.insert(Successor);
-        }
+  return true;
+}
 
+void CollectCFG::collect(BasicBlock &BB) {
+  if (!isNewInstruction(&BB))
+    return;
+
+  OnceQueue<BasicBlock *> Queue;
+  Queue.insert(&BB);
+  while (!Queue.empty()) {
+    BasicBlock *ToExplore = Queue.pop();
+    for (BasicBlock *Successor : successors(ToExplore)) {
+
+      // If it's a new instruction register it, otherwise enqueue the basic
+      // block for further processing
+      if (isNewInstruction(Successor)) {
+        Result[&BB].push_back(Successor);
+      } else if (BlackList.count(Successor) == 0) {
+        Queue.insert(Successor);
       }
+
     }
   }
+}
+
+bool CollectCFG::runOnFunction(Function &F) {
+  prepare(F);
+
+  // For each basic block
+  for (BasicBlock &BB : F)
+    collect(BB);
 
   return false;
 }
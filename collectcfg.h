@@ -6,7 +6,6 @@
 //
 
 // Standard includes
-#include <fstream>
 #include <map>
 #include <set>
 
@@ -15,6 +14,10 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 
+namespace llvm {
+class raw_ostream;
+}
+
 template<typename T>
 struct CompareByName {
   bool operator()(const T *LHS, const T *RHS) const {
@@ -35,7 +38,16 @@ public:
     AU.setPreservesAll();
   }
 
-  void serialize(std::ostream &Output);
+  /// \brief Prepare to collect the CFG of \p F one basic block at a time
+  ///
+  /// \return true, collect has to be called on all the basic blocks of \p F.
+  bool prepare(llvm::Function &F);
+
+  /// \brief Collect the edges starting from \p BB, if it's the start of an
+  ///        instruction
+  void collect(llvm::BasicBlock &BB);
+
+  void serialize(llvm::raw_ostream &Output);
 
 private:
   bool isNewInstruction(llvm::BasicBlock *BB);
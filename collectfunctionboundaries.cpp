@@ -10,6 +10,9 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ValueSymbolTable.h"
+#include "llvm/Support/raw_ostream.h"
 
 // Local includes
 #include "collectfunctionboundaries.h"
@@ -30,34 +33,61 @@ static RegisterPass<CollectFunctionBoundaries> X("cfb",
                                                  true,
                                                  true);
 
-void CollectFunctionBoundaries::serialize(std::ostream &Output) {
+void CollectFunctionBoundaries::serialize(raw_ostream &Output) {
   Output << "function,basicblock\n";
 
   auto Comparator = CompareByName<const BasicBlock>();
   for (auto &P : Functions) {
     std::sort(P.second.begin(), P.second.end(), Comparator);
     for (BasicBlock *BB : P.second) {
-      Output << P.first.data() << "," << BB->getName().data() << "\n";
+      Output << P.first << "," << BB->getName() << "\n";
     }
   }
 }
 
-bool CollectFunctionBoundaries::runOnFunction(Function &F) {
+bool CollectFunctionBoundaries::prepare(Function &F) {
   Functions.clear();
 
-  for (BasicBlock &BB : F) {
-    if (!BB.empty()) {
-      TerminatorInst *Terminator = BB.getTerminator();
-      if (MDNode *Node = Terminator->getMetadata("func.member.of")) {
-        auto *Tuple = cast<MDTuple>(Node);
-        for (const MDOperand &Op : Tuple->operands()) {
-          auto *FunctionMD = cast<MDTuple>(Op);
-          auto *FunctionNameMD = cast<MDString>(&*FunctionMD->getOperand(0));
-          Functions[FunctionNameMD->getString()].push_back(&BB);
-        }
+  // Use the list stored by revamb --analysis-metadata, if available: each
+  // entry is the name of the entry basic block followed by its members
+  Module *M = F.getParent();
+  NamedMDNode *FunctionsMD = M->getNamedMetadata("revamb.functions");
+  if (FunctionsMD == nullptr)
+    return true;
+
+  ValueSymbolTable &Symbols = F.getValueSymbolTable();
+  for (MDNode *Node : FunctionsMD->operands()) {
+    auto *FunctionNameMD = cast<MDString>(&*Node->getOperand(0));
+    auto &Members = Functions[FunctionNameMD->getString()];
+    for (unsigned I = 1; I < Node->getNumOperands(); I++) {
+      auto *MemberNameMD = cast<MDString>(&*Node->getOperand(I));
+      Value *V = Symbols.lookup(MemberNameMD->getString());
+      if (auto *BB = dyn_cast_or_null<BasicBlock>(V))
+        Members.push_back(BB);
+    }
+  }
+
+  return false;
+}
+
+void CollectFunctionBoundaries::collect(BasicBlock &BB) {
+  if (!BB.empty()) {
+    TerminatorInst *Terminator = BB.getTerminator();
+    if (MDNode *Node = Terminator->getMetadata("func.member.of")) {
+      auto *Tuple = cast<MDTuple>(Node);
+      for (const MDOperand &Op : Tuple->operands()) {
+        auto *FunctionMD = cast<MDTuple>(Op);
+        auto *FunctionNameMD = cast<MDString>(&*FunctionMD->getOperand(0));
+        Functions[FunctionNameMD->getString()].push_back(&BB);
       }
     }
   }
+}
+
+bool CollectFunctionBoundaries::runOnFunction(Function &F) {
+  if (prepare(F))
+    for (BasicBlock &BB : F)
+      collect(BB);
 
   return false;
 }
@@ -6,7 +6,6 @@
 //
 
 // Standard includes
-#include <fstream>
 #include <map>
 #include <vector>
 
@@ -16,6 +15,7 @@
 
 namespace llvm {
 class BasicBlock;
+class raw_ostream;
 }
 
 class CollectFunctionBoundaries : public llvm::FunctionPass {
@@ -31,7 +31,16 @@ public:
     AU.setPreservesAll();
   }
 
-  void serialize(std::ostream &Output);
+  /// \brief Prepare to collect the function boundaries of \p F
+  ///
+  /// \return true if collect has to be called on all the basic blocks of
+  ///         \p F, i.e., if the boundaries are not available in the metadata.
+  bool prepare(llvm::Function &F);
+
+  /// \brief Register \p BB in the functions it belongs to
+  void collect(llvm::BasicBlock &BB);
+
+  void serialize(llvm::raw_ostream &Output);
 
 private:
   std::map<llvm::StringRef, std::vector<llvm::BasicBlock *>> Functions;
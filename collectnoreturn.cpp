@@ -10,6 +10,9 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ValueSymbolTable.h"
+#include "llvm/Support/raw_ostream.h"
 
 // Local includes
 #include "collectnoreturn.h"
@@ -29,26 +32,47 @@ static RegisterPass<CollectNoreturn> X("cnoreturn",
                                        true,
                                        true);
 
-void CollectNoreturn::serialize(std::ostream &Output) {
+void CollectNoreturn::serialize(raw_ostream &Output) {
+  std::sort(NoreturnBBs.begin(),
+            NoreturnBBs.end(),
+            CompareByName<BasicBlock>());
+
   Output << "noreturn\n";
   for (BasicBlock *BB : NoreturnBBs)
-    Output << BB->getName().data() << "\n";
+    Output << BB->getName() << "\n";
 }
 
-bool CollectNoreturn::runOnFunction(Function &F) {
+bool CollectNoreturn::prepare(Function &F) {
   NoreturnBBs.clear();
 
-  for (BasicBlock &BB : F) {
-    if (!BB.empty()) {
-      TerminatorInst *Terminator = BB.getTerminator();
-      if (Terminator->getMetadata("noreturn") != nullptr)
-        NoreturnBBs.push_back(&BB);
-    }
+  // Use the list stored by revamb --analysis-metadata, if available
+  NamedMDNode *NoreturnMD = F.getParent()->getNamedMetadata("revamb.noreturn");
+  if (NoreturnMD == nullptr)
+    return true;
+
+  ValueSymbolTable &Symbols = F.getValueSymbolTable();
+  for (MDNode *Node : NoreturnMD->operands()) {
+    auto *NameMD = cast<MDString>(&*Node->getOperand(0));
+    Value *V = Symbols.lookup(NameMD->getString());
+    if (auto *BB = dyn_cast_or_null<BasicBlock>(V))
+      NoreturnBBs.push_back(BB);
   }
 
-  std::sort(NoreturnBBs.begin(),
-            NoreturnBBs.end(),
-            CompareByName<BasicBlock>());
+  return false;
+}
+
+void CollectNoreturn::collect(BasicBlock &BB) {
+  if (!BB.empty()) {
+    TerminatorInst *Terminator = BB.getTerminator();
+    if (Terminator->getMetadata("noreturn") != nullptr)
+      NoreturnBBs.push_back(&BB);
+  }
+}
+
+bool CollectNoreturn::runOnFunction(Function &F) {
+  if (prepare(F))
+    for (BasicBlock &BB : F)
+      collect(BB);
 
   return false;
 }
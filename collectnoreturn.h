@@ -6,7 +6,6 @@
 //
 
 // Standard includes
-#include <fstream>
 #include <vector>
 
 // LLVM includes
@@ -14,6 +13,7 @@
 
 namespace llvm {
 class BasicBlock;
+class raw_ostream;
 }
 
 class CollectNoreturn : public llvm::FunctionPass {
@@ -29,7 +29,16 @@ public:
     AU.setPreservesAll();
   }
 
-  void serialize(std::ostream &Output);
+  /// \brief Prepare to collect the noreturn basic blocks of \p F
+  ///
+  /// \return true if collect has to be called on all the basic blocks of
+  ///         \p F, i.e., if the list is not available in the metadata.
+  bool prepare(llvm::Function &F);
+
+  /// \brief Register \p BB if it's marked as noreturn
+  void collect(llvm::BasicBlock &BB);
+
+  void serialize(llvm::raw_ostream &Output);
 
 private:
   std::vector<llvm::BasicBlock *> NoreturnBBs;
@@ -0,0 +1,140 @@
+/// \file csvaccesses.cpp
+/// \brief Implementation of the CSVAccessAnalysis
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <utility>
+
+// LLVM includes
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+// Local includes
+#include "csvaccesses.h"
+
+using namespace llvm;
+
+/// \brief Return true if \p F is one of the markers introduced by revamb,
+///        which have no body but don't access the CPU state
+static bool isMarker(Function *F) {
+  StringRef Name = F->getName();
+  return Name == "newpc"
+    || Name == "newbb"
+    || Name == "exitTB"
+    || Name == "function_call"
+    || Name == "nodce";
+}
+
+CSVAccessAnalysis::CSVAccessAnalysis(Module &M,
+                                     Function *Root,
+                                     const std::vector<GlobalVariable *> &CSVs) :
+  Root(Root)
+{
+  // Consider only the CSVs used by root and whose address is only loaded or
+  // stored
+  for (GlobalVariable *CSV : CSVs) {
+    bool UsedByRoot = false;
+    bool Trackable = true;
+    for (User *U : CSV->users()) {
+      auto *I = dyn_cast<Instruction>(U);
+      auto *Store = dyn_cast_or_null<StoreInst>(I);
+      if (I == nullptr
+          || !(isa<LoadInst>(I)
+               || (Store != nullptr && Store->getValueOperand() != CSV))) {
+        Trackable = false;
+        break;
+      }
+
+      if (I->getParent() != nullptr && I->getParent()->getParent() == Root)
+        UsedByRoot = true;
+    }
+
+    if (Trackable && UsedByRoot) {
+      Index[CSV] = Tracked.size();
+      Tracked.push_back(CSV);
+    }
+  }
+
+  unsigned Size = Tracked.size();
+  None = CSVAccesses(Size, false);
+  All = CSVAccesses(Size, true);
+  External = CSVAccesses(Size, false);
+  for (unsigned I = 0; I < Size; I++) {
+    if (!Tracked[I]->hasLocalLinkage()) {
+      External.Read.set(I);
+      External.Written.set(I);
+    }
+  }
+
+  if (Size == 0)
+    return;
+
+  // Collect the direct accesses and the calls of each function
+  std::vector<std::pair<Function *, std::vector<CallInst *>>> Calls;
+  for (Function &F : M) {
+    if (F.isDeclaration() || &F == Root)
+      continue;
+
+    CSVAccesses &FunctionAccesses = Accesses[&F];
+    FunctionAccesses = None;
+    std::vector<CallInst *> FunctionCalls;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        if (auto *Load = dyn_cast<LoadInst>(&I)) {
+          int CSVIndex = indexOf(Load->getPointerOperand());
+          if (CSVIndex != -1)
+            FunctionAccesses.Read.set(CSVIndex);
+        } else if (auto *Store = dyn_cast<StoreInst>(&I)) {
+          int CSVIndex = indexOf(Store->getPointerOperand());
+          if (CSVIndex != -1)
+            FunctionAccesses.Written.set(CSVIndex);
+        } else if (auto *Call = dyn_cast<CallInst>(&I)) {
+          FunctionCalls.push_back(Call);
+        }
+      }
+    }
+
+    Calls.push_back({ &F, std::move(FunctionCalls) });
+  }
+
+  // Propagate the accesses to the callers until a fixed point is reached. A
+  // declaration (e.g., native_do_syscall in the support module) can call back
+  // any function visible from outside the module (e.g., qemu_do_syscall or
+  // revamb_save_cpu_state), therefore it accesses what they access too.
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (auto &P : Calls) {
+      CSVAccesses &FunctionAccesses = Accesses[P.first];
+      for (CallInst *Call : P.second)
+        Changed |= FunctionAccesses.merge(callee(Call));
+
+      if (!P.first->hasLocalLinkage())
+        Changed |= External.merge(FunctionAccesses);
+    }
+  }
+}
+
+int CSVAccessAnalysis::indexOf(Value *Pointer) const {
+  auto It = Index.find(dyn_cast<GlobalVariable>(Pointer));
+  return It == Index.end() ? -1 : static_cast<int>(It->second);
+}
+
+const CSVAccesses &CSVAccessAnalysis::callee(CallInst *Call) const {
+  Value *Called = Call->getCalledValue()->stripPointerCasts();
+  auto *Callee = dyn_cast<Function>(Called);
+  if (Callee == nullptr || Callee == Root)
+    return All;
+  else if (Callee->isIntrinsic() || isMarker(Callee))
+    return None;
+  else if (Callee->isDeclaration())
+    return External;
+
+  // Functions created after the analysis might access anything
+  auto It = Accesses.find(Callee);
+  return It != Accesses.end() ? It->second : All;
+}
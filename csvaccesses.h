@@ -0,0 +1,82 @@
+#ifndef _CSVACCESSES_H
+#define _CSVACCESSES_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <map>
+#include <vector>
+
+// LLVM includes
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+
+namespace llvm {
+class CallInst;
+class Function;
+class GlobalVariable;
+class Module;
+class Value;
+}
+
+/// \brief The sets of CSVs, by index, read and written by a function
+struct CSVAccesses {
+  CSVAccesses() { }
+  CSVAccesses(unsigned Size, bool Value) : Read(Size, Value),
+                                           Written(Size, Value) { }
+
+  /// \brief Add the accesses in \p Other, return true if anything changed
+  bool merge(const CSVAccesses &Other) {
+    llvm::BitVector OldRead = Read;
+    llvm::BitVector OldWritten = Written;
+    Read |= Other.Read;
+    Written |= Other.Written;
+    return Read != OldRead || Written != OldWritten;
+  }
+
+  llvm::BitVector Read;
+  llvm::BitVector Written;
+};
+
+/// \brief Compute which CPU state variables (CSVs) each function might access
+///
+/// Only the CSVs used by the root function and whose address is only loaded
+/// or stored are tracked, so that all their accesses are visible. What a
+/// function accesses is computed on the call graph: declarations are assumed
+/// to access all the tracked CSVs with external linkage, since the others
+/// can't be accessed from outside the module, and everything the functions
+/// with external linkage access, since they can be called back. Indirect
+/// calls access all the tracked CSVs. The markers introduced by revamb (e.g.,
+/// `newpc`) access none.
+class CSVAccessAnalysis {
+public:
+  CSVAccessAnalysis(llvm::Module &M,
+                    llvm::Function *Root,
+                    const std::vector<llvm::GlobalVariable *> &CSVs);
+
+  /// \brief Return the tracked CSVs, the indexes of CSVAccesses refer to them
+  const std::vector<llvm::GlobalVariable *> &csvs() const { return Tracked; }
+
+  /// \brief Return the index of the CSV \p Pointer, or -1 if it's not a
+  ///        tracked CSV
+  int indexOf(llvm::Value *Pointer) const;
+
+  /// \brief Return the CSVs \p Call might access
+  const CSVAccesses &callee(llvm::CallInst *Call) const;
+
+  /// \brief Return a CSVAccesses including all the tracked CSVs
+  const CSVAccesses &all() const { return All; }
+
+private:
+  llvm::Function *Root;
+  std::vector<llvm::GlobalVariable *> Tracked;
+  llvm::DenseMap<llvm::GlobalVariable *, unsigned> Index;
+  std::map<llvm::Function *, CSVAccesses> Accesses;
+  CSVAccesses None;
+  CSVAccesses All;
+  CSVAccesses External;
+};
+
+#endif // _CSVACCESSES_H
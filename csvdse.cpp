@@ -0,0 +1,158 @@
+/// \file csvdse.cpp
+/// \brief Implementation of the CSVDeadStoreEliminationPass
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <vector>
+
+// LLVM includes
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+// Local includes
+#include "csvaccesses.h"
+#include "csvdse.h"
+#include "jumptargetmanager.h"
+#include "statistics.h"
+
+using namespace llvm;
+
+char CSVDeadStoreEliminationPass::ID = 0;
+static RegisterPass<CSVDeadStoreEliminationPass> X("csv-dse",
+                                                   "CSV Dead Store "
+                                                   "Elimination Pass",
+                                                   false,
+                                                   false);
+
+bool CSVDeadStoreEliminationPass::runOnModule(Module &M) {
+  if (Root == nullptr)
+    return false;
+
+  CSVAccessAnalysis Analysis(M, Root, CSVs);
+  unsigned Size = Analysis.csvs().size();
+  if (Size == 0)
+    return false;
+
+  const BitVector &AllCSVs = Analysis.all().Read;
+
+  // Compute the transfer function of each basic block: the CSVs live at its
+  // beginning are Gen plus those live at its end which are not in Kill
+  std::vector<BasicBlock *> Blocks;
+  DenseMap<BasicBlock *, unsigned> BlockIndex;
+  for (BasicBlock &BB : *Root) {
+    BlockIndex[&BB] = Blocks.size();
+    Blocks.push_back(&BB);
+  }
+
+  std::vector<BitVector> Gen(Blocks.size(), BitVector(Size));
+  std::vector<BitVector> Kill(Blocks.size(), BitVector(Size));
+  for (unsigned I = 0; I < Blocks.size(); I++) {
+    BasicBlock *BB = Blocks[I];
+
+    // From the dispatcher and the other non-translated blocks, the execution
+    // can proceed anywhere
+    if (!JTM->isTranslatedBB(BB)) {
+      Gen[I] = AllCSVs;
+      continue;
+    }
+
+    for (auto It = BB->rbegin(); It != BB->rend(); It++) {
+      if (auto *Load = dyn_cast<LoadInst>(&*It)) {
+        int CSVIndex = Analysis.indexOf(Load->getPointerOperand());
+        if (CSVIndex != -1)
+          Gen[I].set(CSVIndex);
+      } else if (auto *Store = dyn_cast<StoreInst>(&*It)) {
+        int CSVIndex = Analysis.indexOf(Store->getPointerOperand());
+        if (CSVIndex != -1) {
+          Gen[I].reset(CSVIndex);
+          Kill[I].set(CSVIndex);
+        }
+      } else if (auto *Call = dyn_cast<CallInst>(&*It)) {
+        Gen[I] |= Analysis.callee(Call).Read;
+      } else if (isa<ReturnInst>(&*It)) {
+        Gen[I] = AllCSVs;
+      }
+    }
+  }
+
+  // Propagate the liveness backward until a fixed point is reached
+  std::vector<BitVector> LiveIn(Blocks.size(), BitVector(Size));
+  std::vector<unsigned> WorkList;
+  BitVector InWorkList(Blocks.size(), true);
+  for (unsigned I = 0; I < Blocks.size(); I++)
+    WorkList.push_back(I);
+
+  auto LiveOut = [&] (BasicBlock *BB) {
+    BitVector Result(Size);
+    for (BasicBlock *Successor : successors(BB))
+      Result |= LiveIn[BlockIndex[Successor]];
+    return Result;
+  };
+
+  while (!WorkList.empty()) {
+    unsigned I = WorkList.back();
+    WorkList.pop_back();
+    InWorkList.reset(I);
+
+    BitVector NewLiveIn = LiveOut(Blocks[I]);
+    NewLiveIn.reset(Kill[I]);
+    NewLiveIn |= Gen[I];
+    if (NewLiveIn == LiveIn[I])
+      continue;
+
+    LiveIn[I] = NewLiveIn;
+    for (BasicBlock *Predecessor : predecessors(Blocks[I])) {
+      unsigned PredecessorIndex = BlockIndex[Predecessor];
+      if (!InWorkList[PredecessorIndex]) {
+        InWorkList.set(PredecessorIndex);
+        WorkList.push_back(PredecessorIndex);
+      }
+    }
+  }
+
+  // Collect the stores to CSVs which are not live after them
+  std::vector<StoreInst *> DeadStores;
+  for (BasicBlock *BB : Blocks) {
+    if (!JTM->isTranslatedBB(BB))
+      continue;
+
+    BitVector Live = LiveOut(BB);
+    for (auto It = BB->rbegin(); It != BB->rend(); It++) {
+      if (auto *Load = dyn_cast<LoadInst>(&*It)) {
+        int CSVIndex = Analysis.indexOf(Load->getPointerOperand());
+        if (CSVIndex != -1)
+          Live.set(CSVIndex);
+      } else if (auto *Store = dyn_cast<StoreInst>(&*It)) {
+        int CSVIndex = Analysis.indexOf(Store->getPointerOperand());
+        if (CSVIndex != -1) {
+          if (!Live[CSVIndex] && !Store->isVolatile())
+            DeadStores.push_back(Store);
+          Live.reset(CSVIndex);
+        }
+      } else if (auto *Call = dyn_cast<CallInst>(&*It)) {
+        Live |= Analysis.callee(Call).Read;
+      } else if (isa<ReturnInst>(&*It)) {
+        Live = AllCSVs;
+      }
+    }
+  }
+
+  // Remove them, along with the computation of the stored values
+  for (StoreInst *Store : DeadStores) {
+    Value *Stored = Store->getValueOperand();
+    Store->eraseFromParent();
+    RecursivelyDeleteTriviallyDeadInstructions(Stored);
+  }
+
+  setCounter("csv.dead-stores", DeadStores.size());
+
+  return !DeadStores.empty();
+}
@@ -0,0 +1,58 @@
+#ifndef _CSVDSE_H
+#define _CSVDSE_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <vector>
+
+// LLVM includes
+#include "llvm/Pass.h"
+
+namespace llvm {
+class Function;
+class GlobalVariable;
+}
+
+class JumpTargetManager;
+
+/// \brief Remove the stores to CPU state variables which are never read
+///
+/// Most input instructions compute the condition flags (e.g., NZCV on ARM or
+/// `cc_src` and `cc_dst` on x86-64), but they are usually overwritten before
+/// being read, possibly in another basic block. This pass computes the
+/// liveness of the CPU state variables (CSVs) on the CFG of the root function
+/// and removes the stores to a CSV which reach no read of it.
+///
+/// A call reads the CSVs its callee might read according to
+/// CSVAccessAnalysis, while a return, the dispatcher and the other blocks not
+/// belonging to the translated code read all of them, since from there the
+/// execution can proceed at any jump target or outside the root function.
+class CSVDeadStoreEliminationPass : public llvm::ModulePass {
+public:
+  static char ID;
+
+  CSVDeadStoreEliminationPass() :
+    llvm::ModulePass(ID),
+    Root(nullptr),
+    JTM(nullptr) { }
+
+  CSVDeadStoreEliminationPass(llvm::Function *Root,
+                              JumpTargetManager *JTM,
+                              std::vector<llvm::GlobalVariable *> CSVs) :
+    llvm::ModulePass(ID),
+    Root(Root),
+    JTM(JTM),
+    CSVs(std::move(CSVs)) { }
+
+  bool runOnModule(llvm::Module &M) override;
+
+private:
+  llvm::Function *Root;
+  JumpTargetManager *JTM;
+  std::vector<llvm::GlobalVariable *> CSVs;
+};
+
+#endif // _CSVDSE_H
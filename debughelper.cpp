@@ -6,9 +6,12 @@
 //
 
 // Standard includes
+#include <algorithm>
 #include <fstream>
+#include <sstream>
 
 // LLVM includes
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/LLVMContext.h"
@@ -18,6 +21,9 @@
 
 // Local includes
 #include "debughelper.h"
+#include "ir-helpers.h"
+#include "ptcdump.h"
+#include "ptcinterface.h"
 
 using namespace llvm;
 
@@ -75,10 +81,10 @@ static void writeMetadataIfNew(const Instruction *TheInstruction,
 }
 
 DebugAnnotationWriter::DebugAnnotationWriter(LLVMContext& Context,
-                                             Metadata *Scope,
+                                             std::set<const Function *> Fs,
                                              bool DebugInfo) :
   Context(Context),
-  Scope(Scope),
+  Functions(std::move(Fs)),
   DebugInfo(DebugInfo)
 {
   OriginalInstrMDKind = Context.getMDKindID("oi");
@@ -88,54 +94,72 @@ DebugAnnotationWriter::DebugAnnotationWriter(LLVMContext& Context,
 
 void DebugAnnotationWriter::emitInstructionAnnot(const Instruction *Instr,
                                                  formatted_raw_ostream &Output) {
-  // Ignore whatever is outside the root function
-  // TODO: comparing strings here is not very elegant
-  if (Instr->getParent()->getParent()->getName() != "root")
+  // Ignore whatever is outside the translated functions (e.g., the helpers)
+  if (Functions.count(Instr->getParent()->getParent()) == 0)
     return;
 
   writeMetadataIfNew(Instr, OriginalInstrMDKind, Output, "\n  ; ");
   writeMetadataIfNew(Instr, PTCInstrMDKind, Output, "\n  ; ");
 
   if (DebugInfo) {
-    // If DebugInfo is activated the generated LLVM IR textual representation
-    // will contain some reference to dangling pointers. So ignore the output
-    // stream if you're using the annotator to generate debug info about the IR
-    // itself.
-    assert(Scope != nullptr);
-
     // Flushing is required to have correct line and column numbers
     Output.flush();
-    auto *Location = DILocation::get(Context,
-                                     Output.getLine() + 1,
-                                     Output.getColumn(),
-                                     Scope);
 
     // Sorry Bjarne
     auto *NonConstInstruction = const_cast<Instruction *>(Instr);
-    NonConstInstruction->setMetadata(DbgMDKind, Location);
+    Locations.push_back({
+      NonConstInstruction,
+      { Output.getLine() + 1, Output.getColumn() }
+    });
   }
 }
 
+void DebugAnnotationWriter::attachLocations() {
+  for (auto &P : Locations) {
+    DISubprogram *Scope = P.first->getParent()->getParent()->getSubprogram();
+    assert(Scope != nullptr);
+
+    auto *Location = DILocation::get(Context,
+                                     P.second.first,
+                                     P.second.second,
+                                     Scope);
+    P.first->setMetadata(DbgMDKind, Location);
+  }
+
+  Locations.clear();
+}
+
 DebugHelper::DebugHelper(std::string Output,
                          std::string Debug,
                          Module *TheModule,
                          DebugInfoType Type) :
   OutputPath(Output),
   DebugPath(Debug),
+  BitcodeOutput(false),
   Builder(*TheModule),
   Type(Type),
   TheModule(TheModule)
 {
   OriginalInstrMDKind = TheModule->getContext().getMDKindID("oi");
   PTCInstrMDKind = TheModule->getContext().getMDKindID("pi");
+  PTCInstrIdMDKind = TheModule->getContext().getMDKindID("pi.id");
   DbgMDKind = TheModule->getContext().getMDKindID("dbg");
 
+  const std::string BitcodeSuffix = ".bc";
+  BitcodeOutput = OutputPath.size() > BitcodeSuffix.size()
+    && std::equal(BitcodeSuffix.rbegin(),
+                  BitcodeSuffix.rend(),
+                  OutputPath.rbegin());
+
   // Generate automatically the name of the source file for debugging
   if (DebugPath.empty()) {
     if (Type == DebugInfoType::PTC)
       DebugPath = OutputPath + ".ptc";
     else if (Type == DebugInfoType::OriginalAssembly)
       DebugPath = OutputPath + ".S";
+    else if (Type == DebugInfoType::LLVMIR && BitcodeOutput)
+      DebugPath = OutputPath.substr(0, OutputPath.size() - BitcodeSuffix.size())
+        + ".ll";
     else if (Type == DebugInfoType::LLVMIR)
       DebugPath = OutputPath;
   }
@@ -161,29 +185,88 @@ void DebugHelper::newFunction(Function *Function) {
     DISubroutineType *EmptyType = nullptr;
     EmptyType = Builder.createSubroutineType(Builder.getOrCreateTypeArray({}));
 
-    CurrentFunction = Function;
+    Functions.push_back(Function);
     assert(CompileUnit != nullptr);
-    CurrentSubprogram = Builder.createFunction(CompileUnit->getFile(), // Scope
-                                               Function->getName(),
-                                               StringRef(), // Linkage name
-                                               CompileUnit->getFile(),
-                                               1, // Line
-                                               EmptyType, // Subroutine type
-                                               false, // isLocalToUnit
-                                               true, // isDefinition
-                                               1, // ScopeLine
-                                               DINode::FlagPrototyped,
-                                               false /* isOptimized */);
-    CurrentFunction->setSubprogram(CurrentSubprogram);
+    DISubprogram *Subprogram;
+    Subprogram = Builder.createFunction(CompileUnit->getFile(), // Scope
+                                        Function->getName(),
+                                        StringRef(), // Linkage name
+                                        CompileUnit->getFile(),
+                                        1, // Line
+                                        EmptyType, // Subroutine type
+                                        false, // isLocalToUnit
+                                        true, // isDefinition
+                                        1, // ScopeLine
+                                        DINode::FlagPrototyped,
+                                        false /* isOptimized */);
+    Function->setSubprogram(Subprogram);
   }
 }
 
+void DebugHelper::generateIndexedPTCDebugInfo() {
+  assert(!Functions.empty());
+
+  QuickMetadata QMD(TheModule->getContext());
+  unsigned LineIndex = 1;
+  std::ofstream Source(DebugPath);
+
+  // Translations are requested in order of appearance, keep the last one
+  uint64_t CurrentTB = 0;
+  PTCInstructionListPtr Instructions;
+
+  for (Function *F : Functions) {
+    DISubprogram *Subprogram = F->getSubprogram();
+    MDNode *Last = nullptr;
+    for (BasicBlock& Block : *F) {
+      for (Instruction& Instruction : Block) {
+        MDNode *IdMD = Instruction.getMetadata(PTCInstrIdMDKind);
+        auto *Id = cast_or_null<MDTuple>(IdMD);
+
+        if (Id == nullptr || Id == Last)
+          continue;
+        Last = Id;
+
+        std::pair<uint64_t, unsigned> Entry;
+        Entry = PTCIndex.at(QMD.extract<uint32_t>(Id, 0));
+
+        if (!Instructions || CurrentTB != Entry.first) {
+          CurrentTB = Entry.first;
+          Instructions.reset(new PTCInstructionList);
+          std::unique_lock<std::mutex> Guard(PTCLock);
+          ptc.translate(CurrentTB, Instructions.get());
+        }
+
+        std::stringstream BodyStream;
+        dumpInstruction(BodyStream, Instructions.get(), Entry.second);
+        BodyStream << "\n";
+        std::string BodyString = BodyStream.str();
+
+        Source << BodyString;
+
+        auto *Location = DILocation::get(TheModule->getContext(),
+                                         LineIndex,
+                                         0,
+                                         Subprogram);
+        Instruction.setMetadata(DbgMDKind, Location);
+        LineIndex += std::count(BodyString.begin(), BodyString.end(), '\n');
+      }
+    }
+  }
+
+  Builder.finalize();
+}
+
 void DebugHelper::generateDebugInfo() {
+  if (Type == DebugInfoType::PTC && !PTCIndex.empty()) {
+    generateIndexedPTCDebugInfo();
+    return;
+  }
+
   switch (Type) {
   case DebugInfoType::PTC:
   case DebugInfoType::OriginalAssembly:
     {
-      assert(CurrentSubprogram != nullptr && CurrentFunction != nullptr);
+      assert(!Functions.empty());
 
       // Generate the source file and the debugging information in tandem
 
@@ -191,24 +274,29 @@ void DebugHelper::generateDebugInfo() {
       unsigned MetadataKind = Type == DebugInfoType::PTC ?
         PTCInstrMDKind : OriginalInstrMDKind;
 
-      MDString *Last = nullptr;
       std::ofstream Source(DebugPath);
-      for (BasicBlock& Block : *CurrentFunction) {
-        for (Instruction& Instruction : Block) {
-          MDString *Body = getMD(&Instruction, MetadataKind);
-
-          if (Body != nullptr && Last != Body) {
-            Last = Body;
-            std::string BodyString = Body->getString().str();
-
-            Source << BodyString;
-
-            auto *Location = DILocation::get(TheModule->getContext(),
-                                             LineIndex,
-                                             0,
-                                             CurrentSubprogram);
-            Instruction.setMetadata(DbgMDKind, Location);
-            LineIndex += std::count(BodyString.begin(), BodyString.end(), '\n');
+      for (Function *F : Functions) {
+        DISubprogram *Subprogram = F->getSubprogram();
+        MDString *Last = nullptr;
+        for (BasicBlock& Block : *F) {
+          for (Instruction& Instruction : Block) {
+            MDString *Body = getMD(&Instruction, MetadataKind);
+
+            if (Body != nullptr && Last != Body) {
+              Last = Body;
+              std::string BodyString = Body->getString().str();
+
+              Source << BodyString;
+
+              auto *Location = DILocation::get(TheModule->getContext(),
+                                               LineIndex,
+                                               0,
+                                               Subprogram);
+              Instruction.setMetadata(DbgMDKind, Location);
+              LineIndex += std::count(BodyString.begin(),
+                                      BodyString.end(),
+                                      '\n');
+            }
           }
         }
       }
@@ -218,18 +306,23 @@ void DebugHelper::generateDebugInfo() {
     }
   case DebugInfoType::LLVMIR:
     {
-      // Use the annotator to obtain line and column of the textual LLVM IR for
-      // each instruction. Discard the output since it will contain errors,
-      // regenerating it later will give a correct result.
+      // Print the module once, using the annotator to record line and column
+      // of each instruction, and attach them only at the end. If the debug
+      // source is the output itself, it will be printed in serialize, so just
+      // discard the text.
       Builder.finalize();
 
-      raw_null_ostream NullStream;
-      TheModule->print(NullStream, annotator(true /* DebugInfo */));
-
-      std::ofstream Output(DebugPath);
-      raw_os_ostream Stream(Output);
-      TheModule->print(Stream, annotator(false));
+      DebugAnnotationWriter *Writer = annotator(true /* DebugInfo */);
+      if (DebugPath == OutputPath) {
+        raw_null_ostream NullStream;
+        TheModule->print(NullStream, Writer);
+      } else {
+        std::ofstream Output(DebugPath);
+        raw_os_ostream Stream(Output);
+        TheModule->print(Stream, Writer);
+      }
 
+      Writer->attachLocations();
       break;
     }
   default:
@@ -240,26 +333,21 @@ void DebugHelper::generateDebugInfo() {
 
 void DebugHelper::print(std::ostream& Output, bool DebugInfo) {
   raw_os_ostream OutputStream(Output);
-  TheModule->print(OutputStream, annotator(DebugInfo));
+  DebugAnnotationWriter *Writer = annotator(DebugInfo);
+  TheModule->print(OutputStream, Writer);
+  if (DebugInfo)
+    Writer->attachLocations();
 }
 
-bool DebugHelper::copySource() {
-  // If debug info refer to LLVM IR, just copy the output file
-  if (Type == DebugInfoType::LLVMIR && DebugPath != OutputPath) {
-    std::ifstream Source(DebugPath, std::ios::binary);
-    std::ofstream Destination(OutputPath, std::ios::binary);
-
-    Destination << Source.rdbuf();
-
-    return true;
-  }
-
-  return false;
+void DebugHelper::writeBitcode(std::ostream& Output) {
+  raw_os_ostream OutputStream(Output);
+  WriteBitcodeToFile(TheModule, OutputStream);
 }
 
 DebugAnnotationWriter *DebugHelper::annotator(bool DebugInfo) {
+  std::set<const Function *> Decorated(Functions.begin(), Functions.end());
   Annotator.reset(new DebugAnnotationWriter(TheModule->getContext(),
-                                            CurrentSubprogram,
+                                            std::move(Decorated),
                                             DebugInfo));
   return Annotator.get();
 }
@@ -8,7 +8,10 @@
 // Standard includes
 #include <memory>
 #include <ostream>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 // LLVM includes
 #include "llvm/IR/DIBuilder.h"
@@ -28,37 +31,46 @@ class Function;
 ///        information
 ///
 /// AssemblyAnnotationWriter implementation inserting in the generated LLVM IR
-/// comments containing the original assembly and the PTC. It can also decorate
-/// the IR with debug information (i.e. DILocations) refered to the generated
+/// comments containing the original assembly and the PTC in the translated
+/// functions. It can also record
+/// the position of each instruction in the generated LLVM IR, so that it can
+/// later be decorated with debug information (i.e. DILocations) refered to the
 /// LLVM IR itself.
 class DebugAnnotationWriter : public llvm::AssemblyAnnotationWriter {
 public:
   /// \brief Create a new DebugAnnotationWriter
   ///
-  /// \warning If \p DebugInfo is `true`, the produced output should be
-  ///          discarded since it will contain errors. \p DebugInfo should be
-  ///          set to `true` in a first run to produce the metadata, and then a
-  ///          new DebugAnnotationWriter with `DebugInfo = false` should be
-  ///          created and run to produce an output without errors.
-  ///
   /// \param Context the LLVM context.
-  /// \param Scope the scope, typically a `DISubprogram`.
-  /// \param DebugInfo whether to decorate the IR being serialized with debug
-  ///        metadata refering to the produce IR itself or not.
+  /// \param Functions the functions to decorate, each one with its
+  ///        `DISubprogram`, which is the scope of its locations.
+  /// \param DebugInfo whether to record the position of the instructions in
+  ///        the IR being serialized or not.
   DebugAnnotationWriter(llvm::LLVMContext& Context,
-                        llvm::Metadata *Scope,
+                        std::set<const llvm::Function *> Functions,
                         bool DebugInfo);
 
   virtual void emitInstructionAnnot(const llvm::Instruction *TheInstruction,
                                     llvm::formatted_raw_ostream &Output);
 
+  /// \brief Decorate the instructions with the recorded positions
+  ///
+  /// The DILocations are attached only once the serialization is over,
+  /// attaching them while printing would produce references to metadata
+  /// unknown to the printer. The `!dbg` attachment is printed on the same line
+  /// of its instruction and metadata is printed at the end of the module,
+  /// therefore the recorded positions remain valid for a module printed after
+  /// this call.
+  void attachLocations();
+
 private:
   llvm::LLVMContext &Context;
-  llvm::Metadata *Scope;
+  std::set<const llvm::Function *> Functions;
   unsigned OriginalInstrMDKind;
   unsigned PTCInstrMDKind;
   unsigned DbgMDKind;
   bool DebugInfo;
+  std::vector<std::pair<llvm::Instruction *,
+                        std::pair<unsigned, unsigned>>> Locations;
 };
 
 /// \brief Handle printing the IR in textual form, possibly with debug
@@ -67,11 +79,13 @@ class DebugHelper {
 public:
   /// \brief Create a new DebugHelper
   ///
-  /// \param Output path where the LLVM IR should be stored.
+  /// \param Output path where the LLVM IR should be stored. If it ends with
+  ///        `.bc` the module will be serialized as bitcode.
   /// \param Debug path where the debug output should be stored. If empty, \p
   ///        Output will be used along with a suffix, e.g. `.pts` if \p Type is
   ///        DebugInfoType::PTC, `.S` if it's DebugInfoType::OriginalAssembly or
-  ///        will match \p Output if \p Type is DebugInfoType::LLVMIR.
+  ///        will match \p Output if \p Type is DebugInfoType::LLVMIR (with a
+  ///        `.ll` extension in place of `.bc` for bitcode output).
   /// \param TheModule the LLVM module to print out.
   /// \param Type type of debug information requested.
   DebugHelper(std::string Output,
@@ -82,17 +96,35 @@ public:
   /// \brief Handle a new function
   ///
   /// Generates the debug information for the given function and caches it for
-  /// future use.
+  /// future use. The root function comes first, followed by the functions
+  /// created out of it (e.g., by FunctionIsolationPass), which share the same
+  /// debug source.
   void newFunction(llvm::Function *Function);
 
-  /// Decorates the current function with the requested debug info
+  /// Decorates the translated functions with the requested debug info
   void generateDebugInfo();
 
   /// Serializes to the given stream the module, with or without debug info
   void print(std::ostream& Output, bool DebugInfo);
 
-  /// Copy the debug file to the output path, if they are the same
-  bool copySource();
+  /// Serializes to the given stream the module in bitcode form
+  void writeBitcode(std::ostream& Output);
+
+  /// \brief Whether the output should be serialized as bitcode
+  bool bitcodeOutput() const { return BitcodeOutput; }
+
+  /// \brief The kind of debug information to generate
+  DebugInfoType type() const { return Type; }
+
+  /// \brief Provide the PTC instruction identifier -> (translation block,
+  ///        offset) index
+  ///
+  /// If an index is provided, DebugInfoType::PTC debug information is
+  /// generated from the "pi.id" metadata, the text of each PTC instruction is
+  /// rebuilt translating again the associated translation block.
+  void setPTCIndex(std::vector<std::pair<uint64_t, unsigned>> Index) {
+    PTCIndex = std::move(Index);
+  }
 
 private:
   /// Create a new AssemblyAnnotationWriter
@@ -101,19 +133,25 @@ private:
   ///        information referred to itself or not.
   DebugAnnotationWriter *annotator(bool DebugInfo);
 
+  /// Generate the PTC source file and debug information using PTCIndex
+  void generateIndexedPTCDebugInfo();
+
 private:
   std::string OutputPath;
   std::string DebugPath;
+  bool BitcodeOutput;
   llvm::DIBuilder Builder;
   DebugInfoType Type;
   llvm::Module *TheModule;
   llvm::DICompileUnit *CompileUnit;
-  llvm::DISubprogram *CurrentSubprogram;
-  llvm::Function *CurrentFunction;
+  /// The functions registered with newFunction, in order
+  std::vector<llvm::Function *> Functions;
   std::unique_ptr<DebugAnnotationWriter> Annotator;
+  std::vector<std::pair<uint64_t, unsigned>> PTCIndex;
 
   unsigned OriginalInstrMDKind;
   unsigned PTCInstrMDKind;
+  unsigned PTCInstrIdMDKind;
   unsigned DbgMDKind;
 };
 
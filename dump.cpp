@@ -3,9 +3,13 @@
 ///        generated by revamb
 
 // Standard includes
+#include <atomic>
 #include <cstdlib>
-#include <iostream>
+#include <functional>
 #include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // LLVM includes
 #include "llvm/IR/Constants.h" // REMOVE ME
@@ -14,7 +18,9 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
 
 // Local includes
 #include "argparse.h"
@@ -72,88 +78,147 @@ static bool parseArgs(int Argc, const char *Argv[], ProgramParameters &Result) {
   return true;
 }
 
+/// \brief Run the requested collectors over a function and write their outputs
+///
+/// All the collectors share a single traversal of the function, then each
+/// output file is written through a buffered stream on its own thread.
 class DumpPass : public FunctionPass {
 public:
   static char ID;
 
 public:
   DumpPass(ProgramParameters &Parameters) : FunctionPass(ID),
-                                            Parameters(Parameters) { }
+                                            Parameters(Parameters),
+                                            Failed(false) { }
 
   bool runOnFunction(Function &F) override {
-    std::ofstream Output;
+    using Serializer = std::function<void(raw_ostream &)>;
+    std::vector<std::function<void(BasicBlock &)>> Collectors;
+    std::vector<std::pair<const char *, Serializer>> Outputs;
 
     if (Parameters.CFGPath != nullptr) {
-      auto &Analysis = getAnalysis<CollectCFG>();
-      Analysis.serialize(pathToStream(Parameters.CFGPath, Output));
+      if (CFG.prepare(F))
+        Collectors.push_back([this] (BasicBlock &BB) { CFG.collect(BB); });
+      Outputs.push_back({
+        Parameters.CFGPath,
+        [this] (raw_ostream &Output) { CFG.serialize(Output); }
+      });
     }
 
     if (Parameters.NoreturnPath != nullptr) {
-      auto &Analysis = getAnalysis<CollectNoreturn>();
-      Analysis.serialize(pathToStream(Parameters.NoreturnPath, Output));
+      if (Noreturn.prepare(F))
+        Collectors.push_back([this] (BasicBlock &BB) {
+            Noreturn.collect(BB);
+          });
+      Outputs.push_back({
+        Parameters.NoreturnPath,
+        [this] (raw_ostream &Output) { Noreturn.serialize(Output); }
+      });
     }
 
     if (Parameters.FunctionBoundariesPath != nullptr) {
-      auto &Analysis = getAnalysis<CollectFunctionBoundaries>();
-      Analysis.serialize(pathToStream(Parameters.FunctionBoundariesPath,
-                                      Output));
+      if (FunctionBoundaries.prepare(F))
+        Collectors.push_back([this] (BasicBlock &BB) {
+            FunctionBoundaries.collect(BB);
+          });
+      Outputs.push_back({
+        Parameters.FunctionBoundariesPath,
+        [this] (raw_ostream &Output) { FunctionBoundaries.serialize(Output); }
+      });
     }
 
+    if (!Collectors.empty())
+      for (BasicBlock &BB : F)
+        for (auto &Collect : Collectors)
+          Collect(BB);
+
+    // Write each file on its own thread, and what goes to stdout on this one,
+    // in order
+    std::vector<std::thread> Writers;
+    for (auto &P : Outputs) {
+      const char *Path = P.first;
+      if (!(Path[0] == '-' && Path[1] == '\0'))
+        Writers.emplace_back(&DumpPass::writeFile, this, Path, P.second);
+    }
+
+    for (auto &P : Outputs) {
+      const char *Path = P.first;
+      if (Path[0] == '-' && Path[1] == '\0')
+        P.second(outs());
+    }
+
+    for (std::thread &Writer : Writers)
+      Writer.join();
+
     return false;
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.setPreservesAll();
-
-    if (Parameters.CFGPath != nullptr)
-      AU.addRequired<CollectCFG>();
-
-    if (Parameters.NoreturnPath != nullptr)
-      AU.addRequired<CollectNoreturn>();
-
-    if (Parameters.FunctionBoundariesPath != nullptr)
-      AU.addRequired<CollectFunctionBoundaries>();
-
   }
 
+  /// \brief Return true if an output file couldn't be written
+  bool failed() const { return Failed; }
+
 private:
-  std::ostream &pathToStream(const char *Path, std::ofstream &File) {
-    if (Path[0] == '-' && Path[1] == '\0') {
-      return std::cout;
-    } else {
-      if (File.is_open())
-        File.close();
-      File.open(Path);
-      return File;
+  void writeFile(const char *Path, std::function<void(raw_ostream &)> Write) {
+    std::error_code EC;
+    raw_fd_ostream Output(Path, EC, sys::fs::F_None);
+    if (EC) {
+      fprintf(stderr, "Couldn't open %s: %s\n", Path, EC.message().c_str());
+      Failed = true;
+      return;
     }
+
+    Write(Output);
   }
 
 private:
   ProgramParameters &Parameters;
+  CollectCFG CFG;
+  CollectNoreturn Noreturn;
+  CollectFunctionBoundaries FunctionBoundaries;
+  std::atomic<bool> Failed;
 };
 
 char DumpPass::ID = 0;
 
 int main(int argc, const char *argv[]) {
-  ProgramParameters Parameters = { nullptr, nullptr };
+  ProgramParameters Parameters = { nullptr, nullptr, nullptr, nullptr };
 
   if (!parseArgs(argc, argv, Parameters))
     return EXIT_FAILURE;
 
   LLVMContext &Context = getGlobalContext();
   SMDiagnostic Err;
-  std::unique_ptr<Module> TheModule = parseIRFile(Parameters.InputPath,
-                                                  Err,
-                                                  Context);
+
+  // Bitcode is loaded lazily: only the root function is materialized, the
+  // helpers are never read
+  std::unique_ptr<Module> TheModule = getLazyIRFileModule(Parameters.InputPath,
+                                                          Err,
+                                                          Context);
 
   if (!TheModule) {
     fprintf(stderr, "Couldn't load the LLVM IR.");
     return EXIT_FAILURE;
   }
 
+  Function *Root = TheModule->getFunction("root");
+  if (Root == nullptr) {
+    fprintf(stderr, "Couldn't find the root function.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (std::error_code EC = Root->materialize()) {
+    fprintf(stderr, "Couldn't load the root function: %s\n",
+            EC.message().c_str());
+    return EXIT_FAILURE;
+  }
+
+  auto *Dump = new DumpPass(Parameters);
   legacy::FunctionPassManager FPM(TheModule.get());
-  FPM.add(new DumpPass(Parameters));
-  FPM.run(*TheModule->getFunction("root"));
+  FPM.add(Dump);
+  FPM.run(*Root);
 
-  return EXIT_SUCCESS;
+  return Dump->failed() ? EXIT_FAILURE : EXIT_SUCCESS;
 }
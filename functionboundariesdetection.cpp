@@ -6,11 +6,14 @@
 //
 
 // Standard includes
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <fstream>
 #include <map>
 #include <set>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 // Boost includes
@@ -19,6 +22,8 @@
 #include <boost/icl/right_open_interval.hpp>
 
 // LLVM includes
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ADT/ilist.h"
 #include "llvm/ADT/SmallVector.h"
@@ -32,6 +37,7 @@
 #include "functionboundariesdetection.h"
 #include "ir-helpers.h"
 #include "jumptargetmanager.h"
+#include "statistics.h"
 
 using namespace llvm;
 
@@ -107,17 +113,79 @@ private:
     uint32_t Reasons;
   };
 
+  /// \brief Set of basic blocks visited from a CFEP
+  ///
+  /// It's a bitset over the dense basic block numbering, which also records
+  /// the visit order, so that the worklist is the list of visited basic
+  /// blocks itself. Each worker reuses one across CFEPs.
+  class VisitedBlocks {
+  public:
+    VisitedBlocks(const FunctionBoundariesDetectionImpl &FBD) :
+      FBD(FBD), Bits(FBD.Blocks.size()) { }
+
+    bool insert(BasicBlock *BB) {
+      unsigned Index = FBD.index(BB);
+      if (Bits.test(Index))
+        return false;
+
+      Bits.set(Index);
+      Visited.push_back(BB);
+      return true;
+    }
+
+    size_t size() const { return Visited.size(); }
+    BasicBlock *operator[](size_t I) const { return Visited[I]; }
+    const std::vector<BasicBlock *> &visited() const { return Visited; }
+
+    void reset() {
+      for (BasicBlock *BB : Visited)
+        Bits.reset(FBD.index(BB));
+      Visited.clear();
+    }
+
+  private:
+    const FunctionBoundariesDetectionImpl &FBD;
+    BitVector Bits;
+    std::vector<BasicBlock *> Visited;
+  };
+
+  /// \brief What phase 1 learns exploring a CFEP, to be merged later
+  struct CFEPExploration {
+    std::vector<std::pair<BasicBlock *, RelationType>> Relations;
+    std::vector<std::pair<BasicBlock *, uint64_t>> SkippingJumps;
+  };
+
 private:
   void initPostDispatcherIt();
+  void numberBasicBlocks();
+  unsigned index(BasicBlock *BB) const {
+    auto It = BlockIndex.find(BB);
+    assert(It != BlockIndex.end());
+    return It->second;
+  }
   void collectFunctionCalls();
   void collectReturnInstructions();
   void registerBasicBlockAddressRanges();
-  interval_set findCoverage(BasicBlock *BB);
+  interval_set findCoverage(BasicBlock *BB) const;
 
   // CFEP related methods
   void collectInitialCFEPSet();
   void cfepProcessPhase1();
   void cfepProcessPhase2();
+  void exploreCFEP(BasicBlock *CFEP,
+                   VisitedBlocks &Visited,
+                   CFEPExploration &Result) const;
+  void collectMembers(BasicBlock *CFEP,
+                      VisitedBlocks &Visited,
+                      std::vector<BasicBlock *> &Result) const;
+
+  /// \brief Call \p Body on each element of \p CFEPs, spreading the calls on
+  ///        multiple threads
+  ///
+  /// \p Body receives the index of the CFEP and a VisitedBlocks owned by the
+  /// current thread. It must not alter the state of this object.
+  template<typename T>
+  void forEachCFEP(const std::vector<BasicBlock *> &CFEPs, T Body) const;
 
   /// Associate to each basic block a metadata with the list of functions it
   /// belongs to
@@ -139,7 +207,7 @@ private:
     Relation.setDistance(Distance);
   }
 
-  bool isCFEP(BasicBlock *BB) const { return CFEPs.count(BB); }
+  bool isCFEP(BasicBlock *BB) const { return CFEPs.count(BB) != 0; }
   void registerCFEP(BasicBlock *BB, CFEPReason Reason) {
     assert(BB != nullptr);
     CFEPs[BB].setReason(Reason);
@@ -176,6 +244,10 @@ private:
   Function &F;
   JumpTargetManager *JTM;
 
+  // Dense numbering of the basic blocks, in layout order
+  std::vector<BasicBlock *> Blocks;
+  DenseMap<BasicBlock *, unsigned> BlockIndex;
+
   std::map<TerminatorInst *, BasicBlock *> FunctionCalls;
   std::map<BasicBlock *, std::vector<BasicBlock *>> CallPredecessors;
   std::set<uint64_t> ReturnPCs;
@@ -207,6 +279,42 @@ void FBD::initPostDispatcherIt() {
   PostDispatcherIt = It;
 }
 
+void FBD::numberBasicBlocks() {
+  Blocks.reserve(F.size());
+  for (BasicBlock &BB : F) {
+    BlockIndex[&BB] = Blocks.size();
+    Blocks.push_back(&BB);
+  }
+}
+
+template<typename T>
+void FBD::forEachCFEP(const std::vector<BasicBlock *> &CFEPs, T Body) const {
+  // Debug output from multiple threads would be interleaved, and small sets of
+  // CFEPs are not worth the threads
+  const size_t MinCFEPsPerJob = 64;
+  size_t Jobs = DebuggingEnabled ? 1 : std::thread::hardware_concurrency();
+  Jobs = std::min(Jobs, (CFEPs.size() + MinCFEPsPerJob - 1) / MinCFEPsPerJob);
+  Jobs = std::max<size_t>(Jobs, 1);
+
+  std::atomic<size_t> NextCFEP(0);
+  auto Worker = [this, &CFEPs, &Body, &NextCFEP] () {
+    VisitedBlocks Visited(*this);
+    size_t I;
+    while ((I = NextCFEP++) < CFEPs.size()) {
+      Visited.reset();
+      Body(I, Visited);
+    }
+  };
+
+  std::vector<std::thread> Workers;
+  for (size_t I = 1; I < Jobs; I++)
+    Workers.emplace_back(Worker);
+  Worker();
+
+  for (std::thread &Thread : Workers)
+    Thread.join();
+}
+
 static inline BasicBlock *getBlock(Value *V) {
   return cast<BlockAddress>(V)->getBasicBlock();
 }
@@ -291,7 +399,7 @@ void FBD::registerBasicBlockAddressRanges() {
   }
 }
 
-interval_set FBD::findCoverage(BasicBlock *BB) {
+interval_set FBD::findCoverage(BasicBlock *BB) const {
   auto It = Coverage.find(BB);
   if (It != Coverage.end()) {
     return It->second;
@@ -357,90 +465,121 @@ void FBD::collectInitialCFEPSet() {
   }
 }
 
-void FBD::cfepProcessPhase1() {
-  // For each CFEP record which basic block it can reach and how. Then also
-  // detect skipping jumps.
-  while (!CFEPWorkList.empty()) {
-    BasicBlock *CFEP = CFEPWorkList.pop();
-
-    // Find all the basic block it can reach
-    OnceQueue<BasicBlock *> WorkList;
-    WorkList.insert(CFEP);
-
-    while (!WorkList.empty()) {
-      BasicBlock *RelatedBB = WorkList.pop();
-
-      auto FCIt = FunctionCalls.find(RelatedBB->getTerminator());
-      if (FCIt != FunctionCalls.end()) {
-        // This basic block ends with a function call, proceed with the return
-        // address, unless it's a call to a noreturn function.
-        if (JTM->noReturn().isNoreturnBasicBlock(RelatedBB)) {
-          DBG("nra", dbg << "Stopping at " << getName(RelatedBB) << " since it's a noreturn call\n");
-        } else {
-          BasicBlock *ReturnBB = FCIt->second;
-          setRelation(CFEP, ReturnBB, Return);
-          WorkList.insert(ReturnBB);
-        }
-
-      } else if (Returns.count(RelatedBB->getTerminator()) == 0) {
-        // It's not a return, it's not a function call, it must be a branch part
-        // of the ordinary control flow of the function.
-        for (BasicBlock *S : successors(RelatedBB)) {
-          if (!JTM->isTranslatedBB(S))
-            continue;
+void FBD::exploreCFEP(BasicBlock *CFEP,
+                      VisitedBlocks &Visited,
+                      CFEPExploration &Result) const {
+  // Find all the basic block it can reach
+  Visited.insert(CFEP);
+
+  for (size_t I = 0; I < Visited.size(); I++) {
+    BasicBlock *RelatedBB = Visited[I];
+
+    auto FCIt = FunctionCalls.find(RelatedBB->getTerminator());
+    if (FCIt != FunctionCalls.end()) {
+      // This basic block ends with a function call, proceed with the return
+      // address, unless it's a call to a noreturn function.
+      if (JTM->noReturn().isNoreturnBasicBlock(RelatedBB)) {
+        DBG("nra", dbg << "Stopping at " << getName(RelatedBB) << " since it's a noreturn call\n");
+      } else {
+        BasicBlock *ReturnBB = FCIt->second;
+        Result.Relations.push_back({ ReturnBB, Return });
+        Visited.insert(ReturnBB);
+      }
 
-          // TODO: track fallthrough
-          setRelation(CFEP, S, Jump);
-          WorkList.insert(S);
-        }
+    } else if (Returns.count(RelatedBB->getTerminator()) == 0) {
+      // It's not a return, it's not a function call, it must be a branch part
+      // of the ordinary control flow of the function.
+      for (BasicBlock *S : successors(RelatedBB)) {
+        if (!JTM->isTranslatedBB(S))
+          continue;
 
+        // TODO: track fallthrough
+        Result.Relations.push_back({ S, Jump });
+        Visited.insert(S);
       }
+
     }
+  }
+
+  // Compute distance of jumps
+
+  // For each basic block look at his Jump successors
+  for (BasicBlock *BB : Visited.visited()) {
+    TerminatorInst *T = BB->getTerminator();
+    if (FunctionCalls.count(T) != 0 || Returns.count(T) != 0)
+      continue;
 
-    // Compute distance of jumps
+    interval_set StartAddressRange = findCoverage(BB);
+    uint64_t StartAddress = StartAddressRange.begin()->lower();
+    assert(StartAddress != 0);
 
-    // For each basic block look at his Jump successors
-    for (BasicBlock *BB : WorkList.visited()) {
-      TerminatorInst *T = BB->getTerminator();
-      if (FunctionCalls.count(T) != 0 || Returns.count(T) != 0)
+    for (BasicBlock *S : successors(BB)) {
+      if (!JTM->isTranslatedBB(S))
         continue;
 
-      interval_set StartAddressRange = findCoverage(BB);
-      uint64_t StartAddress = StartAddressRange.begin()->lower();
-      assert(StartAddress != 0);
+      auto CoverageIt = Coverage.find(S);
+      if (CoverageIt == Coverage.end())
+        continue;
+      const interval_set &DestinationAddressRange = CoverageIt->second;
 
-      for (BasicBlock *S : successors(BB)) {
-        if (!JTM->isTranslatedBB(S) || Coverage.count(S) == 0)
-          continue;
+      // TODO: why this?
+      if (DestinationAddressRange.size() == 0)
+        continue;
 
-        assert(Coverage.find(S) != Coverage.end());
-        interval_set &DestinationAddressRange = Coverage[S];
+      uint64_t DestinationAddress = DestinationAddressRange.begin()->lower();
 
-        // TODO: why this?
-        if (DestinationAddressRange.size() == 0)
-          continue;
+      interval_set JumpInterval;
+      if (StartAddress <= DestinationAddress)
+        JumpInterval += interval::closed(StartAddress, DestinationAddress);
+      else
+        JumpInterval += interval::closed(DestinationAddress, StartAddress);
 
-        uint64_t DestinationAddress = DestinationAddressRange.begin()->lower();
+      JumpInterval -= StartAddressRange;
+      JumpInterval -= DestinationAddressRange;
+      JumpInterval &= Callees;
+      uint64_t Distance = JumpInterval.size();
 
-        interval_set JumpInterval;
-        if (StartAddress <= DestinationAddress)
-          JumpInterval += interval::closed(StartAddress, DestinationAddress);
-        else
-          JumpInterval += interval::closed(DestinationAddress, StartAddress);
+      if (Distance > 0)
+        Result.SkippingJumps.push_back({ S, Distance });
 
-        JumpInterval -= StartAddressRange;
-        JumpInterval -= DestinationAddressRange;
-        JumpInterval &= Callees;
-        uint64_t Distance = JumpInterval.size();
+    }
 
-        if (Distance > 0) {
-          setDistance(CFEP, S, Distance);
-          registerCFEP(S, SkippingJump);
-          CFEPWorkList.insert(S);
-        }
+  }
+}
 
-      }
+void FBD::cfepProcessPhase1() {
+  // For each CFEP record which basic block it can reach and how. Then also
+  // detect skipping jumps.
+  //
+  // The exploration of a CFEP doesn't depend on the others, therefore we
+  // explore in parallel all the CFEPs currently in the worklist and then merge
+  // the results in worklist order. The skipping jumps found in a round are the
+  // CFEPs of the next one.
+  while (!CFEPWorkList.empty()) {
+    std::vector<BasicBlock *> Round;
+    while (!CFEPWorkList.empty())
+      Round.push_back(CFEPWorkList.pop());
 
+    incrementCounter("functions.cfep-explorations", Round.size());
+
+    std::vector<CFEPExploration> Results(Round.size());
+    forEachCFEP(Round, [this, &Round, &Results] (size_t I,
+                                                 VisitedBlocks &Visited) {
+        exploreCFEP(Round[I], Visited, Results[I]);
+      });
+
+    for (size_t I = 0; I < Round.size(); I++) {
+      BasicBlock *CFEP = Round[I];
+
+      for (auto &P : Results[I].Relations)
+        setRelation(CFEP, P.first, P.second);
+
+      for (auto &P : Results[I].SkippingJumps) {
+        BasicBlock *S = P.first;
+        setDistance(CFEP, S, P.second);
+        registerCFEP(S, SkippingJump);
+        CFEPWorkList.insert(S);
+      }
     }
   }
 }
@@ -502,37 +641,53 @@ void FBD::filterCFEPs() {
   Relations.clear();
 }
 
-void FBD::cfepProcessPhase2() {
+void FBD::collectMembers(BasicBlock *CFEP,
+                         VisitedBlocks &Visited,
+                         std::vector<BasicBlock *> &Result) const {
   // Find all the basic block it can reach
-  for (BasicBlock *CFEP : cfeps()) {
-    OnceQueue<BasicBlock *> WorkList;
-    WorkList.insert(CFEP);
-
-    while (!WorkList.empty()) {
-      BasicBlock *RelatedBB = WorkList.pop();
-      assert(JTM->isTranslatedBB(RelatedBB));
-
-      auto FCIt = FunctionCalls.find(RelatedBB->getTerminator());
-      if (FCIt != FunctionCalls.end()) {
-        BasicBlock *ReturnBB = FCIt->second;
-        if (!isCFEP(ReturnBB))
-          WorkList.insert(ReturnBB);
-      } else if (Returns.count(RelatedBB->getTerminator()) == 0) {
-        for (BasicBlock *S : successors(RelatedBB)) {
-          if (!JTM->isTranslatedBB(S))
-            continue;
-
-          // TODO: doesn't handle the div in div case
-          if (!isCFEP(S))
-            WorkList.insert(S);
-        }
+  Visited.insert(CFEP);
+
+  for (size_t I = 0; I < Visited.size(); I++) {
+    BasicBlock *RelatedBB = Visited[I];
+    assert(JTM->isTranslatedBB(RelatedBB));
+
+    auto FCIt = FunctionCalls.find(RelatedBB->getTerminator());
+    if (FCIt != FunctionCalls.end()) {
+      BasicBlock *ReturnBB = FCIt->second;
+      if (!isCFEP(ReturnBB))
+        Visited.insert(ReturnBB);
+    } else if (Returns.count(RelatedBB->getTerminator()) == 0) {
+      for (BasicBlock *S : successors(RelatedBB)) {
+        if (!JTM->isTranslatedBB(S))
+          continue;
 
+        // TODO: doesn't handle the div in div case
+        if (!isCFEP(S))
+          Visited.insert(S);
       }
-    }
 
-    for (BasicBlock *Member : WorkList.visited())
-      Functions[CFEP].push_back(Member);
+    }
   }
+
+  // Keep the members in layout order
+  Result = Visited.visited();
+  std::sort(Result.begin(), Result.end(), [this] (BasicBlock *A,
+                                                  BasicBlock *B) {
+      return index(A) < index(B);
+    });
+}
+
+void FBD::cfepProcessPhase2() {
+  // The CFEPs are now fixed, compute the members of each function in parallel
+  std::vector<BasicBlock *> Heads = cfeps();
+  std::vector<std::vector<BasicBlock *>> Members(Heads.size());
+  forEachCFEP(Heads, [this, &Heads, &Members] (size_t I,
+                                               VisitedBlocks &Visited) {
+      collectMembers(Heads[I], Visited, Members[I]);
+    });
+
+  for (size_t I = 0; I < Heads.size(); I++)
+    Functions[Heads[I]] = std::move(Members[I]);
 }
 
 void FBD::createMetadata() {
@@ -576,6 +731,8 @@ map<BasicBlock *, vector<BasicBlock *>> FBD::run() {
 
   initPostDispatcherIt();
 
+  numberBasicBlocks();
+
   collectFunctionCalls();
 
   collectReturnInstructions();
@@ -620,6 +777,7 @@ std::string FBD::CFEPRelation::describe() const {
 }
 
 bool FBDP::runOnFunction(Function &F) {
+  ScopedPhase Phase("function-boundaries");
   FBD Impl(F, JTM);
   Functions = Impl.run();
   serialize();
@@ -8,6 +8,7 @@
 // Standard includes
 #include <map>
 #include <string>
+#include <vector>
 
 // LLVM includes
 #include "llvm/Pass.h"
@@ -34,6 +35,12 @@ public:
 
   bool runOnFunction(llvm::Function &F) override;
 
+  /// \brief Return the entry basic block of each function and its members
+  const std::map<llvm::BasicBlock *, std::vector<llvm::BasicBlock *>> &
+  functions() const {
+    return Functions;
+  }
+
 private:
   void serialize() const;
 
@@ -0,0 +1,438 @@
+/// \file functionisolation.cpp
+/// \brief Implementation of FunctionIsolationPass
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <algorithm>
+#include <cassert>
+#include <set>
+#include <vector>
+
+// LLVM includes
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+// Local includes
+#include "functionisolation.h"
+#include "ir-helpers.h"
+#include "jumptargetmanager.h"
+#include "statistics.h"
+
+using namespace llvm;
+
+char FunctionIsolationPass::ID = 0;
+static RegisterPass<FunctionIsolationPass> X("isolate-functions",
+                                             "Function Isolation Pass",
+                                             false,
+                                             false);
+
+/// \brief A function to move out of the root function
+struct IsolatedFunction {
+  llvm::BasicBlock *Entry;
+  std::vector<llvm::BasicBlock *> Members;
+  std::set<llvm::BasicBlock *> MemberSet;
+  llvm::Function *F;
+};
+
+/// \brief A call to an isolated function from another one
+struct DirectCall {
+  llvm::BasicBlock *Caller;
+  llvm::Function *Callee;
+  uint64_t CalleePC;
+  llvm::BasicBlock *Return;
+};
+
+/// \brief Return the call to `function_call` preceeding the terminator of
+///        \p BB, or nullptr
+static CallInst *getFunctionCallMarker(BasicBlock *BB) {
+  TerminatorInst *Terminator = BB->getTerminator();
+  if (Terminator == nullptr || Terminator == &BB->front())
+    return nullptr;
+
+  auto *Call = dyn_cast<CallInst>(Terminator->getPrevNode());
+  if (Call == nullptr)
+    return nullptr;
+
+  // TODO: comparing strings is not very elegant
+  Function *Callee = Call->getCalledFunction();
+  if (Callee == nullptr || Callee->getName() != "function_call")
+    return nullptr;
+
+  return Call;
+}
+
+static BasicBlock *getBlockAddressTarget(Value *V) {
+  return cast<BlockAddress>(V)->getBasicBlock();
+}
+
+/// \brief Make the PHIs of \p BB take an undefined value coming from \p Pred
+static void addUndefIncoming(BasicBlock *BB, BasicBlock *Pred) {
+  for (Instruction &I : *BB) {
+    auto *Phi = dyn_cast<PHINode>(&I);
+    if (Phi == nullptr)
+      break;
+    Phi->addIncoming(UndefValue::get(Phi->getType()), Pred);
+  }
+}
+
+bool FunctionIsolationPass::runOnModule(Module &M) {
+  if (Root == nullptr)
+    return false;
+
+  LLVMContext &Context = M.getContext();
+  auto *PCReg = cast<GlobalVariable>(JTM->pcReg());
+  auto *PCType = cast<IntegerType>(PCReg->getType()->getPointerElementType());
+  BasicBlock *RootEntry = &Root->getEntryBlock();
+  BasicBlock *Dispatcher = JTM->dispatcher();
+
+  // The newpc markers might have already been dropped, take the address of
+  // the jump targets from the JumpTargetManager
+  DenseMap<BasicBlock *, uint64_t> JumpTargetPCs;
+  for (auto &P : *JTM)
+    JumpTargetPCs[P.second.head()] = P.first;
+
+  auto IsIsolable = [this, RootEntry, &JumpTargetPCs] (IsolatedFunction &C) {
+    if (JumpTargetPCs.count(C.Entry) == 0)
+      return false;
+
+    for (BasicBlock *BB : C.Members) {
+      if (BB->empty() || BB->getParent() != Root || !JTM->isTranslatedBB(BB))
+        return false;
+
+      // Outside the function we can only go through the dispatcher
+      for (BasicBlock *Successor : successors(BB))
+        if (C.MemberSet.count(Successor) == 0
+            && JTM->isTranslatedBB(Successor)
+            && JumpTargetPCs.count(Successor) == 0)
+          return false;
+
+      for (Instruction &I : *BB) {
+        if (isa<ReturnInst>(&I) || isa<IndirectBrInst>(&I))
+          return false;
+
+        // The values coming from outside the function will be dropped
+        auto *Phi = dyn_cast<PHINode>(&I);
+        for (unsigned J = 0; J < I.getNumOperands(); J++) {
+          if (Phi != nullptr
+              && C.MemberSet.count(Phi->getIncomingBlock(J)) == 0)
+            continue;
+
+          Value *Operand = I.getOperand(J);
+          if (isa<Argument>(Operand))
+            return false;
+
+          auto *Definition = dyn_cast<Instruction>(Operand);
+          if (Definition == nullptr
+              || C.MemberSet.count(Definition->getParent()) != 0
+              || (isa<AllocaInst>(Definition)
+                  && Definition->getParent() == RootEntry))
+            continue;
+
+          return false;
+        }
+      }
+    }
+
+    return true;
+  };
+
+  // Consider the functions by entry PC, so that the output doesn't depend on
+  // the address of the basic blocks. Entries which are not jump targets will
+  // be rejected anyway.
+  using FunctionEntry = FunctionsMap::value_type;
+  std::vector<FunctionEntry *> Sorted;
+  for (FunctionEntry &P : Functions)
+    Sorted.push_back(&P);
+  auto PCOf = [&JumpTargetPCs] (FunctionEntry *P) {
+    auto It = JumpTargetPCs.find(P->first);
+    return It == JumpTargetPCs.end() ? 0 : It->second;
+  };
+  std::stable_sort(Sorted.begin(),
+                   Sorted.end(),
+                   [&PCOf] (FunctionEntry *A, FunctionEntry *B) {
+                     return PCOf(A) < PCOf(B);
+                   });
+
+  std::vector<IsolatedFunction> Isolated;
+  for (FunctionEntry *P : Sorted) {
+    IsolatedFunction Candidate;
+    Candidate.Entry = P->first;
+    Candidate.Members = P->second;
+    if (std::find(Candidate.Members.begin(),
+                  Candidate.Members.end(),
+                  Candidate.Entry) == Candidate.Members.end())
+      Candidate.Members.insert(Candidate.Members.begin(), Candidate.Entry);
+    Candidate.MemberSet.insert(Candidate.Members.begin(),
+                               Candidate.Members.end());
+    Candidate.F = nullptr;
+
+    if (IsIsolable(Candidate))
+      Isolated.push_back(std::move(Candidate));
+    else
+      incrementCounter("isolation.rejected-functions");
+  }
+
+  // Create the functions and decide which one handles each jump target: its
+  // entry, or the first function containing it
+  auto *IsolatedType = FunctionType::get(Type::getVoidTy(Context),
+                                         { PCType },
+                                         false);
+  DenseMap<BasicBlock *, Function *> Entries;
+  for (IsolatedFunction &C : Isolated) {
+    C.F = Function::Create(IsolatedType,
+                           GlobalValue::InternalLinkage,
+                           "isolated." + C.Entry->getName(),
+                           &M);
+    Entries[C.Entry] = C.F;
+    IsolatedFunctions.push_back(C.F);
+  }
+
+  DenseMap<BasicBlock *, Function *> Owners(Entries);
+  std::vector<BasicBlock *> Stubs;
+  for (IsolatedFunction &C : Isolated)
+    Stubs.push_back(C.Entry);
+  for (IsolatedFunction &C : Isolated)
+    for (BasicBlock *BB : C.Members)
+      if (JumpTargetPCs.count(BB) != 0 && Owners.insert({ BB, C.F }).second)
+        Stubs.push_back(BB);
+
+  for (IsolatedFunction &C : Isolated) {
+    Function *F = C.F;
+    Argument *EntryPC = &*F->arg_begin();
+    EntryPC->setName("entry_pc");
+
+    ValueToValueMapTy VMap;
+    auto CloneOf = [&VMap] (BasicBlock *BB) {
+      Value *Clone = VMap[BB];
+      return cast<BasicBlock>(Clone);
+    };
+
+    auto *EntryBB = BasicBlock::Create(Context, "entry", F);
+
+    std::vector<std::pair<BasicBlock *, BasicBlock *>> Clones;
+    for (BasicBlock *BB : C.Members) {
+      BasicBlock *Clone = CloneBasicBlock(BB, VMap, "", F);
+      VMap[BB] = Clone;
+      Clones.push_back({ BB, Clone });
+    }
+
+    // Each function gets its own copy of the local variables of the root
+    // function it uses
+    for (auto &P : Clones) {
+      for (Instruction &I : *P.second) {
+        for (Value *Operand : I.operands()) {
+          auto *Alloca = dyn_cast<AllocaInst>(Operand);
+          if (Alloca == nullptr
+              || Alloca->getParent() != RootEntry
+              || VMap.count(Alloca) != 0)
+            continue;
+
+          Instruction *Copy = Alloca->clone();
+          Copy->setName(Alloca->getName());
+          EntryBB->getInstList().push_back(Copy);
+          VMap[Alloca] = Copy;
+        }
+      }
+    }
+
+    // Leaving the function, go back to the root function: the dispatcher
+    // will handle the PC
+    BasicBlock *ReturnBB = nullptr;
+    auto GetReturn = [&ReturnBB, &Context, F] () {
+      if (ReturnBB == nullptr) {
+        ReturnBB = BasicBlock::Create(Context, "return", F);
+        ReturnInst::Create(Context, ReturnBB);
+      }
+      return ReturnBB;
+    };
+
+    for (auto &P : Clones) {
+      for (BasicBlock *Successor : successors(P.first)) {
+        if (VMap.count(Successor) != 0)
+          continue;
+
+        if (!JTM->isTranslatedBB(Successor)) {
+          VMap[Successor] = GetReturn();
+          continue;
+        }
+
+        // The translated code doesn't always set the PC jumping to another
+        // jump target (e.g., falling through)
+        auto *Exit = BasicBlock::Create(Context,
+                                        "exit." + Successor->getName(),
+                                        F);
+        new StoreInst(ConstantInt::get(PCType, JumpTargetPCs[Successor]),
+                      PCReg,
+                      Exit);
+        ReturnInst::Create(Context, Exit);
+        VMap[Successor] = Exit;
+      }
+    }
+
+    // Drop the incoming values from outside the function and the function
+    // call markers, which refer to basic blocks of the root function
+    std::vector<DirectCall> Calls;
+    for (auto &P : Clones) {
+      for (Instruction &I : *P.second) {
+        auto *Phi = dyn_cast<PHINode>(&I);
+        if (Phi == nullptr)
+          break;
+
+        for (unsigned J = Phi->getNumIncomingValues(); J > 0; J--)
+          if (C.MemberSet.count(Phi->getIncomingBlock(J - 1)) == 0)
+            Phi->removeIncomingValue(J - 1, false);
+      }
+
+      if (CallInst *Marker = getFunctionCallMarker(P.second)) {
+        BasicBlock *Callee = getBlockAddressTarget(Marker->getArgOperand(0));
+        BasicBlock *Return = getBlockAddressTarget(Marker->getArgOperand(1));
+        Marker->eraseFromParent();
+
+        auto It = Entries.find(Callee);
+        if (It != Entries.end())
+          Calls.push_back({
+              P.second,
+              It->second,
+              JumpTargetPCs[Callee],
+              Return
+            });
+      }
+    }
+
+    for (auto &P : Clones)
+      for (Instruction &I : *P.second)
+        RemapInstruction(&I,
+                         VMap,
+                         RF_NoModuleLevelChanges | RF_IgnoreMissingEntries);
+
+    // Call directly the other isolated functions, and go on if they return
+    // where expected
+    for (DirectCall &Call : Calls) {
+      BasicBlock *Caller = Call.Caller;
+      TerminatorInst *Terminator = Caller->getTerminator();
+      for (BasicBlock *Successor : successors(Caller))
+        Successor->removePredecessor(Caller);
+      Terminator->eraseFromParent();
+
+      auto *CalleePC = ConstantInt::get(PCType, Call.CalleePC);
+      CallInst::Create(Call.Callee, { CalleePC }, "", Caller);
+
+      auto ReturnIt = JumpTargetPCs.find(Call.Return);
+      if (C.MemberSet.count(Call.Return) != 0
+          && ReturnIt != JumpTargetPCs.end()) {
+        BasicBlock *ReturnClone = CloneOf(Call.Return);
+        auto *PC = new LoadInst(PCReg, "", Caller);
+        auto *ReturnPC = ConstantInt::get(PCType, ReturnIt->second);
+        auto *IsExpected = new ICmpInst(*Caller,
+                                        CmpInst::ICMP_EQ,
+                                        PC,
+                                        ReturnPC);
+        BranchInst::Create(ReturnClone, GetReturn(), IsExpected, Caller);
+        addUndefIncoming(ReturnClone, Caller);
+      } else {
+        BranchInst::Create(GetReturn(), Caller);
+      }
+
+      incrementCounter("isolation.direct-calls");
+    }
+
+    // Start from the requested jump target
+    BasicBlock *EntryClone = CloneOf(C.Entry);
+    auto *Switch = SwitchInst::Create(EntryPC, EntryClone, 0, EntryBB);
+    addUndefIncoming(EntryClone, EntryBB);
+    for (BasicBlock *BB : C.Members) {
+      auto It = JumpTargetPCs.find(BB);
+      if (BB == C.Entry || It == JumpTargetPCs.end())
+        continue;
+
+      BasicBlock *Clone = CloneOf(BB);
+      Switch->addCase(ConstantInt::get(PCType, It->second), Clone);
+      addUndefIncoming(Clone, EntryBB);
+    }
+  }
+
+  // Find out what the root function can still reach once the jump targets
+  // owned by an isolated function just call it and go to the dispatcher,
+  // which is reachable from the entry anyway
+  SmallPtrSet<BasicBlock *, 16> Reachable;
+  for (BasicBlock *BB : Stubs)
+    Reachable.insert(BB);
+
+  std::vector<BasicBlock *> WorkList;
+  Reachable.insert(RootEntry);
+  WorkList.push_back(RootEntry);
+  while (!WorkList.empty()) {
+    BasicBlock *BB = WorkList.back();
+    WorkList.pop_back();
+    for (BasicBlock *Successor : successors(BB))
+      if (Reachable.insert(Successor).second)
+        WorkList.push_back(Successor);
+  }
+
+  // Replace the code of the jump targets with a call
+  for (BasicBlock *BB : Stubs) {
+    for (BasicBlock *Successor : successors(BB))
+      Successor->removePredecessor(BB);
+
+    while (!BB->empty()) {
+      Instruction &I = BB->back();
+      if (!I.use_empty())
+        I.replaceAllUsesWith(UndefValue::get(I.getType()));
+      I.eraseFromParent();
+    }
+
+    auto *PC = ConstantInt::get(PCType, JumpTargetPCs[BB]);
+    CallInst::Create(Owners[BB], { PC }, "", BB);
+    BranchInst::Create(Dispatcher, BB);
+  }
+
+  // Remove the rest of the isolated code from the root function
+  std::vector<BasicBlock *> Dead;
+  for (BasicBlock &BB : *Root)
+    if (Reachable.count(&BB) == 0)
+      Dead.push_back(&BB);
+
+  for (BasicBlock *BB : Dead)
+    for (BasicBlock *Successor : successors(BB))
+      if (Reachable.count(Successor) != 0)
+        Successor->removePredecessor(BB);
+
+  if (Function *FunctionCall = M.getFunction("function_call")) {
+    std::vector<CallInst *> Stale;
+    for (User *U : FunctionCall->users()) {
+      auto *Call = dyn_cast<CallInst>(U);
+      if (Call == nullptr
+          || Call->getParent()->getParent() != Root
+          || Reachable.count(Call->getParent()) == 0)
+        continue;
+
+      BasicBlock *Callee = getBlockAddressTarget(Call->getArgOperand(0));
+      BasicBlock *Return = getBlockAddressTarget(Call->getArgOperand(1));
+      if (Reachable.count(Callee) == 0 || Reachable.count(Return) == 0)
+        Stale.push_back(Call);
+    }
+
+    for (CallInst *Call : Stale)
+      Call->eraseFromParent();
+  }
+
+  for (BasicBlock *BB : Dead)
+    BB->dropAllReferences();
+  for (BasicBlock *BB : Dead)
+    BB->eraseFromParent();
+
+  setCounter("isolation.functions", Isolated.size());
+  setCounter("isolation.removed-blocks", Dead.size());
+
+  return true;
+}
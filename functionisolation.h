@@ -0,0 +1,78 @@
+#ifndef _FUNCTIONISOLATION_H
+#define _FUNCTIONISOLATION_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <map>
+#include <vector>
+
+// LLVM includes
+#include "llvm/Pass.h"
+
+namespace llvm {
+class BasicBlock;
+class Function;
+}
+
+class JumpTargetManager;
+
+/// \brief Move each function identified by FunctionBoundariesDetectionPass in
+///        its own LLVM function
+///
+/// Each isolated function takes as argument the PC where the execution should
+/// start: it begins with a switch over the jump targets among its members and
+/// leaves the PC of the next instruction to execute in the PC CSV when it
+/// returns. In the root function, the code of each jump target belonging to an
+/// isolated function is replaced by a call to it followed by a jump to the
+/// dispatcher, which remains the fallback for the addresses known only at run
+/// time. The basic blocks of the root function which are no longer reachable
+/// are removed.
+///
+/// Inside an isolated function, a call (see FunctionCallIdentification) to the
+/// entry of another isolated function becomes a direct call, followed by a
+/// check that the callee returned to the expected address.
+///
+/// A function is left in the root function if one of its members uses a value
+/// defined outside of it (other than the local variables of the root function)
+/// or jumps to a basic block which is neither a member, nor a jump target, nor
+/// the dispatcher.
+class FunctionIsolationPass : public llvm::ModulePass {
+public:
+  static char ID;
+
+  using FunctionsMap = std::map<llvm::BasicBlock *,
+                                std::vector<llvm::BasicBlock *>>;
+
+  FunctionIsolationPass() :
+    llvm::ModulePass(ID),
+    Root(nullptr),
+    JTM(nullptr) { }
+
+  /// \param Functions the entry and the members of each function, as returned
+  ///        by FunctionBoundariesDetectionPass::functions.
+  FunctionIsolationPass(llvm::Function *Root,
+                        JumpTargetManager *JTM,
+                        FunctionsMap Functions) :
+    llvm::ModulePass(ID),
+    Root(Root),
+    JTM(JTM),
+    Functions(std::move(Functions)) { }
+
+  bool runOnModule(llvm::Module &M) override;
+
+  /// \brief The functions created by the pass, by entry PC
+  const std::vector<llvm::Function *> &isolatedFunctions() const {
+    return IsolatedFunctions;
+  }
+
+private:
+  llvm::Function *Root;
+  JumpTargetManager *JTM;
+  FunctionsMap Functions;
+  std::vector<llvm::Function *> IsolatedFunctions;
+};
+
+#endif // _FUNCTIONISOLATION_H
@@ -16,6 +16,7 @@
 
 // Local includes
 #include "ir-helpers.h"
+#include "pcindex.h"
 #include "revamb.h"
 
 // Forward declarations
@@ -165,6 +166,8 @@ private:
   llvm::BasicBlock *AnyPC;
   llvm::BasicBlock *UnexpectedPC;
   std::map<uint64_t, llvm::BasicBlock *> JumpTargets;
+  /// No basic block is recorded here, the lookups always explore the IR
+  PCIndex PCs;
 };
 
 template<>
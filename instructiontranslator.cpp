@@ -28,8 +28,10 @@
 #include "ptcinterface.h"
 #include "rai.h"
 #include "range.h"
+#include "statistics.h"
 #include "transformadapter.h"
 #include "variablemanager.h"
+#include "vectorhelpers.h"
 
 using namespace llvm;
 
@@ -472,7 +474,9 @@ IT::InstructionTranslator(IRBuilder<>& Builder,
                           JumpTargetManager& JumpTargets,
                           std::vector<BasicBlock *> Blocks,
                           const Architecture &SourceArchitecture,
-                          const Architecture &TargetArchitecture) :
+                          const Architecture &TargetArchitecture,
+                          MetadataSpill *Spill,
+                          VectorHelpers *Vectors) :
   Builder(Builder),
   Variables(Variables),
   JumpTargets(JumpTargets),
@@ -481,7 +485,11 @@ IT::InstructionTranslator(IRBuilder<>& Builder,
   TheFunction(Builder.GetInsertBlock()->getParent()),
   SourceArchitecture(SourceArchitecture),
   TargetArchitecture(TargetArchitecture),
-  NewPCMarker(nullptr) {
+  NewPCMarker(nullptr),
+  LastPC(0),
+  LastNextPC(0),
+  Spill(Spill),
+  Vectors(Vectors) {
 
   auto &Context = TheModule.getContext();
   using FT = FunctionType;
@@ -505,7 +513,7 @@ IT::InstructionTranslator(IRBuilder<>& Builder,
                                  &TheModule);
 }
 
-void IT::finalizeNewPCMarkers(std::string &CoveragePath) {
+void IT::finalizeNewPCMarkers(std::string &CoveragePath, MarkersMode Mode) {
   std::ofstream Output(CoveragePath);
 
   Output << std::hex;
@@ -531,10 +539,66 @@ void IT::finalizeNewPCMarkers(std::string &CoveragePath) {
     }
   }
   Output << std::dec;
+
+  if (Mode == MarkersMode::Full)
+    return;
+
+  // The analyses are over, the markers are no longer needed, drop them or
+  // replace the first one in each basic block with a call to a cheaper hook
+  // taking only the program counter
+  Function *Hook = nullptr;
+  if (Mode == MarkersMode::BasicBlock) {
+    auto &Context = TheModule.getContext();
+    auto *HookTy = FunctionType::get(Type::getVoidTy(Context),
+                                     { Type::getInt64Ty(Context) },
+                                     false);
+    Hook = Function::Create(HookTy,
+                            GlobalValue::ExternalLinkage,
+                            "newbb",
+                            &TheModule);
+  }
+
+  unsigned Removed = 0;
+  for (BasicBlock &BB : *TheFunction) {
+    bool First = true;
+    for (auto It = BB.begin(); It != BB.end(); ) {
+      auto *Call = dyn_cast<CallInst>(&*It);
+      It++;
+
+      if (Call == nullptr || Call->getCalledFunction() != NewPCMarker)
+        continue;
+
+      if (Hook != nullptr && First)
+        CallInst::Create(Hook, { Call->getArgOperand(0) }, "", Call);
+      First = false;
+
+      Call->eraseFromParent();
+      Removed++;
+    }
+  }
+
+  incrementCounter("markers.removed", Removed);
+}
+
+void TranslationBlockIndex::link(PTCInstructionList *Instructions) {
+  assert(Instructions->instruction_count == size());
+
+  // Walk backward, keeping track of the last instruction start we met
+  unsigned Following = size();
+  for (unsigned I = size(); I > 0; I--) {
+    unsigned Index = I - 1;
+    NextInstructionStart[Index] = Following;
+
+    PTCInstruction &Instruction = Instructions->instructions[Index];
+    if (Instruction.opc == PTC_INSTRUCTION_op_debug_insn_start
+        && !Ignored[Index])
+      Following = Index;
+  }
 }
 
-SmallSet<unsigned, 1> IT::preprocess(PTCInstructionList *InstructionList) {
-  SmallSet<unsigned, 1> Result;
+void IT::preprocess(PTCInstructionList *InstructionList,
+                    TranslationBlockIndex &Index) {
+  Index.reset(InstructionList->instruction_count);
 
   for (unsigned I = 0; I < InstructionList->instruction_count; I++) {
     PTCInstruction &Instruction = InstructionList->instructions[I];
@@ -561,13 +625,13 @@ SmallSet<unsigned, 1> IT::preprocess(PTCInstructionList *InstructionList) {
     for (unsigned J = I + 1; J < InstructionList->instruction_count; J++) {
       unsigned Opcode = InstructionList->instructions[J].opc;
       if (Opcode == PTC_INSTRUCTION_op_debug_insn_start)
-        Result.insert(J);
+        Index.ignore(J);
     }
 
     break;
   }
 
-  return Result;
+  Index.link(InstructionList);
 }
 
 std::tuple<IT::TranslationResult, MDNode *, uint64_t, uint64_t>
@@ -588,7 +652,11 @@ IT::newInstruction(PTCInstruction *Instr,
   disassembleOriginal(OriginalStringStream, PC);
   std::string OriginalString = OriginalStringStream.str();
   LLVMContext& Context = TheModule.getContext();
-  MDString *MDOriginalString = MDString::get(Context, OriginalString);
+  Metadata *MDOriginalString = nullptr;
+  if (Spill != nullptr)
+    MDOriginalString = Spill->spill(Context, OriginalString);
+  else
+    MDOriginalString = MDString::get(Context, OriginalString);
   auto *MDPC = ConstantAsMetadata::get(Builder.getInt64(PC));
   MDNode *MDOriginalInstr = MDNode::getDistinct(Context,
                                                 { MDOriginalString, MDPC });
@@ -716,17 +784,25 @@ IT::TranslationResult IT::translateCall(PTCInstruction *Instr) {
     ResultType = Builder.getVoidTy();
   }
 
-  auto *CalleeType = FunctionType::get(ResultType,
-                                       ArrayRef<Type *>(InArgsType),
-                                       false);
-
-  std::string HelperName = "helper_" + TheCall.helperName();
-  Constant *FunctionDeclaration = TheModule.getOrInsertFunction(HelperName,
-                                                                CalleeType);
-
   StoreInst *PCSaver = getLastUniqueWrite(Builder.GetInsertBlock(),
                                           JumpTargets.pcReg());
-  CallInst *Result = Builder.CreateCall(FunctionDeclaration, InArgs);
+
+  Value *Result = nullptr;
+  if (Vectors == nullptr || !Vectors->lower(Builder,
+                                            TheCall.helperName(),
+                                            InArgs,
+                                            ResultType,
+                                            Result)) {
+    auto *CalleeType = FunctionType::get(ResultType,
+                                         ArrayRef<Type *>(InArgsType),
+                                         false);
+
+    std::string HelperName = "helper_" + TheCall.helperName();
+    Constant *FunctionDeclaration = TheModule.getOrInsertFunction(HelperName,
+                                                                  CalleeType);
+
+    Result = Builder.CreateCall(FunctionDeclaration, InArgs);
+  }
 
   if (TheCall.OutArguments.size() != 0) {
     auto *Store = Builder.CreateStore(Result, ResultDestination);
@@ -757,6 +833,7 @@ IT::TranslationResult IT::translate(PTCInstruction *Instr,
 
   auto ConstArgs = TheInstruction.ConstArguments;
   LastPC = PC;
+  LastNextPC = NextPC;
   auto Result = translateOpcode(TheInstruction.opcode(),
                                 ConstArgs.toVector(),
                                 InArgs);
@@ -1332,6 +1409,7 @@ IT::translateOpcode(PTCOpcode Opcode,
 
       Blocks.push_back(Fallthrough);
       Builder.SetInsertPoint(Fallthrough);
+      JumpTargets.registerBlockPC(Fallthrough, LastPC, LastNextPC - LastPC);
       Variables.newBasicBlock();
 
       return v { };
@@ -1381,6 +1459,7 @@ IT::translateOpcode(PTCOpcode Opcode,
 
       Blocks.push_back(Fallthrough);
       Builder.SetInsertPoint(Fallthrough);
+      JumpTargets.registerBlockPC(Fallthrough, LastPC, LastNextPC - LastPC);
       Variables.newBasicBlock();
 
       return v { };
@@ -1394,6 +1473,7 @@ IT::translateOpcode(PTCOpcode Opcode,
       auto *NextBB = BasicBlock::Create(Context, "", TheFunction);
       Blocks.push_back(NextBB);
       Builder.SetInsertPoint(NextBB);
+      JumpTargets.registerBlockPC(NextBB, LastPC, LastNextPC - LastPC);
       Variables.newBasicBlock();
 
       return v { };
@@ -19,6 +19,7 @@
 #include "revamb.h"
 #include "ptcdump.h"
 #include "jumptargetmanager.h"
+#include "metadataspill.h"
 
 // Forward declarations
 namespace llvm {
@@ -31,6 +32,49 @@ class Module;
 
 class JumpTargetManager;
 class VariableManager;
+class VectorHelpers;
+
+/// \brief Precomputed information to walk the instructions of a translation
+///        block in linear time
+///
+/// For each instruction it records whether it should be ignored and the index
+/// of the next `PTC_INSTRUCTION_op_debug_insn_start` which has not to be
+/// ignored. Instances are meant to be reused across translation blocks, so
+/// that the underlying storage is recycled instead of being reallocated.
+class TranslationBlockIndex {
+public:
+  /// \brief Prepare the index for a translation block of \p Count
+  ///        instructions, preserving the allocated storage
+  void reset(unsigned Count) {
+    Ignored.assign(Count, false);
+    NextInstructionStart.assign(Count, Count);
+  }
+
+  unsigned size() const { return NextInstructionStart.size(); }
+
+  /// \brief Check if the instruction with index \p Index has to be ignored
+  bool isIgnored(unsigned Index) const { return Ignored[Index]; }
+
+  void ignore(unsigned Index) { Ignored[Index] = true; }
+
+  /// \brief Return the next `PTC_INSTRUCTION_op_debug_insn_start` after \p
+  ///        Index which has not to be ignored, or `nullptr` if there's none
+  PTCInstruction *nextInstructionStart(PTCInstructionList *Instructions,
+                                       unsigned Index) const {
+    unsigned Next = NextInstructionStart[Index];
+    if (Next == size())
+      return nullptr;
+    return &Instructions->instructions[Next];
+  }
+
+  /// \brief Compute the links to the next instructions, call this once all
+  ///        the instructions to ignore have been marked
+  void link(PTCInstructionList *Instructions);
+
+private:
+  std::vector<bool> Ignored;
+  std::vector<unsigned> NextInstructionStart;
+};
 
 /// \brief Expands a PTC instruction to LLVM IR
 class InstructionTranslator {
@@ -46,12 +90,18 @@ public:
   ///        further processing.
   /// \param SourceArchitecture the input architecture.
   /// \param TargetArchitecture the output architecture.
+  /// \param Spill where the disassembly of the original instructions should
+  ///        be written, or nullptr to keep it in the `oi` metadata.
+  /// \param Vectors the lowering of the SIMD helpers to vector operations, or
+  ///        nullptr to always call the helpers.
   InstructionTranslator(llvm::IRBuilder<>& Builder,
                         VariableManager& Variables,
                         JumpTargetManager& JumpTargets,
                         std::vector<llvm::BasicBlock *> Blocks,
                         const Architecture &SourceArchitecture,
-                        const Architecture &TargetArchitecture);
+                        const Architecture &TargetArchitecture,
+                        MetadataSpill *Spill,
+                        VectorHelpers *Vectors);
 
   /// \brief Result status of the translation of a PTC opcode
   enum TranslationResult {
@@ -112,17 +162,21 @@ public:
   /// \brief Handle calls to `newPC` marker and emit coverage information
   ///
   /// \param CoveragePath path where the coverage information should be stored.
-  void finalizeNewPCMarkers(std::string &CoveragePath);
+  /// \param Mode whether the markers should be kept as they are, lowered to a
+  ///        call to `newbb` for each basic block or removed.
+  void finalizeNewPCMarkers(std::string &CoveragePath, MarkersMode Mode);
 
   /// \brief Notifies InstructionTranslator about a new PTC translation
   void reset() { LabeledBasicBlocks.clear(); }
 
   /// \brief Preprocess the translated instructions
   ///
-  /// Check if the translated code contains a delay slot and return a blacklist
-  /// of the PTC_INSTRUCTION_op_debug_insn_start instructions that have to be
-  /// ignored to merge the delay slot into the branch instruction.
-  llvm::SmallSet<unsigned, 1> preprocess(PTCInstructionList *Instructions);
+  /// Check if the translated code contains a delay slot and mark in \p Index
+  /// the PTC_INSTRUCTION_op_debug_insn_start instructions that have to be
+  /// ignored to merge the delay slot into the branch instruction. Then compute
+  /// the links to the next instruction to translate.
+  void preprocess(PTCInstructionList *Instructions,
+                  TranslationBlockIndex &Index);
 
 private:
   llvm::ErrorOr<std::vector<llvm::Value *>>
@@ -145,6 +199,10 @@ private:
   llvm::Function *NewPCMarker;
 
   uint64_t LastPC;
+  uint64_t LastNextPC;
+
+  MetadataSpill *Spill;
+  VectorHelpers *Vectors;
 };
 
 #endif // _INSTRUCTIONTRANSLATOR_H
@@ -8,11 +8,14 @@
 //
 
 // Standard includes
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <fstream>
+#include <limits>
 #include <queue>
 #include <sstream>
+#include <thread>
 
 // Boost includes
 #include <boost/icl/interval_set.hpp>
@@ -22,24 +25,35 @@
 // LLVM includes
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 
 // Local includes
 #include "datastructures.h"
 #include "debug.h"
+#include "functioncallidentification.h"
 #include "generatedcodebasicinfo.h"
 #include "ir-helpers.h"
 #include "jumptargetmanager.h"
+#include "osra.h"
 #include "revamb.h"
 #include "set.h"
 #include "simplifycomparisons.h"
+#include "statistics.h"
 #include "subgraph.h"
 
 using namespace llvm;
@@ -76,12 +90,11 @@ static void exitTBCleanup(Instruction *ExitTBCall) {
   }
 }
 
-bool TranslateDirectBranchesPass::pinJTs(Function &F) {
-  const auto *SET = getAnalysisIfAvailable<SETPass>();
-  if (SET == nullptr || SET->jumps().size() == 0)
-    return false;
-
-  LLVMContext &Context = getContext(&F);
+/// Replace the jump to the dispatcher after each of \p Jumps with a switch over
+/// its destinations
+static void pinJumps(JumpTargetManager *JTM,
+                     const std::vector<SETPass::JumpInfo> &Jumps) {
+  LLVMContext &Context = JTM->pcReg()->getContext();
   Value *PCReg = JTM->pcReg();
   auto *RegType = cast<IntegerType>(PCReg->getType()->getPointerElementType());
   auto C = [RegType] (uint64_t A) { return ConstantInt::get(RegType, A); };
@@ -89,7 +102,7 @@ bool TranslateDirectBranchesPass::pinJTs(Function &F) {
   BasicBlock *UnexpectedPC = JTM->unexpectedPC();
   // TODO: enforce CFG
 
-  for (const auto &Jump : SET->jumps()) {
+  for (const auto &Jump : Jumps) {
     StoreInst *PCWrite = Jump.Instruction;
     bool Approximate = Jump.Approximate;
     const std::vector<uint64_t> &Destinations = Jump.Destinations;
@@ -100,7 +113,6 @@ bool TranslateDirectBranchesPass::pinJTs(Function &F) {
     CallInst *CallExitTB = JTM->findNextExitTB(PCWrite);
 
     assert(CallExitTB != nullptr);
-    assert(PCWrite->getParent()->getParent() == &F);
     assert(JTM->isPCReg(PCWrite->getPointerOperand()));
     assert(Destinations.size() != 0);
 
@@ -138,10 +150,80 @@ bool TranslateDirectBranchesPass::pinJTs(Function &F) {
     if (Destinations.size() > OldTargetsCount)
       JTM->newBranch();
   }
+}
+
+bool TranslateDirectBranchesPass::pinJTs(Function &F) {
+  const auto *SET = getAnalysisIfAvailable<SETPass>();
+  if (SET == nullptr || SET->jumps().size() == 0)
+    return false;
+
+  for (const auto &Jump : SET->jumps()) {
+    assert(Jump.Instruction->getParent()->getParent() == &F);
+    JTM->recordResolvedJump(JTM->getPC(Jump.Instruction).first,
+                            Jump.Approximate,
+                            Jump.Destinations);
+  }
+
+  pinJumps(JTM, SET->jumps());
 
   return true;
 }
 
+void JumpTargetManager::recordResolvedJump(uint64_t PC,
+                                           bool Approximate,
+                                           const std::vector<uint64_t> &New) {
+  if (PC == 0)
+    return;
+
+  ResolvedJump &Jump = ResolvedJumps[PC];
+  Jump.Approximate = Jump.Approximate || Approximate;
+
+  std::vector<uint64_t> Old = std::move(Jump.Destinations);
+  std::vector<uint64_t> Sorted = New;
+  std::sort(Sorted.begin(), Sorted.end());
+  Jump.Destinations.clear();
+  std::set_union(Old.begin(), Old.end(),
+                 Sorted.begin(), Sorted.end(),
+                 std::back_inserter(Jump.Destinations));
+  Jump.Destinations.erase(std::unique(Jump.Destinations.begin(),
+                                      Jump.Destinations.end()),
+                          Jump.Destinations.end());
+}
+
+void JumpTargetManager::pinImportedJumps() {
+  std::vector<SETPass::JumpInfo> Jumps;
+  for (User *U : ExitTB->users()) {
+    auto *Call = dyn_cast<CallInst>(U);
+    if (Call == nullptr || Call->getParent() == nullptr)
+      continue;
+
+    StoreInst *PCWrite = getPrevPCWrite(Call);
+    if (PCWrite == nullptr || isa<ConstantInt>(PCWrite->getValueOperand()))
+      continue;
+
+    auto It = ResolvedJumps.find(getPC(PCWrite).first);
+    if (It == ResolvedJumps.end())
+      continue;
+
+    std::vector<uint64_t> Destinations;
+    for (uint64_t Destination : It->second.Destinations)
+      if (isJumpTarget(Destination))
+        Destinations.push_back(Destination);
+
+    // The first argument of exit_tb is the number of destinations the jump
+    // has already been pinned to, if any: pin it again only if the imported
+    // ones are more
+    uint64_t PinnedCount = getLimitedValue(Call->getArgOperand(0));
+    if (Destinations.size() > PinnedCount)
+      Jumps.push_back(SETPass::JumpInfo(PCWrite,
+                                        It->second.Approximate,
+                                        Destinations));
+  }
+
+  pinJumps(this, Jumps);
+  setCounter("import-jts.pinned-jumps", Jumps.size());
+}
+
 bool TranslateDirectBranchesPass::pinConstantStore(Function &F) {
   auto &Context = F.getParent()->getContext();
 
@@ -271,6 +353,7 @@ bool TranslateDirectBranchesPass::forceFallthroughAfterHelper(CallInst *Call) {
 }
 
 bool TranslateDirectBranchesPass::runOnFunction(Function &F) {
+  ScopedPhase Phase("translate-direct-branches");
   pinConstantStore(F);
   pinJTs(F);
   return true;
@@ -300,6 +383,10 @@ uint64_t TranslateDirectBranchesPass::getNextPC(Instruction *TheInstruction) {
       }
     }
 
+    // The translator might know which instruction created this basic block
+    if (auto BlockPC = JTM->blockPC(Block))
+      return BlockPC->first + BlockPC->second;
+
     auto *Node = DT.getNode(Block);
     assert(Node != nullptr &&
            "BasicBlock not in the dominator tree, is it reachable?" );
@@ -324,39 +411,49 @@ JumpTargetManager::readRawValue(uint64_t Address,
     abort();
   }
 
-  for (auto &Segment : Binary.segments()) {
-    // Note: we also consider writeable memory areas because, despite being
-    // modifiable, can contain useful information
-    if (Segment.contains(Address, Size) && Segment.IsReadable) {
-      auto *Array = cast<ConstantDataArray>(Segment.Variable->getInitializer());
-      StringRef RawData = Array->getRawDataValues();
-      const unsigned char *RawDataPtr = RawData.bytes_begin();
-      uint64_t Offset = Address - Segment.StartVirtualAddress;
-      const unsigned char *Start = RawDataPtr + Offset;
-
-      using support::endian::read;
-      using support::endianness;
-      switch (Size) {
-      case 1:
-        return read<uint8_t, endianness::little, 1>(Start);
-      case 2:
-        if (IsLittleEndian)
-          return read<uint16_t, endianness::little, 1>(Start);
-        else
-          return read<uint16_t, endianness::big, 1>(Start);
-      case 4:
-        if (IsLittleEndian)
-          return read<uint32_t, endianness::little, 1>(Start);
-        else
-          return read<uint32_t, endianness::big, 1>(Start);
-      case 8:
-        if (IsLittleEndian)
-          return read<uint64_t, endianness::little, 1>(Start);
-        else
-          return read<uint64_t, endianness::big, 1>(Start);
-      default:
-        assert(false && "Unexpected read size");
-      }
+  const SegmentInfo *Segment = Binary.findSegment(Address);
+
+  // Note: we also consider writeable memory areas because, despite being
+  // modifiable, can contain useful information
+  if (Segment != nullptr
+      && Segment->contains(Address, Size)
+      && Segment->IsReadable) {
+    // Read from the mapped input file, the part of the segment it doesn't
+    // cover (e.g., .bss) is zero. The segment variable might not even have an
+    // initializer.
+    unsigned char Buffer[8] = { 0 };
+    assert(Size <= sizeof(Buffer));
+    uint64_t Offset = Address - Segment->StartVirtualAddress;
+    if (Offset < Segment->Data.size()) {
+      uint64_t Available = Segment->Data.size() - Offset;
+      std::copy_n(Segment->Data.data() + Offset,
+                  std::min<uint64_t>(Size, Available),
+                  Buffer);
+    }
+    const unsigned char *Start = Buffer;
+
+    using support::endian::read;
+    using support::endianness;
+    switch (Size) {
+    case 1:
+      return read<uint8_t, endianness::little, 1>(Start);
+    case 2:
+      if (IsLittleEndian)
+        return read<uint16_t, endianness::little, 1>(Start);
+      else
+        return read<uint16_t, endianness::big, 1>(Start);
+    case 4:
+      if (IsLittleEndian)
+        return read<uint32_t, endianness::little, 1>(Start);
+      else
+        return read<uint32_t, endianness::big, 1>(Start);
+    case 8:
+      if (IsLittleEndian)
+        return read<uint64_t, endianness::little, 1>(Start);
+      else
+        return read<uint64_t, endianness::big, 1>(Start);
+    default:
+      assert(false && "Unexpected read size");
     }
   }
 
@@ -410,7 +507,11 @@ static cl::opt<T> *getOption(StringMap<cl::Option *>& Options,
 JumpTargetManager::JumpTargetManager(Function *TheFunction,
                                      Value *PCReg,
                                      const BinaryFile &Binary,
-                                     bool EnableOSRA) :
+                                     bool EnableOSRA,
+                                     bool SplitInPlace,
+                                     bool IncrementalHarvest,
+                                     unsigned SETDepth,
+                                     bool SlicedOSRA) :
   TheModule(*TheFunction->getParent()),
   Context(TheModule.getContext()),
   TheFunction(TheFunction),
@@ -420,20 +521,23 @@ JumpTargetManager::JumpTargetManager(Function *TheFunction,
   ExitTB(nullptr),
   Dispatcher(nullptr),
   DispatcherSwitch(nullptr),
+  DispatcherFail(nullptr),
+  AnyPC(nullptr),
+  UnexpectedPC(nullptr),
   Binary(Binary),
   EnableOSRA(EnableOSRA),
+  SplitInPlace(SplitInPlace),
+  IncrementalHarvest(IncrementalHarvest),
+  SETDepth(SETDepth),
+  SlicedOSRA(SlicedOSRA),
   NoReturn(Binary.architecture()),
   CurrentCFGForm(UnknownFormCFG) {
   FunctionType *ExitTBTy = FunctionType::get(Type::getVoidTy(Context),
                                              { Type::getInt32Ty(Context) },
                                              false);
   ExitTB = cast<Function>(TheModule.getOrInsertFunction("exitTB", ExitTBTy));
-  createDispatcher(TheFunction, PCReg, true);
-
-  for (auto &Segment : Binary.segments())
-    Segment.insertExecutableRanges(std::back_inserter(ExecutableRanges));
-
-  initializeSymbolMap();
+  if (!adoptDispatcher())
+    createDispatcher(TheFunction, PCReg, true);
 
   // Configure GlobalValueNumbering
   StringMap<cl::Option *>& Options(cl::getRegisteredOptions());
@@ -443,43 +547,105 @@ JumpTargetManager::JumpTargetManager(Function *TheFunction,
   // getOption<uint32_t>(Options, "max-recurse-depth")->setInitialValue(10);
 }
 
-void JumpTargetManager::initializeSymbolMap() {
+/// Marker for the absence of an enclosing symbol in EnclosingSymbol
+static const unsigned NoSymbol = std::numeric_limits<unsigned>::max();
+
+/// \brief Return the end of the addresses named after \p Symbol, we keep
+///        zero-size symbols
+static uint64_t symbolEnd(const SymbolInfo *Symbol) {
+  return Symbol->Address + std::max<uint64_t>(1, Symbol->Size);
+}
+
+void JumpTargetManager::initializeSymbolIndex() const {
+  SymbolIndexReady = true;
+
   // Collect how many times each name is used
-  std::map<std::string, unsigned> SeenCount;
+  StringMap<unsigned> SeenCount;
   for (const SymbolInfo &Symbol : Binary.symbols())
-    SeenCount[std::string(Symbol.Name)]++;
+    SeenCount[Symbol.Name]++;
 
+  SymbolsByStart.clear();
   for (const SymbolInfo &Symbol : Binary.symbols()) {
     // Discard symbols pointing to 0, with zero-sized names or present multiple
     // times. Note that we keep zero-size symbols.
     if (Symbol.Address == 0
         || Symbol.Name.size() == 0
-        || SeenCount[std::string(Symbol.Name)] > 1)
+        || SeenCount[Symbol.Name] > 1)
       continue;
 
-    // Associate to this interval the symbol
-    unsigned Size = std::max(1UL, Symbol.Size);
-    auto NewInterval = interval::right_open(Symbol.Address,
-                                            Symbol.Address + Size);
-    SymbolMap += make_pair(NewInterval, SymbolInfoSet { &Symbol });
+    SymbolsByStart.push_back(&Symbol);
+  }
+
+  auto CompareStart = [] (const SymbolInfo *A, const SymbolInfo *B) {
+    if (A->Address != B->Address)
+      return A->Address < B->Address;
+    return symbolEnd(A) > symbolEnd(B);
+  };
+  std::stable_sort(SymbolsByStart.begin(), SymbolsByStart.end(), CompareStart);
+
+  // For each symbol, find the closest previous one covering its start. The
+  // symbols in between end before the start of the previous one, so we can
+  // skip them following the chain.
+  EnclosingSymbol.assign(SymbolsByStart.size(), NoSymbol);
+  for (unsigned I = 1; I < SymbolsByStart.size(); I++) {
+    unsigned J = I - 1;
+    while (J != NoSymbol
+           && symbolEnd(SymbolsByStart[J]) <= SymbolsByStart[I]->Address)
+      J = EnclosingSymbol[J];
+    EnclosingSymbol[I] = J;
   }
+
+  auto CompareEnd = [] (const SymbolInfo *A, const SymbolInfo *B) {
+    if (symbolEnd(A) != symbolEnd(B))
+      return symbolEnd(A) < symbolEnd(B);
+    return A->Address < B->Address;
+  };
+  SymbolsByEnd = SymbolsByStart;
+  std::stable_sort(SymbolsByEnd.begin(), SymbolsByEnd.end(), CompareEnd);
 }
 
 // TODO: move this in BinaryFile?
 std::string JumpTargetManager::nameForAddress(uint64_t Address) const {
-  std::stringstream Result;
+  if (!SymbolIndexReady)
+    initializeSymbolIndex();
 
-  // Take the interval greater than [Address, Address + 1[
-  auto It = SymbolMap.upper_bound(interval::right_open(Address, Address + 1));
-  if (It != SymbolMap.begin()) {
-    // Go back one position
-    It--;
+  std::stringstream Result;
+  const SymbolInfo *BestMatch = nullptr;
+
+  // Look for the symbol containing Address which starts the closest to it:
+  // start from the last symbol starting before Address and go up the chain of
+  // the enclosing ones
+  auto CompareStart = [] (uint64_t Address, const SymbolInfo *Symbol) {
+    return Address < Symbol->Address;
+  };
+  auto StartIt = std::upper_bound(SymbolsByStart.begin(),
+                                  SymbolsByStart.end(),
+                                  Address,
+                                  CompareStart);
+  if (StartIt != SymbolsByStart.begin()) {
+    unsigned I = (StartIt - SymbolsByStart.begin()) - 1;
+    while (I != NoSymbol && symbolEnd(SymbolsByStart[I]) <= Address)
+      I = EnclosingSymbol[I];
+
+    if (I != NoSymbol)
+      BestMatch = SymbolsByStart[I];
+  }
 
-    // In case we have multiple matching symbols, take the closest one
-    const SymbolInfoSet &Matching = It->second;
-    auto MaxIt = std::max_element(Matching.begin(), Matching.end());
-    const SymbolInfo *const BestMatch = *MaxIt;
+  // Otherwise, take the symbol ending the closest before Address, preferring
+  // the one starting the latest
+  if (BestMatch == nullptr) {
+    auto CompareEnd = [] (uint64_t Address, const SymbolInfo *Symbol) {
+      return Address < symbolEnd(Symbol);
+    };
+    auto EndIt = std::upper_bound(SymbolsByEnd.begin(),
+                                  SymbolsByEnd.end(),
+                                  Address,
+                                  CompareEnd);
+    if (EndIt != SymbolsByEnd.begin())
+      BestMatch = *std::prev(EndIt);
+  }
 
+  if (BestMatch != nullptr) {
     // Use the symbol name
     Result << BestMatch->Name.str();
 
@@ -495,16 +661,15 @@ std::string JumpTargetManager::nameForAddress(uint64_t Address) const {
 }
 
 void JumpTargetManager::harvestGlobalData() {
-  // Register landing pads, if available
-  // TODO: should register them in UnusedCodePointers?
-  for (uint64_t LandingPad : Binary.landingPads())
-    registerJT(LandingPad, GlobalData);
+  // Landing pads are registered by harvest, once they're actually needed
+  LandingPadsPending = true;
 
   for (auto& Segment : Binary.segments()) {
-    auto *Data = cast<ConstantDataArray>(Segment.Variable->getInitializer());
+    // Only the part of the segment backed by the input file can contain
+    // pointers, the rest is zero
     uint64_t StartVirtualAddress = Segment.StartVirtualAddress;
-    const unsigned char *DataStart = Data->getRawDataValues().bytes_begin();
-    const unsigned char *DataEnd = Data->getRawDataValues().bytes_end();
+    const unsigned char *DataStart = Segment.Data.data();
+    const unsigned char *DataEnd = DataStart + Segment.Data.size();
 
     using endianness = support::endianness;
     if (Binary.architecture().pointerSize() == 64) {
@@ -539,14 +704,76 @@ void JumpTargetManager::findCodePointers(uint64_t StartVirtualAddress,
                                          const unsigned char *End) {
   using support::endian::read;
   using support::endianness;
-  for (auto Pos = Start; Pos < End - sizeof(value_type); Pos++) {
-    uint64_t Value = read<value_type,
-                          static_cast<endianness>(endian),
-                          1>(Pos);
-    BasicBlock *Result = registerJT(Value, GlobalData);
 
-    if (Result != nullptr)
-      UnusedCodePointers.insert(StartVirtualAddress + (Pos - Start));
+  auto &Ranges = Binary.executableRanges();
+  if (Ranges.empty() || End - Start <= static_cast<ptrdiff_t>(sizeof(value_type)))
+    return;
+
+  auto ReadAt = [Start] (size_t Offset) -> uint64_t {
+    return read<value_type, static_cast<endianness>(endian), 1>(Start + Offset);
+  };
+
+  // Almost all the values are not code pointers: before performing the actual
+  // lookup, discard everything outside the hull of the executable ranges. The
+  // check is a single unsigned comparison and it's performed without branches
+  // on blocks of 64 positions, so that the compiler can vectorize it.
+  const uint64_t Low = Ranges.front().first;
+  const uint64_t Span = Ranges.back().second - Low;
+  const unsigned Alignment = Binary.architecture().instructionAlignment();
+  const size_t Positions = (End - Start) - sizeof(value_type);
+  const size_t BlockSize = 64;
+
+  auto Scan = [&] (size_t Begin, size_t Finish, std::vector<size_t> &Result) {
+    for (size_t Block = Begin; Block < Finish; Block += BlockSize) {
+      size_t Size = std::min(BlockSize, Finish - Block);
+      uint64_t Mask = 0;
+      for (size_t I = 0; I < Size; I++)
+        Mask |= static_cast<uint64_t>(ReadAt(Block + I) - Low < Span) << I;
+
+      while (Mask != 0) {
+        unsigned I = __builtin_ctzll(Mask);
+        Mask &= Mask - 1;
+
+        size_t Offset = Block + I;
+        uint64_t Value = ReadAt(Offset);
+        if (Value % Alignment == 0 && Binary.isExecutableAddress(Value))
+          Result.push_back(Offset);
+      }
+    }
+  };
+
+  // Split large segments in chunks scanned in parallel, each chunk produces
+  // an ordered list of candidates
+  const size_t MinChunkSize = 1 << 20;
+  size_t Chunks = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  Chunks = std::min(Chunks, (Positions + MinChunkSize - 1) / MinChunkSize);
+  Chunks = std::max<size_t>(Chunks, 1);
+
+  // Keep chunk boundaries aligned to the block size
+  size_t ChunkSize = (Positions + Chunks - 1) / Chunks;
+  ChunkSize = (ChunkSize + BlockSize - 1) / BlockSize * BlockSize;
+
+  std::vector<std::vector<size_t>> Candidates(Chunks);
+  std::vector<std::thread> Workers;
+  for (size_t Chunk = 1; Chunk < Chunks; Chunk++) {
+    size_t Begin = std::min(Chunk * ChunkSize, Positions);
+    size_t Finish = std::min(Begin + ChunkSize, Positions);
+    Workers.emplace_back(Scan, Begin, Finish, std::ref(Candidates[Chunk]));
+  }
+  Scan(0, std::min(ChunkSize, Positions), Candidates[0]);
+
+  for (std::thread &Worker : Workers)
+    Worker.join();
+
+  // Register the candidates in order, so that the result is deterministic
+  for (std::vector<size_t> &ChunkCandidates : Candidates) {
+    incrementCounter("jt.code-pointer-candidates", ChunkCandidates.size());
+    for (size_t Offset : ChunkCandidates) {
+      BasicBlock *Result = registerJT(ReadAt(Offset), GlobalData);
+
+      if (Result != nullptr)
+        UnusedCodePointers.insert(StartVirtualAddress + Offset);
+    }
   }
 }
 
@@ -567,18 +794,22 @@ BasicBlock *JumpTargetManager::newPC(uint64_t PC, bool& ShouldContinue) {
   auto JTIt = JumpTargets.find(PC);
   if (JTIt != JumpTargets.end()) {
     // If it was planned to explore it in the future, just to do it now
-    for (auto UnexploredIt = Unexplored.begin();
-         UnexploredIt != Unexplored.end();
-         UnexploredIt++) {
-
-      if (UnexploredIt->first == PC) {
-        auto Result = UnexploredIt->second;
-        Unexplored.erase(UnexploredIt);
-        ShouldContinue = true;
-        assert(Result->empty());
-        return Result;
-      }
-
+    auto OrderIt = UnexploredOrder.find(PC);
+    if (OrderIt != UnexploredOrder.end()) {
+      UnexploredJT Key = {
+        executionCount(PC),
+        OrderIt->second,
+        { PC, nullptr }
+      };
+      UnexploredOrder.erase(OrderIt);
+
+      auto UnexploredIt = Unexplored.find(Key);
+      assert(UnexploredIt != Unexplored.end());
+      auto Result = UnexploredIt->Target.second;
+      Unexplored.erase(UnexploredIt);
+      ShouldContinue = true;
+      assert(Result->empty());
+      return Result;
     }
 
     // It wasn't planned to visit it, so we've already been there, just jump
@@ -744,67 +975,7 @@ static bool isSumJump(StoreInst *PCWrite) {
 
 std::pair<uint64_t, uint64_t>
 JumpTargetManager::getPC(Instruction *TheInstruction) const {
-  CallInst *NewPCCall = nullptr;
-  std::set<BasicBlock *> Visited;
-  std::queue<BasicBlock::reverse_iterator> WorkList;
-  if (TheInstruction->getIterator() == TheInstruction->getParent()->begin())
-    WorkList.push(--TheInstruction->getParent()->rend());
-  else
-    WorkList.push(make_reverse_iterator(TheInstruction));
-
-  while (!WorkList.empty()) {
-    auto I = WorkList.front();
-    WorkList.pop();
-    auto *BB = I->getParent();
-    auto End = BB->rend();
-
-    // Go through the instructions looking for calls to newpc
-    for (; I != End; I++) {
-      if (auto Marker = dyn_cast<CallInst>(&*I)) {
-        // TODO: comparing strings is not very elegant
-        auto *Callee = Marker->getCalledFunction();
-        if (Callee != nullptr && Callee->getName() == "newpc") {
-
-          // We found two distinct newpc leading to the requested instruction
-          if (NewPCCall != nullptr)
-            return { 0, 0 };
-
-          NewPCCall = Marker;
-          break;
-        }
-      }
-    }
-
-    // If we haven't find a newpc call yet, continue exploration backward
-    if (NewPCCall == nullptr) {
-      // If one of the predecessors is the dispatcher, don't explore any further
-      for (BasicBlock *Predecessor : predecessors(BB)) {
-        // Assert we didn't reach the almighty dispatcher
-        assert(!(NewPCCall == nullptr && Predecessor == Dispatcher));
-        if (Predecessor == Dispatcher)
-          continue;
-      }
-
-      for (BasicBlock *Predecessor : predecessors(BB)) {
-        // Ignore already visited or empty BBs
-        if (!Predecessor->empty()
-            && Visited.find(Predecessor) == Visited.end()) {
-          WorkList.push(Predecessor->rbegin());
-          Visited.insert(Predecessor);
-        }
-      }
-    }
-
-  }
-
-  // Couldn't find the current PC
-  if (NewPCCall == nullptr)
-    return { 0, 0 };
-
-  uint64_t PC = getLimitedValue(NewPCCall->getArgOperand(0));
-  uint64_t Size = getLimitedValue(NewPCCall->getArgOperand(1));
-  assert(Size != 0);
-  return { PC, Size };
+  return PCs.getPC(TheInstruction, Dispatcher);
 }
 
 void JumpTargetManager::handleSumJump(Instruction *SumJump) {
@@ -935,10 +1106,86 @@ private:
   std::queue<std::pair<BasicBlock *, uint64_t>> NewPC;
 };
 
-void JumpTargetManager::translateIndirectJumps() {
+/// Maximum number of targets in the inline cache of an indirect jump
+static const unsigned InlineCacheSize = 4;
+
+std::map<uint64_t, std::vector<uint64_t>>
+JumpTargetManager::collectInlineCacheTargets(std::string TracePath,
+                                             const std::set<uint64_t> &Sites)
+  const {
+  std::map<uint64_t, std::vector<uint64_t>> Result;
+
+  std::ifstream Trace(TracePath, std::ios::binary);
+  if (!Trace) {
+    dbg << "Couldn't open the execution trace " << TracePath << "\n";
+    abort();
+  }
+
+  // The trace is a sequence of PCs in the host endianess. The target of a
+  // jump is the first PC after its delay slots, i.e., Distance positions
+  // after the jump. Window keeps the last Distance PCs.
+  std::map<uint64_t, std::map<uint64_t, uint64_t>> Counts;
+  unsigned Distance = 1 + Binary.architecture().delaySlotSize();
+  std::vector<uint64_t> Window(Distance, 0);
+  uint64_t Seen = 0;
+  std::vector<uint64_t> Buffer(1 << 16);
+  while (Trace) {
+    Trace.read(reinterpret_cast<char *>(Buffer.data()),
+               Buffer.size() * sizeof(uint64_t));
+    size_t Count = Trace.gcount() / sizeof(uint64_t);
+    for (size_t I = 0; I < Count; I++) {
+      uint64_t PC = Buffer[I];
+      uint64_t Site = Window[Seen % Window.size()];
+      if (Seen >= Distance && Sites.count(Site) != 0)
+        Counts[Site][PC]++;
+
+      Window[Seen % Window.size()] = PC;
+      Seen++;
+    }
+  }
+
+  for (auto &P : Counts) {
+    std::vector<std::pair<uint64_t, uint64_t>> Targets;
+    for (auto &T : P.second)
+      if (isJumpTarget(T.first))
+        Targets.push_back({ T.second, T.first });
+
+    // Most frequent first, then lower addresses first
+    std::sort(Targets.begin(),
+              Targets.end(),
+              [] (const std::pair<uint64_t, uint64_t> &A,
+                  const std::pair<uint64_t, uint64_t> &B) {
+                return A.first > B.first
+                  || (A.first == B.first && A.second < B.second);
+              });
+
+    std::vector<uint64_t> &SiteTargets = Result[P.first];
+    for (unsigned I = 0; I < Targets.size() && I < InlineCacheSize; I++)
+      SiteTargets.push_back(Targets[I].second);
+  }
+
+  return Result;
+}
+
+void JumpTargetManager::translateIndirectJumps(std::string InlineCacheTrace) {
   if (ExitTB->use_empty())
     return;
 
+  // Identify the sites of the indirect jumps and their most frequent targets
+  std::map<uint64_t, std::vector<uint64_t>> InlineCaches;
+  if (!InlineCacheTrace.empty()) {
+    std::set<uint64_t> Sites;
+    for (Use &ExitTBUse : ExitTB->uses())
+      if (auto *Call = dyn_cast<CallInst>(ExitTBUse.getUser()))
+        if (Call->getCalledFunction() == ExitTB
+            && getLimitedValue(Call->getArgOperand(0)) == 0)
+          Sites.insert(getPC(Call).first);
+
+    InlineCaches = collectInlineCacheTargets(InlineCacheTrace, Sites);
+  }
+
+  auto *PCRegType = cast<IntegerType>(PCReg->getType()->getPointerElementType());
+
   auto I = ExitTB->use_begin();
   while (I != ExitTB->use_end()) {
     Use& ExitTBUse = *I++;
@@ -956,7 +1203,24 @@ void JumpTargetManager::translateIndirectJumps() {
 
         if (getLimitedValue(Call->getArgOperand(0)) == 0) {
           exitTBCleanup(Call);
-          BranchInst::Create(Dispatcher, Call);
+
+          auto It = InlineCaches.find(getPC(Call).first);
+          if (It != InlineCaches.end() && !It->second.empty()) {
+            // Check the cached targets before going to the dispatcher
+            IRBuilder<> Builder(Call);
+            Value *PC = Builder.CreateLoad(PCReg);
+            SwitchInst *Cache = Builder.CreateSwitch(PC,
+                                                     Dispatcher,
+                                                     It->second.size());
+            for (uint64_t Target : It->second)
+              Cache->addCase(ConstantInt::get(PCRegType, Target),
+                             getBlockAt(Target));
+
+            incrementCounter("ic.sites");
+            incrementCounter("ic.targets", It->second.size());
+          } else {
+            BranchInst::Create(Dispatcher, Call);
+          }
         }
 
         Call->eraseFromParent();
@@ -966,24 +1230,42 @@ void JumpTargetManager::translateIndirectJumps() {
 }
 
 JumpTargetManager::BlockWithAddress JumpTargetManager::peek() {
-  harvest();
+  while (true) {
+    harvest();
+
+    // Purge all the partial translations we know might be wrong
+    for (BasicBlock *BB : ToPurge)
+      purgeTranslation(BB);
+    ToPurge.clear();
+
+    if (Unexplored.empty())
+      return NoMoreTargets;
 
-  // Purge all the partial translations we know might be wrong
-  for (BasicBlock *BB : ToPurge)
-    purgeTranslation(BB);
-  ToPurge.clear();
+    // Without a profile, this is the most recently registered jump target
+    BlockWithAddress Result = Unexplored.begin()->Target;
+    Unexplored.erase(Unexplored.begin());
+    UnexploredOrder.erase(Result.first);
+    if (inShard(Result.first))
+      return Result;
 
-  if (Unexplored.empty())
-    return NoMoreTargets;
-  else {
-    BlockWithAddress Result = Unexplored.back();
-    Unexplored.pop_back();
-    return Result;
+    // Leave the jump target to the process translating its shard
+    incrementCounter("shard.foreign-jump-targets");
+    if (Result.second->empty())
+      new UnreachableInst(Context, Result.second);
   }
 }
 
+std::vector<uint64_t> JumpTargetManager::nextUnexplored(unsigned Count) const {
+  std::vector<uint64_t> Result;
+  for (auto It = Unexplored.begin();
+       It != Unexplored.end() && Result.size() < Count;
+       It++)
+    Result.push_back(It->Target.first);
+  return Result;
+}
+
 void JumpTargetManager::unvisit(BasicBlock *BB) {
-  if (Visited.find(BB) != Visited.end()) {
+  if (Visited.count(BB) != 0) {
     std::vector<BasicBlock *> WorkList;
     WorkList.push_back(BB);
 
@@ -994,8 +1276,7 @@ void JumpTargetManager::unvisit(BasicBlock *BB) {
       Visited.erase(Current);
 
       for (BasicBlock *Successor : successors(BB)) {
-        if (Visited.find(Successor) != Visited.end()
-            && !Successor->empty()) {
+        if (Visited.count(Successor) != 0 && !Successor->empty()) {
           auto *Call = dyn_cast<CallInst>(&*Successor->begin());
           if (Call == nullptr
               || Call->getCalledFunction()->getName() != "newpc") {
@@ -1007,13 +1288,58 @@ void JumpTargetManager::unvisit(BasicBlock *BB) {
   }
 }
 
+void JumpTargetManager::recordMemoryUsage() const {
+  recordContainerSize("jtm.jump-targets", treeBytes(JumpTargets));
+  recordContainerSize("jtm.original-instruction-addresses",
+                      OriginalInstructionAddresses.getMemorySize());
+  recordContainerSize("jtm.unexplored", treeBytes(Unexplored));
+  recordContainerSize("jtm.set-cache", SETResults.memoryUsage());
+  recordContainerSize("jtm.unused-code-pointers",
+                      UnusedCodePointers.getMemorySize());
+  recordContainerSize("jtm.profile", Profile.getMemorySize());
+  recordContainerSize("jtm.block-pcs", PCs.memoryUsage());
+
+  // Estimate the size of the instructions, along with their operands, and of
+  // the metadata attached to them, most notably the PTC instructions
+  uint64_t InstructionsBytes = 0;
+  uint64_t MetadataBytes = 0;
+  SmallPtrSet<const MDNode *, 16> Seen;
+  SmallVector<std::pair<unsigned, MDNode *>, 4> Attachments;
+  for (const Function &F : TheModule) {
+    for (const BasicBlock &BB : F) {
+      for (const Instruction &I : BB) {
+        InstructionsBytes += sizeof(Instruction);
+        InstructionsBytes += I.getNumOperands() * sizeof(Use);
+
+        Attachments.clear();
+        I.getAllMetadata(Attachments);
+        for (auto &P : Attachments) {
+          const MDNode *Node = P.second;
+          if (!Seen.insert(Node).second)
+            continue;
+
+          MetadataBytes += sizeof(MDNode);
+          MetadataBytes += Node->getNumOperands() * sizeof(MDOperand);
+          for (const MDOperand &Operand : Node->operands())
+            if (auto *String = dyn_cast_or_null<MDString>(Operand.get()))
+              MetadataBytes += sizeof(MDString) + String->getLength();
+        }
+      }
+    }
+  }
+
+  recordContainerSize("module.instructions", InstructionsBytes);
+  recordContainerSize("module.metadata", MetadataBytes);
+}
+
 BasicBlock *JumpTargetManager::getBlockAt(uint64_t PC) {
   auto TargetIt = JumpTargets.find(PC);
   assert(TargetIt != JumpTargets.end());
   return TargetIt->second.head();
 }
 
-void JumpTargetManager::purgeTranslation(BasicBlock *Start) {
+std::set<BasicBlock *>
+JumpTargetManager::collectTranslation(BasicBlock *Start) {
   OnceQueue<BasicBlock *> Queue;
   Queue.insert(Start);
 
@@ -1029,8 +1355,62 @@ void JumpTargetManager::purgeTranslation(BasicBlock *Start) {
     }
   }
 
+  return Queue.visited();
+}
+
+bool JumpTargetManager::canSplitInPlace(Instruction *I) {
+  BasicBlock *ContainingBlock = I->getParent();
+  BasicBlock *EntryBlock = &TheFunction->getEntryBlock();
+  std::set<BasicBlock *> Region = collectTranslation(ContainingBlock);
+
+  // The translation must be complete, i.e., we're not translating it right now
+  for (BasicBlock *BB : Region)
+    if (BB->getTerminator() == nullptr)
+      return false;
+
+  // Collect the instructions that will remain before the split point
+  std::set<Instruction *> Before;
+  for (Instruction &Preceding : make_range(ContainingBlock->begin(),
+                                           I->getIterator()))
+    Before.insert(&Preceding);
+
+  auto UsesOnlyDominatingValues = [&] (Instruction &User) {
+    for (Value *Operand : User.operand_values()) {
+      auto *Definition = dyn_cast<Instruction>(Operand);
+      if (Definition == nullptr)
+        continue;
+
+      BasicBlock *DefinitionBlock = Definition->getParent();
+      if (DefinitionBlock == EntryBlock)
+        continue;
+
+      if (Before.count(Definition) != 0
+          || Region.count(DefinitionBlock) == 0)
+        return false;
+    }
+
+    return true;
+  };
+
+  for (BasicBlock *BB : Region) {
+    auto Begin = BB == ContainingBlock ? I->getIterator() : BB->begin();
+    for (Instruction &User : make_range(Begin, BB->end()))
+      if (!UsesOnlyDominatingValues(User))
+        return false;
+  }
+
+  return true;
+}
+
+void JumpTargetManager::purgeTranslation(BasicBlock *Start) {
   // Erase all the visited basic blocks
-  std::set<BasicBlock *> Visited = Queue.visited();
+  std::set<BasicBlock *> Visited = collectTranslation(Start);
+  incrementCounter("jt.purged-blocks", Visited.size());
+
+  // SETResults and NoReturn might refer to the basic blocks we're going to
+  // erase
+  SETResults.clear();
+  NoReturn.invalidate(Visited);
 
   // Build a subgraph, so that we can visit it in post order, and purge the
   // content of each basic block
@@ -1076,12 +1456,14 @@ BasicBlock *JumpTargetManager::registerJT(uint64_t PC, JTReason Reason) {
   // Did we already meet this PC (i.e. do we know what's the associated
   // instruction)?
   BasicBlock *NewBlock = nullptr;
+  bool Explore = true;
   InstructionMap::iterator InstrIt = OriginalInstructionAddresses.find(PC);
   if (InstrIt != OriginalInstructionAddresses.end()) {
     // Case 2: the address has already been met, but needs to be promoted to
     //         BasicBlock level.
     Instruction *I = InstrIt->second;
     BasicBlock *ContainingBlock = I->getParent();
+    bool InPlace = SplitInPlace && canSplitInPlace(I);
     if (isFirst(I)) {
       NewBlock = ContainingBlock;
     } else {
@@ -1089,11 +1471,20 @@ BasicBlock *JumpTargetManager::registerJT(uint64_t PC, JTReason Reason) {
       NewBlock = ContainingBlock->splitBasicBlock(I);
     }
 
-    // Register the basic block and all of its descendants to be purged so that
-    // we can retranslate this PC
-    // TODO: this might create a problem if QEMU generates control flow that
-    //       crosses an instruction boundary
-    ToPurge.insert(NewBlock);
+    if (InPlace) {
+      // The existing translation can be reused as is, we just have to make it
+      // reachable from the dispatcher
+      DBG("jtcount", dbg << "Splitting in place at 0x"
+          << std::hex << PC << "\n");
+      incrementCounter("jt.split-in-place");
+      Explore = false;
+    } else {
+      // Register the basic block and all of its descendants to be purged so
+      // that we can retranslate this PC
+      // TODO: this might create a problem if QEMU generates control flow that
+      //       crosses an instruction boundary
+      ToPurge.insert(NewBlock);
+    }
 
     unvisit(NewBlock);
   } else {
@@ -1102,7 +1493,8 @@ BasicBlock *JumpTargetManager::registerJT(uint64_t PC, JTReason Reason) {
     NewBlock = BasicBlock::Create(Context, "", TheFunction);
   }
 
-  Unexplored.push_back(BlockWithAddress(PC, NewBlock));
+  if (Explore)
+    pushUnexplored(PC, NewBlock);
 
   if (NewBlock->getName().empty()) {
     std::stringstream Name;
@@ -1125,8 +1517,6 @@ void JumpTargetManager::registerReadRange(uint64_t Address, uint64_t Size) {
   ReadIntervalSet += interval::right_open(Address, Address + Size);
 }
 
-// TODO: instead of a gigantic switch case we could map the original memory area
-//       and write the address of the translated basic block at the jump target
 // If this function looks weird it's because it has been designed to be able
 // to create the dispatcher in the "root" function or in a standalone function
 void JumpTargetManager::createDispatcher(Function *OutputFunction,
@@ -1171,6 +1561,112 @@ void JumpTargetManager::createDispatcher(Function *OutputFunction,
   setCFGForm(SemanticPreservingCFG);
 }
 
+bool JumpTargetManager::adoptDispatcher() {
+  QuickMetadata QMD(Context);
+  for (BasicBlock &BB : *TheFunction) {
+    TerminatorInst *T = BB.getTerminator();
+    if (T == nullptr)
+      continue;
+
+    auto *MD = cast_or_null<MDTuple>(T->getMetadata("revamb.block.type"));
+    if (MD == nullptr)
+      continue;
+
+    switch (BlockType(QMD.extract<uint32_t>(MD, 0))) {
+    case DispatcherBlock:
+      Dispatcher = &BB;
+      DispatcherSwitch = cast<SwitchInst>(T);
+      break;
+    case AnyPCBlock:
+      AnyPC = &BB;
+      break;
+    case UnexpectedPCBlock:
+      UnexpectedPC = &BB;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (Dispatcher == nullptr)
+    return false;
+
+  assert(AnyPC != nullptr && UnexpectedPC != nullptr);
+  DispatcherFail = DispatcherSwitch->getDefaultDest();
+  NoReturn.setDispatcher(Dispatcher);
+  CurrentCFGForm = SemanticPreservingCFG;
+
+  // Each case of the dispatcher is a jump target, the reasons are lost
+  for (auto Case : DispatcherSwitch->cases()) {
+    uint64_t PC = Case.getCaseValue()->getZExtValue();
+    JumpTargets[PC] = JumpTarget(Case.getCaseSuccessor());
+  }
+
+  if (Function *NewPCFunction = TheModule.getFunction("newpc")) {
+    for (User *U : NewPCFunction->users()) {
+      auto *Call = cast<CallInst>(U);
+      BasicBlock *BB = Call->getParent();
+      if (BB != nullptr && BB->getParent() == TheFunction) {
+        uint64_t PC = getLimitedValue(Call->getArgOperand(0));
+        OriginalInstructionAddresses[PC] = Call;
+      }
+    }
+  }
+
+  return true;
+}
+
+void JumpTargetManager::writePreHarvest() {
+  ScopedPhase Phase("pre-harvest-dump");
+
+  QuickMetadata QMD(Context);
+  NamedMDNode *MD = TheModule.getOrInsertNamedMetadata("revamb.pre-harvest");
+  MD->addOperand(QMD.tuple(Binary.path().c_str()));
+
+  // The user explicitly asked for the dump, don't go on without it
+  std::error_code EC;
+  raw_fd_ostream Output(PreHarvestPath, EC, sys::fs::F_None);
+  if (EC) {
+    dbg << "Couldn't open " << PreHarvestPath << ": " << EC.message() << "\n";
+    abort();
+  }
+
+  WriteBitcodeToFile(&TheModule, Output);
+  Output.close();
+  if (Output.has_error()) {
+    dbg << "Couldn't write " << PreHarvestPath << "\n";
+    abort();
+  }
+
+  MD->eraseFromParent();
+  PreHarvestPath.clear();
+}
+
+void JumpTargetManager::collectStatistics() const {
+  if (!StatisticsEnabled)
+    return;
+
+  static const std::pair<JTReason, const char *> ReasonNames[] = {
+    { PostHelper, "PostHelper" },
+    { DirectJump, "DirectJump" },
+    { GlobalData, "GlobalData" },
+    { AmbigousInstruction, "AmbigousInstruction" },
+    { SETToPC, "SETToPC" },
+    { SETNotToPC, "SETNotToPC" },
+    { UnusedGlobalData, "UnusedGlobalData" },
+    { Callee, "Callee" },
+    { SumJump, "SumJump" }
+  };
+
+  setCounter("jt.total", JumpTargets.size());
+  for (auto &P : JumpTargets)
+    for (auto &Reason : ReasonNames)
+      if (P.second.hasReason(Reason.first))
+        incrementCounter(std::string("jt.reason.") + Reason.second);
+
+  setCounter("dispatcher.cases", DispatcherSwitch->getNumCases());
+}
+
 static void purge(BasicBlock *BB) {
   // Allow up to a single instruction in the basic block
   if (!BB->empty())
@@ -1179,6 +1675,7 @@ static void purge(BasicBlock *BB) {
 }
 
 void JumpTargetManager::setCFGForm(CFGForm NewForm) {
+  ScopedPhase Phase("cfg-form");
   assert(CurrentCFGForm != NewForm);
   assert(NewForm != UnknownFormCFG);
 
@@ -1233,27 +1730,813 @@ void JumpTargetManager::setCFGForm(CFGForm NewForm) {
     }
   }
 
-  rebuildDispatcher();
+  // Bring the dispatcher back to all the jump targets and, if required,
+  // detach those with predecessors again, taking into account the new ones
+  restoreDispatcherCases();
+  if (NewForm != SemanticPreservingCFG)
+    parkDispatcherCases();
+}
+
+void JumpTargetManager::parkDispatcherCases() {
+  assert(ParkedCases.empty());
+
+  // Keep only the jump targets with no predecessors other than the dispatcher
+  unsigned Index = 0;
+  for (auto Case : DispatcherSwitch->cases()) {
+    BasicBlock *BB = Case.getCaseSuccessor();
+    if (hasPredecessors(BB)) {
+      ParkedCases.push_back({ Index, BB });
+      Case.setSuccessor(DispatcherFail);
+    }
+    Index++;
+  }
+}
+
+void JumpTargetManager::restoreDispatcherCases() {
+  // Cases registered in the meantime are appended, so the parked ones are
+  // still where we left them
+  for (auto &P : ParkedCases) {
+    auto Case = SwitchInst::CaseIt(DispatcherSwitch, P.first);
+    assert(Case.getCaseSuccessor() == DispatcherFail);
+    Case.setSuccessor(P.second);
+  }
+
+  freeContainer(ParkedCases);
+}
+
+/// Number of PCs handled by each page of the dispatcher table, must be a power
+/// of two
+static const unsigned DispatcherPageSize = 256;
+/// Minimum number of jump targets to dispatch a page through the table
+static const unsigned DispatcherMinPageJTs = 8;
+/// Maximum number of entries in the page map of the dispatcher table
+static const uint64_t DispatcherMaxPageMap = 1 << 22;
+
+void JumpTargetManager::createDispatcherTable() {
+  ScopedPhase Phase("dispatcher-table");
+
+  unsigned Alignment = Binary.architecture().instructionAlignment();
+  if (DispatcherSwitch->getNumCases() == 0 || !isPowerOf2_32(Alignment))
+    return;
+  unsigned AlignmentShift = Log2_32(Alignment);
+  unsigned PageShift = Log2_32(DispatcherPageSize);
+
+  // Collect the current cases of the dispatcher, sorted by PC
+  std::map<uint64_t, BasicBlock *> Cases;
+  for (auto Case : DispatcherSwitch->cases())
+    Cases[Case.getCaseValue()->getZExtValue()] = Case.getCaseSuccessor();
+
+  // Group the aligned jump targets in pages, starting from the first one
+  uint64_t Low = Cases.begin()->first;
+  Low &= ~static_cast<uint64_t>(Alignment - 1);
+  std::map<uint64_t, unsigned> PageJTs;
+  for (auto &P : Cases)
+    if ((P.first - Low) % Alignment == 0)
+      PageJTs[((P.first - Low) >> AlignmentShift) >> PageShift]++;
+
+  std::vector<uint64_t> DensePages;
+  for (auto &P : PageJTs)
+    if (P.second >= DispatcherMinPageJTs)
+      DensePages.push_back(P.first);
+
+  DBG("jtcount", dbg << "Dispatcher table: " << std::dec << DensePages.size()
+      << " dense pages out of " << PageJTs.size() << "\n");
+
+  if (DensePages.empty())
+    return;
+
+  // Make the table start from the first dense page
+  uint64_t FirstPage = DensePages.front();
+  Low += (FirstPage << PageShift) << AlignmentShift;
+  for (uint64_t &Page : DensePages)
+    Page -= FirstPage;
+
+  if (DensePages.back() + 1 > DispatcherMaxPageMap) {
+    DBG("jtcount", dbg << "Dense pages are too far apart, not using the"
+        << " dispatcher table\n");
+    return;
+  }
+
+  setCounter("dispatcher.table-pages", DensePages.size());
+
+  // Create a new basic block for the switch, which will handle the sparse
+  // jump targets and the holes in the table
+  Function *F = Dispatcher->getParent();
+  BasicBlock *Sparse = BasicBlock::Create(Context, "dispatcher.sparse", F,
+                                          AnyPC);
+  DispatcherSwitch->removeFromParent();
+  Sparse->getInstList().push_back(DispatcherSwitch);
+  DispatcherSwitch->setMetadata("revamb.block.type", nullptr);
+
+  auto *PCTy = cast<IntegerType>(PCReg->getType()->getPointerElementType());
+  auto *Int32Ty = Type::getInt32Ty(Context);
+  auto *Int8PtrTy = Type::getInt8PtrTy(Context);
+
+  // The page map associates to each page the index of its table, or the index
+  // of an empty page forwarding everything to the switch
+  uint64_t PageCount = DensePages.back() + 1;
+  unsigned EmptyPage = DensePages.size();
+  std::vector<Constant *> PageMap(PageCount, ConstantInt::get(Int32Ty,
+                                                              EmptyPage));
+  Constant *SparseAddress = BlockAddress::get(F, Sparse);
+  std::vector<Constant *> Targets((DensePages.size() + 1) * DispatcherPageSize,
+                                  SparseAddress);
+  std::set<BasicBlock *> Destinations;
+  for (unsigned I = 0; I < DensePages.size(); I++) {
+    uint64_t Page = DensePages[I];
+    PageMap[Page] = ConstantInt::get(Int32Ty, I);
+
+    uint64_t PageStart = Low + ((Page << PageShift) << AlignmentShift);
+    uint64_t PageEnd = PageStart + (DispatcherPageSize << AlignmentShift);
+    for (auto It = Cases.lower_bound(PageStart);
+         It != Cases.end() && It->first < PageEnd;
+         It++) {
+      uint64_t Slot = (It->first - PageStart) >> AlignmentShift;
+      if ((It->first - PageStart) % Alignment != 0)
+        continue;
+
+      Targets[I * DispatcherPageSize + Slot] = BlockAddress::get(F, It->second);
+      Destinations.insert(It->second);
+
+      // This jump target is now handled by the table
+      auto Case = DispatcherSwitch->findCaseValue(ConstantInt::get(PCTy,
+                                                                   It->first));
+      DispatcherSwitch->removeCase(Case);
+    }
+  }
+
+  auto *PageMapTy = ArrayType::get(Int32Ty, PageCount);
+  auto *PageMapVar = new GlobalVariable(TheModule,
+                                        PageMapTy,
+                                        true,
+                                        GlobalValue::InternalLinkage,
+                                        ConstantArray::get(PageMapTy, PageMap),
+                                        "dispatcher.pagemap");
+  auto *TargetsTy = ArrayType::get(Int8PtrTy, Targets.size());
+  auto *TargetsVar = new GlobalVariable(TheModule,
+                                        TargetsTy,
+                                        true,
+                                        GlobalValue::InternalLinkage,
+                                        ConstantArray::get(TargetsTy, Targets),
+                                        "dispatcher.targets");
+
+  // Compute the address of the target in the table:
+  //
+  //     Offset = PC - Low
+  //     Slot = Offset >> AlignmentShift
+  //     Page = Slot >> PageShift
+  //     Valid = Page < PageCount && Offset is aligned
+  //     Index = (Valid ? PageMap[Page] : EmptyPage) << PageShift
+  //             | (Slot & (DispatcherPageSize - 1))
+  //     indirectbr Targets[Index]
+  IRBuilder<> Builder(Dispatcher);
+  Value *PC = DispatcherSwitch->getCondition();
+  Value *Offset = Builder.CreateSub(PC, ConstantInt::get(PCTy, Low));
+  Value *Slot = Builder.CreateLShr(Offset, AlignmentShift);
+  Value *Page = Builder.CreateLShr(Slot, PageShift);
+  Value *Valid = Builder.CreateICmpULT(Page, ConstantInt::get(PCTy, PageCount));
+  if (Alignment != 1) {
+    Value *Misalignment = Builder.CreateAnd(Offset, Alignment - 1);
+    Value *Aligned = Builder.CreateICmpEQ(Misalignment,
+                                          ConstantInt::get(PCTy, 0));
+    Valid = Builder.CreateAnd(Valid, Aligned);
+  }
+  Value *SafePage = Builder.CreateSelect(Valid, Page, ConstantInt::get(PCTy, 0));
+  Value *PageMapEntry = Builder.CreateGEP(PageMapTy,
+                                          PageMapVar,
+                                          { Builder.getInt32(0), SafePage });
+  Value *TableIndex = Builder.CreateSelect(Valid,
+                                           Builder.CreateLoad(PageMapEntry),
+                                           Builder.getInt32(EmptyPage));
+  TableIndex = Builder.CreateZExt(TableIndex, PCTy);
+  TableIndex = Builder.CreateShl(TableIndex, PageShift);
+  Value *SlotInPage = Builder.CreateAnd(Slot, DispatcherPageSize - 1);
+  TableIndex = Builder.CreateOr(TableIndex, SlotInPage);
+  Value *TargetEntry = Builder.CreateGEP(TargetsTy,
+                                         TargetsVar,
+                                         { Builder.getInt32(0), TableIndex });
+  Value *Target = Builder.CreateLoad(TargetEntry);
+
+  IndirectBrInst *Branch = Builder.CreateIndirectBr(Target,
+                                                    Destinations.size() + 1);
+  Branch->addDestination(Sparse);
+  for (BasicBlock *Destination : Destinations)
+    Branch->addDestination(Destination);
+
+  QuickMetadata QMD(Context);
+  Branch->setMetadata("revamb.block.type", QMD.tuple(DispatcherBlock));
 }
 
-void JumpTargetManager::rebuildDispatcher() {
-  // Remove all cases
-  unsigned NumCases = DispatcherSwitch->getNumCases();
-  while (NumCases --> 0)
-    DispatcherSwitch->removeCase(DispatcherSwitch->case_begin());
+/// Number of entries of the shadow stack, must be a power of two
+static const unsigned ShadowStackSize = 64;
+
+void JumpTargetManager::createShadowStack() {
+  ScopedPhase Phase("shadow-stack");
+
+  // The function calls are identified by OSRA, which might have been skipped
+  Function *FunctionCall = TheModule.getFunction("function_call");
+  if (FunctionCall == nullptr) {
+    dbg << "Warning: no function call has been identified, the shadow stack"
+        << " will not be created\n";
+    return;
+  }
+
+  Function *F = Dispatcher->getParent();
+  std::map<BasicBlock *, uint64_t> JumpTargetPCs;
+  for (auto &P : JumpTargets)
+    JumpTargetPCs[P.second.head()] = P.first;
+
+  // Collect the calls whose return address is a jump target
+  std::vector<std::pair<CallInst *, BasicBlock *>> Calls;
+  std::set<TerminatorInst *> CallTerminators;
+  for (User *U : FunctionCall->users()) {
+    auto *Call = dyn_cast<CallInst>(U);
+    if (Call == nullptr || Call->getParent()->getParent() != F)
+      continue;
+
+    CallTerminators.insert(Call->getParent()->getTerminator());
 
-  auto *PCRegType = PCReg->getType()->getPointerElementType();
-  auto *SwitchType = cast<IntegerType>(PCRegType);
+    // The return basic block might have been removed
+    auto *ReturnAddress = dyn_cast<BlockAddress>(Call->getArgOperand(1));
+    if (ReturnAddress == nullptr
+        || JumpTargetPCs.count(ReturnAddress->getBasicBlock()) == 0)
+      continue;
+
+    Calls.push_back({ Call, ReturnAddress->getBasicBlock() });
+  }
 
-  // Add all the jump targets if we're using the SemanticPreservingCFG, or
-  // only those with no predecessors otherwise
+  if (Calls.empty())
+    return;
+
+  auto *PCTy = cast<IntegerType>(PCReg->getType()->getPointerElementType());
+  auto *Int32Ty = Type::getInt32Ty(Context);
+  auto *Int8PtrTy = Type::getInt8PtrTy(Context);
+
+  // The empty entries have PC 0, which is never matched
+  auto *PCsTy = ArrayType::get(PCTy, ShadowStackSize);
+  auto *PCsVar = new GlobalVariable(TheModule,
+                                    PCsTy,
+                                    false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantAggregateZero::get(PCsTy),
+                                    "shadow_stack.pcs");
+  auto *TargetsTy = ArrayType::get(Int8PtrTy, ShadowStackSize);
+  auto *TargetsVar = new GlobalVariable(TheModule,
+                                        TargetsTy,
+                                        false,
+                                        GlobalValue::InternalLinkage,
+                                        ConstantAggregateZero::get(TargetsTy),
+                                        "shadow_stack.targets");
+  auto *TopVar = new GlobalVariable(TheModule,
+                                    Int32Ty,
+                                    false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantInt::get(Int32Ty, 0),
+                                    "shadow_stack.top");
+
+  // Push the return address before each call, keeping the function_call
+  // marker right before the terminator
+  IRBuilder<> Builder(Context);
+  std::set<BasicBlock *> Destinations;
+  for (auto &P : Calls) {
+    CallInst *Call = P.first;
+    BasicBlock *Return = P.second;
+    Builder.SetInsertPoint(Call);
+
+    Value *Top = Builder.CreateAdd(Builder.CreateLoad(TopVar),
+                                   Builder.getInt32(1));
+    Top = Builder.CreateAnd(Top, ShadowStackSize - 1);
+    Builder.CreateStore(Top, TopVar);
+    Value *PCEntry = Builder.CreateGEP(PCsTy,
+                                       PCsVar,
+                                       { Builder.getInt32(0), Top });
+    Builder.CreateStore(ConstantInt::get(PCTy, JumpTargetPCs[Return]),
+                        PCEntry);
+    Value *TargetEntry = Builder.CreateGEP(TargetsTy,
+                                           TargetsVar,
+                                           { Builder.getInt32(0), Top });
+    Builder.CreateStore(BlockAddress::get(F, Return), TargetEntry);
+
+    Destinations.insert(Return);
+  }
+
+  // Compare the PC with the top of the stack:
+  //
+  //     Top = shadow_stack.top
+  //     if (PC != 0 && PC == shadow_stack.pcs[Top]) {
+  //       revamb_shadow_stack_hits++
+  //       shadow_stack.top = (Top - 1) % ShadowStackSize
+  //       indirectbr shadow_stack.targets[Top]
+  //     } else {
+  //       goto Miss
+  //     }
+  //
+  // Miss is anypc for the jumps to anypc and the dispatcher for the unresolved
+  // indirect jumps (see translateIndirectJumps), which go to the dispatcher
+  // directly or through the default case of their inline cache.
+  BasicBlock *Hit = BasicBlock::Create(Context, "shadow_stack.hit", F, AnyPC);
+  auto CreateCheck = [&] (const char *Name, BasicBlock *Miss) {
+    BasicBlock *Check = BasicBlock::Create(Context, Name, F, Hit);
+    Builder.SetInsertPoint(Check);
+    Value *Top = Builder.CreateLoad(TopVar);
+    Value *PC = Builder.CreateLoad(PCReg);
+    Value *PCEntry = Builder.CreateGEP(PCsTy,
+                                       PCsVar,
+                                       { Builder.getInt32(0), Top });
+    Value *Match = Builder.CreateICmpEQ(PC, Builder.CreateLoad(PCEntry));
+    Value *NonZero = Builder.CreateICmpNE(PC, ConstantInt::get(PCTy, 0));
+    Builder.CreateCondBr(Builder.CreateAnd(Match, NonZero), Hit, Miss);
+    return Check;
+  };
+  BasicBlock *AnyPCCheck = CreateCheck("shadow_stack.check", AnyPC);
+  BasicBlock *DispatcherCheck = CreateCheck("shadow_stack.dispatcher_check",
+                                            Dispatcher);
+
+  // Count the returns taken through the shadow stack, support.c reports them
+  // if REVAMB_SHADOW_STACK_STATS is set
+  auto *Int64Ty = Type::getInt64Ty(Context);
+  auto *HitsVar = new GlobalVariable(TheModule,
+                                     Int64Ty,
+                                     false,
+                                     GlobalValue::ExternalLinkage,
+                                     ConstantInt::get(Int64Ty, 0),
+                                     "revamb_shadow_stack_hits");
+
+  Builder.SetInsertPoint(Hit);
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(HitsVar),
+                                        Builder.getInt64(1)),
+                      HitsVar);
+  Value *Top = Builder.CreateLoad(TopVar);
+  Value *NewTop = Builder.CreateSub(Top, Builder.getInt32(1));
+  Builder.CreateStore(Builder.CreateAnd(NewTop, ShadowStackSize - 1), TopVar);
+  Value *TargetEntry = Builder.CreateGEP(TargetsTy,
+                                         TargetsVar,
+                                         { Builder.getInt32(0), Top });
+  IndirectBrInst *Branch = Builder.CreateIndirectBr(
+    Builder.CreateLoad(TargetEntry),
+    Destinations.size());
+  for (BasicBlock *Destination : Destinations)
+    Branch->addDestination(Destination);
+
+  // Let all the other jumps to anypc or to the dispatcher go through the check
+  unsigned CheckedJumps = 0;
+  for (BasicBlock &BB : *F) {
+    if (&BB == AnyPCCheck || &BB == DispatcherCheck || &BB == Hit
+        || !isTranslatedBB(&BB))
+      continue;
+
+    TerminatorInst *Terminator = BB.getTerminator();
+    if (Terminator == nullptr || CallTerminators.count(Terminator) != 0)
+      continue;
+
+    bool Redirected = false;
+    for (unsigned I = 0; I < Terminator->getNumSuccessors(); I++) {
+      BasicBlock *Successor = Terminator->getSuccessor(I);
+      if (Successor == AnyPC) {
+        Terminator->setSuccessor(I, AnyPCCheck);
+        Redirected = true;
+      } else if (Successor == Dispatcher) {
+        Terminator->setSuccessor(I, DispatcherCheck);
+        Redirected = true;
+      }
+    }
+
+    if (Redirected)
+      CheckedJumps++;
+  }
+
+  setCounter("shadow-stack.call-sites", Calls.size());
+  setCounter("shadow-stack.checked-jumps", CheckedJumps);
+}
+
+void JumpTargetManager::createAddressMap() {
+  Function *F = Dispatcher->getParent();
+  auto *Int8PtrTy = Type::getInt8PtrTy(Context);
+  auto *Int64Ty = Type::getInt64Ty(Context);
+  auto *EntryTy = StructType::get(Context, { Int8PtrTy, Int64Ty });
+
+  std::vector<Constant *> Entries;
   for (auto &P : JumpTargets) {
+    BasicBlock *Head = P.second.head();
+    if (Head->empty() || Head->getParent() != F)
+      continue;
+
+    Constant *Fields[2] = {
+      BlockAddress::get(F, Head),
+      ConstantInt::get(Int64Ty, P.first)
+    };
+    Entries.push_back(ConstantStruct::get(EntryTy, Fields));
+  }
+
+  auto *MapTy = ArrayType::get(EntryTy, Entries.size());
+  new GlobalVariable(TheModule,
+                     MapTy,
+                     true,
+                     GlobalValue::ExternalLinkage,
+                     ConstantArray::get(MapTy, Entries),
+                     "revamb_address_map");
+  new GlobalVariable(TheModule,
+                     Int64Ty,
+                     true,
+                     GlobalValue::ExternalLinkage,
+                     ConstantInt::get(Int64Ty, Entries.size()),
+                     "revamb_address_map_size");
+
+  // Mark the end of the translated code with an empty function right after
+  // it: the functions are emitted in the order they appear in the module, and
+  // everything following root (e.g., the helpers) is not part of any jump
+  // target
+  auto *EndTy = FunctionType::get(Type::getVoidTy(Context), false);
+  Function *End = Function::Create(EndTy,
+                                   GlobalValue::ExternalLinkage,
+                                   "revamb_address_map_end");
+  TheModule.getFunctionList().insertAfter(F->getIterator(), End);
+  End->addFnAttr(Attribute::NoInline);
+  ReturnInst::Create(Context, BasicBlock::Create(Context, "", End));
+
+  setCounter("address-map.entries", Entries.size());
+}
+
+void JumpTargetManager::loadProfile(std::string ProfilePath) {
+  ScopedPhase Phase("profile-loading");
+
+  std::ifstream Trace(ProfilePath, std::ios::binary);
+  if (!Trace) {
+    dbg << "Couldn't open the profile " << ProfilePath << "\n";
+    abort();
+  }
+
+  // Compressed traces have to be decoded first
+  char Magic[8] = { 0 };
+  Trace.read(Magic, sizeof(Magic));
+  if (Trace.gcount() == sizeof(Magic)
+      && std::equal(Magic, Magic + sizeof(Magic), "RVTRACE1")) {
+    dbg << ProfilePath << " is a compressed trace, decode it with"
+        << " revamb-trace-decode first\n";
+    abort();
+  }
+  Trace.clear();
+  Trace.seekg(0);
+
+  // As in collectInlineCacheTargets, the trace is a sequence of PCs in the
+  // host endianess
+  std::vector<uint64_t> Buffer(1 << 16);
+  while (Trace) {
+    Trace.read(reinterpret_cast<char *>(Buffer.data()),
+               Buffer.size() * sizeof(uint64_t));
+    size_t Count = Trace.gcount() / sizeof(uint64_t);
+    for (size_t I = 0; I < Count; I++)
+      Profile[Buffer[I]]++;
+  }
+
+  setCounter("profile.pcs", Profile.size());
+
+  // The jump targets already registered have to be prioritized too
+  std::set<UnexploredJT> Old;
+  std::swap(Old, Unexplored);
+  for (UnexploredJT Entry : Old) {
+    Entry.ExecutionCount = executionCount(Entry.Target.first);
+    Unexplored.insert(Entry);
+  }
+}
+
+void JumpTargetManager::loadSeeds(std::string SeedsPath) {
+  std::ifstream Seeds(SeedsPath, std::ios::binary);
+  if (!Seeds) {
+    dbg << "Couldn't open the jump targets list " << SeedsPath << "\n";
+    abort();
+  }
+
+  uint64_t Count = 0;
+  std::vector<uint64_t> Buffer(1 << 16);
+  while (Seeds) {
+    Seeds.read(reinterpret_cast<char *>(Buffer.data()),
+               Buffer.size() * sizeof(uint64_t));
+    size_t Read = Seeds.gcount() / sizeof(uint64_t);
+    for (size_t I = 0; I < Read; I++)
+      if (registerJT(Buffer[I], Seed) != nullptr)
+        Count++;
+  }
+
+  setCounter("seeds.jump-targets", Count);
+}
+
+void JumpTargetManager::setShard(unsigned Index, unsigned Count) {
+  assert(Index < Count);
+
+  auto &Ranges = Binary.executableRanges();
+  uint64_t Total = 0;
+  for (auto &Range : Ranges)
+    Total += Range.second - Range.first;
+
+  // The shard covers the bytes from Start to End, counting them across all
+  // the executable ranges
+  uint64_t Start = Total / Count * Index;
+  uint64_t End = Index + 1 == Count ? Total : Total / Count * (Index + 1);
+
+  Sharded = true;
+  ShardRanges.clear();
+  uint64_t Offset = 0;
+  for (auto &Range : Ranges) {
+    uint64_t Size = Range.second - Range.first;
+    uint64_t First = std::max(Start, Offset);
+    uint64_t Last = std::min(End, Offset + Size);
+    if (First < Last)
+      ShardRanges.push_back({ Range.first + First - Offset,
+                              Range.first + Last - Offset });
+    Offset += Size;
+  }
+}
+
+bool JumpTargetManager::inShard(uint64_t PC) const {
+  if (!Sharded)
+    return true;
+
+  using Range = std::pair<uint64_t, uint64_t>;
+  auto Compare = [] (uint64_t Address, const Range &R) {
+    return Address < R.first;
+  };
+  auto It = std::upper_bound(ShardRanges.begin(),
+                             ShardRanges.end(),
+                             PC,
+                             Compare);
+  if (It == ShardRanges.begin())
+    return false;
+
+  --It;
+  return PC < It->second;
+}
+
+bool JumpTargetManager::writeJumpTargets(std::string Path) const {
+  std::ofstream Output(Path, std::ios::binary | std::ios::trunc);
+  if (!Output)
+    return false;
+
+  for (auto &P : JumpTargets)
+    Output.write(reinterpret_cast<const char *>(&P.first), sizeof(P.first));
+
+  Output.close();
+  return !Output.fail();
+}
+
+std::string JumpTargetManager::executableSegmentsDigest() const {
+  MD5 Hasher;
+  for (auto &Segment : Binary.segments()) {
+    if (!Segment.IsExecutable)
+      continue;
+
+    uint64_t Range[2] = {
+      Segment.StartVirtualAddress,
+      Segment.EndVirtualAddress
+    };
+    Hasher.update(ArrayRef<uint8_t>(reinterpret_cast<uint8_t *>(Range),
+                                    sizeof(Range)));
+    Hasher.update(Segment.Data);
+  }
+
+  MD5::MD5Result Digest;
+  Hasher.final(Digest);
+  SmallString<32> Result;
+  MD5::stringifyResult(Digest, Result);
+  return Result.str();
+}
+
+bool JumpTargetManager::exportJumpTargets(std::string Path) const {
+  std::ofstream Output(Path, std::ios::trunc);
+  if (!Output)
+    return false;
+
+  // The harvest is complete if SET and OSRA have run until no new jump target
+  // could be found. A shard is complete only as far as its own code is
+  // concerned: revamb-distributed merges the shards into a complete file.
+  bool Complete = EnableOSRA
+    && !HarvestStopped
+    && !OSRASkipped;
+  const char *Completeness = " partial ";
+  if (Complete)
+    Completeness = Sharded ? " shard-complete " : " complete ";
+
+  Output << "revamb-jump-targets 0x" << std::hex << Binary.entryPoint()
+         << Completeness << executableSegmentsDigest() << "\n";
+
+  for (auto &P : JumpTargets)
+    Output << "jt 0x" << P.first << " 0x" << P.second.getReasons() << "\n";
+
+  for (auto &P : ResolvedJumps) {
+    Output << "jump 0x" << P.first
+           << (P.second.Approximate ? " approximate" : " exhaustive");
+    for (uint64_t Destination : P.second.Destinations)
+      Output << " 0x" << Destination;
+    Output << "\n";
+  }
+
+  Output.close();
+  return !Output.fail();
+}
+
+void JumpTargetManager::importJumpTargets(std::string Path) {
+  std::ifstream Input(Path);
+  if (!Input) {
+    dbg << "Couldn't open the jump targets " << Path << ", ignoring it\n";
+    return;
+  }
+
+  std::string Line;
+  std::getline(Input, Line);
+  std::istringstream Header(Line);
+  std::string Magic, Completeness, Digest;
+  uint64_t EntryPoint = 0;
+  Header >> Magic >> std::hex >> EntryPoint >> Completeness >> Digest;
+  if (Header.fail()
+      || Magic != "revamb-jump-targets"
+      || EntryPoint != Binary.entryPoint()
+      || Digest != executableSegmentsDigest()) {
+    dbg << Path << " doesn't contain the jump targets of this binary,"
+        << " ignoring it\n";
+    return;
+  }
+
+  // Parse the whole file before registering anything, a single malformed
+  // record makes us ignore all of it
+  const uint32_t KnownReasons = 2 * Seed - 1;
+  std::vector<std::pair<uint64_t, uint32_t>> Targets;
+  std::map<uint64_t, ResolvedJump> Jumps;
+  unsigned LineNumber = 1;
+  // A single shard is handled as a partial harvest
+  bool Valid = Completeness == "complete"
+    || Completeness == "shard-complete"
+    || Completeness == "partial";
+  while (Valid && std::getline(Input, Line)) {
+    LineNumber++;
+    std::istringstream Record(Line);
+    std::string Kind;
+    uint64_t PC = 0;
+    Record >> Kind >> std::hex >> PC;
+    Valid = !Record.fail();
+
+    if (Valid && Kind == "jt") {
+      uint32_t Reasons = 0;
+      Record >> Reasons;
+      Valid = !Record.fail()
+        && Reasons != 0
+        && (Reasons & ~KnownReasons) == 0
+        && isExecutableAddress(PC)
+        && isInstructionAligned(PC);
+      Targets.push_back({ PC, Reasons });
+    } else if (Valid && Kind == "jump") {
+      std::string Exhaustiveness;
+      ResolvedJump Jump;
+      Record >> Exhaustiveness;
+      Jump.Approximate = Exhaustiveness == "approximate";
+      Valid = Jump.Approximate || Exhaustiveness == "exhaustive";
+
+      uint64_t Destination;
+      while (Valid && Record >> Destination)
+        Jump.Destinations.push_back(Destination);
+      std::sort(Jump.Destinations.begin(), Jump.Destinations.end());
+
+      Valid = Valid
+        && Jump.Destinations.size() != 0
+        && Jumps.count(PC) == 0;
+      Jumps[PC] = std::move(Jump);
+    } else {
+      Valid = false;
+    }
+
+    // The record must span the whole line
+    Valid = Valid && Record.eof();
+  }
+
+  if (!Valid) {
+    dbg << Path << ":" << std::dec << LineNumber << ": malformed record,"
+        << " ignoring the jump targets\n";
+    return;
+  }
+
+  for (auto &P : Targets) {
     uint64_t PC = P.first;
-    BasicBlock *BB = P.second.head();
-    if (CurrentCFGForm == SemanticPreservingCFG || !hasPredecessors(BB))
-      DispatcherSwitch->addCase(ConstantInt::get(SwitchType, PC), BB);
+    uint32_t Reasons = P.second;
+
+    // Register with one of the original reasons, and then restore the others,
+    // the analyses rely on them
+    auto First = static_cast<JTReason>(Reasons & -Reasons);
+    notNull(registerJT(PC, First));
+    for (uint32_t Reason = First; Reason <= Seed; Reason <<= 1)
+      if (Reasons & Reason)
+        JumpTargets.at(PC).setReason(static_cast<JTReason>(Reason));
+  }
+
+  ResolvedJumps = std::move(Jumps);
+
+  if (Completeness == "complete")
+    ImportedJumpTargets = JumpTargets.size();
+
+  setCounter("import-jts.jump-targets", Targets.size());
+  setCounter("import-jts.jumps", ResolvedJumps.size());
+}
+
+/// Create branch weights proportional to \p Counts, scaled down to fit in 32
+/// bits and never zero, so that LLVM doesn't consider the edge impossible
+static MDNode *createWeights(MDBuilder &MDB, ArrayRef<uint64_t> Counts) {
+  uint64_t Max = *std::max_element(Counts.begin(), Counts.end());
+  uint64_t Scale = Max / std::numeric_limits<uint32_t>::max() + 1;
+
+  SmallVector<uint32_t, 8> Weights;
+  for (uint64_t Count : Counts)
+    Weights.push_back(static_cast<uint32_t>(Count / Scale) + 1);
+
+  return MDB.createBranchWeights(Weights);
+}
+
+void JumpTargetManager::applyProfile() {
+  if (Profile.empty())
+    return;
+
+  ScopedPhase Phase("profile");
+
+  DenseMap<BasicBlock *, uint64_t> HeadCounts;
+  for (auto &P : JumpTargets)
+    HeadCounts[P.second.head()] = executionCount(P.first);
+
+  // Branch weights: each successor of a branch takes the count of the jump
+  // target it leads to, looking through unconditional branches (e.g., the
+  // PTC labels preceding the jump)
+  const unsigned MaxForwardSteps = 8;
+  MDBuilder MDB(Context);
+  unsigned WeightedBranches = 0;
+  for (BasicBlock &BB : *TheFunction) {
+    TerminatorInst *T = BB.getTerminator();
+    if (T == nullptr
+        || T->getNumSuccessors() < 2
+        || !(isa<BranchInst>(T) || isa<SwitchInst>(T)))
+      continue;
+
+    SmallVector<uint64_t, 8> Counts;
+    bool Profiled = false;
+    for (BasicBlock *Successor : successors(&BB)) {
+      for (unsigned I = 0;
+           I < MaxForwardSteps && HeadCounts.count(Successor) == 0;
+           I++) {
+        auto *Branch = dyn_cast_or_null<BranchInst>(Successor->getTerminator());
+        if (Branch == nullptr || Branch->isConditional())
+          break;
+        Successor = Branch->getSuccessor(0);
+      }
+
+      auto It = HeadCounts.find(Successor);
+      uint64_t Count = It != HeadCounts.end() ? It->second : 0;
+      Profiled |= Count != 0;
+      Counts.push_back(Count);
+    }
+
+    if (Profiled) {
+      T->setMetadata(LLVMContext::MD_prof, createWeights(MDB, Counts));
+      WeightedBranches++;
+    }
+  }
+  setCounter("profile.weighted-branches", WeightedBranches);
+
+  // Layout: each basic block takes the count of the closest jump target
+  // preceding the first original instruction it contains or, if it doesn't
+  // contain any, of the previous block. The executed blocks are then moved, hottest
+  // first, right after the entry block, the others keep their order.
+  BasicBlock *Entry = &TheFunction->getEntryBlock();
+  BasicBlock *Sparse = DispatcherSwitch->getParent();
+  std::vector<std::pair<BasicBlock *, uint64_t>> HotBlocks;
+  uint64_t LastCount = 0;
+  for (BasicBlock &BB : *TheFunction) {
+    if (&BB == Entry || &BB == Sparse || !isTranslatedBB(&BB))
+      continue;
+
+    for (Instruction &I : BB) {
+      uint64_t PC = getPCFromNewPCCall(&I);
+      if (PC != 0) {
+        auto It = JumpTargets.upper_bound(PC);
+        if (It == JumpTargets.begin())
+          LastCount = 0;
+        else
+          LastCount = executionCount(std::prev(It)->first);
+        break;
+      }
+    }
 
+    if (LastCount != 0)
+      HotBlocks.push_back({ &BB, LastCount });
   }
+
+  std::stable_sort(HotBlocks.begin(),
+                   HotBlocks.end(),
+                   [] (const std::pair<BasicBlock *, uint64_t> &A,
+                       const std::pair<BasicBlock *, uint64_t> &B) {
+                     return A.second > B.second;
+                   });
+
+  BasicBlock *Previous = Entry;
+  for (auto &P : HotBlocks) {
+    P.first->moveAfter(Previous);
+    Previous = P.first;
+  }
+  setCounter("profile.hot-blocks", HotBlocks.size());
 }
 
 bool JumpTargetManager::hasPredecessors(BasicBlock *BB) const {
@@ -1263,6 +2546,116 @@ bool JumpTargetManager::hasPredecessors(BasicBlock *BB) const {
   return false;
 }
 
+/// \brief Simplify the instructions of \p BB within the boundaries of the
+///        basic block
+///
+/// This is a cheap, local, version of ConstantPropagation and EarlyCSE: it
+/// folds instructions and forwards stored (or already loaded) values to loads
+/// from allocas and global variables, forgetting everything at each store to
+/// other locations and at each call which might write memory.
+static void simplifyBlock(BasicBlock *BB, const DataLayout &DL) {
+  std::map<Value *, Value *> Available;
+
+  auto IsTracked = [] (Value *Pointer) {
+    return isa<AllocaInst>(Pointer) || isa<GlobalVariable>(Pointer);
+  };
+
+  for (auto It = BB->begin(); It != BB->end();) {
+    Instruction *I = &*It++;
+
+    if (auto *Store = dyn_cast<StoreInst>(I)) {
+      Value *Pointer = Store->getPointerOperand();
+      if (!IsTracked(Pointer) || Store->isVolatile())
+        Available.clear();
+      else
+        Available[Pointer] = Store->getValueOperand();
+    } else if (auto *Load = dyn_cast<LoadInst>(I)) {
+      Value *Pointer = Load->getPointerOperand();
+      if (!IsTracked(Pointer) || Load->isVolatile())
+        continue;
+
+      auto AvailableIt = Available.find(Pointer);
+      if (AvailableIt != Available.end()
+          && AvailableIt->second->getType() == Load->getType()) {
+        Load->replaceAllUsesWith(AvailableIt->second);
+        Load->eraseFromParent();
+      } else {
+        Available[Pointer] = Load;
+      }
+    } else if (I->mayWriteToMemory()) {
+      Available.clear();
+    } else if (Value *Simplified = SimplifyInstruction(I, DL)) {
+      I->replaceAllUsesWith(Simplified);
+      if (isInstructionTriviallyDead(I))
+        I->eraseFromParent();
+    }
+  }
+
+  // Drop the instructions we made useless
+  for (auto It = BB->begin(); It != BB->end();) {
+    Instruction *I = &*It++;
+    if (isInstructionTriviallyDead(I))
+      I->eraseFromParent();
+  }
+}
+
+void JumpTargetManager::harvestOptimizations() {
+  ScopedPhase Phase("harvest.optimizations");
+
+  if (IncrementalHarvest) {
+    // Collect the basic blocks that changed since the last round and their
+    // predecessors
+    std::set<BasicBlock *> Dirty;
+    unsigned Total = 0;
+    for (BasicBlock &BB : *TheFunction) {
+      Total++;
+      if (Visited.count(&BB) == 0) {
+        Dirty.insert(&BB);
+        for (BasicBlock *Predecessor : predecessors(&BB))
+          Dirty.insert(Predecessor);
+      }
+    }
+
+    // If most of the function changed, the global passes are more effective
+    if (Dirty.size() * 4 < Total) {
+      DBG("jtcount", dbg << "Incremental harvest on " << std::dec
+          << Dirty.size() << " basic blocks out of " << Total << "\n");
+      incrementCounter("harvest.incremental-blocks", Dirty.size());
+
+      const DataLayout &DL = TheModule.getDataLayout();
+      for (BasicBlock &BB : *TheFunction)
+        if (Dirty.count(&BB) != 0)
+          simplifyBlock(&BB, DL);
+
+      return;
+    }
+  }
+
+  legacy::PassManager OptimizingPM;
+  OptimizingPM.add(createSROAPass());
+  OptimizingPM.add(createConstantPropagationPass());
+  OptimizingPM.add(createEarlyCSEPass());
+  OptimizingPM.run(TheModule);
+}
+
+bool JumpTargetManager::harvestDeadlinePassed() {
+  if (HarvestStopped)
+    return true;
+
+  if (!HarvestDeadline.hasValue()
+      || std::chrono::steady_clock::now() < *HarvestDeadline)
+    return false;
+
+  HarvestStopped = true;
+  dbg << "The time budget is running out, no more jump targets will be "
+      << "searched\n";
+  setCounter("time-budget.exhausted", 1);
+  setCounter("time-budget.harvest-rounds", getCounter("harvest.rounds"));
+  setCounter("time-budget.osra-rounds", getCounter("harvest.osra-rounds"));
+  setCounter("time-budget.jump-targets", JumpTargets.size());
+  return true;
+}
+
 // Harvesting proceeds trying to avoid to run expensive analyses if not strictly
 // necessary, OSRA in particular. To do this we keep in mind two aspects: do we
 // have new basic blocks to visit? If so, we avoid any further anyalysis and
@@ -1271,6 +2664,23 @@ bool JumpTargetManager::hasPredecessors(BasicBlock *BB) const {
 // block to translate we proceed as long as we are able to create new edges on
 // the CFG (not considering the dispatcher).
 void JumpTargetManager::harvest() {
+  // Register landing pads, if available, parsing .eh_frame only now. Go back
+  // to translation if they lead to new code.
+  // TODO: should register them in UnusedCodePointers?
+  if (empty() && LandingPadsPending) {
+    LandingPadsPending = false;
+    for (uint64_t LandingPad : Binary.landingPads())
+      registerJT(LandingPad, GlobalData);
+
+    if (!empty())
+      return;
+  }
+
+  // Once the time budget is almost over, just translate what has already been
+  // found
+  if (empty() && harvestDeadlinePassed())
+    return;
+
   if (empty()) {
     // TODO: move me to a commit function
     // Update the third argument of newpc calls (isJT, i.e., is this instruction
@@ -1294,22 +2704,28 @@ void JumpTargetManager::harvest() {
     DBG("verify", if (verifyModule(TheModule, &dbgs())) { abort(); });
 
     DBG("jtcount", dbg << "Harvesting: SROA, ConstProp, EarlyCSE and SET\n");
+    incrementCounter("harvest.rounds");
 
-    legacy::PassManager OptimizingPM;
-    OptimizingPM.add(createSROAPass());
-    OptimizingPM.add(createConstantPropagationPass());
-    OptimizingPM.add(createEarlyCSEPass());
-    OptimizingPM.run(TheModule);
+    harvestOptimizations();
+
+    if (PreHarvestPath.size() != 0)
+      writePreHarvest();
 
     // To improve the quality of our analysis, keep in the CFG only the edges we
     // where able to recover (e.g., no jumps to the dispatcher)
     setCFGForm(RecoveredOnlyCFG);
 
     NewBranches = 0;
-    legacy::PassManager AnalysisPM;
-    AnalysisPM.add(new SETPass(this, false, &Visited));
-    AnalysisPM.add(new TranslateDirectBranchesPass(this));
-    AnalysisPM.run(TheModule);
+    {
+      ScopedPhase Phase("harvest.set");
+      legacy::PassManager AnalysisPM;
+      AnalysisPM.add(new SETPass(this, false, &Visited));
+      AnalysisPM.add(new TranslateDirectBranchesPass(this));
+      AnalysisPM.run(TheModule);
+
+      if (MemoryReportEnabled)
+        recordMemoryUsage();
+    }
 
     // Restore the CFG
     setCFGForm(SemanticPreservingCFG);
@@ -1319,7 +2735,37 @@ void JumpTargetManager::harvest() {
                        << NewBranches << " new branches were found\n");
   }
 
-  if (EnableOSRA && empty()) {
+  // The imported jump targets include everything SET and OSRA found in the
+  // previous run: if nothing new turned up, its indirect jumps can be pinned
+  // directly to the same destinations
+  if (EnableOSRA
+      && empty()
+      && ImportedJumpTargets != 0
+      && JumpTargets.size() == ImportedJumpTargets) {
+    incrementCounter("import-jts.osra-skipped");
+    NoReturn.registerSyscalls(TheFunction);
+
+    setCFGForm(RecoveredOnlyCFG);
+    pinImportedJumps();
+
+    // OSRA would have run FunctionCallIdentification, the function_call
+    // markers are required by the function boundaries detection,
+    // --shadow-stack and --isolate-functions
+    {
+      legacy::PassManager AnalysisPM;
+      AnalysisPM.add(new FunctionCallIdentification());
+      AnalysisPM.run(TheModule);
+    }
+    setCFGForm(SemanticPreservingCFG);
+
+    // Only once, everything is translated from now on
+    ImportedJumpTargets = 0;
+  } else if (EnableOSRA && empty() && memoryLimitReached()) {
+    // Past the memory limit, go on with SET alone: OSRA is by far the most
+    // memory hungry analysis
+    OSRASkipped = true;
+    incrementCounter("memory.osra-skipped");
+  } else if (EnableOSRA && empty() && !harvestDeadlinePassed()) {
     DBG("verify", if (verifyModule(TheModule, &dbgs())) { abort(); });
 
     NoReturn.registerSyscalls(TheFunction);
@@ -1331,24 +2777,31 @@ void JumpTargetManager::harvest() {
               << (NewBranches > 0 ? "SROA, ConstProp, EarlyCSE, " : "")
               << "SET + OSRA\n");
 
-      // TODO: decide what to do with Visited
+      incrementCounter("harvest.rounds");
+      incrementCounter("harvest.osra-rounds");
+
+      // OSRA might improve the results on any basic block, the memoized ones
+      // are reused only if they didn't depend on OSRA (see SETCache)
       Visited.clear();
-      legacy::PassManager PM;
-      if (NewBranches > 0) {
-        legacy::PassManager OptimizingPM;
-        OptimizingPM.add(createSROAPass());
-        OptimizingPM.add(createConstantPropagationPass());
-        OptimizingPM.add(createEarlyCSEPass());
-        OptimizingPM.run(TheModule);
-      }
+      if (NewBranches > 0)
+        harvestOptimizations();
 
       setCFGForm(RecoveredOnlyCFG);
 
       NewBranches = 0;
-      legacy::PassManager AnalysisPM;
-      AnalysisPM.add(new SETPass(this, true, &Visited));
-      AnalysisPM.add(new TranslateDirectBranchesPass(this));
-      AnalysisPM.run(TheModule);
+      {
+        ScopedPhase Phase("harvest.set-osra");
+        legacy::PassManager AnalysisPM;
+        // SETPass will use this instance instead of creating a full one
+        if (SlicedOSRA)
+          AnalysisPM.add(new OSRAPass(PCReg));
+        AnalysisPM.add(new SETPass(this, true, &Visited, &SETResults));
+        AnalysisPM.add(new TranslateDirectBranchesPass(this));
+        AnalysisPM.run(TheModule);
+
+        if (MemoryReportEnabled)
+          recordMemoryUsage();
+      }
 
       // Restore the CFG
       setCFGForm(SemanticPreservingCFG);
@@ -1357,7 +2810,10 @@ void JumpTargetManager::harvest() {
                          << Unexplored.size() << " new jump targets and "
                          << NewBranches << " new branches were found\n");
 
-    } while (empty() && NewBranches > 0);
+    } while (empty()
+             && NewBranches > 0
+             && !memoryLimitReached()
+             && !harvestDeadlinePassed());
   }
 
   if (empty()) {
@@ -6,23 +6,31 @@
 //
 
 // Standard includes
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <map>
 #include <set>
+#include <tuple>
 #include <vector>
 #include <boost/icl/interval_set.hpp>
-#include <boost/icl/interval_map.hpp>
 #include <boost/type_traits/is_same.hpp>
 
 // LLVM includes
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 
 // Local includes
 #include "binaryfile.h"
 #include "datastructures.h"
 #include "ir-helpers.h"
 #include "noreturnanalysis.h"
+#include "pcindex.h"
 #include "revamb.h"
+#include "set.h"
 
 // Forward declarations
 namespace llvm {
@@ -123,6 +131,7 @@ public:
                            ///  by SET. Likely a function pointer.
     Callee = 128, ///< This JT is the target of a call instruction.
     SumJump = 256, ///< Obtained from the "sumjump" heuristic
+    Seed = 512, ///< Provided by the user (see loadSeeds)
   };
 
   class JumpTarget {
@@ -159,6 +168,8 @@ public:
         SS << " Callee";
       if (hasReason(SumJump))
         SS << " SumJump";
+      if (hasReason(Seed))
+        SS << " Seed";
 
       return SS.str();
     }
@@ -187,16 +198,48 @@ public:
 
 public:
   using RangesVector = std::vector<std::pair<uint64_t, uint64_t>>;
+  /// \brief Jump targets sorted by PC, the order in which they are iterated
+  ///
+  /// This is a std::map, and not a sorted vector or a DenseMap, because:
+  ///
+  /// * registerJT inserts the jump targets one at a time, interleaved with
+  ///   the lookups of newPC and registerJT itself, for the whole translation.
+  ///   Keeping a vector sorted would make each insertion linear, and the
+  ///   harvesting rounds register new jump targets in the middle of the
+  ///   existing ones.
+  /// * writeJumpTargets, exportJumpTargets, the artifact, the function
+  ///   boundaries detection and the function isolation walk it in PC order,
+  ///   and applyProfile looks for the jump target preceding a PC through
+  ///   upper_bound. A DenseMap would have to be copied and sorted for each of
+  ///   them.
+  using BlockMap = std::map<uint64_t, JumpTarget>;
 
   /// \param TheFunction the translated function.
   /// \param PCReg the global variable representing the program counter.
   /// \param Binary reference to the information about a given binary, such as
   ///        segments and symbols.
   /// \param EnableOSRA whether OSRA is enabled or not.
+  /// \param SplitInPlace whether jump targets landing in the middle of already
+  ///        translated code should be handled, when possible, splitting the
+  ///        containing basic block instead of translating the code again.
+  /// \param IncrementalHarvest whether harvesting should only optimize the
+  ///        code changed since the previous round, see harvestOptimizations.
+  /// \param SETDepth maximum number of basic blocks SET goes backward looking
+  ///        for the stores to a variable.
+  /// \param SlicedOSRA whether OSRA should only analyze the code affecting the
+  ///        stores to the PC.
+  ///
+  /// If \p TheFunction already contains a dispatcher, i.e., it comes from a
+  /// module saved with dumpPreHarvest, the manager adopts it and rebuilds the
+  /// jump targets and the instruction addresses from the IR.
   JumpTargetManager(llvm::Function *TheFunction,
                     llvm::Value *PCReg,
                     const BinaryFile &Binary,
-                    bool EnableOSRA);
+                    bool EnableOSRA,
+                    bool SplitInPlace = false,
+                    bool IncrementalHarvest = false,
+                    unsigned SETDepth = 3,
+                    bool SlicedOSRA = false);
 
   /// \brief Transform the IR to represent the request form of CFG
   void setCFGForm(CFGForm NewForm);
@@ -204,6 +247,9 @@ public:
   CFGForm cfgForm() const { return CurrentCFGForm; }
 
   /// \brief Collect jump targets from the program's segments
+  ///
+  /// The landing pads are registered later, by the first harvest() with
+  /// nothing left to translate, so that .eh_frame is parsed only then.
   void harvestGlobalData();
 
   /// Handle a new program counter. We might already have a basic block for that
@@ -224,7 +270,13 @@ public:
   void registerInstruction(uint64_t PC, llvm::Instruction *Instruction);
 
   /// \brief Translate the non-constant jumps into jumps to the dispatcher
-  void translateIndirectJumps();
+  ///
+  /// \param InlineCacheTrace path to an execution trace produced by a
+  ///        translated program linked against the tracing support module. If
+  ///        not empty, each indirect jump checks first the targets it has
+  ///        jumped to most often in the trace (an inline cache), and only
+  ///        then falls back to the dispatcher.
+  void translateIndirectJumps(std::string InlineCacheTrace = "");
 
   /// \brief Return the most recent instruction writing the program counter
   ///
@@ -255,14 +307,111 @@ public:
   /// \brief Return true if no unexplored jump targets are available
   bool empty() { return Unexplored.empty(); }
 
+  /// \brief Return the PCs in the worklist which will be popped first by peek
+  ///
+  /// \param Count the maximum number of PCs to return.
+  std::vector<uint64_t> nextUnexplored(unsigned Count) const;
+
+  /// \brief Load the execution counts of the original program counters
+  ///
+  /// Once a profile is loaded, peek returns the most executed jump targets
+  /// first and applyProfile can annotate the generated code.
+  ///
+  /// \param ProfilePath path to an execution trace produced by a translated
+  ///        program linked against the tracing support module.
+  void loadProfile(std::string ProfilePath);
+
+  /// \brief Stop looking for new jump targets at \p Deadline
+  ///
+  /// Past the deadline, harvest doesn't run SET and OSRA anymore, so the
+  /// translation ends once the jump targets already registered have been
+  /// translated. The reason why the harvesting stopped is recorded in the
+  /// `time-budget.*` counters.
+  void setHarvestDeadline(std::chrono::steady_clock::time_point Deadline) {
+    HarvestDeadline = Deadline;
+  }
+
+  /// \brief Save the module to \p Path the first time SET is about to run
+  ///
+  /// The bitcode is written after the cleanup optimizations of the first
+  /// harvest, in the SemanticPreservingCFG form. The path of the input binary
+  /// is recorded in the `revamb.pre-harvest` named metadata, so that the
+  /// analysis passes can be run again on it in isolation (see
+  /// `revamb-analysis-bench`).
+  void dumpPreHarvest(std::string Path) { PreHarvestPath = Path; }
+
+  /// \brief Register as jump targets the PCs listed in \p SeedsPath
+  ///
+  /// \param SeedsPath path to a sequence of PCs as 64-bit integers in the host
+  ///        endianess, the format of the execution traces and of
+  ///        writeJumpTargets.
+  void loadSeeds(std::string SeedsPath);
+
+  /// \brief Only translate the jump targets in the \p Index-th of \p Count
+  ///        shards of the executable ranges
+  ///
+  /// The executable ranges are split in \p Count contiguous shards of about
+  /// the same size. The jump targets outside the shard are still registered,
+  /// but peek never returns them: their basic block is terminated by an
+  /// `unreachable`, they are left to the process translating their shard.
+  void setShard(unsigned Index, unsigned Count);
+
+  /// \brief Write the PCs of all the registered jump targets to \p Path, in
+  ///        the format of loadSeeds
+  ///
+  /// \return false in case of error.
+  bool writeJumpTargets(std::string Path) const;
+
+  /// \brief Write all the registered jump targets, with their reasons, and the
+  ///        destinations of the indirect jumps resolved by SET to \p Path
+  ///
+  /// The output is a text file, one record per line: a header with the entry
+  /// point of the binary, whether the harvest has been complete and a digest
+  /// of the executable segments (see executableSegmentsDigest), a `jt`
+  /// line for each jump target (PC and JTReason mask) and a `jump` line for
+  /// each resolved indirect jump (PC of the jump, whether the destinations
+  /// are `exhaustive` or `approximate` and the PCs of the destinations). See
+  /// importJumpTargets.
+  ///
+  /// \return false in case of error.
+  bool exportJumpTargets(std::string Path) const;
+
+  /// \brief Register the jump targets listed in a file written by
+  ///        exportJumpTargets, with their original reasons
+  ///
+  /// If the file has been produced by a complete harvest and the first
+  /// harvest round doesn't find any new jump target, the SET + OSRA rounds are
+  /// skipped and the imported indirect jumps are pinned to their destinations
+  /// instead. A missing file or a file produced for another binary (or for
+  /// another version of it) are ignored, so that the same path can be used
+  /// both for import and export. A file containing a malformed record is
+  /// ignored as a whole.
+  void importJumpTargets(std::string Path);
+
+  /// \brief Record that SET found \p Destinations for the jump at \p PC
+  ///
+  /// The destinations are added to those already known for the same jump,
+  /// which is considered approximate if any of the results was.
+  void recordResolvedJump(uint64_t PC,
+                          bool Approximate,
+                          const std::vector<uint64_t> &Destinations);
+
+  /// \brief Use the loaded profile to attach branch weights to the dispatcher
+  ///        and to the branches between jump targets, and to move the hot
+  ///        basic blocks next to each other at the beginning of the function
+  void applyProfile();
+
+  /// \brief Return how many times \p PC has been executed according to the
+  ///        loaded profile
+  uint64_t executionCount(uint64_t PC) const {
+    auto It = Profile.find(PC);
+    return It == Profile.end() ? 0 : It->second;
+  }
+
   /// \brief Return true if the whole [\p Start,\p End) range is in an
   ///        executable segment
   bool isExecutableRange(uint64_t Start, uint64_t End) const {
-    for (std::pair<uint64_t, uint64_t> Range : ExecutableRanges)
-      if (Range.first <= Start && Start < Range.second
-          && Range.first <= End && End < Range.second)
-        return true;
-    return false;
+    return Binary.isExecutableRange(Start, End);
   }
 
   /// \brief Return true if the given PC respects the input architecture's
@@ -296,10 +445,7 @@ public:
 
   /// \brief Return true if \p PC is in an executable segment
   bool isExecutableAddress(uint64_t PC) const {
-    for (std::pair<uint64_t, uint64_t> Range : ExecutableRanges)
-      if (Range.first <= PC && PC < Range.second)
-        return true;
-    return false;
+    return Binary.isExecutableAddress(PC);
   }
 
   /// \brief Get the basic block associated to the original address \p PC
@@ -322,11 +468,15 @@ public:
   ///         valid or another error occurred.
   llvm::BasicBlock *registerJT(uint64_t PC, JTReason Reason);
 
-  std::map<uint64_t, JumpTarget>::const_iterator begin() const {
+  /// \brief Iterate over all the jump targets, sorted by PC
+  ///
+  /// The iteration order is part of the interface: analyses such as function
+  /// boundaries detection rely on it to produce a deterministic output.
+  BlockMap::const_iterator begin() const {
     return JumpTargets.begin();
   }
 
-  std::map<uint64_t, JumpTarget>::const_iterator end() const {
+  BlockMap::const_iterator end() const {
     return JumpTargets.end();
   }
 
@@ -342,6 +492,13 @@ public:
   /// \brief Removes a `BasicBlock` from the SET's visited list
   void unvisit(llvm::BasicBlock *BB);
 
+  /// \brief Record, through recordContainerSize, the size of the main
+  ///        containers of this object and of the module being translated
+  ///
+  /// The size of the module is an estimate computed going through all of its
+  /// instructions, call this only if MemoryReportEnabled is true.
+  void recordMemoryUsage() const;
+
   /// \brief Checks if \p BB is a basic block generated during translation
   bool isTranslatedBB(llvm::BasicBlock *BB) const {
     return BB != anyPC()
@@ -367,18 +524,30 @@ public:
 
   bool isPCReg(llvm::Value *TheValue) const { return TheValue == PCReg; }
 
+  /// \brief Return the maximum depth, in basic blocks, of the SET exploration
+  unsigned maxSETDepth() const { return SETDepth; }
+
   llvm::Value *pcReg() const { return PCReg; }
 
-  // TODO: can this be replaced by the corresponding method in
-  // GeneratedCodeBasicInfo?
-  /// \brief Get the PC associated to \p TheInstruction and the next one
+  /// \brief Get the PC associated to \p TheInstruction and the size of the
+  ///        instruction
   ///
   /// \return a pair containing the PC associated to \p TheInstruction and the
-  ///         next one.
+  ///         size of the input instruction, see PCIndex::getPC.
   std::pair<uint64_t, uint64_t> getPC(llvm::Instruction *TheInstruction) const;
 
-  // TODO: can this be replaced by the corresponding method in
-  // GeneratedCodeBasicInfo?
+  /// \brief Record that the beginning of \p BB, created while translating the
+  ///        instruction at \p PC, belongs to it
+  void registerBlockPC(llvm::BasicBlock *BB, uint64_t PC, uint64_t Size) {
+    PCs.setBlockPC(BB, PC, Size);
+  }
+
+  /// \brief Return the instruction the beginning of \p BB belongs to, if it
+  ///        has been registered with registerBlockPC
+  llvm::Optional<PCIndex::PCAndSize> blockPC(llvm::BasicBlock *BB) const {
+    return PCs.blockPC(BB);
+  }
+
   uint64_t getNextPC(llvm::Instruction *TheInstruction) const {
     auto Pair = getPC(TheInstruction);
     return Pair.first + Pair.second;
@@ -426,7 +595,14 @@ public:
   /// their proper behavior.
   void finalizeJumpTargets() {
     unsigned ReadSize = Binary.architecture().pointerSize() / 8;
-    for (uint64_t MemoryAddress : UnusedCodePointers) {
+
+    // Register the new jump targets in address order, so that the output
+    // doesn't depend on the layout of the hash table
+    std::vector<uint64_t> SortedCodePointers(UnusedCodePointers.begin(),
+                                             UnusedCodePointers.end());
+    std::sort(SortedCodePointers.begin(), SortedCodePointers.end());
+
+    for (uint64_t MemoryAddress : SortedCodePointers) {
       // Read using the original endianess, we want the correct address
       uint64_t PC = readRawValue(MemoryAddress,
                                  ReadSize,
@@ -469,6 +645,49 @@ public:
 
   NoReturnAnalysis &noReturn() { return NoReturn; }
 
+  /// \brief Record counters about the jump targets and the dispatcher
+  void collectStatistics() const;
+
+  /// \brief Dispatch dense areas of jump targets through a table
+  ///
+  /// The jump targets are grouped in pages of DispatcherPageSize possible
+  /// (aligned) PCs. Pages containing at least DispatcherMinPageJTs jump
+  /// targets are dispatched through a table of `blockaddress`es and an
+  /// `indirectbr`, all the others stay in the dispatcher switch, which is
+  /// moved in a new basic block ("dispatcher.sparse").
+  ///
+  /// \note This has to be the last transformation performed on the
+  ///       dispatcher, all the analyses expect the switch.
+  void createDispatcherTable();
+
+  /// \brief Return directly to the caller through a shadow stack
+  ///
+  /// Each call identified by FunctionCallIdentification pushes on a circular
+  /// stack of ShadowStackSize entries the return address and the
+  /// `blockaddress` of its jump target. All the other jumps to anyPC from the
+  /// translated code go to a new basic block ("shadow_stack.check") comparing
+  /// the PC with the top of the stack: on a match, the entry is popped and the
+  /// execution proceeds through an `indirectbr`, otherwise it goes to anyPC.
+  /// Since the entry always points to the translation of the PC it records,
+  /// a stale or overwritten entry never leads to the wrong code.
+  ///
+  /// \note The `function_call` markers must still be in place.
+  void createShadowStack();
+
+  /// \brief Emit a table associating the translation of each jump target to
+  ///        its PC
+  ///
+  /// `revamb_address_map` is an array of `revamb_address_map_size` pairs
+  /// composed by the `blockaddress` of a jump target and its PC, in no
+  /// particular order. The empty `revamb_address_map_end` function, emitted
+  /// right after the translated code, marks its end. Once the module has been
+  /// compiled, it allows the support module to map a host PC back to the
+  /// jump target containing it (e.g., to profile the input program).
+  ///
+  /// \note The map has no entry for the instructions which are not jump
+  ///       targets.
+  void createAddressMap();
+
   /// \brief Return a proper name for the given address, possibly using symbols
   ///
   /// \param Address the address for which a name should be produced.
@@ -505,28 +724,71 @@ private:
     I->eraseFromParent();
   }
 
+  /// \brief Collect \p Start and all the descendants, stopping when a JT is
+  ///        met
+  std::set<llvm::BasicBlock *> collectTranslation(llvm::BasicBlock *Start);
+
   /// \brief Drop \p Start and all the descendants, stopping when a JT is met
   void purgeTranslation(llvm::BasicBlock *Start);
 
+  /// \brief Check if the code starting from \p I can become a jump target
+  ///        without being translated again
+  ///
+  /// This is possible if the translation is complete and none of the
+  /// instructions following \p I uses a value computed by an instruction
+  /// preceding it, except for those in the entry block (i.e., the variables).
+  bool canSplitInPlace(llvm::Instruction *I);
+
   /// \brief Check if \p BB has at least a predecessor, excluding the dispatcher
   bool hasPredecessors(llvm::BasicBlock *BB) const;
 
-  /// \brief Rebuild the dispatcher switch
-  ///
-  /// Depending on the CFG form we're currently adopting the dispatcher might go
-  /// to all the jump targets or only to those who have no other predecessor.
-  void rebuildDispatcher();
+  /// \brief Add the jump target at \p PC, whose basic block is \p BB, to
+  ///        Unexplored
+  void pushUnexplored(uint64_t PC, llvm::BasicBlock *BB) {
+    UnexploredOrder[PC] = UnexploredCount;
+    Unexplored.insert({ executionCount(PC), UnexploredCount, { PC, BB } });
+    UnexploredCount++;
+  }
 
-  /// \brief Populate the interval -> Symbol map from Binary.Symbols
-  void initializeSymbolMap();
+  /// \brief Detach from the dispatcher the jump targets with predecessors
+  ///
+  /// In the RecoveredOnlyCFG and NoFunctionCallsCFG forms the dispatcher goes
+  /// only to the jump targets with no other predecessor. Instead of rebuilding
+  /// the switch, the cases of the other jump targets are temporarily redirected
+  /// to the default destination, so that switching form costs a single pass
+  /// over the cases and preserves their order.
+  void parkDispatcherCases();
+
+  /// \brief Undo parkDispatcherCases, going back to all the jump targets
+  void restoreDispatcherCases();
+
+  /// \brief Build the sorted symbol index from Binary.Symbols, called by the
+  ///        first nameForAddress
+  void initializeSymbolIndex() const;
+
+  /// \brief Collect from \p TracePath the most frequent targets of each of
+  ///        the indirect jumps in \p Sites
+  ///
+  /// \return a map associating to each site (the PC of the instruction
+  ///         performing the jump) its most frequent targets, the most frequent
+  ///         first.
+  std::map<uint64_t, std::vector<uint64_t>>
+  collectInlineCacheTargets(std::string TracePath,
+                            const std::set<uint64_t> &Sites) const;
 
-  // TODO: instead of a gigantic switch case we could map the original memory
-  //       area and write the address of the translated basic block at the jump
-  //       target
   void createDispatcher(llvm::Function *OutputFunction,
                         llvm::Value *SwitchOnPtr,
                         bool JumpDirectly);
 
+  /// \brief Use the dispatcher already present in TheFunction, if any
+  ///
+  /// \return true if a dispatcher has been found.
+  bool adoptDispatcher();
+
+  /// \brief Write the module to PreHarvestPath, then forget it, aborting if
+  ///        the file can't be written
+  void writePreHarvest();
+
   template<typename value_type, unsigned endian>
   void findCodePointers(uint64_t StartVirtualAddress,
                         const unsigned char *Start,
@@ -534,11 +796,36 @@ private:
 
   void harvest();
 
+  /// \brief Pin the indirect jumps to the destinations read by
+  ///        importJumpTargets, unless they're already pinned to as many
+  void pinImportedJumps();
+
+  /// \brief Return the MD5 of the addresses and of the contents of the
+  ///        executable segments, in hexadecimal
+  std::string executableSegmentsDigest() const;
+
+  /// \brief Check if the deadline for harvesting has passed, recording the
+  ///        state of the translation the first time it happens
+  bool harvestDeadlinePassed();
+
+  /// \brief Check if \p PC belongs to the shard set with setShard
+  bool inShard(uint64_t PC) const;
+
+  /// \brief Run the cleanup optimizations preceeding SET
+  ///
+  /// If incremental harvesting is enabled and only a small portion of the
+  /// function has changed since the last round (i.e., it's not Visited), only
+  /// the changed basic blocks and their predecessors are simplified through a
+  /// block-local constant folding and store-to-load forwarding. Otherwise,
+  /// SROA, ConstantPropagation and EarlyCSE are run on the whole module.
+  void harvestOptimizations();
+
   void handleSumJump(llvm::Instruction *SumJump);
 
 private:
-  using BlockMap = std::map<uint64_t, JumpTarget>;
-  using InstructionMap = std::map<uint64_t, llvm::Instruction *>;
+  // Only JumpTargets is iterated in an order that can affect the output, all
+  // the other containers are either never iterated or sorted before.
+  using InstructionMap = llvm::DenseMap<uint64_t, llvm::Instruction *>;
 
   llvm::Module &TheModule;
   llvm::LLVMContext &Context;
@@ -548,32 +835,98 @@ private:
   InstructionMap OriginalInstructionAddresses;
   /// Holds the association between a PC and a BasicBlock.
   BlockMap JumpTargets;
-  /// Queue of program counters we still have to translate.
-  std::vector<BlockWithAddress> Unexplored;
+  /// \brief A jump target still to translate
+  ///
+  /// The most executed jump target goes first, on ties (e.g., if no profile
+  /// has been loaded) the most recently registered one.
+  struct UnexploredJT {
+    uint64_t ExecutionCount;
+    uint64_t Order;
+    BlockWithAddress Target;
+
+    bool operator<(const UnexploredJT &Other) const {
+      return std::tie(ExecutionCount, Order)
+        > std::tie(Other.ExecutionCount, Other.Order);
+    }
+  };
+  /// Program counters we still have to translate, in the order peek returns
+  /// them.
+  std::set<UnexploredJT> Unexplored;
+  /// Order of the jump targets in Unexplored, by PC.
+  llvm::DenseMap<uint64_t, uint64_t> UnexploredOrder;
+  /// Number of jump targets ever added to Unexplored.
+  uint64_t UnexploredCount = 0;
   llvm::Value *PCReg;
   llvm::Function *ExitTB;
-  RangesVector ExecutableRanges;
   llvm::BasicBlock *Dispatcher;
   llvm::SwitchInst *DispatcherSwitch;
   llvm::BasicBlock *DispatcherFail;
   llvm::BasicBlock *AnyPC;
   llvm::BasicBlock *UnexpectedPC;
-  std::set<llvm::BasicBlock *> Visited;
+  llvm::SmallPtrSet<llvm::BasicBlock *, 16> Visited;
 
   const BinaryFile &Binary;
 
   bool EnableOSRA;
+  bool SplitInPlace;
+  bool IncrementalHarvest;
+  unsigned SETDepth;
+  bool SlicedOSRA;
+  SETCache SETResults;
 
   unsigned NewBranches = 0;
 
-  std::set<uint64_t> UnusedCodePointers;
+  /// Code pointers found in global data and not read by SET yet, they are
+  /// sorted before being registered in finalizeJumpTargets.
+  llvm::DenseSet<uint64_t> UnusedCodePointers;
   interval_set ReadIntervalSet;
   NoReturnAnalysis NoReturn;
-  using SymbolInfoSet = std::set<const SymbolInfo *>;
-  boost::icl::interval_map<uint64_t, SymbolInfoSet> SymbolMap;
+  /// Symbols usable to name addresses, sorted by start address and, for the
+  /// same start, by decreasing end address.
+  mutable std::vector<const SymbolInfo *> SymbolsByStart;
+  /// For each entry of SymbolsByStart, the index of the closest previous
+  /// symbol still covering its start address, if any.
+  mutable std::vector<unsigned> EnclosingSymbol;
+  /// The symbols of SymbolsByStart, sorted by end and then by start address.
+  mutable std::vector<const SymbolInfo *> SymbolsByEnd;
+  mutable bool SymbolIndexReady = false;
+  /// harvestGlobalData has been called, the landing pads still have to be
+  /// registered.
+  bool LandingPadsPending = false;
 
   CFGForm CurrentCFGForm;
-  std::set<llvm::BasicBlock *> ToPurge;
+  /// Index and original destination of the dispatcher cases redirected by
+  /// parkDispatcherCases.
+  std::vector<std::pair<unsigned, llvm::BasicBlock *>> ParkedCases;
+  /// Partial translations to drop, in the order they have been registered.
+  llvm::SmallSetVector<llvm::BasicBlock *, 16> ToPurge;
+  /// Number of times each PC appears in the execution trace passed to
+  /// loadProfile.
+  llvm::DenseMap<uint64_t, uint64_t> Profile;
+  /// If set, the time after which harvest stops looking for jump targets.
+  llvm::Optional<std::chrono::steady_clock::time_point> HarvestDeadline;
+  bool HarvestStopped = false;
+  /// OSRA has been skipped at least once because of the memory limit.
+  bool OSRASkipped = false;
+  /// If not empty, where the module should be saved before the first SET run.
+  std::string PreHarvestPath;
+  /// Input instruction of the basic blocks not starting with a newpc call
+  PCIndex PCs;
+  /// If Sharded, the sorted ranges of addresses whose jump targets should be
+  /// translated.
+  std::vector<std::pair<uint64_t, uint64_t>> ShardRanges;
+  bool Sharded = false;
+
+  struct ResolvedJump {
+    bool Approximate;
+    std::vector<uint64_t> Destinations;
+  };
+  /// Destinations of the indirect jumps found by SET or imported, by PC of the
+  /// jump instruction.
+  std::map<uint64_t, ResolvedJump> ResolvedJumps;
+  /// Number of jump targets after importJumpTargets, 0 if nothing has been
+  /// imported or the imported harvest wasn't complete.
+  size_t ImportedJumpTargets = 0;
 };
 
 template<>
@@ -9,6 +9,8 @@
 // Standard includes
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <map>
 #include <memory>
 #include <fstream>
 #include <iostream>
@@ -19,7 +21,11 @@
 extern "C"
 {
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 }
 
@@ -33,10 +39,14 @@ extern "C"
 #include "binaryfile.h"
 #include "codegenerator.h"
 #include "debug.h"
+#include "osra.h"
 #include "ptcinterface.h"
+#include "reachingdefinitions.h"
 #include "revamb.h"
+#include "statistics.h"
 
 PTCInterface ptc = {}; ///< The interface with the PTC library.
+std::mutex PTCLock; ///< Lock for the global state of the PTC library.
 static std::string LibTinycodePath;
 static std::string LibHelpersPath;
 
@@ -53,15 +63,75 @@ struct ProgramParameters {
   bool NoOSRA;               // 是否使用OSRA编译器
   bool UseSections;          // 是否使用段
   bool DetectFunctionsBoundaries;  // 是否检测函数边界
+  bool IsolateFunctions;     // 是否将每个函数放到单独的 LLVM 函数中
+  bool ShadowStack;          // 是否用影子栈直接返回到调用者
+  bool AddressMap;           // 是否生成从翻译后代码到原始 PC 的映射表
+  bool GuestThreads;         // 是否支持在多个宿主线程上运行输入程序的线程
   bool NoLink;               // 是否取消链接
   bool External;             // 是否为外部文件
+  int LiftJobs;              // 预先翻译 PTC 的线程数
+  const char *PTCCachePath;  // PTC 缓存目录
+  bool PTCIndex;             // 是否只在 IR 中保存 PTC 指令的索引
+  bool SplitInPlace;         // 是否原地分割已翻译的基本块
+  bool DispatcherTable;      // 是否通过查找表分派密集的跳转目标
+  const char *InlineCacheTracePath; // 用于构建间接跳转内联缓存的执行轨迹
+  bool IncrementalHarvest;   // 是否只优化上一轮之后改变的代码
+  int SETDepth;              // SET 向前搜索的最大基本块数
+  int OSRAJobs;              // 并行运行 OSRA 的线程数
+  bool SlicedOSRA;           // 是否只对影响 PC 的代码运行 OSRA
+  int OSRAMaxIterations;     // OSRA 在每个区域上的最大迭代次数
+  int OSRATimeout;           // OSRA 在每个函数上的最长运行时间（秒）
+  bool OnDemandRD;           // 是否只为需要的 load 按需计算到达定值
+  bool AnalysisMetadata;     // 是否将分析结果保存为模块的命名元数据
+  const char *ExternalSegmentsPath; // 引用输入文件中 segment 内容的汇编文件路径
+  const char *EmitObjPath;   // 直接生成的目标文件路径
+  const char *SupportModulePath; // 生成目标文件前链接的 support 模块路径
+  int EmitObjOpt;            // 生成目标文件时的优化级别
+  MarkersMode Markers;       // 翻译结束后如何处理 newpc 标记
+  const char *ProfilePath;   // 用于按热度排序和布局代码的执行轨迹
+  bool PromoteCSVs;          // 是否在 root 函数中用局部变量保存 CPU 状态
+  bool SpecializeHelpers;    // 是否按常量参数特化 helper 并内联较小的 helper
+  int HelpersInlineBudget;   // 内联 helper 的最大指令数
+  bool CSVDSE;               // 是否删除从未被读取的 CPU 状态写入
+  bool NativeSyscalls;       // 是否让 support 模块直接转发常用系统调用
+  bool LowerVectorHelpers;   // 是否将常见的 SSE/NEON helper 翻译为 LLVM 向量操作
+  const char *ArtifactPath;  // 二进制分析结果文件的路径
+  int TimeBudget;            // 翻译的时间预算（秒），快用完时停止寻找新的跳转目标
+  const char *PreHarvestPath; // 第一次运行 SET 之前保存模块的路径
+  const char *OutOfCorePath; // 翻译期间保存 oi 和 pi 元数据文本的文件路径
+  const char *SeedsPath;     // 额外跳转目标列表的路径
+  const char *ImportJTsPath; // 之前运行导出的跳转目标文件的路径
+  const char *ExportJTsPath; // 导出跳转目标及其原因的文件路径
+  unsigned ShardIndex;       // 要翻译的分片编号
+  unsigned ShardCount;       // 分片总数，0 表示翻译全部代码
+  bool Stats;                // 是否在结束时打印统计信息
+  bool MemoryReport;         // 是否在每个阶段结束时报告主要容器的内存占用
+  int MemoryLimit;           // 内存软上限（MiB），达到后切换到更省内存的模式
+  const char *StatsJSONPath; // 统计信息 JSON 文件路径
 };
 
 using LibraryDestructor = GenericFunctor<decltype(&dlclose), &dlclose>;
 using LibraryPointer = std::unique_ptr<void, LibraryDestructor>;
 
+/// A libtinycode library loaded in advance by the batch mode, along with the
+/// path of its helpers module
+struct PreloadedLibrary
+{
+    LibraryPointer Handle;
+    PTCInterface Interface;
+    std::string HelpersPath;
+};
+
+/// The libraries loaded in advance by the batch mode, by architecture name
+static std::map<std::string, PreloadedLibrary> PreloadedLibraries;
+
+/// In a job of the batch mode, where to write the name of the architecture
+/// of the input if its library hasn't been loaded in advance, -1 otherwise
+static int ArchitecturesPipe = -1;
+
 static const char *const Usage[] = {
     "revamb [options] [--] INFILE OUTFILE",
+    "revamb --batch JOBS [--batch-jobs N]",
     nullptr,
 };
 
@@ -88,6 +158,8 @@ static void findQemu(const char *Architecture)
 #endif
     SearchPaths.push_back(Directory + "/../lib");
 
+    LibTinycodePath.clear();
+    LibHelpersPath.clear();
     for (auto &Path : SearchPaths)
     {
          // 在搜索路径上构造libtinycode和libtinycode-helpers库的路径
@@ -101,11 +173,60 @@ static void findQemu(const char *Architecture)
             // 把路径保存在全局变量LibTinycodePath和LibHelpersPath中
             LibTinycodePath = LibraryPath.str(); // TCG lib路径
             LibHelpersPath = HelpersPath.str();  // helper lib路径
+            break;
+        }
+    }
+
+    assert(LibTinycodePath.size() != 0
+           && "Couldn't find libtinycode and the helpers");
+
+    // Prefer the helpers precompiled at install time, which are loaded lazily,
+    // unless they're older than the textual ones
+    struct stat HelpersStat;
+    if (stat(LibHelpersPath.c_str(), &HelpersStat) != 0)
+        return;
+
+    for (auto &Path : SearchPaths)
+    {
+        std::stringstream BitcodePath;
+        BitcodePath << Path << "/libtinycode-helpers-" << Architecture << ".bc";
+        struct stat BitcodeStat;
+        if (stat(BitcodePath.str().c_str(), &BitcodeStat) == 0
+            && BitcodeStat.st_mtime >= HelpersStat.st_mtime)
+        {
+            LibHelpersPath = BitcodePath.str();
             return;
         }
     }
+}
+
+/// 寻找 support 模块
+/// Looks for the normal support module (in bitcode form) for the specified
+/// architecture, in the install directory or next to the executable.
+static std::string findSupportModule(const char *Architecture)
+{
+    char *FullPath = realpath("/proc/self/exe", nullptr);
+    assert(FullPath != nullptr);
+    std::string Directory(dirname(FullPath));
+    free(FullPath);
+
+    std::vector<std::string> SearchPaths;
+#ifdef INSTALL_PATH
+    SearchPaths.push_back(std::string(INSTALL_PATH) + "/share/revamb");
+#endif
+    SearchPaths.push_back(Directory + "/../share/revamb");
+    SearchPaths.push_back(Directory);
+
+    for (auto &Path : SearchPaths)
+    {
+        std::stringstream SupportPath;
+        SupportPath << Path << "/support-" << Architecture << "-normal.bc";
+        if (access(SupportPath.str().c_str(), F_OK) != -1)
+            return SupportPath.str();
+    }
 
-    assert(false && "Couldn't find libtinycode and the helpers");
+    assert(false && "Couldn't find the support module");
+    return "";
 }
 
 /// 给出一个体系结构名字，加载合适的 PTC 版本库，
@@ -171,8 +292,15 @@ static int parseArgs(int Argc, const char *Argv[],
     const char *DebugString = nullptr;
     const char *DebugLoggingString = nullptr;
     const char *EntryPointAddressString = nullptr;
+    const char *MarkersString = nullptr;
+    const char *ShardString = nullptr;
     long long EntryPointAddress = 0;
 
+    // 默认值 Default values
+    Parameters->SETDepth = 3;
+    Parameters->OSRAJobs = 1;
+    Parameters->HelpersInlineBudget = 32;
+
     // 初始化参数解析器
     struct argparse Arguments;
     struct argparse_option Options[] = {
@@ -215,6 +343,173 @@ static int parseArgs(int Argc, const char *Argv[],
         OPT_BOOLEAN('f', "functions-boundaries",
                     &Parameters->DetectFunctionsBoundaries,
                     "enable functions boundaries detection."),
+        OPT_BOOLEAN(0, "isolate-functions", &Parameters->IsolateFunctions,
+                    "move each function identified by the function "
+                    "boundaries detection to its own LLVM function (requires "
+                    "-f)."),
+        OPT_BOOLEAN(0, "shadow-stack", &Parameters->ShadowStack,
+                    "push the return address of the identified calls on a "
+                    "shadow stack, so that returns don't need the "
+                    "dispatcher."),
+        OPT_BOOLEAN(0, "address-map", &Parameters->AddressMap,
+                    "emit a table mapping the translated code back to the "
+                    "input PCs, used by the sampling profiler of the "
+                    "support module."),
+        OPT_BOOLEAN(0, "guest-threads", &Parameters->GuestThreads,
+                    "make the CPU state thread-local and keep the QEMU "
+                    "locks, so that the threads of the input program run on "
+                    "host threads. Requires --native-syscalls."),
+        OPT_INTEGER(0, "lift-jobs",
+                    &Parameters->LiftJobs,
+                    "number of threads translating code to PTC ahead of the "
+                    "LLVM IR emission (0 to disable)."),
+        OPT_STRING(0, "ptc-cache",
+                   &Parameters->PTCCachePath,
+                   "directory where to cache the PTC translations across "
+                   "runs."),
+        OPT_BOOLEAN(0, "ptc-index", &Parameters->PTCIndex,
+                    "do not store the PTC text in the IR, write an index of "
+                    "the PTC instructions to OUTFILE.ptc-index.csv instead."),
+        OPT_BOOLEAN(0, "split-in-place", &Parameters->SplitInPlace,
+                    "when possible, handle new jump targets in already "
+                    "translated code splitting the basic block instead of "
+                    "translating it again."),
+        OPT_BOOLEAN(0, "dispatcher-table", &Parameters->DispatcherTable,
+                    "dispatch dense areas of jump targets through a table "
+                    "instead of the dispatcher switch."),
+        OPT_STRING(0, "inline-caches",
+                   &Parameters->InlineCacheTracePath,
+                   "path of an execution trace (see translate -trace) used to "
+                   "make each indirect jump check its most frequent targets "
+                   "before going to the dispatcher."),
+        OPT_BOOLEAN(0, "incremental-harvest", &Parameters->IncrementalHarvest,
+                    "when looking for new jump targets, only optimize the "
+                    "code translated or changed since the previous round."),
+        OPT_INTEGER(0, "set-depth",
+                    &Parameters->SETDepth,
+                    "maximum number of basic blocks to go backward while "
+                    "looking for the value of a variable (default: 3)."),
+        OPT_INTEGER(0, "osra-jobs",
+                    &Parameters->OSRAJobs,
+                    "number of threads running OSRA on independent regions "
+                    "of the code (default: 1)."),
+        OPT_BOOLEAN(0, "sliced-osra", &Parameters->SlicedOSRA,
+                    "run OSRA only on the code affecting the stores to the "
+                    "program counter."),
+        OPT_INTEGER(0, "osra-max-iterations",
+                    &Parameters->OSRAMaxIterations,
+                    "maximum number of iterations of OSRA on a region of the "
+                    "code before giving up on it (0 for no limit)."),
+        OPT_INTEGER(0, "osra-timeout",
+                    &Parameters->OSRATimeout,
+                    "maximum number of seconds OSRA can spend on a function "
+                    "before giving up on the rest of it (0 for no limit)."),
+        OPT_BOOLEAN(0, "on-demand-rd", &Parameters->OnDemandRD,
+                    "compute the reaching definitions of the loads feeding "
+                    "the comparisons on demand, instead of solving them on "
+                    "the whole function."),
+        OPT_BOOLEAN(0, "analysis-metadata", &Parameters->AnalysisMetadata,
+                    "store the function boundaries, the noreturn basic blocks "
+                    "and the function calls as named metadata for "
+                    "revamb-dump."),
+        OPT_STRING(0, "external-segments",
+                   &Parameters->ExternalSegmentsPath,
+                   "destination path for an assembly file defining the "
+                   "segments with the contents of the input file, instead of "
+                   "embedding them in the module."),
+        OPT_STRING(0, "emit-obj",
+                   &Parameters->EmitObjPath,
+                   "destination path for an object file for the host, "
+                   "produced in-process after linking the support module."),
+        OPT_STRING(0, "support-module",
+                   &Parameters->SupportModulePath,
+                   "path of the support module to link before emitting the "
+                   "object file (default: the normal support module for the "
+                   "input architecture)."),
+        OPT_INTEGER(0, "emit-obj-opt",
+                    &Parameters->EmitObjOpt,
+                    "optimization level for --emit-obj, 0, 1 or 2 as in "
+                    "translate, 3 for a pipeline tailored to the translated "
+                    "code (default: 0)."),
+        OPT_STRING(0, "markers",
+                   &MarkersString,
+                   "what to do with the newpc markers at the end of the "
+                   "translation: full, bb or none (default: full)."),
+        OPT_STRING(0, "profile",
+                   &Parameters->ProfilePath,
+                   "path of an execution trace to translate the most "
+                   "executed code first and to weight and lay out the "
+                   "generated code accordingly."),
+        OPT_BOOLEAN(0, "promote-csvs", &Parameters->PromoteCSVs,
+                    "keep the CPU state in local variables of the root "
+                    "function, writing it back only around the calls which "
+                    "access it."),
+        OPT_BOOLEAN(0, "specialize-helpers", &Parameters->SpecializeHelpers,
+                    "specialize the helpers called with constant arguments "
+                    "and inline the small ones in the root function."),
+        OPT_INTEGER(0, "helpers-inline-budget",
+                    &Parameters->HelpersInlineBudget,
+                    "maximum number of instructions of a helper inlined by "
+                    "--specialize-helpers (default: 32)."),
+        OPT_BOOLEAN(0, "csv-dse", &Parameters->CSVDSE,
+                    "remove the writes to the CPU state which are never "
+                    "read, also across basic blocks."),
+        OPT_BOOLEAN(0, "native-syscalls", &Parameters->NativeSyscalls,
+                    "let the support module forward the most common "
+                    "syscalls directly to the host, if its ABI matches the "
+                    "input one."),
+        OPT_BOOLEAN(0, "vector-helpers", &Parameters->LowerVectorHelpers,
+                    "translate the calls to the most common SSE and NEON "
+                    "integer helpers to LLVM vector operations."),
+        OPT_STRING(0, "artifact",
+                   &Parameters->ArtifactPath,
+                   "path where the analysis results (jump targets, coverage, "
+                   "segments, functions and noreturn basic blocks) should be "
+                   "stored in a single binary file."),
+        OPT_INTEGER(0, "time-budget", &Parameters->TimeBudget,
+                    "seconds the translation should take at most: when they "
+                    "are about to run out, stop looking for new code and "
+                    "produce the module with what has been found (default: "
+                    "no budget)."),
+        OPT_STRING(0, "dump-pre-harvest", &Parameters->PreHarvestPath,
+                   "path where the module should be saved right before the "
+                   "first run of SET, to benchmark the analysis passes with "
+                   "revamb-analysis-bench."),
+        OPT_STRING(0, "out-of-core", &Parameters->OutOfCorePath,
+                   "path of a scratch file where the text of the original "
+                   "and PTC instructions should be kept during the "
+                   "translation, to reduce the memory usage on large "
+                   "inputs."),
+        OPT_STRING(0, "seeds", &Parameters->SeedsPath,
+                   "path of a list of additional jump targets, as 64-bit "
+                   "integers in the host endianess (e.g., the "
+                   "OUTFILE.jump-targets of the --shard mode)."),
+        OPT_STRING(0, "import-jts", &Parameters->ImportJTsPath,
+                   "path of the jump targets exported by a previous run on "
+                   "the same binary, used to seed the translation and skip "
+                   "the OSRA rounds if nothing new is found."),
+        OPT_STRING(0, "export-jts", &Parameters->ExportJTsPath,
+                   "path where the jump targets, their reasons and the "
+                   "resolved indirect jumps should be written."),
+        OPT_STRING(0, "shard", &ShardString,
+                   "INDEX/COUNT: only translate the code in the INDEX-th of "
+                   "COUNT parts of the executable code, and write all the jump "
+                   "targets found to OUTFILE.jump-targets (see "
+                   "revamb-distributed)."),
+        OPT_BOOLEAN(0, "stats", &Parameters->Stats,
+                    "print timings and counters about the translation on "
+                    "stderr."),
+        OPT_STRING(0, "stats-json",
+                   &Parameters->StatsJSONPath,
+                   "destination path for a JSON file containing timings and "
+                   "counters about the translation."),
+        OPT_BOOLEAN(0, "memory-report", &Parameters->MemoryReport,
+                    "print on stderr the size of the major data structures "
+                    "at the end of each phase."),
+        OPT_INTEGER(0, "memory-limit", &Parameters->MemoryLimit,
+                    "soft limit on the resident memory, in MiB: once "
+                    "reached, switch to cheaper translation modes (default: "
+                    "no limit)."),
         OPT_END(),
     };
 
@@ -283,6 +578,45 @@ static int parseArgs(int Argc, const char *Argv[],
             enableDebugFeature(Type.c_str());
     }
 
+    if (Parameters->LiftJobs < 0)
+    {
+        fprintf(stderr, "The number of lifting threads (--lift-jobs) cannot"
+                        " be negative.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->SETDepth < 1)
+    {
+        fprintf(stderr, "The SET depth (--set-depth) must be at least"
+                        " 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->OSRAJobs < 1)
+    {
+        fprintf(stderr, "The number of OSRA threads (--osra-jobs) must be at"
+                        " least 1.\n");
+        return EXIT_FAILURE;
+    }
+    OSRAJobs = Parameters->OSRAJobs;
+
+    if (Parameters->HelpersInlineBudget < 0)
+    {
+        fprintf(stderr, "The helpers inline budget (--helpers-inline-budget)"
+                        " cannot be negative.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->OSRAMaxIterations < 0 || Parameters->OSRATimeout < 0)
+    {
+        fprintf(stderr, "The OSRA budget (--osra-max-iterations and"
+                        " --osra-timeout) cannot be negative.\n");
+        return EXIT_FAILURE;
+    }
+    OSRAMaxIterations = Parameters->OSRAMaxIterations;
+    OSRATimeout = Parameters->OSRATimeout;
+    OnDemandReachingDefinitions = Parameters->OnDemandRD;
+
     if (Parameters->DebugPath == nullptr)
         Parameters->DebugPath = "";
 
@@ -295,11 +629,139 @@ static int parseArgs(int Argc, const char *Argv[],
     if (Parameters->BBSummaryPath == nullptr)
         Parameters->BBSummaryPath = "";
 
+    if (Parameters->PTCCachePath == nullptr)
+        Parameters->PTCCachePath = "";
+
+    if (Parameters->InlineCacheTracePath == nullptr)
+        Parameters->InlineCacheTracePath = "";
+
+    if (Parameters->ExternalSegmentsPath == nullptr)
+        Parameters->ExternalSegmentsPath = "";
+
+    if (Parameters->ProfilePath == nullptr)
+        Parameters->ProfilePath = "";
+
+    if (Parameters->ArtifactPath == nullptr)
+        Parameters->ArtifactPath = "";
+
+    if (Parameters->PreHarvestPath == nullptr)
+        Parameters->PreHarvestPath = "";
+
+    if (Parameters->OutOfCorePath == nullptr)
+        Parameters->OutOfCorePath = "";
+
+    if (Parameters->SeedsPath == nullptr)
+        Parameters->SeedsPath = "";
+
+    if (Parameters->ImportJTsPath == nullptr)
+        Parameters->ImportJTsPath = "";
+
+    if (Parameters->ExportJTsPath == nullptr)
+        Parameters->ExportJTsPath = "";
+
+    if (ShardString != nullptr)
+    {
+        char Trailing;
+        if (sscanf(ShardString, "%u/%u%c", &Parameters->ShardIndex,
+                   &Parameters->ShardCount, &Trailing) != 2
+            || Parameters->ShardCount == 0
+            || Parameters->ShardIndex >= Parameters->ShardCount)
+        {
+            fprintf(stderr, "The shard (--shard) must be in the INDEX/COUNT"
+                            " form, with INDEX less than COUNT.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (MarkersString == nullptr || strcmp("full", MarkersString) == 0)
+    {
+        Parameters->Markers = MarkersMode::Full;
+    }
+    else if (strcmp("bb", MarkersString) == 0)
+    {
+        Parameters->Markers = MarkersMode::BasicBlock;
+    }
+    else if (strcmp("none", MarkersString) == 0)
+    {
+        Parameters->Markers = MarkersMode::Strip;
+    }
+    else
+    {
+        fprintf(stderr, "Unexpected value for the --markers parameter.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->EmitObjOpt < 0 || Parameters->EmitObjOpt > 3)
+    {
+        fprintf(stderr, "Unexpected optimization level for --emit-obj\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->Stats || Parameters->StatsJSONPath != nullptr)
+        StatisticsEnabled = true;
+
+    if (Parameters->IsolateFunctions
+        && !Parameters->DetectFunctionsBoundaries)
+    {
+        fprintf(stderr, "Function isolation (--isolate-functions) requires"
+                        " function boundaries detection (-f).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->ShadowStack && Parameters->IsolateFunctions)
+    {
+        fprintf(stderr, "The shadow stack (--shadow-stack) can't be used"
+                        " with --isolate-functions.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->ShadowStack && Parameters->NoOSRA)
+    {
+        fprintf(stderr, "The shadow stack (--shadow-stack) can't be used"
+                        " with --no-osra, OSRA identifies the function"
+                        " calls.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->AddressMap && Parameters->IsolateFunctions)
+    {
+        fprintf(stderr, "The address map (--address-map) can't be used"
+                        " with --isolate-functions.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->GuestThreads && !Parameters->NativeSyscalls)
+    {
+        fprintf(stderr, "The guest threads (--guest-threads) require"
+                        " --native-syscalls.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->TimeBudget < 0)
+    {
+        fprintf(stderr, "The time budget (--time-budget) cannot be"
+                        " negative.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Parameters->MemoryLimit < 0)
+    {
+        fprintf(stderr, "The memory limit (--memory-limit) cannot be"
+                        " negative.\n");
+        return EXIT_FAILURE;
+    }
+
+    MemoryReportEnabled = Parameters->MemoryReport;
+    MemoryLimit = static_cast<uint64_t>(Parameters->MemoryLimit) * 1024;
+
     return EXIT_SUCCESS;
 }
 
-// 主程序入口
-int main(int argc, const char *argv[])
+/// 翻译单个二进制文件
+/// Translates a single binary according to the given command-line arguments.
+///
+/// \return EXIT_SUCCESS if the translation has been successful.
+static int runTranslation(int argc, const char *argv[])
 {
     // 1. 解析参数 Parse arguments
     ProgramParameters Parameters{};
@@ -309,33 +771,329 @@ int main(int argc, const char *argv[])
     // 2. 读取二进制文件 && 查找 QEMU
     BinaryFile TheBinary(Parameters.InputPath, Parameters.UseSections);
 
-    findQemu(TheBinary.architecture().name());
-
     // 3. 加载合适版本的libtyncode库 Load the appropriate libtyncode version
-    LibraryPointer PTCLibrary;  
-    if (loadPTCLibrary(PTCLibrary) != EXIT_SUCCESS)
-        return EXIT_FAILURE;
+    const char *ArchitectureName = TheBinary.architecture().name();
+    LibraryPointer PTCLibrary;
+    auto Preloaded = PreloadedLibraries.find(ArchitectureName);
+    if (Preloaded != PreloadedLibraries.end())
+    {
+        ptc = Preloaded->second.Interface;
+        LibHelpersPath = Preloaded->second.HelpersPath;
+    }
+    else
+    {
+        findQemu(ArchitectureName);
+        if (loadPTCLibrary(PTCLibrary) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+
+        // Let the batch driver load it in advance for the next jobs
+        if (ArchitecturesPipe != -1)
+        {
+            std::string Line = std::string(ArchitectureName) + "\n";
+            if (write(ArchitecturesPipe, Line.data(), Line.size()) < 0)
+                perror("Couldn't notify the batch driver");
+        }
+    }
 
     Architecture TargetArchitecture;
     // 4. 初始化代码生成器对象    
-    CodeGenerator Generator(TheBinary,
-                            TargetArchitecture,
-                            std::string(Parameters.OutputPath),
-                            LibHelpersPath,
-                            Parameters.DebugInfo,
-                            std::string(Parameters.DebugPath),
-                            std::string(Parameters.LinkingInfoPath),
-                            std::string(Parameters.CoveragePath),
-                            std::string(Parameters.BBSummaryPath),
-                            !Parameters.NoOSRA,
-                            Parameters.DetectFunctionsBoundaries,
-                            !Parameters.NoLink,
-                            Parameters.External);
+    CodeGeneratorOptions Options;
+    Options.Output = Parameters.OutputPath;
+    Options.Helpers = LibHelpersPath;
+    Options.DebugInfo = Parameters.DebugInfo;
+    Options.Debug = Parameters.DebugPath;
+    Options.LinkingInfo = Parameters.LinkingInfoPath;
+    Options.Coverage = Parameters.CoveragePath;
+    Options.BBSummary = Parameters.BBSummaryPath;
+    Options.EnableOSRA = !Parameters.NoOSRA;
+    Options.DetectFunctionBoundaries = Parameters.DetectFunctionsBoundaries;
+    Options.EnableLinking = !Parameters.NoLink;
+    Options.ExternalCSVs = Parameters.External;
+    Options.LiftJobs = Parameters.LiftJobs;
+    Options.PTCCache = Parameters.PTCCachePath;
+    Options.PTCIndex = Parameters.PTCIndex;
+    Options.SplitInPlace = Parameters.SplitInPlace;
+    Options.DispatcherTable = Parameters.DispatcherTable;
+    Options.InlineCacheTrace = Parameters.InlineCacheTracePath;
+    Options.IncrementalHarvest = Parameters.IncrementalHarvest;
+    Options.SETDepth = Parameters.SETDepth;
+    Options.SlicedOSRA = Parameters.SlicedOSRA;
+    Options.AnalysisMetadata = Parameters.AnalysisMetadata;
+    Options.ExternalSegments = Parameters.ExternalSegmentsPath;
+    Options.Markers = Parameters.Markers;
+    Options.Profile = Parameters.ProfilePath;
+    Options.PromoteCSVs = Parameters.PromoteCSVs;
+    Options.SpecializeHelpers = Parameters.SpecializeHelpers;
+    Options.HelpersInlineBudget = Parameters.HelpersInlineBudget;
+    Options.CSVDSE = Parameters.CSVDSE;
+    Options.NativeSyscalls = Parameters.NativeSyscalls;
+    Options.Artifact = Parameters.ArtifactPath;
+    Options.TimeBudget = Parameters.TimeBudget;
+    Options.PreHarvest = Parameters.PreHarvestPath;
+    Options.OutOfCore = Parameters.OutOfCorePath;
+    Options.Seeds = Parameters.SeedsPath;
+    Options.ShardIndex = Parameters.ShardIndex;
+    Options.ShardCount = Parameters.ShardCount;
+    Options.IsolateFunctions = Parameters.IsolateFunctions;
+    Options.LowerVectorHelpers = Parameters.LowerVectorHelpers;
+    Options.ShadowStack = Parameters.ShadowStack;
+    Options.AddressMap = Parameters.AddressMap;
+    Options.GuestThreads = Parameters.GuestThreads;
+    Options.ImportJTs = Parameters.ImportJTsPath;
+    Options.ExportJTs = Parameters.ExportJTsPath;
+
+    CodeGenerator Generator(TheBinary, TargetArchitecture, Options);
 
     // 5. 翻译中间代码
-    Generator.translate(Parameters.EntryPointAddress);
+    {
+        ScopedPhase Phase("translate");
+        Generator.translate(Parameters.EntryPointAddress);
+    }
     // 6.将结果序列化
     Generator.serialize();
+
+    // 生成目标文件 Emit the object file
+    if (Parameters.EmitObjPath != nullptr)
+    {
+        std::string SupportPath;
+        if (Parameters.SupportModulePath != nullptr)
+            SupportPath = Parameters.SupportModulePath;
+        else
+            SupportPath = findSupportModule(TheBinary.architecture().name());
+
+        Generator.emitObject(std::string(Parameters.EmitObjPath),
+                             SupportPath,
+                             Parameters.EmitObjOpt);
+    }
+
+    // 打印统计信息 Print statistics
+    if (Parameters.Stats)
+        printStatistics(std::cerr);
+
+    if (Parameters.StatsJSONPath != nullptr)
+    {
+        std::ofstream StatsJSON(Parameters.StatsJSONPath);
+        printStatisticsJSON(StatsJSON);
+    }
+
     // 7.程序结束
     return EXIT_SUCCESS;
 }
+
+/// 为批处理模式预先加载某个体系结构的库
+/// Loads in advance the PTC library and the helpers module of \p Architecture,
+/// so that the jobs of the batch mode can reuse them.
+static void preloadArchitecture(const std::string &Architecture)
+{
+    if (PreloadedLibraries.count(Architecture) != 0)
+        return;
+
+    findQemu(Architecture.c_str());
+
+    PreloadedLibrary &Library = PreloadedLibraries[Architecture];
+    if (loadPTCLibrary(Library.Handle) != EXIT_SUCCESS)
+    {
+        // The jobs will try again on their own, and report the error
+        PreloadedLibraries.erase(Architecture);
+        return;
+    }
+
+    Library.Interface = ptc;
+    Library.HelpersPath = LibHelpersPath;
+    ptc = {};
+
+    CodeGenerator::preloadHelpers(LibHelpersPath);
+}
+
+/// Loads in advance the architectures the jobs reported through \p Pipe
+static void preloadReportedArchitectures(int Pipe, std::string &Pending)
+{
+    char Buffer[256];
+    ssize_t Size;
+    while ((Size = read(Pipe, Buffer, sizeof(Buffer))) > 0)
+        Pending.append(Buffer, Size);
+
+    size_t End;
+    while ((End = Pending.find('\n')) != std::string::npos)
+    {
+        preloadArchitecture(Pending.substr(0, End));
+        Pending.erase(0, End + 1);
+    }
+}
+
+/// 批处理模式：每行一个翻译任务
+/// Runs the translations listed in \p JobsPath, one per line, each in a new
+/// process forked from this one, at most \p Jobs at a time.
+///
+/// Each line contains the arguments for a single translation, separated by
+/// whitespace, empty lines and lines starting with `#` are ignored. The PTC
+/// library and the helpers module of each architecture are loaded once, the
+/// first time a job for that architecture is met, and inherited by all the
+/// following jobs. For each completed job, its line number and its exit status
+/// are printed on the standard output.
+///
+/// \param JobsPath path of the list of jobs, "-" for the standard input.
+///
+/// \return EXIT_SUCCESS if all the jobs have been successful.
+static int runBatch(const char *JobsPath, unsigned Jobs)
+{
+    std::ifstream JobsFile;
+    std::istream *Input = &std::cin;
+    if (strcmp(JobsPath, "-") != 0)
+    {
+        JobsFile.open(JobsPath);
+        if (!JobsFile)
+        {
+            fprintf(stderr, "Couldn't open the list of jobs %s.\n", JobsPath);
+            return EXIT_FAILURE;
+        }
+        Input = &JobsFile;
+    }
+
+    int Pipe[2];
+    if (pipe(Pipe) != 0 || fcntl(Pipe[0], F_SETFL, O_NONBLOCK) != 0)
+    {
+        perror("Couldn't create the pipe for the batch mode");
+        return EXIT_FAILURE;
+    }
+    std::string PendingArchitectures;
+
+    std::map<pid_t, unsigned> Running;
+    unsigned Failed = 0;
+    auto WaitJob = [&Running, &Failed] ()
+    {
+        int Status = 0;
+        pid_t Pid = waitpid(-1, &Status, 0);
+        if (Pid == -1)
+            return;
+
+        // Report the status as a shell would
+        int ExitCode = EXIT_FAILURE;
+        if (WIFEXITED(Status))
+            ExitCode = WEXITSTATUS(Status);
+        else if (WIFSIGNALED(Status))
+            ExitCode = 128 + WTERMSIG(Status);
+
+        if (ExitCode != EXIT_SUCCESS)
+            Failed++;
+
+        std::cout << Running[Pid] << " " << ExitCode << std::endl;
+        Running.erase(Pid);
+    };
+
+    std::string Line;
+    unsigned LineNumber = 0;
+    while (std::getline(*Input, Line))
+    {
+        LineNumber++;
+
+        std::vector<std::string> Arguments { "revamb" };
+        std::stringstream Stream(Line);
+        std::string Argument;
+        while (Stream >> Argument)
+            Arguments.push_back(Argument);
+
+        if (Arguments.size() == 1 || Arguments[1][0] == '#')
+            continue;
+
+        while (Running.size() >= Jobs)
+            WaitJob();
+
+        preloadReportedArchitectures(Pipe[0], PendingArchitectures);
+
+        // Don't let the job inherit what's still to print
+        std::cout.flush();
+        std::cerr.flush();
+        fflush(nullptr);
+
+        pid_t Pid = fork();
+        if (Pid == 0)
+        {
+            close(Pipe[0]);
+            ArchitecturesPipe = Pipe[1];
+
+            std::vector<const char *> Argv;
+            for (std::string &Argument : Arguments)
+                Argv.push_back(Argument.c_str());
+            Argv.push_back(nullptr);
+
+            int Result = runTranslation(Argv.size() - 1, Argv.data());
+
+            // Skip the destruction of the preloaded state, it's just a waste
+            // of time
+            std::cout.flush();
+            std::cerr.flush();
+            fflush(nullptr);
+            _exit(Result);
+        }
+        else if (Pid == -1)
+        {
+            perror("Couldn't start a job");
+            Failed++;
+            continue;
+        }
+
+        Running[Pid] = LineNumber;
+    }
+
+    while (!Running.empty())
+        WaitJob();
+
+    close(Pipe[0]);
+    close(Pipe[1]);
+
+    return Failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// Parses the arguments of the batch mode and runs it.
+static int batchMain(int Argc, const char *Argv[])
+{
+    const char *JobsPath = nullptr;
+    int Jobs = 1;
+
+    struct argparse Arguments;
+    struct argparse_option Options[] = {
+        OPT_HELP(),
+        OPT_STRING(0, "batch",
+                   &JobsPath,
+                   "path of a file listing the arguments of a translation on "
+                   "each line, - for the standard input."),
+        OPT_INTEGER(0, "batch-jobs", &Jobs,
+                    "number of translations to run in parallel (default: "
+                    "1)."),
+        OPT_END(),
+    };
+
+    argparse_init(&Arguments, Options, Usage, 0);
+    argparse_describe(&Arguments, "\nrevamb batch mode.",
+                      "\nRuns multiple translations reusing the libraries "
+                      "loaded for the previous ones.\n");
+    Argc = argparse_parse(&Arguments, Argc, Argv);
+
+    if (Argc != 0 || JobsPath == nullptr)
+    {
+        fprintf(stderr, "Expected only --batch and --batch-jobs.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (Jobs < 1)
+    {
+        fprintf(stderr, "The number of batch jobs (--batch-jobs) must be at"
+                        " least 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    return runBatch(JobsPath, Jobs);
+}
+
+// 主程序入口
+int main(int argc, const char *argv[])
+{
+    // Look for --batch among the options, i.e., before "--"
+    for (int I = 1; I < argc && strcmp(argv[I], "--") != 0; I++)
+        if (strcmp(argv[I], "--batch") == 0
+            || strncmp(argv[I], "--batch=", strlen("--batch=")) == 0)
+            return batchMain(argc, argv);
+
+    return runTranslation(argc, argv);
+}
@@ -132,6 +132,14 @@ public:
   }
 
   bool isValid() const { return Type != Invalid; }
+  bool isCPUState() const { return Type == CPUState; }
+  bool isRegisterAndOffset() const { return Type == RegisterAndOffset; }
+
+  /// \brief The accessed part of the CPU state or the register holding the
+  ///        base address
+  const llvm::Value *base() const { return Base; }
+  uint64_t offset() const { return Offset; }
+  uint64_t size() const { return Size; }
 
   static bool mayAlias(llvm::BasicBlock *BB,
                        const MemoryAccess &Other,
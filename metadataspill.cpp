@@ -0,0 +1,108 @@
+/// \file metadataspill.cpp
+/// \brief Implementation of the MetadataSpill
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+// LLVM includes
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+
+// Local includes
+#include "debug.h"
+#include "ir-helpers.h"
+#include "metadataspill.h"
+
+using namespace llvm;
+
+bool MetadataSpill::open(const std::string &Path) {
+  this->Path = Path;
+  Count = 0;
+  Output.open(Path, std::ios::binary | std::ios::trunc);
+  return !Output.fail();
+}
+
+Metadata *MetadataSpill::spill(LLVMContext &Context, StringRef Text) {
+  uint32_t Size = Text.size();
+  Output.write(reinterpret_cast<const char *>(&Size), sizeof(Size));
+  Output.write(Text.data(), Size);
+
+  // Losing the text would silently produce wrong debug information
+  if (Output.fail()) {
+    dbg << "Couldn't write to the out-of-core file " << Path << "\n";
+    abort();
+  }
+
+  auto *ID = ConstantInt::get(Type::getInt32Ty(Context), Count++);
+  return ConstantAsMetadata::get(ID);
+}
+
+bool MetadataSpill::reload(Module &M, ArrayRef<unsigned> Kinds) {
+  Output.close();
+  if (Output.fail())
+    return false;
+
+  // Collect the nodes referencing the spill file, sorted by identifier, so
+  // that the file can be read sequentially
+  std::vector<std::pair<uint32_t, MDNode *>> References;
+  SmallPtrSet<MDNode *, 16> Seen;
+  for (Function &F : M) {
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        for (unsigned Kind : Kinds) {
+          MDNode *Node = I.getMetadata(Kind);
+          if (Node == nullptr
+              || Node->getNumOperands() == 0
+              || !Seen.insert(Node).second)
+            continue;
+
+          Metadata *Operand = Node->getOperand(0).get();
+          auto *ID = dyn_cast_or_null<ConstantAsMetadata>(Operand);
+          if (ID != nullptr)
+            References.push_back({ getLimitedValue(ID->getValue()), Node });
+        }
+      }
+    }
+  }
+
+  std::sort(References.begin(), References.end());
+
+  std::ifstream Input(Path, std::ios::binary);
+  if (!Input)
+    return false;
+
+  LLVMContext &Context = M.getContext();
+  std::string Text;
+  uint32_t Next = 0;
+  for (auto &P : References) {
+    // Skip the text of the instructions which are no longer in the module
+    do {
+      uint32_t Size;
+      if (!Input.read(reinterpret_cast<char *>(&Size), sizeof(Size)))
+        return false;
+      Text.resize(Size);
+      if (!Input.read(&Text[0], Size))
+        return false;
+    } while (Next++ != P.first);
+
+    P.second->replaceOperandWith(0, MDString::get(Context, Text));
+  }
+
+  Input.close();
+  std::remove(Path.c_str());
+
+  return true;
+}
@@ -0,0 +1,64 @@
+#ifndef _METADATASPILL_H
+#define _METADATASPILL_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// LLVM includes
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+
+// Forward declarations
+namespace llvm {
+class LLVMContext;
+class Metadata;
+class Module;
+}
+
+/// \brief Keep on disk the text attached to the translated instructions
+///
+/// The disassembly of the original instructions and the text of the PTC
+/// instructions, attached to the generated code through the `oi` and `pi`
+/// metadata, are a large part of the memory used by the module on large
+/// inputs, and they're not used until the output is produced. The spill
+/// appends each text to a file as soon as it's produced, the first operand of
+/// the metadata node is an integer identifying it, which reload() replaces
+/// with the original string.
+///
+/// An entry of the file is the size of the text (4 bytes, host endianess)
+/// followed by the text itself.
+class MetadataSpill {
+public:
+  MetadataSpill() : Count(0) { }
+
+  /// \brief Create the spill file at \p Path
+  ///
+  /// \return false if the file can't be created.
+  bool open(const std::string &Path);
+
+  bool isOpen() const { return Output.is_open(); }
+
+  /// \brief Append \p Text to the file, aborting if it can't be written
+  ///
+  /// \return the metadata to use in place of the MDString of \p Text.
+  llvm::Metadata *spill(llvm::LLVMContext &Context, llvm::StringRef Text);
+
+  /// \brief Put back the text in the metadata of kind \p Kinds of \p M
+  ///        referencing the spill file, then remove the file
+  ///
+  /// \return false if the file couldn't be read.
+  bool reload(llvm::Module &M, llvm::ArrayRef<unsigned> Kinds);
+
+private:
+  std::string Path;
+  std::ofstream Output;
+  uint32_t Count;
+};
+
+#endif // _METADATASPILL_H
@@ -5,6 +5,9 @@
 // This file is distributed under the MIT License. See LICENSE.md for details.
 //
 
+// Standard includes
+#include <algorithm>
+
 // LLVM includes
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Dominators.h"
@@ -17,6 +20,7 @@
 #include "debug.h"
 #include "ir-helpers.h"
 #include "noreturnanalysis.h"
+#include "statistics.h"
 
 using namespace llvm;
 
@@ -54,7 +58,7 @@ void NoReturnAnalysis::registerSyscalls(llvm::Function *F) {
       if (RegisteredSyscalls.count(Call) == 0) {
         auto *DeadLoad = new LoadInst(SyscallNumberRegister, "", Call);
         CallInst::Create(NoDCE, { DeadLoad }, "", Call);
-        SyscallRegisterReads.push_back(DeadLoad);
+        SyscallRegisterReads.emplace_back(DeadLoad);
         RegisteredSyscalls.insert(Call);
       }
 
@@ -63,7 +67,24 @@ void NoReturnAnalysis::registerSyscalls(llvm::Function *F) {
 
 }
 
-bool NoReturnAnalysis::endsUpIn(Instruction *I, BasicBlock *Target) {
+BasicBlock *NoReturnAnalysis::nextInChain(BasicBlock *BB) const {
+  BasicBlock *Next = nullptr;
+  for (BasicBlock *Successor : successors(BB)) {
+    if (Successor != Dispatcher) {
+      if (Next == nullptr) {
+        Next = Successor;
+      } else {
+        return Dispatcher;
+      }
+    }
+  }
+
+  return Next;
+}
+
+bool NoReturnAnalysis::endsUpIn(Instruction *I,
+                                BasicBlock *Target,
+                                Chain *Steps) {
   // Very simple check if the only possible destination of I is Target.
   // The only check we make is if there's always a single sucessor which in the
   // end leads to Target.
@@ -76,16 +97,13 @@ bool NoReturnAnalysis::endsUpIn(Instruction *I, BasicBlock *Target) {
       return false;
     Visited.insert(BB);
 
-    BasicBlock *Next = nullptr;
-    for (BasicBlock *Successor : successors(BB)) {
-      if (Successor != Dispatcher) {
-        if (Next == nullptr) {
-          Next = Successor;
-        } else {
-          return false;
-        }
-      }
-    }
+    BasicBlock *Next = nextInChain(BB);
+    if (Steps != nullptr)
+      Steps->push_back({ BB, Next });
+
+    // More than a successor
+    if (Next == Dispatcher)
+      return false;
 
     BB = Next;
   }
@@ -97,16 +115,79 @@ void NoReturnAnalysis::collectDefinitions(ConditionalReachedLoadsPass &CRL) {
   if (!hasSyscalls())
     return;
 
-  SyscallRegisterDefinitions.clear();
   KillerBBs.clear();
 
   // Register all the reaching definitions of the SyscallRegisterReads, which
-  // can only end up in the corresponding read
-  for (LoadInst *Load : SyscallRegisterReads)
-    for (Instruction *I : CRL.getReachingDefinitions(Load))
-      if (auto *Store = dyn_cast<StoreInst>(I))
-        if (endsUpIn(Store, Load->getParent()))
-            SyscallRegisterDefinitions.insert(Store);
+  // can only end up in the corresponding read. Reads whose definitions and
+  // chains of basic blocks didn't change since the last time are not
+  // considered again.
+  bool Changed = false;
+  for (SyscallRegisterRead &Read : SyscallRegisterReads) {
+    LoadInst *Load = Read.Load;
+    ArrayRef<Instruction *> Definitions = CRL.getReachingDefinitions(Load);
+
+    bool Unchanged = Definitions.equals(Read.Definitions);
+    for (SyscallRegisterStore &Store : Read.Stores)
+      Unchanged = Unchanged && isChainUnchanged(Store.Steps);
+
+    if (Unchanged) {
+      incrementCounter("nra.reused-reads");
+      continue;
+    }
+
+    incrementCounter("nra.updated-reads");
+    Changed = true;
+    Read.Definitions.assign(Definitions.begin(), Definitions.end());
+    Read.Stores.clear();
+    for (Instruction *I : Definitions) {
+      if (auto *Store = dyn_cast<StoreInst>(I)) {
+        Chain Steps;
+        bool EndsUpInRead = endsUpIn(Store, Load->getParent(), &Steps);
+        Read.Stores.push_back({ Store, EndsUpInRead, std::move(Steps) });
+      }
+    }
+  }
+
+  if (!Changed)
+    return;
+
+  SyscallRegisterDefinitions.clear();
+  for (SyscallRegisterRead &Read : SyscallRegisterReads)
+    for (SyscallRegisterStore &Store : Read.Stores)
+      if (Store.EndsUpInRead)
+        SyscallRegisterDefinitions.insert(Store.Store);
+}
+
+void NoReturnAnalysis::invalidate(const std::set<BasicBlock *> &Erased) {
+  auto IsErased = [&Erased] (Instruction *I) {
+    return Erased.count(I->getParent()) != 0;
+  };
+
+  for (auto It = RegisteredSyscalls.begin(); It != RegisteredSyscalls.end(); )
+    if (IsErased(*It))
+      It = RegisteredSyscalls.erase(It);
+    else
+      It++;
+
+  auto IsReadErased = [&IsErased] (const SyscallRegisterRead &Read) {
+    return IsErased(Read.Load);
+  };
+  auto ReadsEnd = std::remove_if(SyscallRegisterReads.begin(),
+                                 SyscallRegisterReads.end(),
+                                 IsReadErased);
+  incrementCounter("nra.invalidated-reads",
+                   SyscallRegisterReads.end() - ReadsEnd);
+  SyscallRegisterReads.erase(ReadsEnd, SyscallRegisterReads.end());
+
+  // The cached definitions and stores of the surviving reads might come from
+  // the erased code, force collectDefinitions to examine them again
+  for (SyscallRegisterRead &Read : SyscallRegisterReads) {
+    Read.Definitions.clear();
+    Read.Stores.clear();
+  }
+
+  SyscallRegisterDefinitions.clear();
+  KillerBBs.clear();
 }
 
 bool NoReturnAnalysis::setsSyscallNumber(llvm::StoreInst *Store) {
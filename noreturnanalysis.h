@@ -8,6 +8,7 @@
 // Standard includes
 #include <cstdint>
 #include <map>
+#include <set>
 #include <vector>
 
 // LLVM includes
@@ -39,8 +40,20 @@ public:
 
   /// \brief Use \p CRL to collect all the definitions reaching the sentinel
   ///        load
+  ///
+  /// The results of the previous call are kept: a sentinel load is examined
+  /// again only if its reaching definitions or the part of the CFG leading
+  /// them to the load changed.
   void collectDefinitions(ConditionalReachedLoadsPass &CRL);
 
+  /// \brief Forget everything referring to the basic blocks in \p Erased
+  ///
+  /// To be called before erasing \p Erased: the syscalls and sentinel loads
+  /// they contain are dropped and the results of collectDefinitions for all
+  /// the other sentinel loads are discarded, since they might refer to stores
+  /// in \p Erased.
+  void invalidate(const std::set<llvm::BasicBlock *> &Erased);
+
   /// \brief Return true if \p Store is ever used to write the syscall number
   bool setsSyscallNumber(llvm::StoreInst *Store);
 
@@ -101,7 +114,29 @@ private:
     }
   }
 
-  bool endsUpIn(llvm::Instruction *I, llvm::BasicBlock *Target);
+  /// \brief Steps of a chain of basic blocks, each one paired with the result
+  ///        of nextInChain on it
+  using Chain = std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>>;
+
+  /// \brief Return the only successor of \p BB ignoring the dispatcher, the
+  ///        dispatcher itself if there's more than one or nullptr if there's
+  ///        none
+  llvm::BasicBlock *nextInChain(llvm::BasicBlock *BB) const;
+
+  /// \param Steps if not nullptr, filled with the basic blocks visited to
+  ///        reach the result
+  bool endsUpIn(llvm::Instruction *I,
+                llvm::BasicBlock *Target,
+                Chain *Steps = nullptr);
+
+  /// \brief Check that the basic blocks in \p Steps are still linked as they
+  ///        were
+  bool isChainUnchanged(const Chain &Steps) const {
+    for (auto &Step : Steps)
+      if (nextInChain(Step.first) != Step.second)
+        return false;
+    return true;
+  }
 
   bool checkKiller(llvm::BasicBlock *BB) const {
     if (BB == Dispatcher)
@@ -118,10 +153,28 @@ private:
   /// \brief Register as killer basic blocks those parts of infinite loops
   void findInfinteLoops();
 
+private:
+  /// \brief A store reaching a sentinel load and whether it can only end up
+  ///        in it
+  struct SyscallRegisterStore {
+    llvm::StoreInst *Store;
+    bool EndsUpInRead;
+    Chain Steps;
+  };
+
+  /// \brief A sentinel load and the outcome of the last collectDefinitions
+  struct SyscallRegisterRead {
+    SyscallRegisterRead(llvm::LoadInst *Load) : Load(Load) { }
+
+    llvm::LoadInst *Load;
+    std::vector<llvm::Instruction *> Definitions;
+    std::vector<SyscallRegisterStore> Stores;
+  };
+
 private:
   Architecture SourceArchitecture;
   std::set<llvm::CallInst *> RegisteredSyscalls;
-  std::vector<llvm::LoadInst *> SyscallRegisterReads;
+  std::vector<SyscallRegisterRead> SyscallRegisterReads;
   std::set<llvm::StoreInst *> SyscallRegisterDefinitions;
   std::set<llvm::BasicBlock *> KillerBBs;
   llvm::BasicBlock *Dispatcher;
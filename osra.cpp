@@ -7,17 +7,26 @@
 
 // Standard includes
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <thread>
 #include <vector>
 
 // LLVM includes
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/EquivalenceClasses.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/raw_os_ostream.h"
 #include "llvm/Pass.h"
@@ -32,6 +41,7 @@
 #include "revamb.h"
 #include "ir-helpers.h"
 #include "osra.h"
+#include "statistics.h"
 
 using namespace llvm;
 
@@ -50,6 +60,7 @@ const BoundedValue::MergeType AndMerge = BoundedValue::And;
 const BoundedValue::MergeType OrMerge = BoundedValue::Or;
 
 using BVVector = SmallVector<BoundedValue, 2>;
+using Clock = std::chrono::steady_clock;
 
 template<typename C>
 static auto skip(unsigned ToSkip, C &Container)
@@ -83,6 +94,74 @@ static bool differ(SmallVector<BoundedValue, 2> &Old,
   return false;
 }
 
+/// \brief Return the value of \p C, zero-extended
+///
+/// Only constant expressions need to be folded, which creates new constants: a
+/// ConstantInt is read without taking the OSRAContextGuard.
+static uint64_t readZExtValue(Constant *C, const DataLayout &DL) {
+  if (auto *Int = dyn_cast<ConstantInt>(C))
+    return Int->getZExtValue();
+
+  OSRAContextGuard Guard;
+  return getZExtValue(C, DL);
+}
+
+/// \brief Compute \p Op1 \p Opcode \p Op2 on integers of \p Width bits
+///
+/// Equivalent to constant folding the operation on ConstantInts, but it doesn't
+/// create any constant, therefore it doesn't require the OSRAContextGuard.
+///
+/// \param Signed whether the operands and the result should be sign-extended
+///        to/from \p Width bits.
+static uint64_t foldBinaryOperator(unsigned Opcode,
+                                   bool Signed,
+                                   uint64_t Op1,
+                                   uint64_t Op2,
+                                   unsigned Width) {
+  APInt A(Width, Op1, Signed);
+  APInt B(Width, Op2, Signed);
+  APInt Result;
+
+  using I = Instruction;
+  switch (Opcode) {
+  case I::Add: Result = A + B; break;
+  case I::Sub: Result = A - B; break;
+  case I::Mul: Result = A * B; break;
+  case I::UDiv: Result = A.udiv(B); break;
+  case I::SDiv: Result = A.sdiv(B); break;
+  case I::URem: Result = A.urem(B); break;
+  case I::SRem: Result = A.srem(B); break;
+  case I::Shl: Result = A.shl(B); break;
+  case I::LShr: Result = A.lshr(B); break;
+  case I::AShr: Result = A.ashr(B); break;
+  case I::And: Result = A & B; break;
+  case I::Or: Result = A | B; break;
+  case I::Xor: Result = A ^ B; break;
+  default:
+    llvm_unreachable("Unexpected binary operator");
+  }
+
+  return Signed ? Result.getSExtValue() : Result.getZExtValue();
+}
+
+/// \brief Check if the integer comparison \p P holds for \p A and \p B
+static bool compareIntegers(unsigned P, const APInt &A, const APInt &B) {
+  switch (P) {
+  case CmpInst::ICMP_EQ: return A.eq(B);
+  case CmpInst::ICMP_NE: return A.ne(B);
+  case CmpInst::ICMP_UGT: return A.ugt(B);
+  case CmpInst::ICMP_UGE: return A.uge(B);
+  case CmpInst::ICMP_ULT: return A.ult(B);
+  case CmpInst::ICMP_ULE: return A.ule(B);
+  case CmpInst::ICMP_SGT: return A.sgt(B);
+  case CmpInst::ICMP_SGE: return A.sge(B);
+  case CmpInst::ICMP_SLT: return A.slt(B);
+  case CmpInst::ICMP_SLE: return A.sle(B);
+  default:
+    llvm_unreachable("Unexpected integer comparison");
+  }
+}
+
 // TODO: check also undefined behaviors due to shifts
 static bool isSupportedOperation(unsigned Opcode,
                                  Constant *ConstantOp,
@@ -91,7 +170,7 @@ static bool isSupportedOperation(unsigned Opcode,
   // Division by zero
   if ((Opcode == Instruction::SDiv
        || Opcode == Instruction::UDiv)
-      && getZExtValue(ConstantOp, DL) == 0)
+      && readZExtValue(ConstantOp, DL) == 0)
     return false;
 
   // Shift too much
@@ -99,7 +178,7 @@ static bool isSupportedOperation(unsigned Opcode,
   if ((Opcode == Instruction::Shl
        || Opcode == Instruction::LShr
        || Opcode == Instruction::AShr)
-      && getZExtValue(ConstantOp, DL) >= OperandTy->getBitWidth())
+      && readZExtValue(ConstantOp, DL) >= OperandTy->getBitWidth())
     return false;
 
   // 128-bit operand
@@ -140,19 +219,25 @@ static bool mergeBVVectors(BVVector &Base,
   return Result;
 }
 
+/// \brief Association between a (basic block, value) pair and its BVs
+///
+/// Basic blocks are numbered in order of appearance and the BVs of each basic
+/// block are stored contiguously, in order of creation. The MapValues are
+/// allocated in an arena, therefore references to them are stable and they are
+/// freed all at once when the BVMap is destroyed.
 class BVMap {
 private:
-  using MapIndex = std::pair<BasicBlock *, const Value *>;
   using BVWithOrigin = std::pair<BasicBlock *, BoundedValue>;
   struct MapValue {
     BoundedValue Summary;
     std::vector<BVWithOrigin> Components;
   };
+  using BlockValues = SmallVector<std::pair<const Value *, MapValue *>, 4>;
 
 public:
   BVMap() : BlockBlackList(nullptr), DL(nullptr), Int64(nullptr) { }
 
-  void initialize(std::set<BasicBlock *> *BlackList,
+  void initialize(const std::set<BasicBlock *> *BlackList,
                   const DataLayout *DL,
                   Type *Int64) {
     this->BlockBlackList = BlackList;
@@ -163,25 +248,22 @@ public:
   void describe(formatted_raw_ostream &O, const BasicBlock *BB) const;
 
   BoundedValue &get(BasicBlock *BB, const Value *V) {
-    auto Index = std::make_pair(BB, V);
-    auto MapIt = TheMap.find(Index);
-    if (MapIt == TheMap.end()) {
-      MapValue NewBVOVector;
-      NewBVOVector.Summary = BoundedValue(V);
-      auto It = TheMap.insert(std::make_pair(Index, NewBVOVector)).first;
-      return summarize(BB, &It->second);
+    MapValue *BVOs;
+    bool New;
+    std::tie(BVOs, New) = findOrCreate(BB, V);
+    if (New) {
+      BVOs->Summary = BoundedValue(V);
+      return summarize(BB, BVOs);
     }
 
-    MapValue &BVOs = MapIt->second;
-    return BVOs.Summary;
+    return BVOs->Summary;
   }
 
   BoundedValue *getEdge(BasicBlock *BB,
                         BasicBlock *Predecessor,
                         const Value *V) {
-    auto MapIt = TheMap.find({ BB, V });
-    if (MapIt != TheMap.end())
-      for (auto &Component : MapIt->second.Components)
+    if (MapValue *BVOs = find(BB, V))
+      for (auto &Component : BVOs->Components)
         if (Component.first == Predecessor)
           return &Component.second;
 
@@ -189,16 +271,14 @@ public:
   }
 
   void setSignedness(BasicBlock *BB, const Value *V, bool IsSigned) {
-    auto Index = std::make_pair(BB, V);
-    auto MapIt = TheMap.find(Index);
-    assert(MapIt != TheMap.end());
+    MapValue *BVOVector = find(BB, V);
+    assert(BVOVector != nullptr);
 
-    MapValue &BVOVector = MapIt->second;
-    BVOVector.Summary.setSignedness(IsSigned);
-    for (BVWithOrigin &BVO : BVOVector.Components)
+    BVOVector->Summary.setSignedness(IsSigned);
+    for (BVWithOrigin &BVO : BVOVector->Components)
       BVO.second.setSignedness(IsSigned);
 
-    summarize(BB, &MapIt->second);
+    summarize(BB, BVOVector);
   }
 
   /// Associate to basic block \p Target a new constraint \p NewBV coming from
@@ -210,59 +290,92 @@ public:
                                          BasicBlock *Origin,
                                          BoundedValue NewBV);
 
-  void prepareDescribe() const {
-    BBMap.clear();
-    for (auto Pair : TheMap) {
-      auto *BB = Pair.first.first;
-      if (BBMap.find(BB) == BBMap.end())
-        BBMap[BB] = std::vector<MapValue> { Pair.second };
-      else
-        BBMap[BB].push_back(Pair.second);
-    }
-  }
-
   BoundedValue &forceBV(Instruction *V, BoundedValue BV) {
-    MapIndex I { V->getParent(), V };
-    MapValue NewValue;
-    NewValue.Summary = BV;
-    TheMap[I] = NewValue;
-    return TheMap[I].Summary;
+    return forceBV(V->getParent(), V, BV);
   }
 
-  BoundedValue &forceBV(BasicBlock *BB, Value *V, BoundedValue BV) {
-    MapIndex I { BB, V };
-    MapValue NewValue;
-    NewValue.Summary = BV;
-    TheMap[I] = NewValue;
-    return TheMap[I].Summary;
+  BoundedValue &forceBV(BasicBlock *BB, const Value *V, BoundedValue BV) {
+    MapValue *BVOs = findOrCreate(BB, V).first;
+    BVOs->Components.clear();
+    BVOs->Summary = BV;
+    return BVOs->Summary;
   }
 
   void clear() {
-    freeContainer(TheMap);
-    freeContainer(BBMap);
+    freeContainer(BlockIndices);
+    freeContainer(Blocks);
+    freeContainer(Index);
+    Arena.DestroyAll();
+  }
+
+  /// \brief Return an estimate of the bytes allocated by the map
+  uint64_t memoryUsage() const {
+    uint64_t Result = BlockIndices.getMemorySize()
+      + Index.getMemorySize()
+      + vectorBytes(Blocks);
+    for (const BlockValues &Values : Blocks)
+      for (auto &P : Values)
+        Result += sizeof(MapValue) + vectorBytes(P.second->Components);
+    return Result;
   }
 
 private:
   BoundedValue &summarize(BasicBlock *Target,
                           MapValue *BVOVectorLoopInfoWrapperPass);
 
-  bool isForced(std::map<MapIndex, MapValue>::iterator &It) const {
-    const MapIndex &Index = It->first;
+  const BlockValues *blockValues(const BasicBlock *BB) const {
+    auto It = BlockIndices.find(BB);
+    if (It == BlockIndices.end())
+      return nullptr;
+    return &Blocks[It->second];
+  }
+
+  MapValue *find(const BasicBlock *BB, const Value *V) const {
+    return Index.lookup({ BB, V });
+  }
+
+  /// \brief Return the entry for \p V in \p BB, creating it if necessary
+  ///
+  /// \return the entry and whether it has been created
+  std::pair<MapValue *, bool> findOrCreate(const BasicBlock *BB,
+                                           const Value *V) {
+    auto IndexIt = Index.insert({ { BB, V }, nullptr });
+    if (!IndexIt.second)
+      return { IndexIt.first->second, false };
+
+    auto It = BlockIndices.find(BB);
+    if (It == BlockIndices.end()) {
+      It = BlockIndices.insert({ BB, Blocks.size() }).first;
+      Blocks.emplace_back();
+    }
+
+    MapValue *Result = new (Arena.Allocate()) MapValue();
+    Blocks[It->second].push_back({ V, Result });
+    IndexIt.first->second = Result;
+    return { Result, true };
+  }
 
-    if (auto *I = dyn_cast<Instruction>(Index.second)) {
-      return I->getParent() == Index.first
-        && It->second.Components.size() == 0;
+  bool isForced(const BasicBlock *BB,
+                const Value *V,
+                const MapValue &BVOs) const {
+    if (auto *I = dyn_cast<Instruction>(V)) {
+      return I->getParent() == BB && BVOs.Components.size() == 0;
     } else {
       return false;
     }
   }
 
 private:
-  std::set<BasicBlock *> *BlockBlackList;
+  const std::set<BasicBlock *> *BlockBlackList;
   const DataLayout *DL;
   Type *Int64;
-  std::map<MapIndex, MapValue> TheMap;
-  mutable std::map<const BasicBlock *, std::vector<MapValue>> BBMap;
+  /// Index in Blocks of the BVs of each basic block
+  DenseMap<const BasicBlock *, unsigned> BlockIndices;
+  /// The BVs of each basic block, in order of creation
+  std::vector<BlockValues> Blocks;
+  /// The BV of each value in each basic block
+  DenseMap<std::pair<const BasicBlock *, const Value *>, MapValue *> Index;
+  SpecificBumpPtrAllocator<MapValue> Arena;
 };
 
 class OSRA {
@@ -274,6 +387,11 @@ public:
        SimplifyComparisonsPass &SCP,
        ConditionalReachedLoadsPass &RDP,
        FunctionCallIdentification &FCI,
+       const std::set<BasicBlock *> &BlockBlackList,
+       DominatorTreeBase<BasicBlock> &PDT,
+       const std::vector<BasicBlock *> &Region,
+       const SmallPtrSetImpl<Instruction *> *Slice,
+       const Clock::time_point *Deadline,
        std::map<const Value *, const OSR> &OSRs,
        BVMap &BVs) :
     F(F),
@@ -282,16 +400,42 @@ public:
     RDP(RDP),
     FCI(FCI),
     Int64(IntegerType::get(getContext(&F), 64)),
+    BlockBlackList(BlockBlackList),
+    Region(Region),
+    Slice(Slice),
+    Deadline(Deadline),
     OSRs(OSRs),
     BVs(BVs),
-    PDT(true) { }
+    PDT(PDT) { }
 
   void run();
   void dump();
 
+  /// \brief Record the size of the temporary data structures of the analysis
+  void recordMemoryUsage() const {
+    recordContainerSize("osra.constraints", treeBytes(Constraints));
+    recordContainerSize("osra.load-reachers", treeBytes(LoadReachers));
+    recordContainerSize("osra.subscriptions", treeBytes(Subscriptions));
+  }
+
   bool inBlackList(BasicBlock *BB) { return BlockBlackList.count(BB) > 0; }
+  void enqueue(Instruction *I) {
+    if (Slice == nullptr || Slice->count(I) != 0)
+      WorkList.insert(I);
+  }
   void enqueueUsers(Instruction *I);
 
+  /// \brief Check if we've been running for too long
+  bool budgetExhausted(uint64_t Iterations) const {
+    if (OSRAMaxIterations != 0 && Iterations >= OSRAMaxIterations)
+      return true;
+
+    // Reading the clock is not free, do it only every now and then
+    return Deadline != nullptr
+      && Iterations % 1024 == 0
+      && Clock::now() >= *Deadline;
+  }
+
   void propagateConstraints(Instruction *I,
                             Value *Operand,
                             UpdateFunc Updater);
@@ -424,7 +568,13 @@ private:
   //
   // WorkList related
   //
-  std::set<BasicBlock *> BlockBlackList;
+  const std::set<BasicBlock *> &BlockBlackList;
+  /// The basic blocks this instance of the analysis is responsible for
+  const std::vector<BasicBlock *> &Region;
+  /// If not null, the only instructions to analyze
+  const SmallPtrSetImpl<Instruction *> *Slice;
+  /// If not null, when the analysis of the function has to stop
+  const Clock::time_point *Deadline;
   UniquedQueue<Instruction *> WorkList;
 
   //
@@ -445,7 +595,7 @@ private:
   using SubscribersType = SmallSet<Instruction *, 3>;
   std::map<const LoadInst *, SubscribersType> Subscriptions;
 
-  DominatorTreeBase<BasicBlock> PDT;
+  DominatorTreeBase<BasicBlock> &PDT;
 };
 
 void OSRA::propagateConstraints(Instruction *I,
@@ -492,7 +642,7 @@ void OSRA::handleArithmeticOperator(Instruction *I) {
       if (!IsFree)
         OSRs.erase(I);
 
-      uint64_t Constant = getZExtValue(ConstantOp, DL);
+      uint64_t Constant = readZExtValue(ConstantOp, DL);
       BoundedValue ConstantBV = BoundedValue::createConstant(I, Constant);
       auto &BV = BVs.forceBV(I, ConstantBV);
       OSR ConstantOSR(&BV);
@@ -703,7 +853,11 @@ Optional<BoundedValue> OSRA::applyConstraint(Instruction *I,
     if (Flip)
       Result.flip();
 
-    auto *Zero = ConstantInt::get(ConstOp->getType(), 0);
+    Constant *Zero = nullptr;
+    {
+      OSRAContextGuard Guard;
+      Zero = ConstantInt::get(ConstOp->getType(), 0);
+    }
     Result.merge(mergePredicate(BaseOp, CmpInst::ICMP_UGE, Zero), DL, Int64);
 
     if (Flip)
@@ -802,11 +956,9 @@ void OSRA::handleComparison(Instruction *I) {
 
   // We use data from SimplifiedComparisonAnalysis
   auto SC = SCP.getComparison(cast<CmpInst>(I));
-  ICmpInst *Comparison = new ICmpInst(SC.Predicate, SC.LHS, SC.RHS);
-  std::unique_ptr<ICmpInst> SimplifiedCmpInst(Comparison);
 
   // Collect general information
-  Predicate P = Comparison->getPredicate();
+  Predicate P = SC.Predicate;
   BasicBlock *BB = I->getParent();
 
   // First of all handle comparisons for equality (or inequality) with 0 of
@@ -905,12 +1057,12 @@ void OSRA::handleComparison(Instruction *I) {
 
       // Check if the comparison holds. If not, set to bottom the associate
       // value
-      Constant *LHSConstant = CI::get(T, LHSPair.first);
-      Constant *RHSConstant = CI::get(T, RHSPair.first);
-      Constant *Compare = CE::getICmp(P, LHSConstant, RHSConstant);
+      unsigned Width = cast<IntegerType>(T)->getBitWidth();
+      APInt LHSConstant(Width, LHSPair.first);
+      APInt RHSConstant(Width, RHSPair.first);
 
       // Does the comparison hold?
-      if (getLimitedValue(Compare) == 0) {
+      if (!compareIntegers(P, LHSConstant, RHSConstant)) {
         // It doens't: send everything to bottom
         if (LHSPair.second != nullptr)
           NewConstraints.push_back(BoundedValue::createBottom(LHSPair.second));
@@ -925,7 +1077,11 @@ void OSRA::handleComparison(Instruction *I) {
 
   // OSR vs const
   for (auto &RHSPair : RHS.Constants) {
-    Constant *ConstOp = CI::get(T, RHSPair.first);
+    Constant *ConstOp = nullptr;
+    {
+      OSRAContextGuard Guard;
+      ConstOp = CI::get(T, RHSPair.first);
+    }
 
     for (OSR &LHSOSR : LHS.OSRs) {
       OSR TheOSR = switchBlock(LHSOSR, BB);
@@ -939,7 +1095,11 @@ void OSRA::handleComparison(Instruction *I) {
   // const vs OSR
   ICmpInst::Predicate FP = ICmpInst::getInversePredicate(P);
   for (auto &LHSPair : LHS.Constants) {
-    Constant *ConstOp = CI::get(T, LHSPair.first);
+    Constant *ConstOp = nullptr;
+    {
+      OSRAContextGuard Guard;
+      ConstOp = CI::get(T, LHSPair.first);
+    }
 
     for (OSR &RHSOSR : RHS.OSRs) {
       OSR TheOSR = switchBlock(RHSOSR, BB);
@@ -1205,7 +1365,7 @@ void OSRA::handleBranch(Instruction *I) {
 
           for (BoundedValue &Constraint : InstructionConstraints) {
             if (Affected.count(Constraint.value()) != 0) {
-              WorkList.insert(&ConstraintUser);
+              enqueue(&ConstraintUser);
               break;
             }
           }
@@ -1231,7 +1391,7 @@ void OSRA::handleBranch(Instruction *I) {
             if (Affected.count(ReacherValue) != 0) {
               // We're affected, update
               mergeLoadReacher(Load);
-              WorkList.insert(Load);
+              enqueue(Load);
               enqueueUsers(Load);
               Affected.insert(Load);
               break;
@@ -1293,7 +1453,7 @@ void OSRA::handleMemoryOperation(Instruction *I) {
     if (auto *ConstantOp = dyn_cast<Constant>(ValueOp)) {
 
       // We're storing a constant, create a constant OSR
-      uint64_t Constant = getZExtValue(ConstantOp, DL);
+      uint64_t Constant = readZExtValue(ConstantOp, DL);
       BoundedValue ConstantBV = BoundedValue::createConstant(ConstantOp,
                                                              Constant);
       auto &BV = BVs.forceBV(I->getParent(), ConstantOp, ConstantBV);
@@ -1319,7 +1479,7 @@ void OSRA::handleMemoryOperation(Instruction *I) {
 
   }
 
-  auto &ReachedLoads = RDP.getReachedLoads(I);
+  auto ReachedLoads = RDP.getReachedLoads(I);
   for (LoadInst *ReachedLoad : ReachedLoads) {
     assert(ReachedLoad != I);
 
@@ -1355,10 +1515,10 @@ void OSRA::handleMemoryOperation(Instruction *I) {
     // If OSR or constraints have changed, mark the reached load and its uses to
     // be visited again
     if (Changed) {
-      WorkList.insert(ReachedLoad);
+      enqueue(ReachedLoad);
       enqueueUsers(ReachedLoad);
       for (Instruction *Subscriber : Subscriptions[ReachedLoad])
-        WorkList.insert(Subscriber);
+        enqueue(Subscriber);
     }
 
   }
@@ -1369,7 +1529,16 @@ void OSRA::enqueueUsers(Instruction *I) {
   for (User *U : I->users())
     if (auto *UI = dyn_cast<Instruction>(U))
       if (BlockBlackList.find(UI->getParent()) == BlockBlackList.end())
-        WorkList.insert(UI);
+        enqueue(UI);
+}
+
+unsigned OSRAJobs = 1;
+uint64_t OSRAMaxIterations = 0;
+unsigned OSRATimeout = 0;
+
+std::recursive_mutex &OSRAContextGuard::lock() {
+  static std::recursive_mutex Lock;
+  return Lock;
 }
 
 char OSRAPass::ID = 0;
@@ -1383,13 +1552,13 @@ OSRAPass::~OSRAPass() {
 void OSRAPass::releaseMemory() {
   DBG("release", { dbg << "OSRAPass is releasing memory\n"; });
   freeContainer(OSRs);
-  if (BVs) {
-    delete BVs;
-    BVs = nullptr;
-  }
+  for (BVMap *RegionBVs : BVs)
+    delete RegionBVs;
+  freeContainer(BVs);
 }
 
 Constant *OSR::evaluate(Constant *Value, Type *Int64) const {
+  OSRAContextGuard Guard;
   Constant *BaseC = CI::get(Int64, Base, BV->isSigned());
   Constant *FactorC = CI::get(Int64, Factor, BV->isSigned());
 
@@ -1407,43 +1576,6 @@ OSR::boundaries(Type *Int64, const DataLayout &DL) const {
   return { Min, Max };
 }
 
-/// \brief Combine two constants using \p Opcode operation
-///
-/// \param Opcode the opcode of the binary operator.
-/// \param Signed whether the operands are signed or not.
-/// \param Op1 the first operand.
-/// \param Op2 the second operand.
-/// \param T the type of the operands the result.
-/// \param DL the DataLayout to compute the result.
-/// \return the result of the operation.
-static uint64_t combineImpl(unsigned Opcode,
-                            bool Signed,
-                            Constant *Op1,
-                            Constant *Op2,
-                            IntegerType *T,
-                            const DataLayout &DL) {
-  auto *R = ConstantFoldInstOperands(Opcode, T, { Op1, Op2 }, DL);
-  return getExtValue(R, Signed, DL);
-}
-
-static uint64_t combineImpl(unsigned Opcode,
-                            bool Signed,
-                            uint64_t Op1,
-                            Constant *Op2,
-                            IntegerType *T,
-                            const DataLayout &DL) {
-  return combineImpl(Opcode, Signed, CI::get(T, Op1, Signed), Op2, T, DL);
-}
-
-static uint64_t combineImpl(unsigned Opcode,
-                            bool Signed,
-                            Constant *Op1,
-                            uint64_t Op2,
-                            IntegerType *T,
-                            const DataLayout &DL) {
-  return combineImpl(Opcode, Signed, Op1, CI::get(T, Op2, Signed), T, DL);
-}
-
 uint64_t BoundedValue::performOp(uint64_t Op1,
                                  unsigned Opcode,
                                  uint64_t Op2,
@@ -1459,14 +1591,7 @@ uint64_t BoundedValue::performOp(uint64_t Op1,
     Ty = cast<IntegerType>(Store->getValueOperand()->getType());
   }
 
-  // Build operands
-  bool IsSigned = isSigned();
-  auto *COp1 = CI::get(Ty, Op1, IsSigned);
-  auto *COp2 = CI::get(Ty, Op2, IsSigned);
-
-  // Compute the result
-  auto *Result = ConstantFoldInstOperands(Opcode, Ty, { COp1, COp2 }, DL);
-  return getExtValue(Result, IsSigned, DL);
+  return foldBinaryOperator(Opcode, isSigned(), Op1, Op2, Ty->getBitWidth());
 }
 
 BoundedValue BoundedValue::moveTo(llvm::Value *V,
@@ -1497,11 +1622,10 @@ bool OSR::combine(unsigned Opcode,
                   unsigned FreeOpIndex,
                   const DataLayout &DL) {
   using I = Instruction;
-  auto *TheType = cast<IntegerType>(Operand->getType());
+  unsigned Width = cast<IntegerType>(Operand->getType())->getBitWidth();
   bool Multiplicative = !(Opcode == I::Add || Opcode == I::Sub);
   bool Signed = (Opcode == I::SDiv || Opcode == I::AShr);
-
-  Operand = getConstValue(Operand, DL);
+  uint64_t OperandValue = readZExtValue(Operand, DL);
 
   uint64_t OldValue = Base;
   uint64_t OldFactor = Factor;
@@ -1515,18 +1639,18 @@ bool OSR::combine(unsigned Opcode,
     // c - x
     // x = a + b * y
     // (c - a) + (-b) * y
-    Base = combineImpl(Opcode, Signed, Operand, Base, TheType, DL);
+    Base = foldBinaryOperator(Opcode, Signed, OperandValue, Base, Width);
     Changed |= Base != OldValue;
-    auto *MinusOne = Constant::getAllOnesValue(TheType);
-    Factor = combineImpl(I::Mul, Signed, MinusOne, Factor, TheType, DL);
+    const uint64_t MinusOne = numeric_limits<uint64_t>::max();
+    Factor = foldBinaryOperator(I::Mul, Signed, MinusOne, Factor, Width);
     Changed |= OldFactor != Factor;
   } else {
     // Commutative/second operand constant case
-    Base = combineImpl(Opcode, Signed, Base, Operand, TheType, DL);
+    Base = foldBinaryOperator(Opcode, Signed, Base, OperandValue, Width);
     Changed |= Base != OldValue;
 
     if (Multiplicative) {
-      Factor = combineImpl(Opcode, Signed, Factor, Operand, TheType, DL);
+      Factor = foldBinaryOperator(Opcode, Signed, Factor, OperandValue, Width);
       Changed |= OldFactor != Factor;
 
     }
@@ -1537,19 +1661,17 @@ bool OSR::combine(unsigned Opcode,
 
 uint64_t OSR::BoundsIterator::operator*() const {
   bool IsSigned = TheOSR.BV->isSigned();
+  unsigned Width = cast<IntegerType>(TheType)->getBitWidth();
 
-  auto Const = [&] (uint64_t V) { return CI::get(TheType, V, IsSigned); };
-  auto *RangeStart = Const(Current->first);
-  auto *RangePosition = Const(Index);
-  auto *Base = Const(TheOSR.Base);
-  auto *Factor = Const(TheOSR.Factor);
-
-  auto *Result = CE::getAdd(CE::getMul(CE::getAdd(RangeStart,
-                                                  RangePosition),
-                                       Factor),
-                            Base);
+  auto Const = [Width, IsSigned] (uint64_t V) {
+    return APInt(Width, V, IsSigned);
+  };
+  APInt RangeStart = Const(Current->first);
+  APInt RangePosition = Const(Index);
+  APInt Base = Const(TheOSR.Base);
+  APInt Factor = Const(TheOSR.Factor);
 
-  return getLimitedValue(Result);
+  return ((RangeStart + RangePosition) * Factor + Base).getLimitedValue();
 }
 
 class OSRAnnotationWriter : public AssemblyAnnotationWriter {
@@ -1572,30 +1694,22 @@ private:
 
 void OSRA::run() {
   BVs.initialize(&BlockBlackList, &DL, Int64);
-  PDT.recalculate(F);
 
-  for (auto &BB : F) {
-    if (!BB.empty()) {
-      if (auto *Call = dyn_cast<CallInst>(&*BB.begin())) {
-        Function *Callee = Call->getCalledFunction();
-        // TODO: comparing with "newpc" string is sad
-        if (Callee != nullptr && Callee->getName() == "newpc")
-          break;
-      }
-    }
-
-    BlockBlackList.insert(&BB);
-  }
-
-  // Initialize the WorkList with all the instructions in the function
-  auto &BBList = F.getBasicBlockList();
-  for (auto &BB : make_range(BBList.begin(), BBList.end()))
-    if (BlockBlackList.find(&BB) == BlockBlackList.end())
-      for (auto &I : make_range(BB.begin(), BB.end()))
-        WorkList.insert(&I);
+  // Initialize the WorkList with all the instructions in the region
+  for (BasicBlock *BB : Region)
+    for (Instruction &I : *BB)
+      enqueue(&I);
 
+  uint64_t Iterations = 0;
+  bool Exhausted = false;
   while (!WorkList.empty()) {
+    if (budgetExhausted(Iterations)) {
+      Exhausted = true;
+      break;
+    }
+
     Instruction *I = WorkList.pop();
+    Iterations++;
 
     unsigned Opcode = I->getOpcode();
     switch (Opcode) {
@@ -1632,12 +1746,25 @@ void OSRA::run() {
     }
   }
 
+  incrementCounter("osra.iterations", Iterations);
+
+  // We didn't reach the fixpoint, so any of the OSRs might be wrong. Widen
+  // them all to top, i.e., forget about them, the rest of the function is not
+  // affected.
+  if (Exhausted) {
+    DBG("osr", dbg << "OSRA budget exhausted after " << std::dec
+                   << Iterations << " iterations, dropping " << OSRs.size()
+                   << " OSRs\n");
+    incrementCounter("osra.budget-exhausted");
+    incrementCounter("osra.widened-values", OSRs.size());
+    freeContainer(OSRs);
+  }
+
   DBG("osr", dump());
 
 }
 
 void OSRA::dump() {
-  BVs.prepareDescribe();
   raw_os_ostream OutputStream(dbg);
   F.getParent()->print(OutputStream, new OSRAnnotationWriter(*this));
 }
@@ -1748,6 +1875,7 @@ Constant *OSR::solveEquation(Constant *KnownTerm,
                              bool CeilingRounding,
                              const DataLayout &DL) {
   // (KnownTerm - Base) udiv Factor
+  OSRAContextGuard Guard;
   bool IsSigned = BV->isSigned();
 
   auto *BaseConst = CI::get(KnownTerm->getType(), Base, IsSigned);
@@ -1804,15 +1932,19 @@ OSRAPass::identifyOperands(std::map<const Value *, const OSR> &OSRs,
   // Is the first operand constant?
   if (auto *Operand = dyn_cast<Instruction>(FirstOp)) {
     auto OSRIt = OSRs.find(Operand);
-    if (OSRIt != OSRs.end() && OSRIt->second.isConstant())
+    if (OSRIt != OSRs.end() && OSRIt->second.isConstant()) {
+      OSRAContextGuard Guard;
       Constants[0] = CI::get(Operand->getType(), OSRIt->second.constant());
+    }
   }
 
   // Is the second operand constant?
   if (auto *Operand = dyn_cast<Instruction>(SecondOp)) {
     auto OSRIt = OSRs.find(Operand);
-    if (OSRIt != OSRs.end() && OSRIt->second.isConstant())
+    if (OSRIt != OSRs.end() && OSRIt->second.isConstant()) {
+      OSRAContextGuard Guard;
       Constants[1] = CI::get(Operand->getType(), OSRIt->second.constant());
+    }
   }
 
   // No constant operands
@@ -1821,6 +1953,7 @@ OSRAPass::identifyOperands(std::map<const Value *, const OSR> &OSRs,
 
   // Both operands are constant, constant fold them
   if (Constants[0] != nullptr && Constants[1] != nullptr) {
+    OSRAContextGuard Guard;
     Instruction *Clone = I->clone();
     Clone->setOperand(0, Constants[0]);
     Clone->setOperand(1, Constants[1]);
@@ -2271,6 +2404,149 @@ BoundedValue OSRA::pathSensitiveMerge(LoadInst *Reached) {
   return FinalBV;
 }
 
+/// \brief Collect the instructions affecting the stores to \p PCReg
+///
+/// The slice starts from the stores of a non-constant value to \p PCReg and
+/// includes, transitively, the operands of each instruction and the
+/// definitions reaching each load. Comparisons are included, along with the
+/// branches using them, if their operands are in the slice or are loads sharing
+/// a reaching definition with the slice, since they might constrain its values.
+static void computeSlice(Function &F,
+                         const Value *PCReg,
+                         const std::set<BasicBlock *> &BlackList,
+                         SimplifyComparisonsPass &SCP,
+                         ConditionalReachedLoadsPass &RDP,
+                         SmallPtrSetImpl<Instruction *> &Slice) {
+  std::vector<Instruction *> WorkList;
+  auto Add = [&BlackList, &Slice, &WorkList] (Value *V) {
+    if (auto *I = dyn_cast<Instruction>(V))
+      if (BlackList.count(I->getParent()) == 0 && Slice.insert(I).second)
+        WorkList.push_back(I);
+  };
+
+  auto IsRelevant = [&Slice, &RDP] (Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (I == nullptr)
+      return false;
+
+    if (Slice.count(I) != 0)
+      return true;
+
+    if (auto *Load = dyn_cast<LoadInst>(I))
+      for (Instruction *Definition : RDP.getReachingDefinitions(Load))
+        if (Slice.count(Definition) != 0)
+          return true;
+
+    return false;
+  };
+
+  std::vector<CmpInst *> Comparisons;
+  for (BasicBlock &BB : F) {
+    if (BlackList.count(&BB) != 0)
+      continue;
+
+    for (Instruction &I : BB) {
+      if (auto *Store = dyn_cast<StoreInst>(&I)) {
+        if (Store->getPointerOperand() == PCReg
+            && !isa<Constant>(Store->getValueOperand()))
+          Add(Store);
+      } else if (auto *Comparison = dyn_cast<CmpInst>(&I)) {
+        Comparisons.push_back(Comparison);
+      }
+    }
+  }
+
+  do {
+    while (!WorkList.empty()) {
+      Instruction *I = WorkList.back();
+      WorkList.pop_back();
+
+      for (Value *Operand : I->operands())
+        Add(Operand);
+
+      if (auto *Load = dyn_cast<LoadInst>(I))
+        for (Instruction *Definition : RDP.getReachingDefinitions(Load))
+          Add(Definition);
+    }
+
+    // Include the comparisons which might constrain the slice, this can bring
+    // in new instructions
+    for (CmpInst *Comparison : Comparisons) {
+      if (Slice.count(Comparison) != 0)
+        continue;
+
+      auto SC = SCP.getComparison(Comparison);
+      if (!IsRelevant(SC.LHS)
+          && !IsRelevant(SC.RHS)
+          && !IsRelevant(Comparison->getOperand(0))
+          && !IsRelevant(Comparison->getOperand(1)))
+        continue;
+
+      Add(Comparison);
+      Add(SC.LHS);
+      Add(SC.RHS);
+      for (User *U : Comparison->users())
+        if (isa<BranchInst>(U))
+          Add(U);
+    }
+  } while (!WorkList.empty());
+}
+
+/// \brief Partition the basic blocks not in \p BlackList in independent regions
+///
+/// Two basic blocks belong to the same region if there's a CFG edge between
+/// them, if an instruction of one is used in the other or if a memory access of
+/// one reaches a load of the other. The analysis of a region therefore never
+/// looks at instructions of another region. Regions are sorted by the position
+/// of their first basic block in the function.
+static std::vector<std::vector<BasicBlock *>>
+computeRegions(Function &F,
+               const std::set<BasicBlock *> &BlackList,
+               ConditionalReachedLoadsPass &RDP) {
+  EquivalenceClasses<BasicBlock *> Classes;
+  auto Merge = [&BlackList, &Classes] (BasicBlock *A, BasicBlock *B) {
+    if (BlackList.count(B) == 0)
+      Classes.unionSets(A, B);
+  };
+
+  for (BasicBlock &BB : F) {
+    if (BlackList.count(&BB) != 0)
+      continue;
+
+    Classes.insert(&BB);
+
+    for (BasicBlock *Successor : successors(&BB))
+      Merge(&BB, Successor);
+
+    for (Instruction &I : BB) {
+      for (User *U : I.users())
+        if (auto *UserInst = dyn_cast<Instruction>(U))
+          Merge(&BB, UserInst->getParent());
+
+      if (isa<LoadInst>(&I) || isa<StoreInst>(&I))
+        for (LoadInst *Load : RDP.getReachedLoads(&I))
+          Merge(&BB, Load->getParent());
+    }
+  }
+
+  std::vector<std::vector<BasicBlock *>> Result;
+  DenseMap<BasicBlock *, unsigned> RegionIndex;
+  for (BasicBlock &BB : F) {
+    if (BlackList.count(&BB) != 0)
+      continue;
+
+    BasicBlock *Leader = Classes.getLeaderValue(&BB);
+    auto It = RegionIndex.find(Leader);
+    if (It == RegionIndex.end()) {
+      It = RegionIndex.insert({ Leader, Result.size() }).first;
+      Result.emplace_back();
+    }
+    Result[It->second].push_back(&BB);
+  }
+
+  return Result;
+}
+
 // Terminology:
 //
 // * OSR: Offset Shifted Range, our main data flow value which represents the
@@ -2280,26 +2556,116 @@ BoundedValue OSRA::pathSensitiveMerge(LoadInst *Reached) {
 // * free value: a value we can't represent as an OSR of another value
 // * bounded variable (or BV): a free value and the range within which it lies.
 bool OSRAPass::runOnFunction(Function &F) {
+  ScopedPhase Phase("osra");
   DBG("passes", { dbg << "Starting OSRAPass\n"; });
 
   releaseMemory();
-  BVs = new BVMap();
 
-  OSRA TheOSRA(F,
-               getAnalysis<SimplifyComparisonsPass>(),
-               getAnalysis<ConditionalReachedLoadsPass>(),
-               getAnalysis<FunctionCallIdentification>(),
-               OSRs,
-               *BVs);
-  TheOSRA.run();
+  auto &SCP = getAnalysis<SimplifyComparisonsPass>();
+  auto &RDP = getAnalysis<ConditionalReachedLoadsPass>();
+  auto &FCI = getAnalysis<FunctionCallIdentification>();
+
+  // Ignore all the basic blocks preceding the first one starting with a call
+  // to newpc
+  std::set<BasicBlock *> BlockBlackList;
+  for (auto &BB : F) {
+    if (!BB.empty()) {
+      if (auto *Call = dyn_cast<CallInst>(&*BB.begin())) {
+        Function *Callee = Call->getCalledFunction();
+        // TODO: comparing with "newpc" string is sad
+        if (Callee != nullptr && Callee->getName() == "newpc")
+          break;
+      }
+    }
+
+    BlockBlackList.insert(&BB);
+  }
+
+  // The post-dominator tree is shared among the regions: compute the DFS
+  // numbers upfront so that querying it never updates it
+  DominatorTreeBase<BasicBlock> PDT(true);
+  PDT.recalculate(F);
+  PDT.updateDFSNumbers();
+
+  SmallPtrSet<Instruction *, 16> Slice;
+  if (PCReg != nullptr) {
+    computeSlice(F, PCReg, BlockBlackList, SCP, RDP, Slice);
+    incrementCounter("osra.sliced-instructions", Slice.size());
+  }
+
+  // Run serially on the whole function, unless we've been asked to use
+  // multiple threads. The debug output can't be interleaved.
+  unsigned Jobs = DebuggingEnabled ? 1 : OSRAJobs;
+  std::vector<std::vector<BasicBlock *>> Regions;
+  if (Jobs > 1) {
+    Regions = computeRegions(F, BlockBlackList, RDP);
+  } else {
+    Regions.emplace_back();
+    for (BasicBlock &BB : F)
+      if (BlockBlackList.count(&BB) == 0)
+        Regions.back().push_back(&BB);
+  }
+  incrementCounter("osra.regions", Regions.size());
+
+  std::vector<std::map<const Value *, const OSR>> RegionOSRs(Regions.size());
+  for (unsigned I = 0; I < Regions.size(); I++)
+    BVs.push_back(new BVMap());
+
+  // The time budget is for the whole function, shared among its regions
+  Clock::time_point Deadline = Clock::now() + std::chrono::seconds(OSRATimeout);
+  const Clock::time_point *DeadlinePtr = OSRATimeout != 0 ? &Deadline : nullptr;
+
+  std::atomic<unsigned> NextRegion(0);
+  auto Worker = [&] () {
+    unsigned Index;
+    while ((Index = NextRegion++) < Regions.size()) {
+      OSRA TheOSRA(F,
+                   SCP,
+                   RDP,
+                   FCI,
+                   BlockBlackList,
+                   PDT,
+                   Regions[Index],
+                   PCReg != nullptr ? &Slice : nullptr,
+                   DeadlinePtr,
+                   RegionOSRs[Index],
+                   *BVs[Index]);
+      TheOSRA.run();
+
+      if (MemoryReportEnabled)
+        TheOSRA.recordMemoryUsage();
+    }
+  };
+
+  Jobs = std::min<size_t>(Jobs, Regions.size());
+  if (Jobs > 1) {
+    std::vector<std::thread> Threads;
+    for (unsigned I = 0; I < Jobs; I++)
+      Threads.emplace_back(Worker);
+    for (std::thread &Thread : Threads)
+      Thread.join();
+  } else {
+    Worker();
+  }
+
+  // Regions are disjoint, so are their results
+  for (auto &Result : RegionOSRs)
+    OSRs.insert(Result.begin(), Result.end());
+
+  if (MemoryReportEnabled) {
+    recordContainerSize("osra.osrs", treeBytes(OSRs));
+    for (BVMap *BV : BVs)
+      recordContainerSize("osra.bvmap", BV->memoryUsage());
+  }
 
   DBG("passes", { dbg << "Ending OSRAPass\n"; });
   return false;
 }
 
 void BVMap::describe(formatted_raw_ostream &O, const BasicBlock *BB) const {
-  if (BBMap.find(BB) != BBMap.end())
-    for (MapValue &MV : BBMap[BB]) {
+  if (const BlockValues *Values = blockValues(BB))
+    for (auto &P : *Values) {
+      const MapValue &MV = *P.second;
       O << "  ; ";
 
       {
@@ -2341,26 +2707,23 @@ std::pair<bool, BoundedValue &> BVMap::update(BasicBlock *Target,
       dbg << ": ";
     });
 
-  auto Index = make_pair(Target, NewBV.value());
-  auto MapIt = TheMap.find(Index);
   MapValue *BVOVector = nullptr;
+  bool New;
+  std::tie(BVOVector, New) = findOrCreate(Target, NewBV.value());
 
   // Have we ever seen this value for this basic block?
-  if (MapIt == TheMap.end()) {
+  if (New) {
     DBG("osr-bv", dbg << "new\n");
 
     // No, just insert it
-    MapValue NewBVOVector;
-    NewBVOVector.Components.push_back({ make_pair(Origin, NewBV) });
-    BVOVector = &TheMap.insert({ Index, NewBVOVector }).first->second;
+    BVOVector->Components.push_back({ make_pair(Origin, NewBV) });
     return { true, summarize(Target, BVOVector) };
-  } else if (isForced(MapIt)) {
+  } else if (isForced(Target, NewBV.value(), *BVOVector)) {
     DBG("osr-bv", dbg << "forced\n");
 
-    return { false, MapIt->second.Summary };
+    return { false, BVOVector->Summary };
   } else {
     bool Changed = true;
-    BVOVector = &MapIt->second;
 
     // Look for an entry with the given origin
     BoundedValue *Base = nullptr;
@@ -2434,9 +2797,10 @@ bool OSR::compare(unsigned short P,
                   Constant *C,
                   const DataLayout &DL,
                   Type *Int64) {
-  Constant *BaseConstant = CI::get(Int64, Base);
-  Constant *Compare = CE::getCompare(P, BaseConstant, C);
-  return getConstValue(Compare, DL)->getLimitedValue() != 0;
+  unsigned Width = cast<IntegerType>(Int64)->getBitWidth();
+  APInt BaseConstant(Width, Base);
+  APInt Other(Width, readZExtValue(C, DL));
+  return compareIntegers(P, BaseConstant, Other);
 }
 
 void BoundedValue::setSignedness(bool IsSigned) {
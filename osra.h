@@ -8,8 +8,11 @@
 // Standard includes
 #include <cstdint>
 #include <map>
+#include <mutex>
+#include <vector>
 
 // LLVM includes
+#include "llvm/ADT/APInt.h"
 #include "llvm/Pass.h"
 
 // Local includes
@@ -35,12 +38,58 @@ class Value;
 class BVMap;
 class BoundedValueHelpers;
 
+/// \brief Maximum number of threads OSRAPass can use, see --osra-jobs
+extern unsigned OSRAJobs;
+
+/// \brief Maximum number of iterations of OSRA on a region, 0 for no limit
+extern uint64_t OSRAMaxIterations;
+
+/// \brief Maximum number of seconds of OSRA on a function, 0 for no limit
+extern unsigned OSRATimeout;
+
+/// \brief Serialize the accesses to the LLVMContext performed by OSRA
+///
+/// OSRA creates constants and temporary instructions, which updates the
+/// uniquing tables of the LLVMContext and the use lists of the operands. None
+/// of them is thread-safe, therefore, if OSRA is allowed to run on multiple
+/// threads, these operations are performed holding a global lock. The
+/// arithmetic on the bounds and on the OSRs is performed on APInts instead,
+/// so that the workers hold the lock only to create new constants.
+class OSRAContextGuard {
+public:
+  OSRAContextGuard() : Locked(OSRAJobs > 1) {
+    if (Locked)
+      lock().lock();
+  }
+
+  ~OSRAContextGuard() {
+    if (Locked)
+      lock().unlock();
+  }
+
+private:
+  static std::recursive_mutex &lock();
+
+private:
+  bool Locked;
+};
+
 /// \brief DFA to represent values as a + b * x, with c < x < d
 class OSRAPass : public llvm::FunctionPass {
 public:
   static char ID;
 
-  OSRAPass() : llvm::FunctionPass(ID), BVs(nullptr) { }
+  OSRAPass() : llvm::FunctionPass(ID), PCReg(nullptr) { }
+
+  /// \brief Only analyze what's needed to resolve the stores to \p PCReg
+  ///
+  /// Instead of the whole function, OSRA only considers the backward slice of
+  /// the stores of a non-constant value to \p PCReg, along with the comparisons
+  /// constraining the values in it. The OSR of any other instruction is not
+  /// available.
+  explicit OSRAPass(const llvm::Value *PCReg) :
+    llvm::FunctionPass(ID),
+    PCReg(PCReg) { }
 
   bool runOnFunction(llvm::Function &F) override;
 
@@ -153,6 +202,7 @@ public:
       assert(Bounds.size() > 0);
 
       using CI = llvm::ConstantInt;
+      OSRAContextGuard Guard;
       uint64_t LowerBound = Bounds.front().first;
       uint64_t UpperBound = Bounds.back().second;
       if (!Negated) {
@@ -439,15 +489,14 @@ public:
       BV(Other.BV) { }
 
     uint64_t constant() const {
-      using CE = llvm::ConstantExpr;
-      using CI = llvm::ConstantInt;
-      using Constant = llvm::Constant;
-      llvm::Type *T = BV->value()->getType();
+      using APInt = llvm::APInt;
+      auto *T = llvm::cast<llvm::IntegerType>(BV->value()->getType());
+      unsigned Width = T->getBitWidth();
 
-      Constant *ConstantC = CI::get(T, BV->constant());
-      Constant *FactorC = CI::get(T, Factor);
-      Constant *BaseC = CI::get(T, Base);
-      return getLimitedValue(CE::getAdd(CE::getMul(ConstantC, FactorC), BaseC));
+      APInt ConstantC(Width, BV->constant());
+      APInt FactorC(Width, Factor);
+      APInt BaseC(Width, Base);
+      return (ConstantC * FactorC + BaseC).getLimitedValue();
     }
 
     /// \brief Combine this OSR with \p Operand through \p Opcode
@@ -649,9 +698,12 @@ private:
   ~OSRAPass();
 
 private:
+  /// If not null, restrict the analysis to the slice of the stores to it
+  const llvm::Value *PCReg;
   // TODO: why value and not instruction?
   std::map<const llvm::Value *, const OSR> OSRs;
-  BVMap *BVs;
+  /// The BVs of each independent region of the function
+  std::vector<BVMap *> BVs;
 };
 
 #endif // _OSRA_H
@@ -0,0 +1,102 @@
+/// \file pcindex.cpp
+/// \brief Implementation of the PC lookup of PCIndex
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cassert>
+#include <queue>
+#include <set>
+
+// LLVM includes
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+// Local includes
+#include "ir-helpers.h"
+#include "pcindex.h"
+
+using namespace llvm;
+
+/// \brief Return the first call to newpc going from \p I to \p End, or nullptr
+static CallInst *findMarker(BasicBlock::reverse_iterator I,
+                            BasicBlock::reverse_iterator End) {
+  for (; I != End; I++) {
+    if (auto Marker = dyn_cast<CallInst>(&*I)) {
+      // TODO: comparing strings is not very elegant
+      auto *Callee = Marker->getCalledFunction();
+      if (Callee != nullptr && Callee->getName() == "newpc")
+        return Marker;
+    }
+  }
+
+  return nullptr;
+}
+
+static PCIndex::PCAndSize getPCAndSize(CallInst *NewPCCall) {
+  uint64_t PC = getLimitedValue(NewPCCall->getArgOperand(0));
+  uint64_t Size = getLimitedValue(NewPCCall->getArgOperand(1));
+  assert(Size != 0);
+  return { PC, Size };
+}
+
+PCIndex::PCAndSize PCIndex::getPC(Instruction *TheInstruction,
+                                  const BasicBlock *Dispatcher) const {
+  BasicBlock *Start = TheInstruction->getParent();
+  BasicBlock::reverse_iterator First;
+  if (TheInstruction->getIterator() == Start->begin())
+    First = --Start->rend();
+  else
+    First = make_reverse_iterator(TheInstruction);
+
+  // Usually the marker is in the same basic block or the basic block has been
+  // recorded during translation
+  if (CallInst *Marker = findMarker(First, Start->rend()))
+    return getPCAndSize(Marker);
+
+  auto It = BlockPCs.find(Start);
+  if (It != BlockPCs.end())
+    return It->second;
+
+  // Explore the predecessors backward, looking for a single newpc call
+  CallInst *NewPCCall = nullptr;
+  std::set<BasicBlock *> Visited;
+  std::queue<BasicBlock *> WorkList;
+  auto Enqueue = [&Visited, &WorkList, Dispatcher] (BasicBlock *BB) {
+    for (BasicBlock *Predecessor : predecessors(BB)) {
+      // Assert we didn't reach the almighty dispatcher
+      assert(Predecessor != Dispatcher);
+
+      // Ignore already visited or empty BBs
+      if (!Predecessor->empty() && Visited.insert(Predecessor).second)
+        WorkList.push(Predecessor);
+    }
+  };
+
+  Enqueue(Start);
+  while (!WorkList.empty()) {
+    BasicBlock *BB = WorkList.front();
+    WorkList.pop();
+
+    if (CallInst *Marker = findMarker(BB->rbegin(), BB->rend())) {
+      // We found two distinct newpc leading to the requested instruction
+      if (NewPCCall != nullptr)
+        return { 0, 0 };
+
+      NewPCCall = Marker;
+    } else if (NewPCCall == nullptr) {
+      // If we haven't find a newpc call yet, continue exploration backward
+      Enqueue(BB);
+    }
+  }
+
+  // Couldn't find the current PC
+  if (NewPCCall == nullptr)
+    return { 0, 0 };
+
+  return getPCAndSize(NewPCCall);
+}
@@ -0,0 +1,77 @@
+#ifndef _PCINDEX_H
+#define _PCINDEX_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+#include <utility>
+
+// LLVM includes
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/IR/ValueMap.h"
+
+// Forward declarations
+namespace llvm {
+class BasicBlock;
+class Instruction;
+}
+
+/// \brief Side table to find the input instruction generating an instruction
+///
+/// The translation of each input instruction starts with a call to `newpc`,
+/// therefore the PC of an instruction is given by the closest `newpc` call
+/// preceeding it in its basic block. The basic blocks created while
+/// translating an input instruction (e.g., for a PTC label) don't start with
+/// a call to `newpc`: the translator records here their input instruction, so
+/// that looking up their PC doesn't require exploring the CFG backward. The
+/// entry of a basic block is dropped when the basic block is deleted.
+///
+/// For the basic blocks which have not been recorded (e.g., those in a module
+/// loaded from a file), the predecessors are explored backward looking for a
+/// single `newpc` call.
+class PCIndex {
+public:
+  /// The PC and the size of an input instruction
+  using PCAndSize = std::pair<uint64_t, uint64_t>;
+
+  /// \brief Record that the code at the beginning of \p BB, up to the first
+  ///        call to `newpc`, belongs to the instruction at \p PC
+  void setBlockPC(llvm::BasicBlock *BB, uint64_t PC, uint64_t Size) {
+    BlockPCs[BB] = { PC, Size };
+  }
+
+  /// \brief Return the instruction the beginning of \p BB belongs to, if it
+  ///        has been recorded
+  llvm::Optional<PCAndSize> blockPC(llvm::BasicBlock *BB) const {
+    auto It = BlockPCs.find(BB);
+    if (It == BlockPCs.end())
+      return llvm::Optional<PCAndSize>();
+    return It->second;
+  }
+
+  /// \brief Find the PC which lead to generated \p TheInstruction
+  ///
+  /// \param Dispatcher the dispatcher, the backward exploration must never
+  ///        reach it.
+  ///
+  /// \return a pair of integers: the first element represents the PC and the
+  ///         second the size of the instruction. If the PC can't be
+  ///         determined uniquely, both are 0.
+  PCAndSize getPC(llvm::Instruction *TheInstruction,
+                  const llvm::BasicBlock *Dispatcher) const;
+
+  /// \brief Estimate of the memory used by the table, in bytes
+  uint64_t memoryUsage() const {
+    // Each entry holds a callback value handle for the key
+    return BlockPCs.size() * (sizeof(llvm::CallbackVH) + sizeof(PCAndSize));
+  }
+
+private:
+  llvm::ValueMap<llvm::BasicBlock *, PCAndSize> BlockPCs;
+};
+
+#endif // _PCINDEX_H
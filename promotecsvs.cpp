@@ -0,0 +1,116 @@
+/// \file promotecsvs.cpp
+/// \brief Implementation of the PromoteCSVsPass
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <vector>
+
+// LLVM includes
+#include "llvm/ADT/BitVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+// Local includes
+#include "csvaccesses.h"
+#include "promotecsvs.h"
+#include "statistics.h"
+
+using namespace llvm;
+
+char PromoteCSVsPass::ID = 0;
+static RegisterPass<PromoteCSVsPass> X("promote-csvs",
+                                       "Promote CSVs Pass",
+                                       false,
+                                       false);
+
+bool PromoteCSVsPass::runOnModule(Module &M) {
+  if (Root == nullptr)
+    return false;
+
+  CSVAccessAnalysis Analysis(M, Root, CSVs);
+  const std::vector<GlobalVariable *> &Promoted = Analysis.csvs();
+  if (Promoted.empty())
+    return false;
+
+  unsigned Size = Promoted.size();
+
+  // Replace the CSVs with local variables in root
+  BasicBlock &Entry = Root->getEntryBlock();
+  IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+  std::vector<AllocaInst *> Locals;
+  for (GlobalVariable *CSV : Promoted) {
+    Type *CSVType = CSV->getType()->getPointerElementType();
+    Locals.push_back(EntryBuilder.CreateAlloca(CSVType,
+                                               nullptr,
+                                               CSV->getName()));
+
+    std::vector<Instruction *> RootUsers;
+    for (User *U : CSV->users()) {
+      auto *I = cast<Instruction>(U);
+      if (I->getParent() != nullptr && I->getParent()->getParent() == Root)
+        RootUsers.push_back(I);
+    }
+
+    for (Instruction *I : RootUsers)
+      I->replaceUsesOfWith(CSV, Locals.back());
+  }
+
+  // Initialize the local variables
+  for (unsigned I = 0; I < Size; I++)
+    EntryBuilder.CreateStore(EntryBuilder.CreateLoad(Promoted[I]), Locals[I]);
+
+  unsigned Spills = 0;
+  unsigned Reloads = 0;
+  auto Spill = [&] (Instruction *Before, const BitVector &ToSpill) {
+    IRBuilder<> Builder(Before);
+    for (int I = ToSpill.find_first(); I != -1; I = ToSpill.find_next(I)) {
+      Builder.CreateStore(Builder.CreateLoad(Locals[I]), Promoted[I]);
+      Spills++;
+    }
+  };
+  auto Reload = [&] (Instruction *Before, const BitVector &ToReload) {
+    IRBuilder<> Builder(Before);
+    for (int I = ToReload.find_first(); I != -1; I = ToReload.find_next(I)) {
+      Builder.CreateStore(Builder.CreateLoad(Promoted[I]), Locals[I]);
+      Reloads++;
+    }
+  };
+
+  std::vector<CallInst *> RootCalls;
+  std::vector<ReturnInst *> RootReturns;
+  for (BasicBlock &BB : *Root) {
+    for (Instruction &I : BB) {
+      if (auto *Call = dyn_cast<CallInst>(&I))
+        RootCalls.push_back(Call);
+      else if (auto *Return = dyn_cast<ReturnInst>(&I))
+        RootReturns.push_back(Return);
+    }
+  }
+
+  // Before a call, write back what the callee might read or partially write,
+  // after it, reload what it might have written
+  for (CallInst *Call : RootCalls) {
+    const CSVAccesses &Callee = Analysis.callee(Call);
+    BitVector ToSpill = Callee.Read;
+    ToSpill |= Callee.Written;
+    Spill(Call, ToSpill);
+
+    Instruction *Next = Call->getNextNode();
+    if (!isa<UnreachableInst>(Next))
+      Reload(Next, Callee.Written);
+  }
+
+  for (ReturnInst *Return : RootReturns)
+    Spill(Return, Analysis.all().Read);
+
+  setCounter("csv.promoted", Size);
+  setCounter("csv.spills", Spills);
+  setCounter("csv.reloads", Reloads);
+
+  return true;
+}
@@ -0,0 +1,51 @@
+#ifndef _PROMOTECSVS_H
+#define _PROMOTECSVS_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <vector>
+
+// LLVM includes
+#include "llvm/Pass.h"
+
+namespace llvm {
+class Function;
+class GlobalVariable;
+}
+
+/// \brief Keep the CPU state variables in local variables of the root function
+///
+/// Each CPU state variable (CSV) accessed by the root function gets an
+/// `alloca`, initialized from the global variable at the beginning of the
+/// function, which replaces all the accesses in the root function and that
+/// can later be promoted to SSA values by SROA.
+///
+/// The global variable is kept in sync only where it's required: before a
+/// call to a function which might read or write the CSV (e.g., a helper), the
+/// local copy is stored to the global variable, and after a call to a
+/// function which might write it, it's loaded back. The same holds for
+/// returns. Which CSVs each function accesses is computed by
+/// CSVAccessAnalysis, CSVs it doesn't track are left untouched.
+class PromoteCSVsPass : public llvm::ModulePass {
+public:
+  static char ID;
+
+  PromoteCSVsPass() : llvm::ModulePass(ID), Root(nullptr) { }
+
+  PromoteCSVsPass(llvm::Function *Root,
+                  std::vector<llvm::GlobalVariable *> CSVs) :
+    llvm::ModulePass(ID),
+    Root(Root),
+    CSVs(std::move(CSVs)) { }
+
+  bool runOnModule(llvm::Module &M) override;
+
+private:
+  llvm::Function *Root;
+  std::vector<llvm::GlobalVariable *> CSVs;
+};
+
+#endif // _PROMOTECSVS_H
@@ -0,0 +1,215 @@
+/// \file ptccache.cpp
+/// \brief This file handles the persistent cache of the PTC translations
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+// LLVM includes
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+
+// Local includes
+#include "binaryfile.h"
+#include "debug.h"
+#include "ptccache.h"
+
+using namespace llvm;
+
+static const char Magic[4] = { 'P', 'T', 'C', 'C' };
+static const uint32_t FormatVersion = 1;
+static const uint32_t NoName = 0xFFFFFFFF;
+
+/// Header of a cache entry, followed by the instructions, the temporaries and
+/// the names of the temporaries
+struct EntryHeader {
+  char Magic[4];
+  uint32_t Version;
+  uint32_t InstructionSize;
+  uint32_t TempSize;
+  uint64_t PC;
+  uint64_t ConsumedSize;
+  uint8_t Digest[16];
+  uint32_t InstructionCount;
+  uint32_t TotalTemps;
+  uint32_t GlobalTemps;
+};
+
+template<typename T>
+static bool readRaw(std::istream &Stream, T *Buffer, size_t Count = 1) {
+  Stream.read(reinterpret_cast<char *>(Buffer), sizeof(T) * Count);
+  return static_cast<bool>(Stream);
+}
+
+template<typename T>
+static void writeRaw(std::ostream &Stream, const T *Buffer, size_t Count = 1) {
+  Stream.write(reinterpret_cast<const char *>(Buffer), sizeof(T) * Count);
+}
+
+PTCCache::PTCCache(std::string Directory, const BinaryFile &Binary) :
+  Directory(Directory),
+  Binary(Binary),
+  Hits(0),
+  Misses(0) {
+  std::error_code Error = sys::fs::create_directories(Directory);
+  if (Error) {
+    dbg << "Couldn't create the PTC cache directory " << Directory << ": "
+        << Error.message() << "\n";
+    abort();
+  }
+}
+
+std::string PTCCache::entryPath(uint64_t PC) const {
+  std::stringstream Result;
+  Result << Directory << "/" << Binary.architecture().name()
+         << "-" << std::hex << PC << ".ptc";
+  return Result.str();
+}
+
+bool PTCCache::digest(uint64_t PC, uint64_t Size, uint8_t Result[16]) const {
+  Optional<ArrayRef<uint8_t>> Data = Binary.getAddressData(PC);
+  if (!Data || Data->size() < Size)
+    return false;
+
+  MD5 Hasher;
+  Hasher.update(Data->slice(0, Size));
+  MD5::MD5Result Digest;
+  Hasher.final(Digest);
+  static_assert(sizeof(Digest) == 16, "Unexpected MD5 digest size");
+  memcpy(Result, &Digest, 16);
+
+  return true;
+}
+
+PTCInstructionListPtr PTCCache::load(uint64_t PC, size_t &ConsumedSize) {
+  auto Miss = [this] () {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Misses++;
+    return PTCInstructionListPtr();
+  };
+
+  std::ifstream Stream(entryPath(PC), std::ios::binary);
+  if (!Stream)
+    return Miss();
+
+  EntryHeader Header;
+  if (!readRaw(Stream, &Header)
+      || memcmp(Header.Magic, Magic, sizeof(Magic)) != 0
+      || Header.Version != FormatVersion
+      || Header.InstructionSize != sizeof(PTCInstruction)
+      || Header.TempSize != sizeof(PTCTemp)
+      || Header.PC != PC)
+    return Miss();
+
+  // Check the input code didn't change
+  uint8_t Digest[16];
+  if (!digest(PC, Header.ConsumedSize, Digest)
+      || memcmp(Digest, Header.Digest, sizeof(Digest)) != 0)
+    return Miss();
+
+  // ptc_instruction_list_free releases the arrays with free
+  PTCInstructionListPtr Result(new PTCInstructionList);
+  memset(Result.get(), 0, sizeof(PTCInstructionList));
+  Result->instruction_count = Header.InstructionCount;
+  Result->total_temps = Header.TotalTemps;
+  Result->global_temps = Header.GlobalTemps;
+  size_t InstructionsSize = sizeof(PTCInstruction) * Header.InstructionCount;
+  size_t TempsSize = sizeof(PTCTemp) * Header.TotalTemps;
+  Result->instructions = static_cast<PTCInstruction *>(malloc(InstructionsSize));
+  Result->temps = static_cast<PTCTemp *>(malloc(TempsSize));
+
+  if (!readRaw(Stream, Result->instructions, Header.InstructionCount)
+      || !readRaw(Stream, Result->temps, Header.TotalTemps))
+    return Miss();
+
+  // Restore the names of the temporaries, they have to survive the list
+  std::vector<std::string> TempNames(Header.TotalTemps);
+  std::vector<bool> HasName(Header.TotalTemps);
+  for (unsigned I = 0; I < Header.TotalTemps; I++) {
+    uint32_t Length;
+    if (!readRaw(Stream, &Length))
+      return Miss();
+
+    HasName[I] = Length != NoName;
+    if (HasName[I]) {
+      TempNames[I].resize(Length);
+      if (Length != 0 && !readRaw(Stream, &TempNames[I][0], Length))
+        return Miss();
+    }
+  }
+
+  std::unique_lock<std::mutex> Guard(Lock);
+  for (unsigned I = 0; I < Header.TotalTemps; I++) {
+    if (HasName[I])
+      Result->temps[I].name = Names.insert(TempNames[I]).first->c_str();
+    else
+      Result->temps[I].name = nullptr;
+  }
+  Hits++;
+
+  ConsumedSize = Header.ConsumedSize;
+  return Result;
+}
+
+void PTCCache::store(uint64_t PC,
+                     PTCInstructionList *Instructions,
+                     size_t ConsumedSize) {
+  EntryHeader Header;
+  memset(&Header, 0, sizeof(Header));
+  memcpy(Header.Magic, Magic, sizeof(Magic));
+  Header.Version = FormatVersion;
+  Header.InstructionSize = sizeof(PTCInstruction);
+  Header.TempSize = sizeof(PTCTemp);
+  Header.PC = PC;
+  Header.ConsumedSize = ConsumedSize;
+  Header.InstructionCount = Instructions->instruction_count;
+  Header.TotalTemps = Instructions->total_temps;
+  Header.GlobalTemps = Instructions->global_temps;
+
+  // Do not cache code we cannot validate
+  if (!digest(PC, ConsumedSize, Header.Digest))
+    return;
+
+  // Write to a temporary file and then rename it, so other instances of
+  // revamb sharing the cache never see partial entries
+  std::string Path = entryPath(PC);
+  std::stringstream TemporaryPath;
+  TemporaryPath << Path << ".tmp." << getpid() << "." << this;
+
+  {
+    std::ofstream Stream(TemporaryPath.str(), std::ios::binary);
+    if (!Stream)
+      return;
+
+    writeRaw(Stream, &Header);
+    writeRaw(Stream, Instructions->instructions, Header.InstructionCount);
+    writeRaw(Stream, Instructions->temps, Header.TotalTemps);
+
+    for (unsigned I = 0; I < Header.TotalTemps; I++) {
+      const char *Name = Instructions->temps[I].name;
+      uint32_t Length = Name == nullptr ? NoName : strlen(Name);
+      writeRaw(Stream, &Length);
+      if (Name != nullptr)
+        writeRaw(Stream, Name, Length);
+    }
+
+    if (!Stream)
+      return;
+  }
+
+  if (sys::fs::rename(TemporaryPath.str(), Path))
+    sys::fs::remove(TemporaryPath.str());
+}
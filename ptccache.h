@@ -0,0 +1,74 @@
+#ifndef _PTCCACHE_H
+#define _PTCCACHE_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+// Local includes
+#include "ptcinterface.h"
+
+class BinaryFile;
+
+/// \brief Persistent, on-disk, cache of the translations produced by
+///        libtinycode
+///
+/// Each entry is stored in a file named after the input architecture and the
+/// PC of the translation block, and records the size of the translated code
+/// along with the MD5 of its bytes. An entry is considered valid only if the
+/// digest matches the current content of the input binary, therefore the same
+/// cache directory can be shared among different versions of a program.
+///
+/// \note The cache is not aware of the libtinycode version in use, clear it
+///       after updating QEMU.
+class PTCCache {
+public:
+  /// \param Directory the path of the cache directory, it will be created if
+  ///        it doesn't exist.
+  /// \param Binary the input binary, used to validate the entries.
+  PTCCache(std::string Directory, const BinaryFile &Binary);
+
+  /// \brief Look for a valid translation of the code at \p PC
+  ///
+  /// \param PC the address of the translation block.
+  /// \param ConsumedSize where the size of the translated code will be stored.
+  ///
+  /// \return the cached PTCInstructionList, or `nullptr` on a miss.
+  PTCInstructionListPtr load(uint64_t PC, size_t &ConsumedSize);
+
+  /// \brief Record the translation of the code at \p PC
+  void store(uint64_t PC,
+             PTCInstructionList *Instructions,
+             size_t ConsumedSize);
+
+  unsigned hits() const { return Hits; }
+  unsigned misses() const { return Misses; }
+
+private:
+  std::string entryPath(uint64_t PC) const;
+
+  /// \brief Compute the MD5 of the input code in [\p PC, \p PC + \p Size)
+  ///
+  /// \return false if the range is not entirely available in a segment.
+  bool digest(uint64_t PC, uint64_t Size, uint8_t Result[16]) const;
+
+private:
+  std::string Directory;
+  const BinaryFile &Binary;
+
+  /// Protects the fields below, load and store can be invoked by multiple
+  /// threads
+  std::mutex Lock;
+  /// Owns the names of the temporaries of the loaded translations
+  std::set<std::string> Names;
+  unsigned Hits;
+  unsigned Misses;
+};
+
+#endif // _PTCCACHE_H
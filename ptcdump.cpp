@@ -12,6 +12,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 
 // Local includes
 #include "ptcinterface.h"
@@ -242,7 +243,10 @@ void disassembleOriginal(std::ostream& Result, uint64_t PC) {
 
   // Using SIZE_MAX is not very nice but the code should disassemble only a
   // single instruction nonetheless.
-  ptc.disassemble(MemoryStream, PC, SIZE_MAX, 1);
+  {
+    std::unique_lock<std::mutex> Guard(PTCLock);
+    ptc.disassemble(MemoryStream, PC, SIZE_MAX, 1);
+  }
   fflush(MemoryStream);
 
   assert(BufferPtr != nullptr);
@@ -7,6 +7,7 @@
 
 // Standard includes
 #include <memory>
+#include <mutex>
 
 // Local includes
 #include "revamb.h"
@@ -21,4 +22,10 @@ using PTCInstructionListPtr = std::unique_ptr<PTCInstructionList,
 
 extern PTCInterface ptc;
 
+/// \brief Serializes the accesses to libtinycode's global state
+///
+/// Take this lock around calls which might touch libtinycode's internal state
+/// (e.g., `ptc.translate` and `ptc.disassemble`) if they can run concurrently.
+extern std::mutex PTCLock;
+
 #endif // _PTCINTERFACE_H
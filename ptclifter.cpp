@@ -0,0 +1,145 @@
+/// \file ptclifter.cpp
+/// \brief This file handles the translation of the input code to PTC, possibly
+///        ahead of time, on a set of worker threads
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cassert>
+
+// Local includes
+#include "debug.h"
+#include "ptccache.h"
+#include "ptclifter.h"
+
+PTCLifter::PTCLifter(unsigned Jobs, PTCCache *Cache) :
+  Cache(Cache),
+  Quit(false) {
+  for (unsigned I = 0; I < Jobs; I++)
+    Workers.emplace_back(&PTCLifter::work, this);
+}
+
+PTCLifter::~PTCLifter() {
+  {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Quit = true;
+  }
+  WorkAvailable.notify_all();
+
+  for (std::thread &Worker : Workers)
+    Worker.join();
+
+  // Release the translations which have never been consumed
+  for (auto &P : Ready)
+    PTCInstructionListPtr Discard(P.second.Instructions);
+}
+
+void PTCLifter::prefetch(uint64_t PC) {
+  if (Workers.empty())
+    return;
+
+  {
+    std::unique_lock<std::mutex> Guard(Lock);
+    if (!Requested.insert(PC).second)
+      return;
+    Pending.push_back(PC);
+  }
+
+  WorkAvailable.notify_one();
+}
+
+PTCLifter::Translation PTCLifter::translateLocked(uint64_t PC) {
+  Translation Result;
+
+  if (Cache != nullptr) {
+    PTCInstructionListPtr Cached = Cache->load(PC, Result.ConsumedSize);
+    if (Cached) {
+      Result.Instructions = Cached.release();
+      return Result;
+    }
+  }
+
+  PTCInstructionListPtr Instructions(new PTCInstructionList);
+  {
+    std::unique_lock<std::mutex> Guard(PTCLock);
+    Result.ConsumedSize = ptc.translate(PC, Instructions.get());
+  }
+
+  if (Cache != nullptr)
+    Cache->store(PC, Instructions.get(), Result.ConsumedSize);
+
+  Result.Instructions = Instructions.release();
+  return Result;
+}
+
+PTCInstructionListPtr PTCLifter::translate(uint64_t PC, size_t &ConsumedSize) {
+  if (!Workers.empty()) {
+    std::unique_lock<std::mutex> Guard(Lock);
+
+    if (Requested.count(PC) != 0) {
+      // Drop the request if nobody picked it up yet, we're going to translate
+      // it ourselves
+      bool Dropped = false;
+      for (auto It = Pending.begin(); It != Pending.end(); It++) {
+        if (*It == PC) {
+          Pending.erase(It);
+          Dropped = true;
+          break;
+        }
+      }
+
+      if (!Dropped) {
+        // A worker is on it, wait for the result
+        TranslationReady.wait(Guard, [this, PC] {
+          return Ready.count(PC) != 0;
+        });
+
+        auto It = Ready.find(PC);
+        Translation Result = It->second;
+        Ready.erase(It);
+        Requested.erase(PC);
+
+        DBG("lift", dbg << "Prefetched translation of 0x"
+            << std::hex << PC << " used\n");
+
+        ConsumedSize = Result.ConsumedSize;
+        return PTCInstructionListPtr(Result.Instructions);
+      }
+
+      Requested.erase(PC);
+    }
+  }
+
+  Translation Result = translateLocked(PC);
+  ConsumedSize = Result.ConsumedSize;
+  return PTCInstructionListPtr(Result.Instructions);
+}
+
+void PTCLifter::work() {
+  while (true) {
+    uint64_t PC;
+
+    {
+      std::unique_lock<std::mutex> Guard(Lock);
+      WorkAvailable.wait(Guard, [this] { return Quit || !Pending.empty(); });
+
+      if (Quit)
+        return;
+
+      PC = Pending.front();
+      Pending.pop_front();
+    }
+
+    Translation Result = translateLocked(PC);
+
+    {
+      std::unique_lock<std::mutex> Guard(Lock);
+      assert(Ready.count(PC) == 0);
+      Ready[PC] = Result;
+    }
+
+    TranslationReady.notify_all();
+  }
+}
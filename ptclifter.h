@@ -0,0 +1,101 @@
+#ifndef _PTCLIFTER_H
+#define _PTCLIFTER_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Local includes
+#include "ptcinterface.h"
+
+class PTCCache;
+
+/// \brief Pre-decodes translation blocks with libtinycode ahead of IR emission
+///
+/// PTCLifter owns a pool of worker threads consuming a queue of program
+/// counters (typically the top of the jump targets worklist) and producing the
+/// corresponding PTCInstructionList. The thread emitting LLVM IR obtains the
+/// lists through translate(), which will not wait if the translation is
+/// already available.
+///
+/// \note libtinycode keeps its state in global variables, therefore the actual
+///       calls to `ptc.translate` are serialized on PTCLock. The gain comes
+///       from overlapping decoding with the LLVM IR emission.
+class PTCLifter {
+public:
+  /// \param Jobs the number of worker threads. If 0, no thread is spawned and
+  ///        translate() simply calls libtinycode synchronously.
+  /// \param Cache an optional persistent cache to query before invoking
+  ///        libtinycode.
+  PTCLifter(unsigned Jobs, PTCCache *Cache = nullptr);
+
+  ~PTCLifter();
+
+  /// \brief Enqueue \p PC for translation by the worker threads
+  ///
+  /// Requests for a PC which has already been requested and not yet consumed
+  /// are ignored.
+  void prefetch(uint64_t PC);
+
+  /// \brief Obtain the translation of the code at \p PC
+  ///
+  /// If the translation has been prefetched it's handed over to the caller
+  /// (waiting for it to be completed, if necessary), otherwise it's performed
+  /// on the spot.
+  ///
+  /// \param PC the address of the code to translate.
+  /// \param ConsumedSize where the size of the translated code will be stored.
+  ///
+  /// \return the PTCInstructionList corresponding to \p PC.
+  PTCInstructionListPtr translate(uint64_t PC, size_t &ConsumedSize);
+
+  /// \brief Number of worker threads
+  unsigned jobs() const { return Workers.size(); }
+
+private:
+  /// \note Instructions is owned by whoever holds the Translation, we don't
+  ///       use PTCInstructionListPtr here to keep libtinycode's deleter out of
+  ///       the class layout.
+  struct Translation {
+    Translation() : Instructions(nullptr), ConsumedSize(0) { }
+
+    PTCInstructionList *Instructions;
+    size_t ConsumedSize;
+  };
+
+  /// \brief Translate \p PC using the cache or libtinycode, serializing on
+  ///        PTCLock
+  Translation translateLocked(uint64_t PC);
+
+  /// \brief Main loop of the worker threads
+  void work();
+
+private:
+  PTCCache *Cache;
+  std::vector<std::thread> Workers;
+
+  /// Protects all the fields below
+  std::mutex Lock;
+  std::condition_variable WorkAvailable;
+  std::condition_variable TranslationReady;
+  bool Quit;
+
+  /// PCs still waiting for a worker
+  std::deque<uint64_t> Pending;
+  /// PCs requested, but not yet handed over through translate()
+  std::set<uint64_t> Requested;
+  /// Completed translations
+  std::map<uint64_t, Translation> Ready;
+};
+
+#endif // _PTCLIFTER_H
@@ -28,6 +28,7 @@
 #include "functioncallidentification.h"
 #include "ir-helpers.h"
 #include "reachingdefinitions.h"
+#include "statistics.h"
 
 // #include "valgrind/callgrind.h"
 
@@ -43,23 +44,23 @@ using std::vector;
 using IndexesVector = SmallVector<int32_t, 2>;
 
 template<class BBI, ReachingDefinitionsResult R>
-const vector<LoadInst *> &
+ArrayRef<LoadInst *>
 ReachingDefinitionsImplPass<BBI, R>::getReachedLoads(const Instruction *Definition) {
   assert(R == ReachingDefinitionsResult::ReachedLoads);
-  return ReachedLoads[Definition];
+  return ReachedLoads.get(Definition);
 }
 
 template<class BBI, ReachingDefinitionsResult R>
-const vector<Instruction *> &
+ArrayRef<Instruction *>
 ReachingDefinitionsImplPass<BBI, R>::getReachingDefinitions(const LoadInst *Load) {
-  return ReachingDefinitions[Load];
+  return ReachingDefinitions.get(Load);
 }
 
 template<class B, ReachingDefinitionsResult R>
 unsigned
 ReachingDefinitionsImplPass<B, R>::getReachingDefinitionsCount(const LoadInst *Load) {
   assert(R == ReachingDefinitionsResult::ReachedLoads);
-  return ReachingDefinitionsCount[Load];
+  return ReachingDefinitions.get(Load).size();
 }
 
 using RDP = ReachingDefinitionsResult;
@@ -197,6 +198,279 @@ ConditionalReachedLoadsPass::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<FunctionCallIdentification>();
 }
 
+// OnDemandReachingDefinitionsPass methods implementation
+
+bool OnDemandReachingDefinitions = false;
+
+char OnDemandReachingDefinitionsPass::ID = 0;
+
+static RegisterPass<OnDemandReachingDefinitionsPass> W("ordp",
+                                                       "On Demand Reaching"
+                                                       " Definitions Pass",
+                                                       true,
+                                                       true);
+
+void OnDemandReachingDefinitionsPass::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+  AU.addRequired<FunctionCallIdentification>();
+}
+
+bool OnDemandReachingDefinitionsPass::runOnFunction(Function &F) {
+  DBG("passes", { dbg << "Starting OnDemandReachingDefinitionsPass\n"; });
+
+  releaseMemory();
+  FCI = &getAnalysis<FunctionCallIdentification>();
+  DL = &F.getParent()->getDataLayout();
+
+  // Nothing is propagated to the basic blocks preceeding the first newpc, as
+  // in ReachingDefinitionsPass
+  for (auto &BB : F) {
+    if (!BB.empty()) {
+      if (auto *Call = dyn_cast<CallInst>(&*BB.begin())) {
+        Function *Callee = Call->getCalledFunction();
+        // TODO: comparing with "newpc" string is sad
+        if (Callee != nullptr && Callee->getName() == "newpc")
+          break;
+      }
+    }
+    BasicBlockBlackList.insert(&BB);
+  }
+
+  DBG("passes", { dbg << "Ending OnDemandReachingDefinitionsPass\n"; });
+
+  return false;
+}
+
+const MemoryAccess &OnDemandReachingDefinitionsPass::getAccess(Instruction *I) {
+  auto It = Accesses.find(I);
+  if (It == Accesses.end())
+    It = Accesses.insert({ I, MemoryAccess(I, *DL) }).first;
+  return It->second;
+}
+
+ArrayRef<Instruction *>
+OnDemandReachingDefinitionsPass::getReachingDefinitions(const LoadInst *Load) {
+  // Free loads have no reaching definitions, they are definitions themselves
+  auto *TheLoad = const_cast<LoadInst *>(Load);
+  if (!getAccess(TheLoad).isValid() || isFree(TheLoad))
+    return { };
+
+  return Walked[Load];
+}
+
+const vector<Instruction *> &
+OnDemandReachingDefinitionsPass::walk(LoadInst *Load) {
+  auto It = Walked.find(Load);
+  if (It != Walked.end())
+    return It->second;
+
+  // Once we meet a free load, the loads preceeding it are no longer
+  // definitions, only the stores are
+  struct WorkItem {
+    BasicBlock *BB;
+    Instruction *End;
+    bool StoresOnly;
+  };
+
+  // The state of the walk from a load. Checking if a load met during the walk
+  // is free requires walking from it, which is done pushing a new frame.
+  struct Frame {
+    Frame(LoadInst *Load, const MemoryAccess &TargetMA, size_t Index) :
+      Load(Load),
+      TargetMA(TargetMA),
+      WorkList({ { Load->getParent(), Load, false } }),
+      BB(nullptr),
+      StoresOnly(false),
+      Killed(false),
+      Steps(0),
+      DependsOn(Index) { }
+
+    LoadInst *Load;
+    MemoryAccess TargetMA;
+    set<Instruction *> Definitions;
+    set<pair<BasicBlock *, bool>> Visited;
+    vector<WorkItem> WorkList;
+
+    // The basic block being scanned, nullptr if a new one has to be popped
+    // from WorkList
+    BasicBlock *BB;
+    BasicBlock::iterator I;
+    bool StoresOnly;
+    bool Killed;
+
+    unsigned Steps;
+
+    /// Index of the outermost frame whose load was met while still in
+    /// progress during this walk or the walks it triggered
+    size_t DependsOn;
+  };
+
+  vector<Frame> Stack;
+  std::map<const LoadInst *, size_t> InProgress;
+
+  // Result of the last frame popped from the stack, if not memoized
+  vector<Instruction *> ChildResult;
+  const LoadInst *Child = nullptr;
+
+  auto Push = [this, &Stack, &InProgress] (LoadInst *L) {
+    incrementCounter("ordp.queries");
+    InProgress[L] = Stack.size();
+    Stack.emplace_back(L, getAccess(L), Stack.size());
+  };
+
+  Push(Load);
+  vector<Instruction *> *Result = nullptr;
+  while (!Stack.empty()) {
+    size_t Index = Stack.size() - 1;
+    Frame &Top = Stack.back();
+    bool Suspended = false;
+
+    while (!Suspended && (Top.BB != nullptr || !Top.WorkList.empty())) {
+      if (Top.BB == nullptr) {
+        WorkItem Item = Top.WorkList.back();
+        Top.WorkList.pop_back();
+
+        if (++Top.Steps > MaxSteps) {
+          // Give up, the load will be considered free
+          incrementCounter("ordp.capped-queries");
+          Top.Definitions.clear();
+          Top.WorkList.clear();
+          break;
+        }
+
+        // Scan the basic block backward, starting from End (excluded) or from
+        // the end of the basic block
+        Top.BB = Item.BB;
+        Top.StoresOnly = Item.StoresOnly;
+        Top.Killed = false;
+        Top.I = Item.End != nullptr ? Item.End->getIterator() : Item.BB->end();
+      }
+
+      BasicBlock::iterator Begin = Top.BB->begin();
+      while (!Top.Killed && Top.I != Begin) {
+        Instruction *Current = &*std::prev(Top.I);
+
+        if (auto *Store = dyn_cast<StoreInst>(Current)) {
+          const MemoryAccess &MA = getAccess(Store);
+          if (MA.isValid()) {
+            if (MA == Top.TargetMA)
+              Top.Definitions.insert(Store);
+            Top.Killed = MA.mayAlias(Top.TargetMA);
+          }
+
+        } else if (auto *Other = dyn_cast<LoadInst>(Current)) {
+          const MemoryAccess &MA = getAccess(Other);
+          if (!Top.StoresOnly && MA.isValid() && MA == Top.TargetMA) {
+            bool OtherIsFree = false;
+            if (Other == Top.Load) {
+              // Self-reaching
+              Top.Definitions.insert(Other);
+              Top.Killed = true;
+            } else if (Child == Other) {
+              // We just walked from Other, but we couldn't memoize the result
+              OtherIsFree = isFree(Other, ChildResult);
+            } else if (Walked.count(Other) != 0) {
+              OtherIsFree = isFree(Other, Walked[Other]);
+            } else {
+              auto InProgressIt = InProgress.find(Other);
+              if (InProgressIt != InProgress.end()) {
+                // A load we're still walking from is reaching itself
+                OtherIsFree = true;
+                Top.DependsOn = std::min(Top.DependsOn, InProgressIt->second);
+              } else {
+                // Suspend this walk, we'll resume from Other
+                Push(Other);
+                Suspended = true;
+                break;
+              }
+            }
+            Child = nullptr;
+
+            if (OtherIsFree) {
+              Top.Definitions.insert(Other);
+              Top.StoresOnly = true;
+            }
+          }
+
+        }
+
+        --Top.I;
+      }
+
+      if (Suspended)
+        break;
+
+      // The basic block is over, enqueue its predecessors
+      BasicBlock *BB = Top.BB;
+      bool StoresOnly = Top.StoresOnly;
+      Top.BB = nullptr;
+      if (Top.Killed || BasicBlockBlackList.count(BB) != 0)
+        continue;
+
+      // Definitions do not reach the successors of a function call
+      for (BasicBlock *Predecessor : predecessors(BB))
+        if (!FCI->isCall(Predecessor)
+            && Top.Visited.insert({ Predecessor, StoresOnly }).second)
+          Top.WorkList.push_back({ Predecessor, nullptr, StoresOnly });
+    }
+
+    if (Suspended)
+      continue;
+
+    // The walk from Top.Load is over. std::set is sorted, as
+    // ReachingDefinitionsPass results.
+    vector<Instruction *> Definitions(Top.Definitions.begin(),
+                                      Top.Definitions.end());
+    LoadInst *Done = Top.Load;
+    size_t DependsOn = Top.DependsOn;
+    InProgress.erase(Done);
+    Stack.pop_back();
+
+    DBG("rdp", {
+        dbg << getName(Done) << " is reached by:";
+        for (auto *Definition : Definitions)
+          dbg << " " << getName(Definition);
+        dbg << "\n";
+      });
+
+    // Memoize the result only if it didn't rely on an outer walk still in
+    // progress, otherwise hand it to the parent frame only
+    if (DependsOn == Index) {
+      vector<Instruction *> &Memoized = Walked[Done];
+      Memoized = std::move(Definitions);
+      if (Stack.empty())
+        Result = &Memoized;
+    } else {
+      incrementCounter("ordp.unmemoized-queries");
+      assert(!Stack.empty());
+      Stack.back().DependsOn = std::min(Stack.back().DependsOn, DependsOn);
+      ChildResult = std::move(Definitions);
+      Child = Done;
+    }
+  }
+
+  assert(Result != nullptr);
+  return *Result;
+}
+
+// ReachingDefinitionsQuery methods implementation
+
+void ReachingDefinitionsQuery::addRequired(AnalysisUsage &AU) {
+  if (OnDemandReachingDefinitions)
+    AU.addRequired<OnDemandReachingDefinitionsPass>();
+  else
+    AU.addRequired<ReachingDefinitionsPass>();
+}
+
+ReachingDefinitionsQuery ReachingDefinitionsQuery::get(Pass &P) {
+  ReachingDefinitionsQuery Result;
+  if (OnDemandReachingDefinitions)
+    Result.OnDemand = &P.getAnalysis<OnDemandReachingDefinitionsPass>();
+  else
+    Result.Full = &P.getAnalysis<ReachingDefinitionsPass>();
+  return Result;
+}
+
 static size_t combine(size_t A, size_t B) {
   return (A << 1 | A >> 31) ^ B;
 }
@@ -219,12 +493,12 @@ static bool isSupportedOperator(unsigned Opcode) {
 
 class ConditionHash {
 public:
-  ConditionHash(ReachingDefinitionsPass &RDP) : RDP(RDP) { }
+  ConditionHash(ReachingDefinitionsQuery &RDP) : RDP(RDP) { }
 
   size_t operator()(BranchInst * const& V) const;
 
 private:
-  ReachingDefinitionsPass &RDP;
+  ReachingDefinitionsQuery &RDP;
 };
 
 size_t ConditionHash::operator()(BranchInst * const& B) const {
@@ -272,12 +546,12 @@ size_t ConditionHash::operator()(BranchInst * const& B) const {
 
 class ConditionEqualTo {
 public:
-  ConditionEqualTo(ReachingDefinitionsPass &RDP) : RDP(RDP) { }
+  ConditionEqualTo(ReachingDefinitionsQuery &RDP) : RDP(RDP) { }
 
   bool operator()(BranchInst * const& A, BranchInst * const& B) const;
 
 private:
-  ReachingDefinitionsPass &RDP;
+  ReachingDefinitionsQuery &RDP;
 };
 
 bool ConditionEqualTo::operator()(BranchInst * const& BA,
@@ -335,7 +609,7 @@ bool ConditionEqualTo::operator()(BranchInst * const& BA,
 }
 
 static SmallSet<BasicBlock *, 2>
-resettingBasicBlocks(ReachingDefinitionsPass &RDP, BranchInst * const& Branch) {
+resettingBasicBlocks(ReachingDefinitionsQuery &RDP, BranchInst * const& Branch) {
   SmallSet<BasicBlock *, 2> Result;
   Value *A = Branch->getCondition();
   queue<Value *> WorkList;
@@ -465,7 +739,7 @@ bool ConditionNumberingPass::runOnFunction(Function &F) {
   DBG("passes", { dbg << "Starting ConditionNumberingPass\n"; });
 
   LLVMContext &C = F.getParent()->getContext();
-  auto &RDP = getAnalysis<ReachingDefinitionsPass>();
+  auto RDP = ReachingDefinitionsQuery::get(*this);
   unordered_map<BranchInst *,
                 SmallVector<BranchInst *, 1>,
                 ConditionHash,
@@ -608,71 +882,148 @@ bool ConditionNumberingPass::runOnFunction(Function &F) {
   return false;
 }
 
-void BasicBlockInfo::dump(std::ostream &Output) {
-  set<Instruction *> Printed;
-  for (const MemoryInstruction &MI : Reaching) {
-    Instruction *V = MI.I;
-    if (Printed.count(V) == 0) {
-      Printed.insert(V);
-      Output << " " << getName(V);
+void DefinitionNumbering::initialize(Function &F, TypeSizeProvider &TSP) {
+  clear();
+
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      if (!isa<LoadInst>(&I) && !isa<StoreInst>(&I))
+        continue;
+
+      MemoryInstruction MI(&I, TSP);
+      const MemoryAccess &MA = MI.MA;
+      if (!MA.isValid())
+        continue;
+
+      unsigned Index = Instructions.size();
+      Instructions.push_back(MI);
+      Indexes[&I] = Index;
+
+      // Get the base
+      auto BaseIt = BaseIndexes.find(MA.base());
+      if (BaseIt == BaseIndexes.end()) {
+        BaseIt = BaseIndexes.insert({ MA.base(), Bases.size() }).first;
+        Bases.emplace_back();
+      }
+      unsigned BaseIndex = BaseIt->second;
+
+      // Get the location
+      LocationKey Key(MA.base(), MA.isCPUState(), MA.offset(), MA.size());
+      auto LocationIt = LocationIndexes.find(Key);
+      if (LocationIt == LocationIndexes.end()) {
+        LocationIt = LocationIndexes.insert({ Key, Locations.size() }).first;
+        Locations.emplace_back(MA, BaseIndex);
+        if (MA.isRegisterAndOffset())
+          Bases[BaseIndex].RegisterAndOffsetLocations.push_back(Locations.size()
+                                                                - 1);
+      }
+      unsigned LocationIndex = LocationIt->second;
+      LocationOf.push_back(LocationIndex);
+
+      // Register the memory access in all the relevant sets
+      Location &TheLocation = Locations[LocationIndex];
+      TheLocation.All.set(Index);
+      if (isa<LoadInst>(&I))
+        TheLocation.Loads.set(Index);
+
+      Base &TheBase = Bases[BaseIndex];
+      TheBase.All.set(Index);
+      if (MA.isCPUState()) {
+        TheBase.CPUState.set(Index);
+      } else {
+        TheBase.RegisterAndOffset.set(Index);
+        AllRegisterAndOffset.set(Index);
+      }
     }
   }
 }
 
-void BasicBlockInfo::newDefinition(StoreInst *Store, TypeSizeProvider &TSP) {
-  // Remove all the aliased reaching definitions
-  MemoryAccess TargetMA(Store, TSP);
-  removeDefinitions([&TargetMA] (MemoryInstruction &MI) {
-      return TargetMA.mayAlias(MI.MA);
-    });
+void DefinitionNumbering::clear() {
+  freeContainer(Instructions);
+  freeContainer(Indexes);
+  freeContainer(LocationOf);
+  freeContainer(Locations);
+  freeContainer(LocationIndexes);
+  freeContainer(Bases);
+  freeContainer(BaseIndexes);
+  AllRegisterAndOffset.clear();
+}
 
-  // Add this definition
-  Definitions.push_back(MemoryInstruction(Store, TSP));
+void DefinitionNumbering::kill(Definitions &Target, unsigned Index) {
+  Location &TheLocation = Locations[LocationOf[Index]];
+  Base &TheBase = Bases[TheLocation.Base];
+
+  // A store to the CPU state aliases everything involving the same part of the
+  // CPU state, see MemoryAccess::mayAlias
+  if (TheLocation.MA.isCPUState()) {
+    Target.intersectWithComplement(TheBase.All);
+    return;
+  }
+
+  // A store relative to a register aliases all the memory accesses relative to
+  // other registers, those overlapping relative to the same register and the
+  // register itself
+  if (!TheLocation.HasOverlapping) {
+    for (unsigned Other : TheBase.RegisterAndOffsetLocations)
+      if (TheLocation.MA.mayAlias(Locations[Other].MA))
+        TheLocation.Overlapping.push_back(Other);
+    TheLocation.HasOverlapping = true;
+  }
+
+  Definitions Preserved = Target;
+  Preserved &= TheBase.RegisterAndOffset;
+  for (unsigned Other : TheLocation.Overlapping)
+    Preserved.intersectWithComplement(Locations[Other].All);
+
+  Target.intersectWithComplement(AllRegisterAndOffset);
+  Target.intersectWithComplement(TheBase.CPUState);
+  Target |= Preserved;
+}
+
+void BasicBlockInfo::dump(std::ostream &Output) {
+  for (unsigned Index : Reaching)
+    Output << " " << getName(Numbering->definition(Index).I);
+}
+
+void BasicBlockInfo::newDefinition(StoreInst *Store, TypeSizeProvider &TSP) {
+  // Remove all the aliased reaching definitions and add this one
+  unsigned Index = Numbering->index(Store);
+  Numbering->kill(Definitions, Index);
+  Definitions.set(Index);
 }
 
 LoadDefinitionType BasicBlockInfo::newDefinition(LoadInst *Load,
                                                  TypeSizeProvider &TSP) {
-  LoadDefinitionType Result = NoReachingDefinitions;
+  unsigned Index = Numbering->index(Load);
 
-  // Check if it's a self-referencing load
-  MemoryAccess TargetMA(Load, TSP);
-  for (auto &MI : Definitions) {
-    auto *Definition = MI.I;
-    if (Definition == Load) {
-      // It's self-referencing, suppress all the matching loads
-      removeDefinitions([&TargetMA] (MemoryInstruction &MI) {
-          return isa<LoadInst>(MI.I) && TargetMA == MI.MA;
-        });
-      Result = SelfReaching;
-      break;
-    } else if (TargetMA == MI.MA) {
-      Result = HasReachingDefinitions;
-    }
+  // Check if it's a self-referencing load, if so suppress all the matching
+  // loads
+  if (Definitions.test(Index)) {
+    Definitions.intersectWithComplement(Numbering->loads(Index));
+    return SelfReaching;
   }
 
-  // Add this definition
-  if (Result == NoReachingDefinitions)
-    Definitions.push_back(MemoryInstruction(Load, TSP));
+  if (Definitions.intersects(Numbering->location(Index)))
+    return HasReachingDefinitions;
 
-  return Result;
+  // Add this definition
+  Definitions.set(Index);
+  return NoReachingDefinitions;
 }
 
 bool BasicBlockInfo::propagateTo(BasicBlockInfo &Target,
                                  TypeSizeProvider &TSP,
                                  const IndexesVector &,
                                  int32_t NewConditionIndex) {
-  bool Changed = false;
-  for (MemoryInstruction &Definition : Definitions)
-    Changed |= Target.Reaching.insert(Definition).second;
-
-  return Changed;
+  return Target.Reaching |= Definitions;
 }
 
 vector<pair<Instruction *, MemoryAccess>>
 BasicBlockInfo::getReachingDefinitions(set<LoadInst *> &WhiteList,
                                        TypeSizeProvider &TSP) {
   vector<pair<Instruction *, MemoryAccess>> Result;
-  for (const MemoryInstruction &MI : Reaching) {
+  for (unsigned Index : Reaching) {
+    const MemoryInstruction &MI = Numbering->definition(Index);
     Instruction *I = MI.I;
     if (auto *Load = dyn_cast<LoadInst>(I)) {
       // If it's a load check it's whitelisted
@@ -684,8 +1035,7 @@ BasicBlockInfo::getReachingDefinitions(set<LoadInst *> &WhiteList,
     }
   }
 
-  freeContainer(Reaching);
-  assert(Reaching.size() == 0);
+  Reaching.clear();
 
   return Result;
 }
@@ -771,19 +1121,20 @@ ConditionalBasicBlockInfo::getReachingDefinitions(set<LoadInst *> &WhiteList,
   return Result;
 }
 
-bool ConditionalBasicBlockInfo::setIndexIfSeen(BitVector &Target,
-                                               int32_t Index) const {
-  auto ConditionIt = std::find(SeenConditions.begin(),
-                               SeenConditions.end(),
-                               Index);
+bool ConditionSet::merge(const ConditionSet &Other) {
+  if (Other.empty())
+    return false;
 
-  // If present set the corresponding bit in Defined
-  if (ConditionIt != SeenConditions.end()) {
-    Target.set(ConditionIt - SeenConditions.begin());
-    return true;
-  }
+  SmallVector<int32_t, 4> Result;
+  std::set_union(Conditions.begin(), Conditions.end(),
+                 Other.Conditions.begin(), Other.Conditions.end(),
+                 std::back_inserter(Result));
 
-  return false;
+  if (Result.size() == Conditions.size())
+    return false;
+
+  Conditions.assign(Result.begin(), Result.end());
+  return true;
 }
 
 bool
@@ -793,86 +1144,54 @@ ConditionalBasicBlockInfo::propagateTo(ConditionalBasicBlockInfo &Target,
                                        int32_t NewConditionIndex) {
   bool Changed = false;
 
-  // Get (and insert, if necessary) the bit associated to the new
-  // condition. This bit will be set in all the definitions being propagated.
+  // Add the new condition to the target. It will also be set in all the
+  // definitions being propagated.
   DBG("rdp-propagation", dbg << "  Adding conditions:");
-  unsigned NewConditionBitIndex = Target.getConditionIndex(NewConditionIndex);
-  if (NewConditionIndex != 0 && !Target.Conditions[NewConditionBitIndex]) {
-    Target.Conditions.set(NewConditionBitIndex);
+  if (NewConditionIndex != 0 && Target.Conditions.insert(NewConditionIndex)) {
     DBG("rdp-propagation", dbg << " " << NewConditionIndex);
     Changed = true;
   }
 
-  // Condition propagation
-  for (int SetBitIndex = Conditions.find_first();
-       SetBitIndex != -1;
-       SetBitIndex = Conditions.find_next(SetBitIndex)) {
-    int32_t ToPropagate = SeenConditions[SetBitIndex];
+  auto IsDefined = [&DefinedIndexes] (int32_t Condition) {
+    return std::find_if(DefinedIndexes.begin(),
+                        DefinedIndexes.end(),
+                        [Condition] (int32_t Defined) {
+                          return Defined == Condition || Defined == -Condition;
+                        }) != DefinedIndexes.end();
+  };
 
+  // Condition propagation
+  for (int32_t ToPropagate : Conditions) {
     // Do not propagate the condition if:
     //
     // * it's defined in the target basic block
     // * it's the condition associated to the current branch
     // * the target basic block already has it
     //
-    auto It = std::find_if(DefinedIndexes.begin(),
-                           DefinedIndexes.end(),
-                           [ToPropagate] (int32_t Defined) {
-                             return Defined == ToPropagate
-                             || Defined == -ToPropagate;
-                           });
-
     if (ToPropagate != NewConditionIndex
         && ToPropagate != -NewConditionIndex
-        && It == DefinedIndexes.end()
-        && !Target.hasCondition(ToPropagate)) {
-      Target.addCondition(ToPropagate);
+        && !IsDefined(ToPropagate)
+        && Target.Conditions.insert(ToPropagate)) {
       DBG("rdp-propagation", dbg << "  " << ToPropagate);
       Changed = true;
     }
-
   }
   DBG("rdp-propagation", dbg << "\n");
 
-  // Compute a bit vector with all the conditions that are incompatible with the
-  // target
-  BitVector Banned(SeenConditions.size());
+  // Collect all the conditions that are incompatible with the target, i.e.,
+  // the opposite of those holding there, unless explicitly allowed
+  ConditionSet Banned;
   DBG("rdp-propagation", dbg << "  Banned conditions:");
-
-  // For each set bit in the target's conditions
-  for (int SetBitIndex = Target.Conditions.find_first();
-       SetBitIndex != -1;
-       SetBitIndex = Target.Conditions.find_next(SetBitIndex)) {
-
-    // Consider the opposite condition as banned
-    int32_t BannedIndex = -Target.SeenConditions[SetBitIndex];
+  for (int32_t Condition : Target.Conditions) {
+    int32_t BannedIndex = -Condition;
     DBG("rdp-propagation", dbg << " " << BannedIndex);
-
-    // Check BannedIndex is not explicitly allowed
-    auto BannedIt = std::find(Target.SeenConditions.begin(),
-                              Target.SeenConditions.end(),
-                              BannedIndex);
-    bool IsAllowed = BannedIt != Target.SeenConditions.end()
-      && Target.Conditions[BannedIt - Target.SeenConditions.begin()];
-    if (!IsAllowed)
-      setIndexIfSeen(Banned, BannedIndex);
-
+    if (!Target.Conditions.contains(BannedIndex))
+      Banned.insert(BannedIndex);
   }
-
   DBG("rdp-propagation", dbg << "\n");
 
-  // Create a BitVector for conditions defined in the target basic block, so
-  // that we can later exclude them
-  BitVector Defined(SeenConditions.size());
-  for (int32_t DefinedIndex : DefinedIndexes) {
-    setIndexIfSeen(Defined, DefinedIndex);
-    setIndexIfSeen(Defined, -DefinedIndex);
-  }
-  BitVector NotDefined = Defined;
-  NotDefined.flip();
-
   for (auto &Definition : Definitions) {
-    BitVector DefinitionConditions = Definition.first;
+    const ConditionSet &DefinitionConditions = Definition.first;
     DBG("rdp-propagation", {
         dbg << "  Propagate " << getName(Definition.second.I);
 
@@ -881,54 +1200,44 @@ ConditionalBasicBlockInfo::propagateTo(ConditionalBasicBlockInfo &Target,
         else if (auto *Store = dyn_cast<StoreInst>(Definition.second.I))
           dbg << " about " << Store->getPointerOperand()->getName().str();
 
-        if (DefinitionConditions.any()) {
+        if (!DefinitionConditions.empty()) {
           dbg << " (conditions:";
-          for (int I = DefinitionConditions.find_first();
-               I != -1;
-               I = DefinitionConditions.find_next(I)) {
-            dbg << " " << SeenConditions[I];
-          }
+          for (int32_t Condition : DefinitionConditions)
+            dbg << " " << Condition;
           dbg << ")";
         }
 
         dbg << "? ";
       });
 
-    // Reset all the conditions that are defined in the target basic block
-    DefinitionConditions &= NotDefined;
+    // Ignore all the conditions that are defined in the target basic block and
+    // check if this definition is compatible with the target basic block
+    ConditionSet Translated;
+    bool IsBanned = false;
+    for (int32_t Condition : DefinitionConditions) {
+      if (IsDefined(Condition))
+        continue;
+
+      if (Banned.contains(Condition)) {
+        IsBanned = true;
+        break;
+      }
 
-    // Check if this definition is compatible with the target basic block
-    auto BannedConditions = DefinitionConditions;
-    BannedConditions &= Banned;
-    if (BannedConditions.any()) {
+      // A condition excludes its opposite
+      Translated.insert(Condition);
+      Translated.erase(-Condition);
+    }
+
+    if (IsBanned) {
       DBG("rdp-propagation", dbg << "no\n");
       continue;
     }
 
     DBG("rdp-propagation", dbg << "yes");
 
-    // Translate the conditions bitvector to the context of the target BBI
-    BitVector Translated(Target.SeenConditions.size());
-
-    for (int I = DefinitionConditions.find_first();
-         I != -1;
-         I = DefinitionConditions.find_next(I)) {
-      // Make sure the target BBI knows about all the necessary conditinos
-      assert(I < static_cast<int>(SeenConditions.size()));
-      unsigned Index = Target.getConditionIndex(SeenConditions[I]);
-      unsigned OppositeIndex = Target.getConditionIndex(-SeenConditions[I]);
-
-      // Keep the size of the new bitvector in sync
-      if (Target.SeenConditions.size() != Translated.size())
-        Translated.resize(Target.SeenConditions.size());
-
-      Translated.set(Index);
-      Translated.reset(OppositeIndex);
-    }
-
     // Add the condition of this branch
     if (NewConditionIndex != 0)
-      Translated.set(NewConditionBitIndex);
+      Translated.insert(NewConditionIndex);
 
     Changed |= Target.mergeDefinition({ Translated, Definition.second },
                                       Target.Reaching,
@@ -943,16 +1252,15 @@ ConditionalBasicBlockInfo::propagateTo(ConditionalBasicBlockInfo &Target,
 bool ConditionalBasicBlockInfo::mergeDefinition(CondDefPair NewDefinition,
                                                 vector<CondDefPair> &Targets,
                                                 TypeSizeProvider &TSP) const {
-  BitVector &NewConditionsBV = NewDefinition.first;
-  assert(NewConditionsBV.size() == SeenConditions.size());
+  ConditionSet &NewConditions = NewDefinition.first;
 
   for (CondDefPair &Target : Targets) {
     // Does this definition matches the one we're looking for?
     if (Target.second.I == NewDefinition.second.I) {
 
       // Are we saying something new? If so, merge the conditions.
-      if (Target.first != NewConditionsBV) {
-        Target.first |= NewConditionsBV;
+      if (Target.first != NewConditions) {
+        Target.first.merge(NewConditions);
         return true;
       } else {
         return false;
@@ -970,20 +1278,20 @@ bool ConditionalBasicBlockInfo::mergeDefinition(CondDefPair NewDefinition,
 bool ConditionalBasicBlockInfo::mergeDefinition(CondDefPair NewDefinition,
                                                 ReachingType &Targets,
                                                 TypeSizeProvider &TSP) const {
-  BitVector &NewConditionsBV = NewDefinition.first;
-  assert(NewConditionsBV.size() == SeenConditions.size());
-
-  // Merge the conditions of the new definition
-  BitVector &BV = Targets[NewDefinition.second];
-  BitVector Old = BV;
-  BV |= NewConditionsBV;
+  // Register the new definition or merge its conditions, and check if
+  // something changed
+  auto It = Targets.find(NewDefinition.second);
+  if (It == Targets.end()) {
+    Targets.insert({ NewDefinition.second, NewDefinition.first });
+    return true;
+  }
 
-  // Check if the new conditions are different from the initial ones
-  return Old != BV;
+  return It->second.merge(NewDefinition.first);
 }
 
 template<class BBI, ReachingDefinitionsResult R>
 bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
+  ScopedPhase Phase("reaching-definitions");
   auto &FCI = getAnalysis<FunctionCallIdentification>();
 
   DBG("passes", {
@@ -1006,6 +1314,8 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
   }
 
   TypeSizeProvider TSP(F.getParent()->getDataLayout());
+  if (std::is_same<BBI, BasicBlockInfo>::value)
+    Numbering.initialize(F, TSP);
 
   // Initialize queue
   unsigned BasicBlockCount = 0;
@@ -1022,7 +1332,7 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
     BasicBlockVisits++;
     BasicBlock *BB = ToVisit.pop();
 
-    BBI &Info = DefinitionsMap[BB];
+    BBI &Info = getInfo(BB);
     Info.resetDefinitions(TSP);
 
     // Find all the definitions
@@ -1072,7 +1382,7 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
         const IndexesVector &DefinedConditions =
           getDefinedConditions(Successor);
 
-        BBI &SuccessorInfo = DefinitionsMap[Successor];
+        BBI &SuccessorInfo = getInfo(Successor);
 
         DBG("rdp-propagation", {
             dbg << "Propagating from " << getName(BB)
@@ -1124,6 +1434,10 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
   std::set<LoadInst *> &FreeLoads = NRDLoads;
   FreeLoads.insert(SelfReachingLoads.begin(), SelfReachingLoads.end());
 
+  // The results are collected as pairs and then stored in CSR layout
+  vector<pair<const LoadInst *, Instruction *>> DefinitionPairs;
+  vector<pair<const Instruction *, LoadInst *>> ReachedPairs;
+
   for (auto &P : DefinitionsMap) {
     BasicBlock *BB = P.first;
     BBI &Info = P.second;
@@ -1165,14 +1479,10 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
 
         } else {
 
-          if (R == ReachingDefinitionsResult::ReachedLoads) {
-            for (auto &Definition : Definitions) {
-              if (TargetMA == Definition.second) {
-                ReachedLoads[Definition.first].push_back(Load);
-                ReachingDefinitionsCount[Load]++;
-              }
-            }
-          }
+          if (R == ReachingDefinitionsResult::ReachedLoads)
+            for (auto &Definition : Definitions)
+              if (TargetMA == Definition.second)
+                ReachedPairs.push_back({ Definition.first, Load });
 
           std::vector<Instruction *> LoadDefinitions;
           for (auto &Definition : Definitions)
@@ -1188,7 +1498,8 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
                   dbg << " " << getName(Definition);
                 dbg << "\n";
               });
-          ReachingDefinitions[Load] = std::move(LoadDefinitions);
+          for (Instruction *Definition : LoadDefinitions)
+            DefinitionPairs.push_back({ Load, Definition });
 
         }
 
@@ -1197,6 +1508,27 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
     }
   }
 
+  ReachingDefinitions.assign(DefinitionPairs);
+  ReachedLoads.assign(ReachedPairs);
+
+  if (R == ReachingDefinitionsResult::ReachedLoads) {
+    DBG("rdp", {
+        set<const Instruction *> Dumped;
+        for (auto &P : ReachedPairs) {
+          if (!Dumped.insert(P.first).second)
+            continue;
+
+          dbg << getName(P.first) << " reaches";
+          for (auto *Load : ReachedLoads.get(P.first))
+            dbg << " " << getName(Load);
+          dbg << "\n";
+        }
+      });
+  }
+
+  freeContainer(DefinitionPairs);
+  freeContainer(ReachedPairs);
+
   DBG("rdp",
       {
         dbg << "Basic blocks: " << std::dec << BasicBlockCount << "\n"
@@ -1205,18 +1537,16 @@ bool ReachingDefinitionsImplPass<BBI, R>::runOnFunction(Function &F) {
             << float(BasicBlockVisits) / BasicBlockCount << "\n";
       });
 
-  if (R == ReachingDefinitionsResult::ReachedLoads) {
-    DBG("rdp",
-        for (auto P : ReachedLoads) {
-          dbg << getName(P.first) << " reaches";
-          for (auto *Load : P.second)
-            dbg << " " << getName(Load);
-          dbg << "\n";
-        });
+  if (MemoryReportEnabled) {
+    recordContainerSize("rd.definitions-map", treeBytes(DefinitionsMap));
+    recordContainerSize("rd.reaching-definitions",
+                        ReachingDefinitions.memoryUsage());
+    recordContainerSize("rd.reached-loads", ReachedLoads.memoryUsage());
   }
 
   // Clear all the temporary data that is not part of the analysis result
   freeContainer(DefinitionsMap);
+  Numbering.clear();
   freeContainer(FreeLoads);
   freeContainer(BasicBlockBlackList);
   freeContainer(NRDLoads);
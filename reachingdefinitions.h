@@ -6,22 +6,29 @@
 //
 
 // Standard includes
-#include <unordered_set>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
 #include <vector>
 
 // LLVM includes
 #include "llvm/Pass.h"
-#include "llvm/ADT/SmallBitVector.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/Support/Allocator.h"
 
 // Local includes
 #include "datastructures.h"
 #include "debug.h"
 #include "memoryaccess.h"
 
-#define BitVector SmallBitVector
-
 namespace llvm {
+class DataLayout;
+class Function;
 class Instruction;
 class StoreInst;
 class LoadInst;
@@ -30,6 +37,8 @@ class BranchInst;
 class TerminatorInst;
 };
 
+class FunctionCallIdentification;
+
 // TODO: [speedup] Use LoadStorePtr
 // TODO: store in definitions/reaching the MemoryAccess
 
@@ -81,20 +90,94 @@ template <> struct hash<MemoryInstruction>
 };
 }
 
+/// \brief Numbering of the memory accesses of a function
+///
+/// Each load and store with a valid MemoryAccess gets an index, so that a set
+/// of definitions can be represented as a bit vector. The memory accesses are
+/// grouped by location (i.e., equal MemoryAccess), and the location are
+/// grouped by base, which allows to compute what a store kills, or all the
+/// definitions of a location, with a few bit vector operations.
+class DefinitionNumbering {
+public:
+  using Definitions = llvm::SparseBitVector<>;
+
+public:
+  void initialize(llvm::Function &F, TypeSizeProvider &TSP);
+  void clear();
+
+  unsigned index(llvm::Instruction *I) const {
+    auto It = Indexes.find(I);
+    assert(It != Indexes.end());
+    return It->second;
+  }
+
+  const MemoryInstruction &definition(unsigned Index) const {
+    return Instructions[Index];
+  }
+
+  /// \brief All the memory accesses to the location accessed by \p Index
+  const Definitions &location(unsigned Index) const {
+    return Locations[LocationOf[Index]].All;
+  }
+
+  /// \brief All the loads from the location accessed by \p Index
+  const Definitions &loads(unsigned Index) const {
+    return Locations[LocationOf[Index]].Loads;
+  }
+
+  /// \brief Remove from \p Target all the definitions a store to the location
+  ///        accessed by \p Index may alias
+  void kill(Definitions &Target, unsigned Index);
+
+private:
+  struct Location {
+    Location(MemoryAccess MA, unsigned Base) : MA(MA), Base(Base) { }
+
+    MemoryAccess MA;
+    unsigned Base;
+    Definitions All;
+    Definitions Loads;
+    bool HasOverlapping = false;
+    /// The register and offset locations with the same base overlapping this
+    /// one, including itself, computed on demand
+    std::vector<unsigned> Overlapping;
+  };
+
+  struct Base {
+    /// All the memory accesses involving this base
+    Definitions All;
+    /// Memory accesses to this part of the CPU state
+    Definitions CPUState;
+    /// Memory accesses relative to the address contained in this base
+    Definitions RegisterAndOffset;
+    std::vector<unsigned> RegisterAndOffsetLocations;
+  };
+
+  using LocationKey = std::tuple<const llvm::Value *, bool, uint64_t, uint64_t>;
+
+private:
+  std::vector<MemoryInstruction> Instructions;
+  llvm::DenseMap<llvm::Instruction *, unsigned> Indexes;
+  std::vector<unsigned> LocationOf;
+  std::vector<Location> Locations;
+  std::map<LocationKey, unsigned> LocationIndexes;
+  std::vector<Base> Bases;
+  llvm::DenseMap<const llvm::Value *, unsigned> BaseIndexes;
+  /// All the memory accesses relative to the content of a register
+  Definitions AllRegisterAndOffset;
+};
+
 class BasicBlockInfo {
 public:
+  BasicBlockInfo(DefinitionNumbering &Numbering) : Numbering(&Numbering) { }
+
   unsigned addCondition(int32_t ConditionIndex) { assert(false); }
 
   void resetDefinitions(TypeSizeProvider &TSP) {
-    Definitions.clear();
-    // for (llvm::Instruction *I : Reaching)
-    //   Definitions.push_back(MemoryInstruction(I, TSP));
-    std::copy(Reaching.begin(),
-              Reaching.end(),
-              std::back_inserter(Definitions));
+    Definitions = Reaching;
   }
 
-  unsigned size() const { return Reaching.size(); }
+  unsigned size() const { return Reaching.count(); }
 
   void clearDefinitions() {
     Definitions.clear();
@@ -115,29 +198,75 @@ public:
   void dump(std::ostream &Output);
 
 private:
+  DefinitionNumbering *Numbering;
+  /// Definitions reaching the beginning of the basic block
+  DefinitionNumbering::Definitions Reaching;
+  /// Definitions reaching the current point of the basic block
+  DefinitionNumbering::Definitions Definitions;
+};
 
-  template<class UnaryPredicate>
-  void removeDefinitions(UnaryPredicate P) {
-    erase_if(Definitions, P);
+/// \brief Sorted set of (signed) condition indexes
+///
+/// ConditionNumberingPass can number thousands of conditions in a function, but
+/// only a handful of them are relevant for each definition, therefore we store
+/// them in a small sorted array instead of a bit vector over all of them.
+class ConditionSet {
+public:
+  using const_iterator = llvm::SmallVectorImpl<int32_t>::const_iterator;
+
+public:
+  const_iterator begin() const { return Conditions.begin(); }
+  const_iterator end() const { return Conditions.end(); }
+  bool empty() const { return Conditions.empty(); }
+
+  bool contains(int32_t Condition) const {
+    return std::binary_search(Conditions.begin(), Conditions.end(), Condition);
+  }
+
+  /// \return true if \p Condition was not already in the set
+  bool insert(int32_t Condition) {
+    auto It = std::lower_bound(Conditions.begin(), Conditions.end(), Condition);
+    if (It != Conditions.end() && *It == Condition)
+      return false;
+    Conditions.insert(It, Condition);
+    return true;
+  }
+
+  void erase(int32_t Condition) {
+    auto It = std::lower_bound(Conditions.begin(), Conditions.end(), Condition);
+    if (It != Conditions.end() && *It == Condition)
+      Conditions.erase(It);
+  }
+
+  /// \brief Add all the conditions in \p Other
+  ///
+  /// \return true if at least a condition was not already in the set
+  bool merge(const ConditionSet &Other);
+
+  bool operator==(const ConditionSet &Other) const {
+    return Conditions == Other.Conditions;
+  }
+
+  bool operator!=(const ConditionSet &Other) const {
+    return !(*this == Other);
   }
 
 private:
-  // llvm::SmallSet<llvm::Instruction *, 3> Reaching;
-  std::unordered_set<MemoryInstruction> Reaching;
-  std::vector<MemoryInstruction> Definitions;
+  llvm::SmallVector<int32_t, 2> Conditions;
 };
 
 class ConditionalBasicBlockInfo {
 public:
-  unsigned addCondition(int32_t ConditionIndex) {
-    unsigned Result = getConditionIndex(ConditionIndex);
-    Conditions.set(Result);
-    return Result;
+  /// The definitions are tracked along with their conditions, no numbering is
+  /// used
+  ConditionalBasicBlockInfo(DefinitionNumbering &) { }
+
+  void addCondition(int32_t ConditionIndex) {
+    Conditions.insert(ConditionIndex);
   }
 
-  bool hasCondition(int32_t ConditionIndex) {
-    unsigned Result = getConditionIndex(ConditionIndex);
-    return Conditions[Result];
+  bool hasCondition(int32_t ConditionIndex) const {
+    return Conditions.contains(ConditionIndex);
   }
 
   void resetDefinitions(TypeSizeProvider &TSP) {
@@ -166,46 +295,15 @@ public:
   void dump(std::ostream& Output);
 
 private:
-  using CondDefPair = std::pair<llvm::BitVector, MemoryInstruction>;
-  using ReachingType = std::unordered_map<MemoryInstruction, llvm::BitVector>;
-
-  enum ConditionsComparison {
-    Identical,
-    Different,
-    Complementary
-  };
+  using CondDefPair = std::pair<ConditionSet, MemoryInstruction>;
+  using ReachingType = std::unordered_map<MemoryInstruction, ConditionSet>;
 
 private:
-  /// \brief Set the bit corresponding to \p Index in \p Target, if present in
-  /// SeenCondtions.
-  bool setIndexIfSeen(llvm::BitVector &Target, int32_t Index) const;
-
   template<class UnaryPredicate>
   void removeDefinitions(UnaryPredicate P) {
     erase_if(Definitions, P);
   }
 
-  unsigned getConditionIndex(uint32_t ConditionIndex) {
-    auto It = std::find(SeenConditions.begin(),
-                        SeenConditions.end(),
-                        ConditionIndex);
-
-    if (It != SeenConditions.end()) {
-      return It - SeenConditions.begin();
-    } else {
-      SeenConditions.push_back(ConditionIndex);
-      auto NewSize = SeenConditions.size();
-
-      Conditions.resize(NewSize);
-      for (auto &P : Reaching)
-        P.second.resize(NewSize);
-      for (CondDefPair &Definition : Definitions)
-        Definition.first.resize(NewSize);
-
-      return NewSize - 1;
-    }
-  }
-
   bool mergeDefinition(CondDefPair NewDefinition,
                        std::vector<CondDefPair> &Targets,
                        TypeSizeProvider &TSP) const;
@@ -215,12 +313,81 @@ private:
                        TypeSizeProvider &TSP) const;
 
 private:
-  // Seen conditions
-  std::vector<int32_t> SeenConditions;
   // TODO: switch to list?
   ReachingType Reaching;
   std::vector<CondDefPair> Definitions;
-  llvm::BitVector Conditions;
+  ConditionSet Conditions;
+};
+
+/// \brief Read-only map from keys to lists of values in CSR layout
+///
+/// Each key gets a dense index in an offset array, the lists of values are
+/// stored one after the other in a single array. Both arrays come from a bump
+/// allocator, so the whole map is released at once, without visiting it.
+template<typename K, typename V>
+class CompactMultimap {
+public:
+  CompactMultimap() : Offsets(nullptr), Values(nullptr) { }
+
+  CompactMultimap(const CompactMultimap &) = delete;
+  CompactMultimap &operator=(const CompactMultimap &) = delete;
+
+  /// \brief Replace the content of the map with \p Pairs
+  ///
+  /// The values of each key preserve their relative order in \p Pairs.
+  void assign(const std::vector<std::pair<K, V>> &Pairs) {
+    clear();
+
+    std::vector<unsigned> Cursors;
+    for (auto &P : Pairs) {
+      auto Result = Index.insert({ P.first, Cursors.size() });
+      if (Result.second)
+        Cursors.push_back(0);
+      Cursors[Result.first->second]++;
+    }
+
+    if (Cursors.empty())
+      return;
+
+    Offsets = Allocator.Allocate<unsigned>(Cursors.size() + 1);
+    Offsets[0] = 0;
+    for (unsigned I = 0; I < Cursors.size(); I++) {
+      Offsets[I + 1] = Offsets[I] + Cursors[I];
+      Cursors[I] = Offsets[I];
+    }
+
+    Values = Allocator.Allocate<V>(Pairs.size());
+    for (auto &P : Pairs)
+      Values[Cursors[Index.find(P.first)->second]++] = P.second;
+  }
+
+  /// \return the values associated to \p Key, an empty list if it's missing
+  llvm::ArrayRef<V> get(K Key) const {
+    auto It = Index.find(Key);
+    if (It == Index.end())
+      return { };
+
+    unsigned I = It->second;
+    return llvm::ArrayRef<V>(Values + Offsets[I], Values + Offsets[I + 1]);
+  }
+
+  void clear() {
+    freeContainer(Index);
+    Allocator.Reset();
+    Offsets = nullptr;
+    Values = nullptr;
+  }
+
+  /// \brief Return the bytes allocated by the map
+  uint64_t memoryUsage() const {
+    return Index.getMemorySize() + Allocator.getTotalMemory();
+  }
+
+private:
+  llvm::DenseMap<K, unsigned> Index;
+  unsigned *Offsets;
+  V *Values;
+  llvm::BumpPtrAllocator Allocator;
 };
 
 using ReachingDefinitionsPass = ReachingDefinitionsImplPass<BasicBlockInfo,
@@ -247,10 +414,10 @@ public:
 
   void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
 
-  const std::vector<llvm::LoadInst *> &
+  llvm::ArrayRef<llvm::LoadInst *>
   getReachedLoads(const llvm::Instruction *I);
 
-  const std::vector<llvm::Instruction *> &
+  llvm::ArrayRef<llvm::Instruction *>
   getReachingDefinitions(const llvm::LoadInst *Load);
 
   unsigned getReachingDefinitionsCount(const llvm::LoadInst *Load);
@@ -259,26 +426,138 @@ public:
     DBG("release", {
         dbg << "ReachingDefinitionsImplPass is releasing memory\n";
       });
-    freeContainer(ReachedLoads);
-    freeContainer(ReachingDefinitions);
-    freeContainer(ReachingDefinitionsCount);
+    ReachedLoads.clear();
+    ReachingDefinitions.clear();
   }
 
 private:
   int32_t getConditionIndex(llvm::TerminatorInst *T);
   const llvm::SmallVector<int32_t, 2> &getDefinedConditions(llvm::BasicBlock *BB);
 
+  BBI &getInfo(llvm::BasicBlock *BB) {
+    auto It = DefinitionsMap.find(BB);
+    if (It == DefinitionsMap.end())
+      It = DefinitionsMap.insert({ BB, BBI(Numbering) }).first;
+    return It->second;
+  }
+
 private:
   using BasicBlock = llvm::BasicBlock;
   using LoadInst = llvm::LoadInst;
   using Instruction = llvm::Instruction;
+  DefinitionNumbering Numbering;
   std::map<BasicBlock *, BBI> DefinitionsMap;
   std::set<BasicBlock *> BasicBlockBlackList;
   std::set<LoadInst *> NRDLoads;
   std::set<LoadInst *> SelfReachingLoads;
-  std::map<const Instruction *, std::vector<LoadInst *>> ReachedLoads;
-  std::map<const LoadInst *, std::vector<Instruction *>> ReachingDefinitions;
-  std::map<const LoadInst *, unsigned>  ReachingDefinitionsCount;
+  CompactMultimap<const Instruction *, LoadInst *> ReachedLoads;
+  CompactMultimap<const LoadInst *, Instruction *> ReachingDefinitions;
+};
+
+/// \brief Whether the clients of ReachingDefinitionsQuery should use
+///        OnDemandReachingDefinitionsPass instead of ReachingDefinitionsPass
+extern bool OnDemandReachingDefinitions;
+
+/// \brief Reaching definitions of single loads, computed on demand
+///
+/// Instead of solving the whole function, each query walks backward from the
+/// load up to the definitions of the memory location it reads. Results are
+/// memoized and the walk stops at loads whose answer is already known.
+/// Prefer this pass to ReachingDefinitionsPass when only the definitions of a
+/// few loads are required.
+///
+/// The results are the same of ReachingDefinitionsPass, except for the loads
+/// requiring more than MaxSteps basic blocks to be visited, which are
+/// considered free.
+class OnDemandReachingDefinitionsPass : public llvm::FunctionPass {
+public:
+  static char ID;
+
+  OnDemandReachingDefinitionsPass() :
+    llvm::FunctionPass(ID), FCI(nullptr), DL(nullptr) { };
+
+  bool runOnFunction(llvm::Function &F) override;
+
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
+
+  llvm::ArrayRef<llvm::Instruction *>
+  getReachingDefinitions(const llvm::LoadInst *Load);
+
+  virtual void releaseMemory() override {
+    DBG("release", {
+        dbg << "OnDemandReachingDefinitionsPass is releasing memory\n";
+      });
+    freeContainer(BasicBlockBlackList);
+    freeContainer(Accesses);
+    freeContainer(Walked);
+  }
+
+private:
+  using BasicBlock = llvm::BasicBlock;
+  using LoadInst = llvm::LoadInst;
+  using Instruction = llvm::Instruction;
+
+  /// \brief Maximum number of basic blocks a query can visit, the equivalent
+  ///        of the limit on the definitions propagated by a basic block in
+  ///        ReachingDefinitionsPass
+  static const unsigned MaxSteps = 5000;
+
+private:
+  const MemoryAccess &getAccess(Instruction *I);
+
+  /// \brief Collect the definitions of the location read by \p Load reaching
+  ///        it, including \p Load itself if it reaches itself
+  ///
+  /// The walk is iterative: the loads whose freedom has to be checked are
+  /// walked on an explicit stack. The results depending on a load whose walk
+  /// was still in progress are not memoized.
+  const std::vector<Instruction *> &walk(LoadInst *Load);
+
+  /// \brief Check if \p Load is a free load, i.e., it's not reached by any
+  ///        definition or it reaches itself
+  ///
+  /// Free loads act as definitions for the loads they reach.
+  bool isFree(LoadInst *Load) { return isFree(Load, walk(Load)); }
+
+  static bool isFree(LoadInst *Load,
+                     const std::vector<Instruction *> &Definitions) {
+    return Definitions.empty()
+      || std::binary_search(Definitions.begin(),
+                            Definitions.end(),
+                            static_cast<Instruction *>(Load));
+  }
+
+private:
+  FunctionCallIdentification *FCI;
+  const llvm::DataLayout *DL;
+  std::set<BasicBlock *> BasicBlockBlackList;
+  std::map<const Instruction *, MemoryAccess> Accesses;
+  std::map<const LoadInst *, std::vector<Instruction *>> Walked;
+};
+
+/// \brief Reaching definitions of loads provided by ReachingDefinitionsPass
+///        or, if OnDemandReachingDefinitions is set, by
+///        OnDemandReachingDefinitionsPass
+class ReachingDefinitionsQuery {
+public:
+  ReachingDefinitionsQuery() : Full(nullptr), OnDemand(nullptr) { }
+
+  /// \brief Require the reaching definitions pass in use in \p AU
+  static void addRequired(llvm::AnalysisUsage &AU);
+
+  /// \brief Obtain the reaching definitions pass in use from \p P
+  static ReachingDefinitionsQuery get(llvm::Pass &P);
+
+  llvm::ArrayRef<llvm::Instruction *>
+  getReachingDefinitions(const llvm::LoadInst *Load) {
+    if (OnDemand != nullptr)
+      return OnDemand->getReachingDefinitions(Load);
+    return Full->getReachingDefinitions(Load);
+  }
+
+private:
+  ReachingDefinitionsPass *Full;
+  OnDemandReachingDefinitionsPass *OnDemand;
 };
 
 /// The ConditionNumberingPass loops over all the conditional branch
@@ -362,7 +641,7 @@ public:
   bool runOnFunction(llvm::Function &F) override;
 
   void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
-    AU.addRequired<ReachingDefinitionsPass>();
+    ReachingDefinitionsQuery::addRequired(AU);
     AU.setPreservesAll();
   }
 
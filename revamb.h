@@ -29,6 +29,14 @@ enum class DebugInfoType {
   LLVMIR ///< produce an LLVM IR with debug metadata referring to itself.
 };
 
+/// \brief What to do with the newpc markers at the end of the translation
+enum class MarkersMode {
+  Full, ///< keep a newpc call for each input instruction.
+  BasicBlock, ///< replace the markers with a call to newbb at the beginning
+              ///  of each basic block.
+  Strip ///< remove all the newpc calls.
+};
+
 // TODO: move me to another header file
 /// \brief Classification of the various basic blocks we are creating
 enum BlockType {
@@ -66,6 +74,7 @@ public:
                unsigned PointerSize,
                llvm::StringRef SyscallHelper,
                llvm::StringRef SyscallNumberRegister,
+               llvm::StringRef SyscallResultRegister,
                llvm::ArrayRef<uint64_t> NoReturnSyscalls,
                unsigned DelaySlotSize) :
     Type(static_cast<llvm::Triple::ArchType>(Type)),
@@ -75,6 +84,7 @@ public:
     PointerSize(PointerSize),
     SyscallHelper(SyscallHelper),
     SyscallNumberRegister(SyscallNumberRegister),
+    SyscallResultRegister(SyscallResultRegister),
     NoReturnSyscalls(NoReturnSyscalls),
     DelaySlotSize(DelaySlotSize) { }
 
@@ -87,6 +97,9 @@ public:
   llvm::StringRef syscallNumberRegister() const {
     return SyscallNumberRegister;
   }
+  llvm::StringRef syscallResultRegister() const {
+    return SyscallResultRegister;
+  }
   llvm::ArrayRef<uint64_t> noReturnSyscalls() const { return NoReturnSyscalls; }
   unsigned delaySlotSize() const { return DelaySlotSize; }
   const char *name() const { return llvm::Triple::getArchTypeName(Type); }
@@ -101,6 +114,7 @@ private:
 
   llvm::StringRef SyscallHelper;
   llvm::StringRef SyscallNumberRegister;
+  llvm::StringRef SyscallResultRegister;
   llvm::ArrayRef<uint64_t> NoReturnSyscalls;
   unsigned DelaySlotSize;
 };
@@ -11,6 +11,8 @@
 #include <iterator>
 
 // LLVM includes
+#include "llvm/ADT/Hashing.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -24,6 +26,7 @@
 #include "osra.h"
 #include "jumptargetmanager.h"
 #include "set.h"
+#include "statistics.h"
 
 using namespace llvm;
 using std::make_pair;
@@ -187,6 +190,8 @@ public:
 
   bool readsMemory() const { return LoadsCount > 0; }
 
+  bool setsSyscallNumber() const { return SetsSyscallNumber; }
+
 private:
   JumpTargetManager *JTM;
   const DataLayout &DL;
@@ -313,14 +318,18 @@ public:
   SET(Function &F,
       JumpTargetManager *JTM,
       OSRAPass *OSRA,
-      std::set<BasicBlock *> *Visited,
+      SmallPtrSetImpl<BasicBlock *> *Visited,
+      SETCache *Cache,
       std::vector<SETPass::JumpInfo> &Jumps) :
+    MaxDepth(JTM->maxSETDepth()),
     DL(F.getParent()->getDataLayout()),
     JTM(JTM),
     OS(JTM, DL),
     F(F),
     OSRA(OSRA),
     Visited(Visited),
+    Cache(Cache),
+    Cacheable(false),
     Jumps(Jumps) { }
 
   /// \brief Run the Simple Expression Tracker on F
@@ -342,13 +351,18 @@ private:
   bool handleInstructionWithOSRA(Instruction *Target, Value *V);
 
 private:
-  const unsigned MaxDepth = 3;
+  const unsigned MaxDepth;
   const DataLayout &DL;
   JumpTargetManager *JTM;
   OperationsStack OS;
   Function& F;
   OSRAPass *OSRA;
-  std::set<BasicBlock *> *Visited;
+  SmallPtrSetImpl<BasicBlock *> *Visited;
+  SETCache *Cache;
+  /// Basic blocks explored while analyzing the current one
+  SmallPtrSet<BasicBlock *, 8> Explored;
+  /// Can the results for the current basic block be memoized?
+  bool Cacheable;
   std::vector<std::pair<Value *, unsigned>> WorkList;
   std::vector<SETPass::JumpInfo> &Jumps;
 };
@@ -377,6 +391,7 @@ bool SET::enqueueStores(LoadInst *Start) {
     }
 
     Visited.insert(BB);
+    Explored.insert(BB);
     BasicBlock::reverse_iterator It(make_reverse_iterator(I));
     BasicBlock::reverse_iterator Begin(BB->rend());
 
@@ -425,11 +440,25 @@ bool SET::enqueueStores(LoadInst *Start) {
 }
 
 bool SET::run() {
+  bool UseCache = OSRA != nullptr && Cache != nullptr;
+  if (UseCache)
+    Cache->beginRound(JTM->exitTB());
+
   for (BasicBlock& BB : make_range(F.begin(), F.end())) {
 
-    if (Visited->find(&BB) != Visited->end())
+    if (!Visited->insert(&BB).second)
       continue;
-    Visited->insert(&BB);
+
+    if (UseCache) {
+      if (Cache->isValid(&BB)) {
+        incrementCounter("set.cache-hits");
+        continue;
+      }
+
+      Explored.clear();
+      Explored.insert(&BB);
+      Cacheable = true;
+    }
 
     for (Instruction& Instr : BB) {
       assert(Instr.getParent() == &BB);
@@ -452,6 +481,8 @@ bool SET::run() {
         // Clean the OperationsStack and, if we're dealing with a store to the
         // PC, ask it to track all the possible values that the PC will assume.
         OS.reset(Store);
+        if (OS.setsSyscallNumber())
+          Cacheable = false;
         WorkList.push_back(make_pair(Store->getValueOperand(), 0));
       } else {
         OS.reset();
@@ -482,6 +513,13 @@ bool SET::run() {
                                           OS.isApproximate(),
                                           OS.trackedValues()));
     }
+
+    if (UseCache) {
+      if (Cacheable)
+        Cache->record(&BB, Explored);
+      else
+        Cache->invalidate(&BB);
+    }
   }
 
   OS.registerPCs();
@@ -489,6 +527,56 @@ bool SET::run() {
   return false;
 }
 
+bool SETCache::isValid(BasicBlock *BB) {
+  auto It = Entries.find(BB);
+  if (It == Entries.end())
+    return false;
+
+  for (auto &P : It->second)
+    if (fingerprint(P.first) != P.second)
+      return false;
+
+  return true;
+}
+
+void SETCache::record(BasicBlock *BB,
+                      const SmallPtrSetImpl<BasicBlock *> &Explored) {
+  Fingerprints &Entry = Entries[BB];
+  Entry.clear();
+  for (BasicBlock *Dependency : Explored)
+    Entry.push_back({ Dependency, fingerprint(Dependency) });
+}
+
+uint64_t SETCache::fingerprint(BasicBlock *BB) {
+  auto It = Memo.find(BB);
+  if (It != Memo.end())
+    return It->second;
+
+  // The order of the predecessors is not relevant
+  size_t Predecessors = 0;
+  for (BasicBlock *Predecessor : predecessors(BB))
+    Predecessors += hash_value(Predecessor);
+
+  hash_code Result = hash_value(Predecessors);
+  for (Instruction &I : *BB) {
+    // Stop at exitTB, its argument and what follows it change each time the
+    // jump is pinned
+    if (auto *Call = dyn_cast<CallInst>(&I)) {
+      if (Call->getCalledFunction() == ExitTB) {
+        Result = hash_combine(Result, &I);
+        break;
+      }
+    }
+
+    Result = hash_combine(Result, &I, I.getOpcode());
+    for (Value *Operand : I.operand_values())
+      Result = hash_combine(Result, Operand);
+  }
+
+  Memo[BB] = Result;
+  return Result;
+}
+
 char SETPass::ID = 0;
 
 void SETPass::getAnalysisUsage(AnalysisUsage &AU) const {
@@ -509,7 +597,7 @@ bool SETPass::runOnFunction(Function &F) {
     JTM->noReturn().collectDefinitions(CRDP);
   }
 
-  SET SimpleExpressionTracker(F, JTM, OSRA, Visited, Jumps);
+  SET SimpleExpressionTracker(F, JTM, OSRA, Visited, Cache, Jumps);
 
   DBG("passes", { dbg << "Ending SETPass\n"; });
   return SimpleExpressionTracker.run();
@@ -518,6 +606,9 @@ bool SETPass::runOnFunction(Function &F) {
 bool SET::handleInstructionWithOSRA(Instruction *Target, Value *V) {
   assert(OSRA != nullptr);
 
+  // OSRA results might improve in the next rounds
+  Cacheable = false;
+
   // We don't know how to proceed, but we can still check if the current
   // instruction is associated with a suitable OSR
   const OSRAPass::OSR *O = OSRA->getOSR(V);
@@ -592,6 +683,10 @@ Value *SET::handleInstruction(Instruction *Target, Value *V) {
   if (V->getType()->isIntegerTy(128))
     return nullptr;
 
+  if (auto *I = dyn_cast<Instruction>(V))
+    if (I->getParent() != nullptr)
+      Explored.insert(I->getParent());
+
   if (auto *C = dyn_cast<ConstantInt>(V)) {
     // We reached the end of the path, materialize the value
     OS.explore(C);
@@ -619,6 +714,7 @@ Value *SET::handleInstruction(Instruction *Target, Value *V) {
       if (OS.insertIfNew(BinOp))
         return IsFirstConstant ? SecondOp.get() : FirstOp.get();
     } else if (OSRA != nullptr) {
+      Cacheable = false;
       Constant *ConstantOp = nullptr;
       Value *FreeOp = nullptr;
       std::tie(ConstantOp, FreeOp) = OSRA->identifyOperands(BinOp, DL);
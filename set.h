@@ -10,6 +10,9 @@
 #include <vector>
 
 // LLVM includes
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Pass.h"
 
 // Forward declarations
@@ -23,6 +26,64 @@ class Value;
 
 class JumpTargetManager;
 
+/// \brief Memoization of the results of SET with OSRA across harvest rounds
+///
+/// SET with OSRA is run on the whole function in each harvest round. The
+/// analysis of a basic block doesn't need to be repeated if it didn't query
+/// OSRA (whose results change as new edges are discovered), it didn't register
+/// killers for the noreturn analysis (they are collected again in each round)
+/// and none of the basic blocks it explored changed in the meantime.
+///
+/// A basic block changed if its instructions, their operands or its
+/// predecessors changed. Erasing a basic block requires a call to clear().
+///
+/// The code following a call to `exitTB` is not part of the fingerprint:
+/// pinJumps replaces it each time it pins the jump again, and it contains no
+/// stores, which are what SET looks at. This way, the basic blocks whose jumps
+/// are pinned again to the same destinations keep hitting the cache.
+class SETCache {
+public:
+  /// \brief Forget all the fingerprints computed in the previous round
+  ///
+  /// \param ExitTB the `exitTB` function (see JumpTargetManager::exitTB).
+  void beginRound(llvm::Function *ExitTB) {
+    this->ExitTB = ExitTB;
+    Memo.clear();
+  }
+
+  /// \brief Check if the results of the previous analysis of \p BB still hold
+  bool isValid(llvm::BasicBlock *BB);
+
+  /// \brief Record that the analysis of \p BB explored the \p Explored blocks
+  void record(llvm::BasicBlock *BB,
+              const llvm::SmallPtrSetImpl<llvm::BasicBlock *> &Explored);
+
+  void invalidate(llvm::BasicBlock *BB) { Entries.erase(BB); }
+
+  void clear() {
+    Entries.clear();
+    Memo.clear();
+  }
+
+  /// \brief Return the bytes allocated by the cache
+  uint64_t memoryUsage() const {
+    return Entries.getMemorySize() + Memo.getMemorySize();
+  }
+
+private:
+  uint64_t fingerprint(llvm::BasicBlock *BB);
+
+private:
+  using Fingerprints = llvm::SmallVector<std::pair<llvm::BasicBlock *,
+                                                   uint64_t>, 4>;
+
+  llvm::Function *ExitTB = nullptr;
+  llvm::DenseMap<llvm::BasicBlock *, Fingerprints> Entries;
+  /// Fingerprints computed in the current round, the IR doesn't change while
+  /// SET is running
+  llvm::DenseMap<llvm::BasicBlock *, uint64_t> Memo;
+};
+
 class SETPass : public llvm::FunctionPass {
 public:
   /// \brief Information about the possible destination of a jump instruction
@@ -45,14 +106,17 @@ public:
   SETPass() : llvm::FunctionPass(ID),
     JTM(nullptr),
     Visited(nullptr),
+    Cache(nullptr),
     UseOSRA(false) { }
 
   SETPass(JumpTargetManager *JTM,
           bool UseOSRA,
-          std::set<llvm::BasicBlock *> *Visited) :
+          llvm::SmallPtrSetImpl<llvm::BasicBlock *> *Visited,
+          SETCache *Cache = nullptr) :
     llvm::FunctionPass(ID),
     JTM(JTM),
     Visited(Visited),
+    Cache(Cache),
     UseOSRA(UseOSRA) { }
 
   bool runOnFunction(llvm::Function &F) override;
@@ -70,7 +134,8 @@ public:
 
 private:
   JumpTargetManager *JTM;
-  std::set<llvm::BasicBlock *> *Visited;
+  llvm::SmallPtrSetImpl<llvm::BasicBlock *> *Visited;
+  SETCache *Cache;
   bool UseOSRA;
   std::vector<JumpInfo> Jumps;
 };
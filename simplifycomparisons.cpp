@@ -156,7 +156,7 @@ Value *SimplifyComparisonsPass::findOldest(Value *V) {
       break;
     Seen.insert(V);
 
-    auto &ReachingDefinitions = RDP->getReachingDefinitions(Load);
+    auto &ReachingDefinitions = RDP.getReachingDefinitions(Load);
     if (ReachingDefinitions.size() != 1)
       break;
 
@@ -282,7 +282,7 @@ static Predicate getEquivalentPredicate(SimplifyComparisonsPass *SCP,
 }
 
 bool SimplifyComparisonsPass::runOnFunction(Function &F) {
-  RDP = &getAnalysis<ReachingDefinitionsPass>();
+  RDP = ReachingDefinitionsQuery::get(*this);
   for (BasicBlock &BB : F) {
     for (Instruction &I : BB) {
       if (auto *Cmp = isa_with_op<CmpInst, Value, ConstantInt>(&I)) {
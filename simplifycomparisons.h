@@ -45,7 +45,7 @@ public:
 
   void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
     AU.setPreservesAll();
-    AU.addRequired<ReachingDefinitionsPass>();
+    ReachingDefinitionsQuery::addRequired(AU);
   }
 
   // TODO: this pass ignores function calls, and in particular calls to newpc,
@@ -69,7 +69,7 @@ public:
   }
 
 private:
-  ReachingDefinitionsPass *RDP;
+  ReachingDefinitionsQuery RDP;
   std::unordered_map<llvm::CmpInst *, Comparison> SimplifiedComparisons;
 };
 
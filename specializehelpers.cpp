@@ -0,0 +1,176 @@
+/// \file specializehelpers.cpp
+/// \brief Implementation of the SpecializeHelpersPass
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <map>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+// LLVM includes
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+// Local includes
+#include "specializehelpers.h"
+#include "statistics.h"
+
+using namespace llvm;
+
+char SpecializeHelpersPass::ID = 0;
+static RegisterPass<SpecializeHelpersPass> X("specialize-helpers",
+                                             "Specialize Helpers Pass",
+                                             false,
+                                             false);
+
+/// \brief Return the helper called by \p Call, or nullptr if it's not a direct
+///        call, with the right prototype, to a helper we have the body of
+static Function *getHelper(CallInst *Call) {
+  Function *Callee = Call->getCalledFunction();
+  if (Callee == nullptr
+      || Callee->isDeclaration()
+      || Callee->isVarArg()
+      || Callee->getFunctionType() != Call->getFunctionType()
+      || !Callee->getName().startswith("helper_"))
+    return nullptr;
+
+  return Callee;
+}
+
+/// \brief Count the instructions of \p F, ignoring debug intrinsics
+static unsigned size(Function *F) {
+  unsigned Result = 0;
+  for (BasicBlock &BB : *F)
+    for (Instruction &I : BB)
+      if (!isa<DbgInfoIntrinsic>(I))
+        Result++;
+  return Result;
+}
+
+/// \brief Check if \p F calls itself directly
+static bool isRecursive(Function *F) {
+  for (User *U : F->users())
+    if (auto *Call = dyn_cast<CallInst>(U))
+      if (Call->getParent() != nullptr
+          && Call->getParent()->getParent() == F)
+        return true;
+  return false;
+}
+
+bool SpecializeHelpersPass::runOnModule(Module &M) {
+  if (Root == nullptr)
+    return false;
+
+  std::vector<CallInst *> Calls;
+  for (BasicBlock &BB : *Root)
+    for (Instruction &I : BB)
+      if (auto *Call = dyn_cast<CallInst>(&I))
+        if (getHelper(Call) != nullptr)
+          Calls.push_back(Call);
+
+  if (Calls.empty())
+    return false;
+
+  // Cleanup passes for the specialized copies, to fold away the constant
+  // arguments
+  legacy::FunctionPassManager FPM(&M);
+  FPM.add(createSCCPPass());
+  FPM.add(createInstructionCombiningPass());
+  FPM.add(createCFGSimplificationPass());
+  FPM.add(createDeadCodeEliminationPass());
+  FPM.doInitialization();
+
+  // Specialize: the key is the original helper and the constant arguments,
+  // by index
+  using ConstantArguments = std::vector<std::pair<unsigned, Constant *>>;
+  std::map<std::pair<Function *, ConstantArguments>, Function *> Copies;
+  unsigned CopiesSize = 0;
+  for (CallInst *Call : Calls) {
+    Function *Callee = getHelper(Call);
+
+    ConstantArguments Arguments;
+    for (unsigned I = 0; I < Call->getNumArgOperands(); I++)
+      if (auto *ConstantArg = dyn_cast<ConstantInt>(Call->getArgOperand(I)))
+        Arguments.push_back({ I, ConstantArg });
+
+    if (Arguments.empty())
+      continue;
+
+    auto CopyIt = Copies.find({ Callee, Arguments });
+    if (CopyIt == Copies.end()) {
+      // Past the budget, keep calling the generic helper
+      unsigned CalleeSize = size(Callee);
+      if (Copies.size() >= MaxCopies
+          || CopiesSize + CalleeSize > MaxCopiesSize) {
+        incrementCounter("helpers.specialization-budget-exhausted");
+        continue;
+      }
+      CopiesSize += CalleeSize;
+      CopyIt = Copies.insert({ { Callee, Arguments }, nullptr }).first;
+    }
+
+    Function *&Copy = CopyIt->second;
+    if (Copy == nullptr) {
+      // The specialization keeps the prototype of the original helper, the
+      // specialized arguments are simply ignored
+      std::stringstream NewName;
+      NewName << Callee->getName().str() << "_const_" << Copies.size();
+      Copy = Function::Create(Callee->getFunctionType(),
+                              GlobalValue::InternalLinkage,
+                              NewName.str(),
+                              &M);
+
+      ValueToValueMapTy VTV;
+      auto CopyArg = Copy->arg_begin();
+      for (Argument &CalleeArg : Callee->args()) {
+        CopyArg->setName(CalleeArg.getName());
+        VTV[&CalleeArg] = &*CopyArg++;
+      }
+      for (auto &P : Arguments) {
+        auto CalleeArg = Callee->arg_begin();
+        std::advance(CalleeArg, P.first);
+        VTV[&*CalleeArg] = P.second;
+      }
+
+      SmallVector<ReturnInst *, 5> Returns;
+      CloneFunctionInto(Copy, Callee, VTV, true, Returns);
+      FPM.run(*Copy);
+      incrementCounter("helpers.specialized");
+    }
+
+    Call->setCalledFunction(Copy);
+  }
+
+  FPM.doFinalization();
+
+  // Inline the calls to small helpers
+  for (CallInst *Call : Calls) {
+    Function *Callee = getHelper(Call);
+    if (Callee == nullptr
+        || size(Callee) > InlineBudget
+        || Callee->hasFnAttribute(Attribute::NoInline)
+        || isRecursive(Callee))
+      continue;
+
+    InlineFunctionInfo IFI;
+    if (InlineFunction(Call, IFI))
+      incrementCounter("helpers.inlined");
+  }
+
+  // Drop the specializations which have been inlined everywhere
+  for (auto &P : Copies)
+    if (P.second->use_empty())
+      P.second->eraseFromParent();
+
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef _SPECIALIZEHELPERS_H
+#define _SPECIALIZEHELPERS_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// LLVM includes
+#include "llvm/Pass.h"
+
+namespace llvm {
+class Function;
+}
+
+/// \brief Specialize the helpers called with constant arguments and inline the
+///        small ones in the root function
+///
+/// For each call in the root function to a helper with one or more constant
+/// arguments (e.g., a condition code or an operand size), a copy of the helper
+/// with those arguments replaced by the constants is created and simplified.
+/// Call sites passing the same constants share the same copy. At most
+/// MaxCopies copies, with at most MaxCopiesSize instructions overall, are
+/// created: once the budget is exhausted the remaining call sites keep calling
+/// the generic helper.
+///
+/// Then, each helper call whose callee (specialized or not) has at most
+/// InlineBudget instructions is inlined, removing the cost of the call and
+/// exposing the helper's accesses to the CPU state to the optimizations of
+/// the root function.
+class SpecializeHelpersPass : public llvm::ModulePass {
+public:
+  static char ID;
+
+  SpecializeHelpersPass() :
+    llvm::ModulePass(ID),
+    Root(nullptr),
+    InlineBudget(0) { }
+
+  SpecializeHelpersPass(llvm::Function *Root, unsigned InlineBudget) :
+    llvm::ModulePass(ID),
+    Root(Root),
+    InlineBudget(InlineBudget) { }
+
+  bool runOnModule(llvm::Module &M) override;
+
+private:
+  /// Maximum number of specialized copies of the helpers
+  static const unsigned MaxCopies = 2048;
+
+  /// Maximum number of instructions of the helpers cloned, overall
+  static const unsigned MaxCopiesSize = 1 << 18;
+
+private:
+  llvm::Function *Root;
+  unsigned InlineBudget;
+};
+
+#endif // _SPECIALIZEHELPERS_H
@@ -0,0 +1,214 @@
+/// \file statistics.cpp
+/// \brief This file handles the collection of counters and timings about the
+///        translation process
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+
+extern "C" {
+#include <sys/resource.h>
+#include <unistd.h>
+}
+
+// Local includes
+#include "statistics.h"
+
+using namespace llvm;
+
+bool StatisticsEnabled = false;
+bool MemoryReportEnabled = false;
+uint64_t MemoryLimit = 0;
+
+struct PhaseInfo {
+  PhaseInfo() : Count(0), Seconds(0), PeakRSS(0) { }
+
+  uint64_t Count;
+  double Seconds;
+  uint64_t PeakRSS;
+};
+
+// Statistics can be collected from multiple threads
+static std::mutex Lock;
+static std::map<std::string, uint64_t> Counters;
+static std::map<std::string, PhaseInfo> Phases;
+/// Container sizes recorded since the end of the last phase
+static std::map<std::string, uint64_t> ContainerSizes;
+static std::atomic<bool> LimitReached(false);
+/// Time of the last check of the resident set size against MemoryLimit, in
+/// milliseconds since the epoch of the steady clock
+static std::atomic<int64_t> LastLimitCheck(0);
+/// Minimum interval between two checks against MemoryLimit, in milliseconds
+static const int64_t LimitCheckInterval = 100;
+
+void incrementCounter(StringRef Name, uint64_t Amount) {
+  if (!StatisticsEnabled)
+    return;
+
+  std::unique_lock<std::mutex> Guard(Lock);
+  Counters[Name.str()] += Amount;
+}
+
+void setCounter(StringRef Name, uint64_t Value) {
+  if (!StatisticsEnabled)
+    return;
+
+  std::unique_lock<std::mutex> Guard(Lock);
+  Counters[Name.str()] = Value;
+}
+
+uint64_t getCounter(StringRef Name) {
+  // Counters are not recorded at all if statistics are disabled
+  if (!StatisticsEnabled)
+    return 0;
+
+  std::unique_lock<std::mutex> Guard(Lock);
+  auto It = Counters.find(Name.str());
+  return It == Counters.end() ? 0 : It->second;
+}
+
+uint64_t peakRSS() {
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) != 0)
+    return 0;
+
+  // On Linux ru_maxrss is expressed in KiB
+  return Usage.ru_maxrss;
+}
+
+uint64_t currentRSS() {
+  // The second field of statm is the number of resident pages
+  std::ifstream Statm("/proc/self/statm");
+  uint64_t Size = 0;
+  uint64_t Resident = 0;
+  if (!(Statm >> Size >> Resident))
+    return 0;
+
+  return Resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void recordContainerSize(StringRef Name, uint64_t Bytes) {
+  if (!MemoryReportEnabled)
+    return;
+
+  std::unique_lock<std::mutex> Guard(Lock);
+  ContainerSizes[Name.str()] += Bytes;
+}
+
+bool memoryLimitReached() {
+  if (LimitReached)
+    return true;
+
+  if (MemoryLimit == 0)
+    return false;
+
+  // Reading /proc/self/statm is not free: check it at most once every
+  // LimitCheckInterval, and only in one of the threads getting here
+  using namespace std::chrono;
+  auto SinceEpoch = steady_clock::now().time_since_epoch();
+  int64_t Now = duration_cast<milliseconds>(SinceEpoch).count();
+  int64_t Last = LastLimitCheck;
+  if (Now - Last < LimitCheckInterval
+      || !LastLimitCheck.compare_exchange_strong(Last, Now))
+    return false;
+
+  uint64_t RSS = currentRSS();
+  if (RSS < MemoryLimit)
+    return false;
+
+  // Report it only once
+  if (!LimitReached.exchange(true)) {
+    std::cerr << "Memory limit reached (" << std::dec << RSS << " KiB), "
+              << "switching to cheaper translation modes\n";
+    setCounter("memory.limit-reached-rss-kib", RSS);
+  }
+
+  return true;
+}
+
+void recordPhase(std::string Name, double Seconds) {
+  uint64_t RSS = peakRSS();
+
+  if (MemoryLimit != 0)
+    memoryLimitReached();
+
+  // Don't read /proc/self/statm while holding the lock
+  uint64_t CurrentRSS = MemoryReportEnabled ? currentRSS() : 0;
+
+  std::unique_lock<std::mutex> Guard(Lock);
+  PhaseInfo &Phase = Phases[Name];
+  Phase.Count++;
+  Phase.Seconds += Seconds;
+  Phase.PeakRSS = RSS;
+
+  // Report only the phases at whose end some container has been measured,
+  // the others (e.g., the decoding of each translation block) would just be
+  // noise
+  if (MemoryReportEnabled && !ContainerSizes.empty()) {
+    std::cerr << "Memory at the end of " << Name << ": "
+              << std::dec << CurrentRSS << " KiB resident, "
+              << RSS << " KiB peak\n";
+    for (auto &P : ContainerSizes)
+      std::cerr << "  " << std::left << std::setw(40) << P.first << std::right
+                << std::setw(14) << P.second << " B\n";
+    ContainerSizes.clear();
+  }
+}
+
+void printStatistics(std::ostream &Output) {
+  std::unique_lock<std::mutex> Guard(Lock);
+
+  Output << "Phases:\n";
+  for (auto &P : Phases)
+    Output << "  " << std::left << std::setw(40) << P.first << std::right
+           << std::dec << std::setw(8) << P.second.Count << "x "
+           << std::fixed << std::setprecision(3) << std::setw(10)
+           << P.second.Seconds << " s "
+           << std::setw(10) << P.second.PeakRSS << " KiB\n";
+
+  Output << "Counters:\n";
+  for (auto &P : Counters)
+    Output << "  " << std::left << std::setw(40) << P.first << std::right
+           << std::dec << std::setw(10) << P.second << "\n";
+}
+
+/// Write \p String as a JSON string, our names never need escaping
+static void writeJSONString(std::ostream &Output, const std::string &String) {
+  Output << '"' << String << '"';
+}
+
+void printStatisticsJSON(std::ostream &Output) {
+  std::unique_lock<std::mutex> Guard(Lock);
+
+  Output << "{\n  \"phases\": {";
+  bool First = true;
+  for (auto &P : Phases) {
+    Output << (First ? "\n" : ",\n") << "    ";
+    First = false;
+    writeJSONString(Output, P.first);
+    Output << ": { \"count\": " << std::dec << P.second.Count
+           << ", \"seconds\": " << std::fixed << std::setprecision(6)
+           << P.second.Seconds
+           << ", \"peak_rss_kib\": " << P.second.PeakRSS << " }";
+  }
+  Output << "\n  },\n  \"counters\": {";
+
+  First = true;
+  for (auto &P : Counters) {
+    Output << (First ? "\n" : ",\n") << "    ";
+    First = false;
+    writeJSONString(Output, P.first);
+    Output << ": " << std::dec << P.second;
+  }
+  Output << "\n  }\n}\n";
+}
@@ -0,0 +1,126 @@
+#ifndef _STATISTICS_H
+#define _STATISTICS_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// LLVM includes
+#include "llvm/ADT/StringRef.h"
+
+extern bool StatisticsEnabled;
+
+/// \brief Whether the size of the major containers should be reported on the
+///        standard error at the end of each phase
+extern bool MemoryReportEnabled;
+
+/// \brief Soft limit on the resident set size, in KiB, 0 if there's none
+///
+/// When the limit is reached, the translation switches to cheaper modes (see
+/// memoryLimitReached) instead of running out of memory.
+extern uint64_t MemoryLimit;
+
+/// \brief Add \p Amount to the counter named \p Name
+void incrementCounter(llvm::StringRef Name, uint64_t Amount = 1);
+
+/// \brief Set the counter named \p Name to \p Value
+void setCounter(llvm::StringRef Name, uint64_t Value);
+
+/// \brief Return the current value of the counter named \p Name
+uint64_t getCounter(llvm::StringRef Name);
+
+/// \brief Return the peak resident set size of the process so far, in KiB
+uint64_t peakRSS();
+
+/// \brief Return the current resident set size of the process, in KiB
+uint64_t currentRSS();
+
+/// \brief Record that the container \p Name occupies about \p Bytes
+///
+/// Sizes recorded multiple times with the same name before the end of the
+/// current phase are accumulated, e.g., one for each OSRA region. They are
+/// printed, along with the resident set size, at the end of the phase if
+/// MemoryReportEnabled is true. This is a no-op otherwise, but computing the
+/// sizes is not free, check MemoryReportEnabled first.
+void recordContainerSize(llvm::StringRef Name, uint64_t Bytes);
+
+/// \brief Return true if the resident set size has reached MemoryLimit
+///
+/// The resident set size is read at most every 100 ms, in between this
+/// returns false until the limit has been found reached. Once the limit has
+/// been reached this keeps returning true, even if the resident set size
+/// decreases, so that each component switches to its cheaper mode once and
+/// for all.
+bool memoryLimitReached();
+
+/// \brief Return an estimate of the bytes used by a std::map or a std::set,
+///        excluding memory owned by its elements
+template<typename T>
+inline uint64_t treeBytes(const T &Container) {
+  // Each red-black tree node holds three pointers and the color
+  return Container.size() * (sizeof(typename T::value_type)
+                             + 4 * sizeof(void *));
+}
+
+/// \brief Return the bytes allocated by a std::vector, excluding memory owned
+///        by its elements
+template<typename T>
+inline uint64_t vectorBytes(const T &Container) {
+  return Container.capacity() * sizeof(typename T::value_type);
+}
+
+/// \brief Record that the phase \p Name took \p Seconds
+void recordPhase(std::string Name, double Seconds);
+
+/// \brief Print all the statistics in human readable form
+void printStatistics(std::ostream &Output);
+
+/// \brief Print all the statistics as a JSON object
+///
+/// The object has two members: "phases", associating to each phase name the
+/// number of times it has been executed ("count"), the total wall time
+/// ("seconds") and the peak RSS at its end ("peak_rss_kib"), and "counters",
+/// associating to each counter name its value.
+void printStatisticsJSON(std::ostream &Output);
+
+/// \brief Measure the wall time of a phase until the object goes out of scope
+///
+/// Multiple executions of a phase with the same name are accumulated. If
+/// statistics, the memory report and the memory limit are all disabled this
+/// is a no-op.
+class ScopedPhase {
+public:
+  /// \param Name the name of the phase, use dots to express nesting, e.g.
+  ///        "harvest.set".
+  ScopedPhase(std::string Name) :
+    Name(Name),
+    Enabled(StatisticsEnabled || MemoryReportEnabled || MemoryLimit != 0) {
+    if (Enabled)
+      Start = std::chrono::steady_clock::now();
+  }
+
+  ~ScopedPhase() { stop(); }
+
+  /// \brief Terminate the phase before the end of the scope
+  void stop() {
+    if (Enabled) {
+      std::chrono::duration<double> Elapsed;
+      Elapsed = std::chrono::steady_clock::now() - Start;
+      recordPhase(Name, Elapsed.count());
+      Enabled = false;
+    }
+  }
+
+private:
+  std::string Name;
+  bool Enabled;
+  std::chrono::steady_clock::time_point Start;
+};
+
+#endif // _STATISTICS_H
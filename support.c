@@ -2,13 +2,18 @@
  * This file is distributed under the MIT License. See LICENSE.md for details.
  */
 
+// Required to access the registers in the signal context
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <elf.h>
 #include <endian.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
@@ -16,6 +21,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdnoreturn.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#include "tracecodec.h"
 
 // Save the program arguments for meaningful error reporting
 static int saved_argc;
@@ -28,16 +40,19 @@ static char **saved_argv;
 #if defined(TARGET_arm)
 
 typedef uint32_t target_reg;
+typedef int32_t abi_long;
 #define SWAP(x) (htole32(x))
 
 #elif defined(TARGET_x86_64)
 
 typedef uint64_t target_reg;
+typedef int64_t abi_long;
 #define SWAP(x) (htole64(x))
 
 #elif defined(TARGET_mips)
 
 typedef uint32_t target_reg;
+typedef int32_t abi_long;
 #define SWAP(x) (htobe32(x))
 
 #else
@@ -226,6 +241,254 @@ void unknownPC() {
   abort();
 }
 
+// Native syscalls support
+//
+// If revamb has been invoked with --native-syscalls, the syscall helpers call
+// native_do_syscall instead of the QEMU syscall emulation layer, which is
+// still available as qemu_do_syscall. When the input and the host ABI match,
+// the most common syscalls are forwarded directly to the host, skipping the
+// arguments marshalling.
+abi_long qemu_do_syscall(void *cpu_env, int num,
+                         abi_long arg1, abi_long arg2, abi_long arg3,
+                         abi_long arg4, abi_long arg5, abi_long arg6,
+                         abi_long arg7, abi_long arg8) __attribute__((weak));
+
+// Guest threads support
+//
+// If revamb has been invoked with --guest-threads, each thread has its own
+// copy of the CSVs, and the exclusive sections of the helpers (e.g., the
+// emulation of store-exclusive and store-conditional) are protected by this
+// lock. revamb also provides the functions to copy the CPU state of a thread
+// and to run the translated code on a new one.
+static pthread_mutex_t exclusive_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void revamb_start_exclusive(void) {
+  pthread_mutex_lock(&exclusive_lock);
+}
+
+void revamb_end_exclusive(void) {
+  pthread_mutex_unlock(&exclusive_lock);
+}
+
+extern const uint64_t revamb_cpu_state_size __attribute__((weak));
+void revamb_save_cpu_state(uint8_t *buffer) __attribute__((weak));
+void revamb_load_cpu_state(uint8_t *buffer) __attribute__((weak));
+void revamb_start_thread(target_reg stack,
+                         target_reg offset) __attribute__((weak));
+
+#if defined(TARGET_x86_64) && defined(__x86_64__)
+
+#include <asm/prctl.h>
+#include <linux/futex.h>
+
+// The child thread starts right after the syscall instruction
+static const target_reg syscall_instruction_size = 2;
+
+// The address the current guest thread has to clear at exit, as requested by
+// CLONE_CHILD_CLEARTID. The TID address of the host thread is left to glibc.
+static __thread pid_t *clear_child_tid = NULL;
+
+// Number of threads of the input program still running, the program ends only
+// when the last one exits
+static int live_guest_threads = 1;
+
+struct guest_thread {
+  void *cpu_env;
+  uint8_t *state;
+  unsigned long flags;
+  target_reg stack;
+  target_reg child_tid;
+  target_reg tls;
+  sem_t started;
+  pid_t tid;
+};
+
+static void *guest_thread_start(void *argument) {
+  struct guest_thread *thread = (struct guest_thread *) argument;
+  unsigned long flags = thread->flags;
+  target_reg stack = thread->stack;
+  pid_t tid = syscall(SYS_gettid);
+
+  revamb_load_cpu_state(thread->state);
+  free(thread->state);
+
+  // Let QEMU set the FS base in the CSVs of this thread
+  if (flags & CLONE_SETTLS)
+    qemu_do_syscall(thread->cpu_env, SYS_arch_prctl,
+                    ARCH_SET_FS, thread->tls, 0, 0, 0, 0, 0, 0);
+
+  if (flags & CLONE_CHILD_SETTID)
+    *(pid_t *) thread->child_tid = tid;
+
+  // Clear the TID and wake up the waiters on exit, see native_exit
+  if (flags & CLONE_CHILD_CLEARTID)
+    clear_child_tid = (pid_t *) thread->child_tid;
+
+  // From now on, thread belongs to the parent
+  thread->tid = tid;
+  sem_post(&thread->started);
+
+  revamb_start_thread(stack, syscall_instruction_size);
+  return NULL;
+}
+
+// Handle the exit syscall of a thread, terminating the program only if it's
+// the last thread, as the kernel does. QEMU doesn't know about the guest
+// threads, so in any other case we have to terminate the host thread
+// ourselves.
+static abi_long native_exit(void *cpu_env, abi_long status) {
+  if (__atomic_sub_fetch(&live_guest_threads, 1, __ATOMIC_SEQ_CST) == 0)
+    return qemu_do_syscall(cpu_env, SYS_exit, status, 0, 0, 0, 0, 0, 0, 0);
+
+  if (clear_child_tid != NULL) {
+    __atomic_store_n(clear_child_tid, 0, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, clear_child_tid, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+
+  pthread_exit(NULL);
+}
+
+static abi_long native_clone(void *cpu_env,
+                             unsigned long flags,
+                             target_reg stack,
+                             target_reg parent_tid,
+                             target_reg child_tid,
+                             target_reg tls) {
+  struct guest_thread thread;
+  thread.cpu_env = cpu_env;
+  thread.flags = flags;
+  thread.stack = stack;
+  thread.child_tid = child_tid;
+  thread.tls = tls;
+
+  thread.state = malloc(revamb_cpu_state_size);
+  if (thread.state == NULL)
+    return -ENOMEM;
+  revamb_save_cpu_state(thread.state);
+
+  sem_init(&thread.started, 0, 0);
+
+  pthread_attr_t attributes;
+  pthread_t handle;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  int result = pthread_create(&handle,
+                              &attributes,
+                              guest_thread_start,
+                              &thread);
+  pthread_attr_destroy(&attributes);
+
+  if (result != 0) {
+    free(thread.state);
+    sem_destroy(&thread.started);
+    return -result;
+  }
+  __atomic_add_fetch(&live_guest_threads, 1, __ATOMIC_SEQ_CST);
+
+  while (sem_wait(&thread.started) != 0) {
+  }
+  sem_destroy(&thread.started);
+
+  if (flags & CLONE_PARENT_SETTID)
+    *(pid_t *) parent_tid = thread.tid;
+
+  return thread.tid;
+}
+
+// Once the fast path is in use, the program break is handled here only
+static target_reg original_brk;
+static target_reg current_brk;
+static target_reg mapped_brk;
+
+static void native_set_brk(target_reg new_brk) {
+  original_brk = current_brk = mapped_brk = new_brk;
+}
+
+static abi_long native_brk(target_reg new_brk) {
+  if (new_brk == 0 || new_brk < original_brk)
+    return current_brk;
+
+  if (new_brk > mapped_brk) {
+    // Map the missing pages right after the current ones, if they're free
+    size_t size = ((new_brk - mapped_brk) + 0xfff) & ~((target_reg) 0xfff);
+    void *result = mmap((void *) mapped_brk,
+                        size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE,
+                        -1,
+                        0);
+    if (result == MAP_FAILED)
+      return current_brk;
+
+    if (result != (void *) mapped_brk) {
+      munmap(result, size);
+      return current_brk;
+    }
+
+    mapped_brk += size;
+  }
+
+  current_brk = new_brk;
+  return current_brk;
+}
+
+abi_long native_do_syscall(void *cpu_env, int num,
+                           abi_long arg1, abi_long arg2, abi_long arg3,
+                           abi_long arg4, abi_long arg5, abi_long arg6,
+                           abi_long arg7, abi_long arg8) {
+  long result;
+
+  switch (num) {
+  case SYS_read:
+  case SYS_write:
+  case SYS_mmap:
+  case SYS_futex:
+  case SYS_clock_gettime:
+    // Guest addresses are host addresses and the structures have the same
+    // layout, just adapt the error reporting
+    result = syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
+    return result == -1 ? -errno : result;
+  case SYS_brk:
+    return native_brk(arg1);
+  case SYS_clone:
+    // Run the new threads sharing the address space on host threads, if the
+    // program has been translated with --guest-threads
+    if (revamb_start_thread != NULL
+        && (arg1 & CLONE_VM)
+        && (arg1 & CLONE_THREAD)
+        && arg2 != 0)
+      return native_clone(cpu_env, arg1, arg2, arg3, arg4, arg5);
+    return qemu_do_syscall(cpu_env, num,
+                           arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8);
+  case SYS_exit:
+    if (revamb_start_thread != NULL)
+      return native_exit(cpu_env, arg1);
+    return qemu_do_syscall(cpu_env, num,
+                           arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8);
+  default:
+    return qemu_do_syscall(cpu_env, num,
+                           arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8);
+  }
+}
+
+#else
+
+static void native_set_brk(target_reg new_brk) {
+}
+
+abi_long native_do_syscall(void *cpu_env, int num,
+                           abi_long arg1, abi_long arg2, abi_long arg3,
+                           abi_long arg4, abi_long arg5, abi_long arg6,
+                           abi_long arg7, abi_long arg8) {
+  return qemu_do_syscall(cpu_env, num,
+                         arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8);
+}
+
+#endif
+
+static void write_profile(void);
+static void write_shadow_stack_stats(void);
+
 #ifdef TRACE
 
 // Execution tracing support
@@ -233,40 +496,102 @@ static int trace_fd = -1;
 static size_t trace_buffer_size = 1024 * 1024;
 static size_t trace_buffer_index = 0;
 static uint64_t *trace_buffer;
+static uint64_t trace_sampling = 1;
+static uint64_t trace_sampling_counter = 0;
+
+// Compressed tracing support: only the jump targets are recorded, in the
+// format described in tracecodec.h. The file is written through a shared
+// mapping of a window of it, moved forward when it's full: the kernel takes
+// care of writing it out, even in case of a crash.
+static int trace_compressed = 0;
+static uint8_t *trace_window = NULL;
+static size_t trace_window_size = 8 * 1024 * 1024;
+static size_t trace_window_index = 0;
+static off_t trace_window_offset = 0;
+static uint64_t trace_last_pc = 0;
 
 static void flush_trace_buffer(void);
 
 void flush_trace_buffer(void);
 void flush_trace_buffer_signal_handler(int signal);
 
+static void map_trace_window(void) {
+  int result = ftruncate(trace_fd, trace_window_offset + trace_window_size);
+  assert(result == 0);
+
+  trace_window = mmap(NULL,
+                      trace_window_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      trace_fd,
+                      trace_window_offset);
+  assert(trace_window != MAP_FAILED);
+  trace_window_index = 0;
+}
+
+static void next_trace_window(void) {
+  munmap(trace_window, trace_window_size);
+  trace_window_offset += trace_window_size;
+  map_trace_window();
+}
+
 void init_tracing(void) {
   // If REVAMB_TRACE_PATH contains a path, enable tracing
   char *trace_path = getenv("REVAMB_TRACE_PATH");
   if (trace_path != NULL && strlen(trace_path) > 0) {
     trace_fd = open(trace_path,
-                    O_WRONLY | O_CREAT | O_TRUNC,
+                    O_RDWR | O_CREAT | O_TRUNC,
                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
      assert(trace_fd != -1);
 
+     // Set REVAMB_TRACE_FORMAT to "compressed" to use the compressed format
+     char *trace_format = getenv("REVAMB_TRACE_FORMAT");
+     trace_compressed = trace_format != NULL
+       && strcmp(trace_format, "compressed") == 0;
+
      // Set REVAMB_TRACE_BUFFER_SIZE to customimze buffer size, default is 1024
-     // * 1024 instructions
+     // * 1024 instructions. In the compressed format it's the size in bytes of
+     // the window, rounded up to the page size, default is 8 MiB.
      char *trace_buffer_size_string = getenv("REVAMB_TRACE_BUFFER_SIZE");
      if (trace_buffer_size_string != NULL
          && strlen(trace_buffer_size_string) > 0) {
-       char **first_invalid = NULL;
-       trace_buffer_size = strtoll(trace_buffer_size_string, first_invalid, 0);
-       assert(**first_invalid == '\0');
+       char *first_invalid = NULL;
+       size_t size = strtoll(trace_buffer_size_string, &first_invalid, 0);
+       assert(*first_invalid == '\0' && size > 0);
+
+       if (trace_compressed) {
+         size_t page_size = sysconf(_SC_PAGESIZE);
+         trace_window_size = (size + page_size - 1) / page_size * page_size;
+       } else {
+         trace_buffer_size = size;
+       }
+     }
+
+     // Set REVAMB_TRACE_SAMPLING to record only one out of N basic blocks
+     // reached through newbb, default is 1 (all of them)
+     char *trace_sampling_string = getenv("REVAMB_TRACE_SAMPLING");
+     if (trace_sampling_string != NULL && strlen(trace_sampling_string) > 0) {
+       trace_sampling = strtoll(trace_sampling_string, NULL, 0);
+       assert(trace_sampling > 0);
      }
 
-     // Allocate buffer to hold program counters
-     trace_buffer = malloc(trace_buffer_size * sizeof(uint64_t));
-     assert(trace_buffer != NULL);
+     if (trace_compressed) {
+       // Map the first window and write the header
+       map_trace_window();
+       memcpy(trace_window, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+       trace_window_index = TRACE_MAGIC_SIZE;
+     } else {
+       // Allocate buffer to hold program counters
+       trace_buffer = malloc(trace_buffer_size * sizeof(uint64_t));
+       assert(trace_buffer != NULL);
+     }
 
      // In case of a crash, flush the buffer
      static const int signals[] = { SIGINT, SIGABRT, SIGTERM, SIGSEGV };
      for (unsigned c = 0; c < sizeof(signals) / sizeof(int); c++) {
        struct sigaction new_handler;
        struct sigaction old_handler;
+       memset(&new_handler, 0, sizeof(new_handler));
        new_handler.sa_handler = flush_trace_buffer_signal_handler;
        int result = sigaction(signals[c], &new_handler, &old_handler);
        assert(result == 0);
@@ -280,8 +605,19 @@ void init_tracing(void) {
   }
 }
 
+// Note: this function has to be async-signal-safe
 static void flush_trace_buffer(void) {
-  if (trace_fd == -1 || trace_buffer_index == 0)
+  if (trace_fd == -1)
+    return;
+
+  if (trace_compressed) {
+    // Drop the unused part of the current window, the rest is already in the
+    // file
+    ftruncate(trace_fd, trace_window_offset + trace_window_index);
+    return;
+  }
+
+  if (trace_buffer_index == 0)
     return;
 
   // Write the all buffer out and reset the counter
@@ -291,20 +627,37 @@ static void flush_trace_buffer(void) {
 
 void flush_trace_buffer_signal_handler(int signal) {
   flush_trace_buffer();
+
+  // The trace is complete, stop tracing and deliver the signal as usual
+  trace_fd = -1;
+  struct sigaction default_handler;
+  memset(&default_handler, 0, sizeof(default_handler));
+  default_handler.sa_handler = SIG_DFL;
+  sigaction(signal, &default_handler, NULL);
+  raise(signal);
 }
 
 // This function is called by the syscall helpers in case of exit/exit_group
 void on_exit_syscall(void) {
   flush_trace_buffer();
+  write_profile();
+  write_shadow_stack_stats();
 }
 
-void newpc(uint64_t pc,
-           uint64_t instruction_size,
-           uint32_t is_first,
-           uint8_t *vars, ...) {
-  // Check if tracing is enabled
-  if (trace_fd == -1)
+static void record_pc(uint64_t pc) {
+  if (trace_compressed) {
+    uint8_t record[TRACE_MAX_RECORD_SIZE];
+    unsigned size = trace_encode_record(trace_last_pc, pc, record);
+    trace_last_pc = pc;
+
+    for (unsigned i = 0; i < size; i++) {
+      if (trace_window_index == trace_window_size)
+        next_trace_window();
+      trace_window[trace_window_index++] = record[i];
+    }
+
     return;
+  }
 
   // Record the program counter
   trace_buffer[trace_buffer_index++] = pc;
@@ -314,12 +667,35 @@ void newpc(uint64_t pc,
     flush_trace_buffer();
 }
 
+void newpc(uint64_t pc,
+           uint64_t instruction_size,
+           uint32_t is_first,
+           uint8_t *vars, ...) {
+  // Check if tracing is enabled, the compressed format only records the jump
+  // targets
+  if (trace_fd == -1 || (trace_compressed && is_first != 1))
+    return;
+
+  record_pc(pc);
+}
+
+void newbb(uint64_t pc) {
+  // Check if tracing is enabled and if this basic block has been sampled
+  if (trace_fd == -1 || ++trace_sampling_counter < trace_sampling)
+    return;
+  trace_sampling_counter = 0;
+
+  record_pc(pc);
+}
+
 #else
 
 void init_tracing(void) {
 }
 
 void on_exit_syscall(void) {
+  write_profile();
+  write_shadow_stack_stats();
 }
 
 void newpc(uint64_t pc,
@@ -328,8 +704,207 @@ void newpc(uint64_t pc,
            uint8_t *vars, ...) {
 }
 
+void newbb(uint64_t pc) {
+}
+
 #endif
 
+// Sampling profiler support: every REVAMB_PROFILE_FREQUENCY-th of a second of
+// CPU time the program is interrupted and the host PC is mapped back to the
+// jump target whose translation contains it, through the table emitted by
+// revamb --address-map. Since the jump targets are not laid out in order, a
+// sample is attributed to the closest jump target preceding it in memory.
+// The samples outside the translated code, which ends at
+// revamb_address_map_end (e.g., in the helpers, in libc or in this file), are
+// counted as unknown.
+struct address_map_entry {
+  void *host;
+  uint64_t pc;
+};
+
+extern const struct address_map_entry revamb_address_map[]
+  __attribute__((weak));
+extern const uint64_t revamb_address_map_size __attribute__((weak));
+void revamb_address_map_end(void) __attribute__((weak));
+
+static struct address_map_entry *profile_map = NULL;
+static uint64_t *profile_counts = NULL;
+static size_t profile_map_size = 0;
+static uintptr_t profile_map_end = 0;
+static uint64_t profile_unknown = 0;
+static char *profile_path = NULL;
+
+static int compare_address_map_entries(const void *a, const void *b) {
+  uintptr_t first = (uintptr_t) ((const struct address_map_entry *) a)->host;
+  uintptr_t second = (uintptr_t) ((const struct address_map_entry *) b)->host;
+  return (first > second) - (first < second);
+}
+
+static uintptr_t signal_host_pc(void *context) {
+  ucontext_t *ucontext = (ucontext_t *) context;
+#if defined(__x86_64__)
+  return ucontext->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+  return ucontext->uc_mcontext.pc;
+#else
+  (void) ucontext;
+  return 0;
+#endif
+}
+
+static void profile_signal_handler(int signal, siginfo_t *info, void *context) {
+  uintptr_t host_pc = signal_host_pc(context);
+
+  // Look for the last entry starting at or before host_pc
+  size_t low = 0;
+  size_t high = profile_map_size;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if ((uintptr_t) profile_map[middle].host <= host_pc)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  // The signal can be delivered to any of the threads
+  if (low == 0 || host_pc >= profile_map_end)
+    __atomic_add_fetch(&profile_unknown, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&profile_counts[low - 1], 1, __ATOMIC_RELAXED);
+}
+
+static void init_profiling(void) {
+  // If REVAMB_PROFILE_PATH contains a path, enable the profiler
+  profile_path = getenv("REVAMB_PROFILE_PATH");
+  if (profile_path == NULL || strlen(profile_path) == 0) {
+    profile_path = NULL;
+    return;
+  }
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+  fprintf(stderr, "Profiling is not supported on this host\n");
+  profile_path = NULL;
+  return;
+#endif
+
+  if (&revamb_address_map_size == NULL || revamb_address_map_size == 0) {
+    fprintf(stderr,
+            "Profiling requires a program translated with --address-map\n");
+    profile_path = NULL;
+    return;
+  }
+
+  // Set REVAMB_PROFILE_FREQUENCY to customize the number of samples per
+  // second of CPU time, default is 1000
+  long frequency = 1000;
+  char *frequency_string = getenv("REVAMB_PROFILE_FREQUENCY");
+  if (frequency_string != NULL && strlen(frequency_string) > 0) {
+    char *first_invalid = NULL;
+    frequency = strtol(frequency_string, &first_invalid, 0);
+    assert(*first_invalid == '\0' && frequency > 0 && frequency <= 1000000);
+  }
+
+  // Sort a copy of the map by host address
+  profile_map_size = revamb_address_map_size;
+  profile_map = malloc(profile_map_size * sizeof(struct address_map_entry));
+  profile_counts = calloc(profile_map_size, sizeof(uint64_t));
+  assert(profile_map != NULL && profile_counts != NULL);
+  memcpy(profile_map,
+         revamb_address_map,
+         profile_map_size * sizeof(struct address_map_entry));
+  qsort(profile_map,
+        profile_map_size,
+        sizeof(struct address_map_entry),
+        compare_address_map_entries);
+
+  // The end of the translated code must follow all the jump targets
+  profile_map_end = (uintptr_t) revamb_address_map_end;
+  if (profile_map_end
+      <= (uintptr_t) profile_map[profile_map_size - 1].host) {
+    fprintf(stderr,
+            "The address map doesn't mark the end of the translated code\n");
+    profile_path = NULL;
+    return;
+  }
+
+  struct sigaction handler;
+  memset(&handler, 0, sizeof(handler));
+  handler.sa_sigaction = profile_signal_handler;
+  handler.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&handler.sa_mask);
+  int result = sigaction(SIGPROF, &handler, NULL);
+  assert(result == 0);
+
+  // tv_usec must be less than a second, i.e., with a frequency of 1 the period
+  // goes in tv_sec
+  long period = 1000000 / frequency;
+  struct itimerval timer;
+  timer.it_interval.tv_sec = period / 1000000;
+  timer.it_interval.tv_usec = period % 1000000;
+  timer.it_value = timer.it_interval;
+  result = setitimer(ITIMER_PROF, &timer, NULL);
+  assert(result == 0);
+
+  atexit(write_profile);
+}
+
+// Write the collected samples in the folded stacks format, one line with the
+// PC of the jump target and the number of samples per sampled jump target
+static void write_profile(void) {
+  if (profile_path == NULL)
+    return;
+
+  // Stop sampling and make sure the profile is written only once
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  char *path = profile_path;
+  profile_path = NULL;
+
+  FILE *profile = fopen(path, "w");
+  if (profile == NULL) {
+    fprintf(stderr, "Couldn't write the profile to %s\n", path);
+    return;
+  }
+
+  for (size_t i = 0; i < profile_map_size; i++) {
+    uint64_t count = __atomic_load_n(&profile_counts[i], __ATOMIC_RELAXED);
+    if (count != 0)
+      fprintf(profile,
+              "0x%llx %llu\n",
+              (unsigned long long) profile_map[i].pc,
+              (unsigned long long) count);
+  }
+
+  uint64_t unknown = __atomic_load_n(&profile_unknown, __ATOMIC_RELAXED);
+  if (unknown != 0)
+    fprintf(profile, "[unknown] %llu\n", (unsigned long long) unknown);
+
+  fclose(profile);
+}
+
+// Shadow stack statistics: revamb --shadow-stack counts in
+// revamb_shadow_stack_hits the returns which reached their call site through
+// the shadow stack instead of the dispatcher. If REVAMB_SHADOW_STACK_STATS is
+// set, the count is printed on the standard error at exit.
+extern uint64_t revamb_shadow_stack_hits __attribute__((weak));
+
+static int shadow_stack_stats_written = 0;
+
+static void write_shadow_stack_stats(void) {
+  char *enabled = getenv("REVAMB_SHADOW_STACK_STATS");
+  if (shadow_stack_stats_written
+      || &revamb_shadow_stack_hits == NULL
+      || enabled == NULL
+      || strlen(enabled) == 0)
+    return;
+
+  shadow_stack_stats_written = 1;
+  fprintf(stderr,
+          "shadow-stack.hits: %llu\n",
+          (unsigned long long) revamb_shadow_stack_hits);
+}
+
 int main(int argc, char *argv[]) {
   // Save the program arguments for error reporting purposes
   saved_argc = argc;
@@ -338,6 +913,12 @@ int main(int argc, char *argv[]) {
   // Initialize the tracing system
   init_tracing();
 
+  // Initialize the sampling profiler
+  init_profiling();
+
+  // Report the shadow stack statistics even if the program returns from main
+  atexit(write_shadow_stack_stats);
+
   // Allocate and initialize the stack
   void *stack = mmap((void *) NULL,
                      16 * 0x100000,
@@ -360,6 +941,7 @@ int main(int argc, char *argv[]) {
 
   SAFE_CAST(brk);
   target_set_brk((target_reg) brk);
+  native_set_brk((target_reg) brk);
 
   // Initialize the syscall system
   syscall_init();
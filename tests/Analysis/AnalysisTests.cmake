@@ -9,50 +9,186 @@ set(OUTPUT_SUFFIX_cfg ".cfg.csv")
 set(OUTPUT_SUFFIX_noreturn ".noreturn.csv")
 set(OUTPUT_SUFFIX_functionsboundaries ".functions-boundaries.csv")
 
+# TEST_OUTPUTS_<arch>_<test> is the list of the outputs with a reference
+# (default: all the OUTPUT_NAMES)
+
 set(TESTS_arm "memset" "switch-addls" "switch-ldrls" "switch-disjoint-ranges")
 set(TEST_SOURCES_arm_memset "${SRC}/arm/memset.S")
 set(TEST_SOURCES_arm_switch-addls "${SRC}/arm/switch-addls.S")
 set(TEST_SOURCES_arm_switch-ldrls "${SRC}/arm/switch-ldrls.S")
 set(TEST_SOURCES_arm_switch-disjoint-ranges "${SRC}/arm/switch-disjoint-ranges.S")
 
-set(TESTS_x86_64 "switch-jump-table" "try-catch-ehframe")
+set(TESTS_x86_64 "switch-jump-table" "try-catch-ehframe"
+  "switch-bound-across-blocks" "switch-index-copy" "nested-switch")
 set(TEST_SOURCES_x86_64_switch-jump-table "${SRC}/x86_64/switch-jump-table.S")
 set(TEST_SOURCES_x86_64_try-catch-ehframe "${SRC}/x86_64/try-catch-ehframe.S")
+set(TEST_SOURCES_x86_64_switch-bound-across-blocks "${SRC}/x86_64/switch-bound-across-blocks.S")
+set(TEST_OUTPUTS_x86_64_switch-bound-across-blocks "cfg" "noreturn")
+set(TEST_SOURCES_x86_64_switch-index-copy "${SRC}/x86_64/switch-index-copy.S")
+set(TEST_OUTPUTS_x86_64_switch-index-copy "cfg" "noreturn")
+set(TEST_SOURCES_x86_64_nested-switch "${SRC}/x86_64/nested-switch.S")
+set(TEST_OUTPUTS_x86_64_nested-switch "cfg" "noreturn")
 
 set(TESTS_mips "switch-jump-table")
 set(TEST_SOURCES_mips_switch-jump-table "${SRC}/mips/switch-jump-table.S")
 
+# Besides the default translation, each test binary is translated with the
+# options of each variant, and its results are checked against the same
+# reference outputs. In VARIANT_FLAGS_<variant>, <BINARY> is replaced with the
+# path of the test binary. VARIANT_DEPENDS_<variant> is the list of the tests
+# (without the -<test>-<arch> suffix) the translation depends on.
+set(VARIANTS "import-jts" "on-demand-rd" "artifact" "memory-limit"
+  "time-budget" "pre-harvest" "out-of-core")
+
+# Reuse the jump targets exported by the default translation
+set(VARIANT_FLAGS_import-jts "--import-jts <BINARY>.jts --export-jts <BINARY>.import-jts.jts")
+set(VARIANT_DEPENDS_import-jts "translate")
+
+# Query the reaching definitions of the compared loads on demand
+set(VARIANT_FLAGS_on-demand-rd "--on-demand-rd")
+set(VARIANT_DEPENDS_on-demand-rd "")
+
+# Also write the binary analysis artifact
+set(VARIANT_FLAGS_artifact "--artifact <BINARY>.artifact")
+set(VARIANT_DEPENDS_artifact "")
+
+# Report the memory usage and check the limit, never reached, at each round
+set(VARIANT_FLAGS_memory-limit "--memory-report --memory-limit 65536")
+set(VARIANT_DEPENDS_memory-limit "")
+
+# Check the deadline, never reached, during the harvest
+set(VARIANT_FLAGS_time-budget "--time-budget 3600")
+set(VARIANT_DEPENDS_time-budget "")
+
+# Save the module before the harvest for revamb-analysis-bench
+set(VARIANT_FLAGS_pre-harvest "--dump-pre-harvest <BINARY>.pre-harvest.bc")
+set(VARIANT_DEPENDS_pre-harvest "")
+
+# Keep the text of the instructions in a scratch file during the analyses
+set(VARIANT_FLAGS_out-of-core "--out-of-core <BINARY>.out-of-core")
+set(VARIANT_DEPENDS_out-of-core "")
+
+# Translate BINARY with FLAGS, extract the analysis results and check them
+# against the reference outputs. VARIANT, if not empty, is part of the names of
+# the tests and of the output files.
+function(add_analysis_tests ARCH TEST_NAME BINARY VARIANT FLAGS DEPENDS)
+  if(VARIANT)
+    set(PREFIX "${VARIANT}-")
+    set(OUTPUT_BINARY "${BINARY}.${VARIANT}")
+  else()
+    set(PREFIX "")
+    set(OUTPUT_BINARY "${BINARY}")
+  endif()
+
+  string(REPLACE "<BINARY>" "${BINARY}" FLAGS "${FLAGS}")
+  separate_arguments(FLAGS UNIX_COMMAND "${FLAGS}")
+
+  set(TRANSLATE_DEPENDS "")
+  foreach(DEPEND ${DEPENDS})
+    list(APPEND TRANSLATE_DEPENDS "${DEPEND}-${TEST_NAME}-${ARCH}")
+  endforeach()
+
+  # Translate the compiled binary
+  add_test(NAME ${PREFIX}translate-${TEST_NAME}-${ARCH}
+    COMMAND $<TARGET_FILE:revamb> --functions-boundaries --use-sections ${FLAGS} -g ll "${BINARY}" "${OUTPUT_BINARY}.ll")
+  set_tests_properties(${PREFIX}translate-${TEST_NAME}-${ARCH}
+    PROPERTIES DEPENDS "${TRANSLATE_DEPENDS}"
+               LABELS "analysis;translate;${TEST_NAME}-${ARCH};${VARIANT}")
+
+  add_analysis_checks("${ARCH}" "${TEST_NAME}" "${OUTPUT_BINARY}" "${VARIANT}"
+    "${PREFIX}translate-${TEST_NAME}-${ARCH}")
+endfunction()
+
+# Extract the analysis results from OUTPUT_BINARY.ll, produced by the
+# TRANSLATE_TEST test, and check them against the reference outputs
+function(add_analysis_checks ARCH TEST_NAME OUTPUT_BINARY VARIANT TRANSLATE_TEST)
+  if(VARIANT)
+    set(PREFIX "${VARIANT}-")
+  else()
+    set(PREFIX "")
+  endif()
+
+  # Extract all the information in a single shot
+  add_test(NAME ${PREFIX}extract-info-${TEST_NAME}-${ARCH}
+    COMMAND $<TARGET_FILE:revamb-dump> --cfg "${OUTPUT_BINARY}.cfg.csv" --noreturn "${OUTPUT_BINARY}.noreturn.csv" --functions-boundaries "${OUTPUT_BINARY}.functions-boundaries.csv" "${OUTPUT_BINARY}.ll")
+  set_tests_properties(${PREFIX}extract-info-${TEST_NAME}-${ARCH}
+    PROPERTIES DEPENDS ${TRANSLATE_TEST}
+               LABELS "analysis;extract-info;${TEST_NAME}-${ARCH};${VARIANT}")
+
+  set(TEST_OUTPUT_NAMES "${OUTPUT_NAMES}")
+  if(DEFINED TEST_OUTPUTS_${ARCH}_${TEST_NAME})
+    set(TEST_OUTPUT_NAMES "${TEST_OUTPUTS_${ARCH}_${TEST_NAME}}")
+  endif()
+
+  foreach(OUTPUT_NAME ${TEST_OUTPUT_NAMES})
+    set(REFERENCE_OUTPUT "${SRC}/${ARCH}/${TEST_NAME}${OUTPUT_SUFFIX_${OUTPUT_NAME}}")
+    set(OUTPUT "${OUTPUT_BINARY}${OUTPUT_SUFFIX_${OUTPUT_NAME}}")
+
+    if(EXISTS "${REFERENCE_OUTPUT}")
+      add_test(NAME ${PREFIX}check-${TEST_NAME}-${ARCH}-${OUTPUT_NAME}
+        COMMAND "${DIFF}" "${REFERENCE_OUTPUT}" "${OUTPUT}")
+      set_tests_properties(${PREFIX}check-${TEST_NAME}-${ARCH}-${OUTPUT_NAME}
+        PROPERTIES DEPENDS ${PREFIX}extract-info-${TEST_NAME}-${ARCH}
+                   LABELS "analysis;check-with-reference;${TEST_NAME};${ARCH};${OUTPUT_NAME};${TEST_NAME}-${ARCH};${VARIANT}")
+    elseif(NOT VARIANT)
+      message(AUTHOR_WARNING "Can't find reference output ${REFERENCE_OUTPUT}")
+    endif()
+  endforeach()
+endfunction()
+
+set(BATCH_JOBS "")
 foreach(ARCH ${SUPPORTED_ARCHITECTURES})
   foreach(TEST_NAME ${TESTS_${ARCH}})
     register_for_compilation("${ARCH}" "${TEST_NAME}" "${TEST_SOURCES_${ARCH}_${TEST_NAME}}" "-nostdlib" BINARY)
 
-    # Translate the compiled binary
-    add_test(NAME translate-${TEST_NAME}-${ARCH}
-      COMMAND $<TARGET_FILE:revamb> --functions-boundaries --use-sections -g ll "${BINARY}" "${BINARY}.ll")
-    set_tests_properties(translate-${TEST_NAME}-${ARCH}
-      PROPERTIES LABELS "analysis;translate;${TEST_NAME}-${ARCH}")
-
-    # Extract all the information in a single shot
-    add_test(NAME extract-info-${TEST_NAME}-${ARCH}
-      COMMAND $<TARGET_FILE:revamb-dump> --cfg "${BINARY}.cfg.csv" --noreturn "${BINARY}.noreturn.csv" --functions-boundaries "${BINARY}.functions-boundaries.csv" "${BINARY}.ll")
-    set_tests_properties(extract-info-${TEST_NAME}-${ARCH}
-      PROPERTIES DEPENDS translate-${TEST_NAME}-${ARCH}
-                 LABELS "analysis;extract-info;${TEST_NAME}-${ARCH}")
-
-    foreach(OUTPUT_NAME ${OUTPUT_NAMES})
-      set(REFERENCE_OUTPUT "${SRC}/${ARCH}/${TEST_NAME}${OUTPUT_SUFFIX_${OUTPUT_NAME}}")
-      set(OUTPUT "${BINARY}${OUTPUT_SUFFIX_${OUTPUT_NAME}}")
-
-      if(EXISTS "${REFERENCE_OUTPUT}")
-        add_test(NAME check-${TEST_NAME}-${ARCH}-${OUTPUT_NAME}
-          COMMAND "${DIFF}" "${REFERENCE_OUTPUT}" "${OUTPUT}")
-        set_tests_properties(check-${TEST_NAME}-${ARCH}-${OUTPUT_NAME}
-          PROPERTIES DEPENDS extract-info-${TEST_NAME}-${ARCH}
-                     LABELS "analysis;check-with-reference;${TEST_NAME};${ARCH};${OUTPUT_NAME};${TEST_NAME}-${ARCH}")
-      else()
-        message(AUTHOR_WARNING "Can't find reference output ${REFERENCE_OUTPUT}")
-      endif()
+    add_analysis_tests("${ARCH}" "${TEST_NAME}" "${BINARY}" "" "--export-jts <BINARY>.jts" "")
+
+    foreach(VARIANT ${VARIANTS})
+      add_analysis_tests("${ARCH}" "${TEST_NAME}" "${BINARY}" "${VARIANT}" "${VARIANT_FLAGS_${VARIANT}}" "${VARIANT_DEPENDS_${VARIANT}}")
     endforeach()
 
+    # The jump targets imported and exported again must be the same
+    add_test(NAME check-import-jts-${TEST_NAME}-${ARCH}
+      COMMAND sh -c "grep '^jt' ${BINARY}.jts | cut -d ' ' -f 2 > ${BINARY}.jts.list && grep '^jt' ${BINARY}.import-jts.jts | cut -d ' ' -f 2 | ${DIFF} ${BINARY}.jts.list -")
+    set_tests_properties(check-import-jts-${TEST_NAME}-${ARCH}
+      PROPERTIES DEPENDS import-jts-translate-${TEST_NAME}-${ARCH}
+                 LABELS "analysis;check-import-jts;${TEST_NAME}-${ARCH}")
+
+    # The jump targets in the artifact must be the exported ones
+    add_test(NAME check-artifact-jts-${TEST_NAME}-${ARCH}
+      COMMAND sh -c "$<TARGET_FILE:test-artifact-jump-targets> ${BINARY}.artifact > ${BINARY}.artifact.jts && grep '^jt' ${BINARY}.jts | ${DIFF} ${BINARY}.artifact.jts -")
+    set_tests_properties(check-artifact-jts-${TEST_NAME}-${ARCH}
+      PROPERTIES DEPENDS "translate-${TEST_NAME}-${ARCH};artifact-translate-${TEST_NAME}-${ARCH}"
+                 LABELS "analysis;check-artifact-jts;${TEST_NAME}-${ARCH}")
+
+    # Each pass revamb-analysis-bench can measure must run on the saved module
+    add_test(NAME analysis-bench-${TEST_NAME}-${ARCH}
+      COMMAND sh -c "for PASS in set set-osra osra sliced-osra rdp rlp crdp crlp scp fbd; do $<TARGET_FILE:revamb-analysis-bench> --use-sections --iterations 1 --pass $PASS ${BINARY}.pre-harvest.bc || exit 1; done")
+    set_tests_properties(analysis-bench-${TEST_NAME}-${ARCH}
+      PROPERTIES DEPENDS pre-harvest-translate-${TEST_NAME}-${ARCH}
+                 LABELS "analysis;analysis-bench;${TEST_NAME}-${ARCH}")
+
+    # Split the harvest in two shards with revamb-distributed, the final
+    # translation must yield the same results
+    add_test(NAME distributed-translate-${TEST_NAME}-${ARCH}
+      COMMAND "${CMAKE_BINARY_DIR}/revamb-distributed" --shards 2 --revamb $<TARGET_FILE:revamb> "${BINARY}" "${BINARY}.distributed.ll" -- --functions-boundaries --use-sections -g ll)
+    set_tests_properties(distributed-translate-${TEST_NAME}-${ARCH}
+      PROPERTIES LABELS "analysis;translate;${TEST_NAME}-${ARCH};distributed")
+    add_analysis_checks("${ARCH}" "${TEST_NAME}" "${BINARY}.distributed" "distributed"
+      "distributed-translate-${TEST_NAME}-${ARCH}")
+
+    # Translate it again in the batch below
+    set(BATCH_JOBS "${BATCH_JOBS}--functions-boundaries --use-sections -g ll ${BINARY} ${BINARY}.batch.ll\n")
+    add_analysis_checks("${ARCH}" "${TEST_NAME}" "${BINARY}.batch" "batch"
+      "batch-translate")
   endforeach()
 endforeach()
+
+# Translate all the test binaries, of all the architectures, in a single run of
+# the batch mode, two at a time
+set(BATCH_JOBS_PATH "${CMAKE_CURRENT_BINARY_DIR}/tests/analysis.jobs")
+file(WRITE "${BATCH_JOBS_PATH}" "${BATCH_JOBS}")
+add_test(NAME batch-translate
+  COMMAND $<TARGET_FILE:revamb> --batch "${BATCH_JOBS_PATH}" --batch-jobs 2)
+set_tests_properties(batch-translate
+  PROPERTIES LABELS "analysis;translate;batch")
@@ -0,0 +1,22 @@
+#
+# This file is distributed under the MIT License. See LICENSE.md for details.
+#
+
+# Write an artifact and read it back, on the host
+add_executable(test-artifact-roundtrip
+  "${CMAKE_SOURCE_DIR}/tests/Artifact/artifact-roundtrip.cpp"
+  "${CMAKE_SOURCE_DIR}/binaryartifact.cpp")
+set_target_properties(test-artifact-roundtrip
+  PROPERTIES INCLUDE_DIRECTORIES "${CMAKE_SOURCE_DIR}")
+
+add_test(NAME artifact-roundtrip
+  COMMAND $<TARGET_FILE:test-artifact-roundtrip> "${CMAKE_CURRENT_BINARY_DIR}/tests/roundtrip.artifact")
+set_tests_properties(artifact-roundtrip
+  PROPERTIES LABELS "artifact")
+
+# Print the jump targets of an artifact written by revamb, to compare them with
+# the exported ones (see AnalysisTests.cmake)
+add_executable(test-artifact-jump-targets
+  "${CMAKE_SOURCE_DIR}/tests/Artifact/artifact-jump-targets.cpp")
+set_target_properties(test-artifact-jump-targets
+  PROPERTIES INCLUDE_DIRECTORIES "${CMAKE_SOURCE_DIR}")
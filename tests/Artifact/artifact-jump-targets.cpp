@@ -0,0 +1,37 @@
+/// \file artifact-jump-targets.cpp
+/// \brief Print the jump targets of an artifact in the format of the jump
+///        targets exported by revamb --export-jts
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// Local includes
+#include "binaryartifact.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s ARTIFACT\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ArtifactReader Reader;
+  if (!Reader.open(argv[1])) {
+    fprintf(stderr, "Couldn't read the artifact %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  auto Addresses = Reader.column(ArtifactTableID::JumpTargets, 0);
+  auto Reasons = Reader.column(ArtifactTableID::JumpTargets, 1);
+  for (uint64_t I = 0; I < Addresses.size(); I++)
+    printf("jt 0x%llx 0x%llx\n",
+           (unsigned long long) Addresses[I],
+           (unsigned long long) Reasons[I]);
+
+  return EXIT_SUCCESS;
+}
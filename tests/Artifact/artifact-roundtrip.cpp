@@ -0,0 +1,117 @@
+/// \file artifact-roundtrip.cpp
+/// \brief Write an artifact with ArtifactWriter and read it back with
+///        ArtifactReader
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Local includes
+#include "binaryartifact.h"
+
+static bool Failed = false;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "Check failed: %s\n", What);
+    Failed = true;
+  }
+}
+
+#define CHECK(Condition) check((Condition), #Condition)
+
+/// \brief Overwrite \p Size bytes at \p Offset of the file at \p Path
+static void patch(const std::string &Path,
+                  uint64_t Offset,
+                  const void *Data,
+                  size_t Size) {
+  std::fstream File(Path, std::ios::binary | std::ios::in | std::ios::out);
+  File.seekp(Offset);
+  File.write(static_cast<const char *>(Data), Size);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s OUTFILE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string Path = argv[1];
+
+  // Each element size, a value to truncate and an empty table
+  std::vector<uint64_t> Addresses = { 0x400000, 0x400010, 0xffffffff00000000 };
+  std::vector<uint64_t> Reasons = { 1, 0x100000002, 512 };
+  std::vector<uint64_t> Flags = { 7, 0x105, 0 };
+  std::vector<uint64_t> Sizes = { 2, 0x10004, 65535 };
+
+  ArtifactWriter Writer;
+  unsigned JumpTargets = Writer.addTable(ArtifactTableID::JumpTargets);
+  Writer.addColumn(JumpTargets, 8, Addresses);
+  Writer.addColumn(JumpTargets, 4, Reasons);
+  unsigned Segments = Writer.addTable(ArtifactTableID::Segments);
+  Writer.addColumn(Segments, 1, Flags);
+  Writer.addColumn(Segments, 2, Sizes);
+  unsigned Noreturn = Writer.addTable(ArtifactTableID::Noreturn);
+  Writer.addColumn(Noreturn, 8, { });
+  CHECK(Writer.write(Path));
+
+  {
+    ArtifactReader Reader;
+    CHECK(Reader.open(Path));
+
+    CHECK(Reader.rows(ArtifactTableID::JumpTargets) == 3);
+    CHECK(Reader.rows(ArtifactTableID::Segments) == 3);
+    CHECK(Reader.rows(ArtifactTableID::Noreturn) == 0);
+    CHECK(Reader.table(ArtifactTableID::Coverage) == nullptr);
+
+    auto AddressColumn = Reader.column(ArtifactTableID::JumpTargets, 0);
+    auto ReasonColumn = Reader.column(ArtifactTableID::JumpTargets, 1);
+    auto FlagColumn = Reader.column(ArtifactTableID::Segments, 0);
+    auto SizeColumn = Reader.column(ArtifactTableID::Segments, 1);
+    CHECK(AddressColumn.elementSize() == 8);
+    CHECK(ReasonColumn.elementSize() == 4);
+    CHECK(FlagColumn.elementSize() == 1);
+    CHECK(SizeColumn.elementSize() == 2);
+    CHECK(Reader.column(ArtifactTableID::JumpTargets, 2).size() == 0);
+
+    // The columns must be aligned to be used in place
+    CHECK(reinterpret_cast<uintptr_t>(AddressColumn.data()) % 8 == 0);
+
+    for (unsigned I = 0; I < 3; I++) {
+      CHECK(AddressColumn[I] == Addresses[I]);
+      CHECK(ReasonColumn[I] == uint32_t(Reasons[I]));
+      CHECK(FlagColumn[I] == uint8_t(Flags[I]));
+      CHECK(SizeColumn[I] == uint16_t(Sizes[I]));
+    }
+  }
+
+  // A column past the end of the file, through an overflowing offset, must be
+  // rejected
+  uint64_t ColumnsOffset = sizeof(ArtifactHeader) + 3 * sizeof(ArtifactTable);
+  uint64_t Overflowing = UINT64_MAX - 7;
+  patch(Path, ColumnsOffset, &Overflowing, sizeof(Overflowing));
+  {
+    ArtifactReader Reader;
+    CHECK(!Reader.open(Path));
+  }
+
+  // So must a truncated file
+  {
+    std::ofstream Truncated(Path, std::ios::binary | std::ios::trunc);
+    Truncated.write(ArtifactMagic, sizeof(ArtifactMagic));
+  }
+  {
+    ArtifactReader Reader;
+    CHECK(!Reader.open(Path));
+  }
+
+  return Failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
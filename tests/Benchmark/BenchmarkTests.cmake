@@ -0,0 +1,138 @@
+#
+# This file is distributed under the MIT License. See LICENSE.md for details.
+#
+
+# Benchmark definitions, they are not part of the test suite but run through
+# the revamb-bench target
+set(SRC ${CMAKE_SOURCE_DIR}/tests/Benchmark)
+
+set(BENCHMARK_ARCHITECTURES "arm;mips;x86_64")
+set(BENCHMARK_RESULTS "${CMAKE_BINARY_DIR}/benchmark-results.csv"
+  CACHE
+  STRING
+  "Path of the CSV file where the revamb-bench target stores its results.")
+set(BENCHMARK_TRANSLATE_FLAGS "-O2"
+  CACHE
+  STRING
+  "Flags for the translate script used by the revamb-bench target.")
+
+set(BENCHMARK_PIPELINES_RESULTS "${CMAKE_BINARY_DIR}/benchmark-pipelines.csv"
+  CACHE
+  STRING
+  "Path of the CSV file where the revamb-bench-pipelines target stores its results.")
+set(BENCHMARK_PIPELINES "-O1;-O2;-Ot"
+  CACHE
+  STRING
+  "Sets of translate flags compared by the revamb-bench-pipelines target.")
+
+set(BENCHMARK_CFLAGS "-std=c99 -static -fno-pic -fno-pie -O2")
+
+## workload
+set(BENCHMARKS "workload")
+set(BENCHMARK_SOURCES_workload "${SRC}/workload.c")
+
+set(BENCHMARK_RUNS_workload "crc" "sort" "matrix" "sieve" "interpreter")
+# Each run takes about half a second natively on a recent x86-64 machine, so
+# that the measurements aren't dominated by the startup and by the noise
+set(BENCHMARK_ARGS_workload_crc "crc 7000")
+set(BENCHMARK_ARGS_workload_sort "sort 1000")
+set(BENCHMARK_ARGS_workload_matrix "matrix 20000")
+set(BENCHMARK_ARGS_workload_sieve "sieve 4000")
+set(BENCHMARK_ARGS_workload_interpreter "interpreter 12000")
+
+# Also benchmark the runtime tests, except those requiring specific
+# architectures or translation options
+set(BENCHMARK_TESTS "")
+foreach(TEST_NAME ${TESTS})
+  if(NOT DEFINED TEST_ARCHITECTURES_${TEST_NAME}
+      AND NOT DEFINED TEST_REVAMB_FLAGS_${TEST_NAME})
+    list(APPEND BENCHMARK_TESTS "${TEST_NAME}")
+  endif()
+endforeach()
+
+foreach(TEST_NAME ${BENCHMARK_TESTS})
+  foreach(RUN_NAME ${TEST_RUNS_${TEST_NAME}})
+    set(BENCHMARK_ARGS_${TEST_NAME}_${RUN_NAME} "${TEST_ARGS_${TEST_NAME}_${RUN_NAME}}")
+  endforeach()
+  set(BENCHMARK_RUNS_${TEST_NAME} "${TEST_RUNS_${TEST_NAME}}")
+  set(BENCHMARK_NATIVE_${TEST_NAME} "$<TARGET_FILE:test-native-${TEST_NAME}>")
+endforeach()
+
+# Create native executables for the benchmarks
+foreach(BENCHMARK_NAME ${BENCHMARKS})
+  add_executable(benchmark-native-${BENCHMARK_NAME} ${BENCHMARK_SOURCES_${BENCHMARK_NAME}})
+  set_target_properties(benchmark-native-${BENCHMARK_NAME} PROPERTIES COMPILE_FLAGS "${BENCHMARK_CFLAGS}")
+  set_target_properties(benchmark-native-${BENCHMARK_NAME} PROPERTIES LINK_FLAGS "${BENCHMARK_CFLAGS}")
+  set_target_properties(benchmark-native-${BENCHMARK_NAME} PROPERTIES EXCLUDE_FROM_ALL 1)
+  set(BENCHMARK_NATIVE_${BENCHMARK_NAME} "$<TARGET_FILE:benchmark-native-${BENCHMARK_NAME}>")
+endforeach()
+
+configure_file(${SRC}/run-benchmark "${CMAKE_BINARY_DIR}/run-benchmark" COPYONLY)
+
+# Identify the commit we're benchmarking, so results can be compared
+find_package(Git)
+set(BENCHMARK_COMMIT "unknown")
+if(GIT_FOUND)
+  execute_process(COMMAND "${GIT_EXECUTABLE}" rev-parse --short HEAD
+    WORKING_DIRECTORY "${CMAKE_SOURCE_DIR}"
+    OUTPUT_VARIABLE BENCHMARK_COMMIT
+    OUTPUT_STRIP_TRAILING_WHITESPACE
+    ERROR_QUIET)
+endif()
+
+set(BENCHMARK_COMMANDS COMMAND "${CMAKE_BINARY_DIR}/run-benchmark" --header "${BENCHMARK_RESULTS}")
+set(BENCHMARK_PIPELINES_COMMANDS COMMAND "${CMAKE_BINARY_DIR}/run-benchmark" --header "${BENCHMARK_PIPELINES_RESULTS}")
+set(BENCHMARK_DEPENDS revamb)
+
+foreach(ARCH ${BENCHMARK_ARCHITECTURES})
+  list(FIND SUPPORTED_ARCHITECTURES "${ARCH}" ARCH_INDEX)
+  if(NOT ARCH_INDEX EQUAL -1)
+    foreach(CONFIG ${SUPPORT_MODULES_CONFIGS})
+      list(APPEND BENCHMARK_DEPENDS "support-module-support-${ARCH}-${CONFIG}.bc")
+    endforeach()
+    list(APPEND BENCHMARK_DEPENDS TEST_PROJECT_${ARCH})
+
+    foreach(BENCHMARK_NAME ${BENCHMARKS})
+      register_for_compilation("${ARCH}" "benchmark-${BENCHMARK_NAME}" "${BENCHMARK_SOURCES_${BENCHMARK_NAME}}" "-O2" BINARY)
+      set(BENCHMARK_BINARY_${ARCH}_${BENCHMARK_NAME} "${BINARY}")
+      list(APPEND BENCHMARK_DEPENDS benchmark-native-${BENCHMARK_NAME})
+    endforeach()
+
+    foreach(TEST_NAME ${BENCHMARK_TESTS})
+      set(BENCHMARK_BINARY_${ARCH}_${TEST_NAME} "${INSTALL_DIR_${ARCH}}/bin/${TEST_NAME}")
+      list(APPEND BENCHMARK_DEPENDS test-native-${TEST_NAME})
+    endforeach()
+
+    foreach(PROGRAM_NAME ${BENCHMARKS} ${BENCHMARK_TESTS})
+      foreach(RUN_NAME ${BENCHMARK_RUNS_${PROGRAM_NAME}})
+        # Arguments are quoted for the shell, let it split them
+        list(APPEND BENCHMARK_COMMANDS
+          COMMAND sh -c "TRANSLATE_FLAGS='${BENCHMARK_TRANSLATE_FLAGS}' ${CMAKE_BINARY_DIR}/run-benchmark ${BENCHMARK_RESULTS} ${BENCHMARK_COMMIT} ${ARCH} ${PROGRAM_NAME} ${RUN_NAME} ${BENCHMARK_BINARY_${ARCH}_${PROGRAM_NAME}} '${BENCHMARK_NATIVE_${PROGRAM_NAME}}' ${QEMU_${ARCH}} ${BENCHMARK_ARGS_${PROGRAM_NAME}_${RUN_NAME}}")
+      endforeach()
+    endforeach()
+
+    # Compare the optimization pipelines on the runtime tests
+    foreach(PIPELINE ${BENCHMARK_PIPELINES})
+      foreach(TEST_NAME ${BENCHMARK_TESTS})
+        foreach(RUN_NAME ${BENCHMARK_RUNS_${TEST_NAME}})
+          list(APPEND BENCHMARK_PIPELINES_COMMANDS
+            COMMAND sh -c "TRANSLATE_FLAGS='${PIPELINE}' ${CMAKE_BINARY_DIR}/run-benchmark ${BENCHMARK_PIPELINES_RESULTS} ${BENCHMARK_COMMIT} ${ARCH} ${TEST_NAME} ${RUN_NAME} ${BENCHMARK_BINARY_${ARCH}_${TEST_NAME}} '${BENCHMARK_NATIVE_${TEST_NAME}}' ${QEMU_${ARCH}} ${BENCHMARK_ARGS_${TEST_NAME}_${RUN_NAME}}")
+        endforeach()
+      endforeach()
+    endforeach()
+  endif()
+endforeach()
+
+add_custom_target(revamb-bench
+  ${BENCHMARK_COMMANDS}
+  DEPENDS ${BENCHMARK_DEPENDS}
+  WORKING_DIRECTORY "${CMAKE_BINARY_DIR}"
+  COMMENT "Running the revamb benchmarks, results in ${BENCHMARK_RESULTS}"
+  VERBATIM)
+
+add_custom_target(revamb-bench-pipelines
+  ${BENCHMARK_PIPELINES_COMMANDS}
+  DEPENDS ${BENCHMARK_DEPENDS}
+  WORKING_DIRECTORY "${CMAKE_BINARY_DIR}"
+  COMMENT "Comparing the optimization pipelines, results in ${BENCHMARK_PIPELINES_RESULTS}"
+  VERBATIM)
@@ -0,0 +1,178 @@
+/*
+ * This file is distributed under the MIT License. See LICENSE.md for details.
+ */
+
+/*
+ * A set of small kernels stressing different aspects of the translation:
+ * tight loops, memory accesses, indirect calls and jump tables. Each kernel is
+ * selected through the first argument, the second one is the number of
+ * iterations. The output is a checksum, so the result of the translated
+ * program can be compared with the native one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define BUFFER_SIZE 4096
+#define MATRIX_SIZE 32
+#define SIEVE_SIZE 65536
+
+static uint8_t buffer[BUFFER_SIZE];
+static uint32_t numbers[BUFFER_SIZE];
+static int32_t matrix_a[MATRIX_SIZE][MATRIX_SIZE];
+static int32_t matrix_b[MATRIX_SIZE][MATRIX_SIZE];
+static int32_t matrix_c[MATRIX_SIZE][MATRIX_SIZE];
+static uint8_t sieve_table[SIEVE_SIZE];
+
+static uint32_t seed = 42;
+
+static uint32_t next_random(void) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static int compare_numbers(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+static uint32_t kernel_crc(void) {
+  for (size_t i = 0; i < BUFFER_SIZE; i++)
+    buffer[i] = next_random();
+  return crc32(buffer, BUFFER_SIZE);
+}
+
+static uint32_t kernel_sort(void) {
+  for (size_t i = 0; i < BUFFER_SIZE; i++)
+    numbers[i] = next_random();
+  qsort(numbers, BUFFER_SIZE, sizeof(numbers[0]), compare_numbers);
+  return numbers[0] ^ numbers[BUFFER_SIZE / 2] ^ numbers[BUFFER_SIZE - 1];
+}
+
+static uint32_t kernel_matrix(void) {
+  for (int i = 0; i < MATRIX_SIZE; i++) {
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      matrix_a[i][j] = next_random() % 256;
+      matrix_b[i][j] = next_random() % 256;
+    }
+  }
+
+  for (int i = 0; i < MATRIX_SIZE; i++) {
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      int32_t sum = 0;
+      for (int k = 0; k < MATRIX_SIZE; k++)
+        sum += matrix_a[i][k] * matrix_b[k][j];
+      matrix_c[i][j] = sum;
+    }
+  }
+
+  uint32_t result = 0;
+  for (int i = 0; i < MATRIX_SIZE; i++)
+    result += matrix_c[i][i];
+  return result;
+}
+
+static uint32_t kernel_sieve(void) {
+  memset(sieve_table, 1, sizeof(sieve_table));
+  sieve_table[0] = sieve_table[1] = 0;
+  for (uint32_t i = 2; i * i < SIEVE_SIZE; i++)
+    if (sieve_table[i])
+      for (uint32_t j = i * i; j < SIEVE_SIZE; j += i)
+        sieve_table[j] = 0;
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < SIEVE_SIZE; i++)
+    count += sieve_table[i];
+  return count;
+}
+
+/* A tiny stack machine, its main loop is compiled to a jump table */
+static uint32_t kernel_interpreter(void) {
+  enum { PUSH, ADD, SUB, MUL, XOR, DUP, SWAP, DROP, JNZ, HALT };
+  static const int32_t program[] = {
+    PUSH, 0, PUSH, 1000, SWAP, DROP,
+    /* loop: */
+    DUP, PUSH, 3, MUL, PUSH, 7, XOR, PUSH, 5, ADD, DROP,
+    PUSH, 1, SUB, DUP, JNZ, 6,
+    HALT
+  };
+  int32_t stack[16];
+  int32_t sp = 0;
+  int32_t pc = 0;
+  uint32_t accumulator = 0;
+
+  while (1) {
+    switch (program[pc++]) {
+    case PUSH: stack[sp++] = program[pc++]; break;
+    case ADD: sp--; stack[sp - 1] += stack[sp]; break;
+    case SUB: sp--; stack[sp - 1] -= stack[sp]; break;
+    case MUL: sp--; stack[sp - 1] *= stack[sp]; break;
+    case XOR: sp--; stack[sp - 1] ^= stack[sp]; accumulator += stack[sp - 1]; break;
+    case DUP: stack[sp] = stack[sp - 1]; sp++; break;
+    case SWAP: {
+      int32_t tmp = stack[sp - 1];
+      stack[sp - 1] = stack[sp - 2];
+      stack[sp - 2] = tmp;
+      break;
+    }
+    case DROP: sp--; break;
+    case JNZ:
+      if (stack[--sp] != 0)
+        pc = program[pc];
+      else
+        pc++;
+      break;
+    case HALT: return accumulator;
+    default: return 0;
+    }
+  }
+}
+
+typedef uint32_t (*kernel_t)(void);
+
+struct kernel_entry {
+  const char *name;
+  kernel_t function;
+};
+
+static const struct kernel_entry kernels[] = {
+  { "crc", kernel_crc },
+  { "sort", kernel_sort },
+  { "matrix", kernel_matrix },
+  { "sieve", kernel_sieve },
+  { "interpreter", kernel_interpreter },
+  { NULL, NULL }
+};
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s KERNEL ITERATIONS\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  long iterations = strtol(argv[2], NULL, 10);
+
+  for (const struct kernel_entry *entry = kernels; entry->name != NULL; entry++) {
+    if (strcmp(entry->name, argv[1]) == 0 || strcmp("all", argv[1]) == 0) {
+      uint32_t checksum = 0;
+      for (long i = 0; i < iterations; i++)
+        checksum ^= entry->function();
+      printf("%s: %u\n", entry->name, checksum);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -8,6 +8,14 @@ set(SRC ${CMAKE_SOURCE_DIR}/tests/Runtime)
 set(TEST_CFLAGS "-std=c99 -static -fno-pic -fno-pie -g")
 set(TESTS "calc" "function_call" "floating_point" "syscall" "global")
 
+# Besides the sources and the runs, each test can optionally define:
+#
+# TEST_ARCHITECTURES_<test>: the architectures to test (default: all)
+# TEST_CFLAGS_<test>: additional flags to compile the program
+# TEST_REVAMB_FLAGS_<test>: additional options to translate the program
+# TEST_DEBUG_INFO_<test>: the debug information to produce (default: ll)
+# TEST_LINK_FLAGS_<test>: additional flags to link the translated program
+
 ## calc
 set(TEST_SOURCES_calc "${SRC}/calc.c")
 
@@ -40,11 +48,110 @@ set(TEST_SOURCES_global "${SRC}/global.c")
 set(TEST_RUNS_global "default")
 set(TEST_ARGS_global_default "nope")
 
+## threads
+list(APPEND TESTS "threads")
+set(TEST_SOURCES_threads "${SRC}/threads.c")
+set(TEST_ARCHITECTURES_threads "x86_64")
+set(TEST_CFLAGS_threads "-pthread")
+set(TEST_REVAMB_FLAGS_threads "--native-syscalls --guest-threads")
+set(TEST_LINK_FLAGS_threads "-lpthread")
+
+set(TEST_RUNS_threads "join" "main_exit")
+set(TEST_ARGS_threads_join "join")
+set(TEST_ARGS_threads_main_exit "main-exit")
+
+## function_call, moving the functions out of root
+list(APPEND TESTS "function_call_isolated")
+set(TEST_SOURCES_function_call_isolated "${SRC}/function-call.c")
+set(TEST_REVAMB_FLAGS_function_call_isolated "--isolate-functions")
+
+set(TEST_RUNS_function_call_isolated "default")
+set(TEST_ARGS_function_call_isolated_default "nope")
+
+## vector, lowering the SSE helpers to LLVM vector operations
+list(APPEND TESTS "vector")
+set(TEST_SOURCES_vector "${SRC}/vector.c")
+set(TEST_ARCHITECTURES_vector "x86_64")
+set(TEST_REVAMB_FLAGS_vector "--vector-helpers")
+
+set(TEST_RUNS_vector "default")
+set(TEST_ARGS_vector_default "nope")
+
+## calc, without the newpc markers and with a newbb call for each basic block
+## (the -g ll debug information would keep the markers)
+foreach(MARKERS "bb" "none")
+  list(APPEND TESTS "calc_markers_${MARKERS}")
+  set(TEST_SOURCES_calc_markers_${MARKERS} "${SRC}/calc.c")
+  set(TEST_REVAMB_FLAGS_calc_markers_${MARKERS} "--markers ${MARKERS}")
+  set(TEST_DEBUG_INFO_calc_markers_${MARKERS} "none")
+
+  set(TEST_RUNS_calc_markers_${MARKERS} "${TEST_RUNS_calc}")
+  foreach(RUN_NAME ${TEST_RUNS_calc})
+    set(TEST_ARGS_calc_markers_${MARKERS}_${RUN_NAME} "${TEST_ARGS_calc_${RUN_NAME}}")
+  endforeach()
+endforeach()
+
+## calc, keeping the CPU state in local variables of root
+list(APPEND TESTS "calc_promote_csvs")
+set(TEST_SOURCES_calc_promote_csvs "${SRC}/calc.c")
+set(TEST_REVAMB_FLAGS_calc_promote_csvs "--promote-csvs")
+
+set(TEST_RUNS_calc_promote_csvs "sum" "multiplication")
+set(TEST_ARGS_calc_promote_csvs_sum "${TEST_ARGS_calc_sum}")
+set(TEST_ARGS_calc_promote_csvs_multiplication "${TEST_ARGS_calc_multiplication}")
+
+## floating_point, specializing and inlining the helpers
+list(APPEND TESTS "floating_point_specialized")
+set(TEST_SOURCES_floating_point_specialized "${SRC}/floating-point.c")
+set(TEST_REVAMB_FLAGS_floating_point_specialized "--specialize-helpers")
+
+set(TEST_RUNS_floating_point_specialized "default")
+set(TEST_ARGS_floating_point_specialized_default "nope")
+
+## calc, removing the dead stores to the CPU state across basic blocks
+list(APPEND TESTS "calc_csv_dse")
+set(TEST_SOURCES_calc_csv_dse "${SRC}/calc.c")
+set(TEST_REVAMB_FLAGS_calc_csv_dse "--csv-dse")
+
+set(TEST_RUNS_calc_csv_dse "sum" "multiplication")
+set(TEST_ARGS_calc_csv_dse_sum "${TEST_ARGS_calc_sum}")
+set(TEST_ARGS_calc_csv_dse_multiplication "${TEST_ARGS_calc_multiplication}")
+
+## threads, removing the dead CPU state stores: those read by the callbacks
+## from the support module (e.g., revamb_save_cpu_state) must be kept
+list(APPEND TESTS "threads_csv_dse")
+set(TEST_SOURCES_threads_csv_dse "${SRC}/threads.c")
+set(TEST_ARCHITECTURES_threads_csv_dse "x86_64")
+set(TEST_CFLAGS_threads_csv_dse "-pthread")
+set(TEST_REVAMB_FLAGS_threads_csv_dse "--csv-dse --native-syscalls --guest-threads")
+set(TEST_LINK_FLAGS_threads_csv_dse "-lpthread")
+
+set(TEST_RUNS_threads_csv_dse "join" "main_exit")
+set(TEST_ARGS_threads_csv_dse_join "join")
+set(TEST_ARGS_threads_csv_dse_main_exit "main-exit")
+
+## syscall, forwarding the common syscalls to the host (on the other
+## architectures, falling back to QEMU through native_do_syscall)
+list(APPEND TESTS "syscall_native")
+set(TEST_SOURCES_syscall_native "${SRC}/syscall.c")
+set(TEST_REVAMB_FLAGS_syscall_native "--native-syscalls")
+
+set(TEST_RUNS_syscall_native "default")
+set(TEST_ARGS_syscall_native_default "nope")
+
+## function_call, returning to the callers through the shadow stack
+list(APPEND TESTS "function_call_shadow_stack")
+set(TEST_SOURCES_function_call_shadow_stack "${SRC}/function-call.c")
+set(TEST_REVAMB_FLAGS_function_call_shadow_stack "--shadow-stack")
+
+set(TEST_RUNS_function_call_shadow_stack "default")
+set(TEST_ARGS_function_call_shadow_stack_default "nope")
+
 # Create native executable and tests
 foreach(TEST_NAME ${TESTS})
   add_executable(test-native-${TEST_NAME} ${TEST_SOURCES_${TEST_NAME}})
-  set_target_properties(test-native-${TEST_NAME} PROPERTIES COMPILE_FLAGS "${TEST_CFLAGS}")
-  set_target_properties(test-native-${TEST_NAME} PROPERTIES LINK_FLAGS "${TEST_CFLAGS}")
+  set_target_properties(test-native-${TEST_NAME} PROPERTIES COMPILE_FLAGS "${TEST_CFLAGS} ${TEST_CFLAGS_${TEST_NAME}}")
+  set_target_properties(test-native-${TEST_NAME} PROPERTIES LINK_FLAGS "${TEST_CFLAGS} ${TEST_CFLAGS_${TEST_NAME}}")
 
   foreach(RUN_NAME ${TEST_RUNS_${TEST_NAME}})
     add_test(NAME run-test-native-${TEST_NAME}-${RUN_NAME}
@@ -78,64 +185,139 @@ endfunction()
 
 foreach(ARCH ${SUPPORTED_ARCHITECTURES})
   foreach(TEST_NAME ${TESTS})
-    # Register the programs for compilation
-    register_for_compilation("${ARCH}" "${TEST_NAME}" "${TEST_SOURCES_${TEST_NAME}}" "" BINARY)
-
-    # Translate the compiled binary
-    add_test(NAME translate-${TEST_NAME}-${ARCH}
-      COMMAND sh -c "$<TARGET_FILE:revamb> --functions-boundaries --use-sections -g ll ${BINARY} ${BINARY}.ll")
-    set_tests_properties(translate-${TEST_NAME}-${ARCH}
-      PROPERTIES LABELS "runtime;translate;${TEST_NAME};${ARCH}")
-
-    # Compose the command line to link support.c and the translated binaries
-    string(REPLACE "-" "_" NORMALIZED_ARCH "${ARCH}")
-    compile_executable("$(${CMAKE_BINARY_DIR}/li-csv-to-ld-options ${BINARY}.ll.li.csv) ${BINARY}${CMAKE_C_OUTPUT_EXTENSION} ${CMAKE_BINARY_DIR}/support.c -DTARGET_${NORMALIZED_ARCH} -lz -lm -lrt -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast -g -fno-pie"
-      "${BINARY}.translated"
-      COMPILE_TRANSLATED)
-
-    # Compile the translated LLVM IR with llc and link using the previously composed command line
-    add_test(NAME compile-translated-${TEST_NAME}-${ARCH}
-      COMMAND sh -c "${LLC} -O0 -filetype=obj ${BINARY}.ll -o ${BINARY}${CMAKE_C_OUTPUT_EXTENSION} && ${COMPILE_TRANSLATED}")
-    set_tests_properties(compile-translated-${TEST_NAME}-${ARCH}
-      PROPERTIES DEPENDS translate-${TEST_NAME}-${ARCH}
-                 LABELS "runtime;compile-translated;${TEST_NAME};${ARCH}")
-
-    # For each set of arguments
-    foreach(RUN_NAME ${TEST_RUNS_${TEST_NAME}})
-      # Test to run the translated program
-      add_test(NAME run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        COMMAND sh -c "${BINARY}.translated ${TEST_ARGS_${TEST_NAME}_${RUN_NAME}} > ${BINARY}-run-translated-test-${RUN_NAME}-${ARCH}.log")
-      set_tests_properties(run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        PROPERTIES DEPENDS compile-translated-${TEST_NAME}-${ARCH}
-                   LABELS "runtime;run-translated-test;${TEST_NAME};${RUN_NAME};${ARCH}")
-
-      # Check the output of the translated binary corresponds to the native's one
-      add_test(NAME check-with-native-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        COMMAND "${DIFF}" "${BINARY}-run-translated-test-${RUN_NAME}-${ARCH}.log" "${CMAKE_CURRENT_BINARY_DIR}/tests/run-test-native-${TEST_NAME}-${RUN_NAME}.log")
-      set(DEPS "")
-      list(APPEND DEPS "run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}")
-      list(APPEND DEPS "run-test-native-${TEST_NAME}-${RUN_NAME}")
-      set_tests_properties(check-with-native-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        PROPERTIES DEPENDS "${DEPS}"
-                   LABELS "runtime;check-with-native;${TEST_NAME};${RUN_NAME};${ARCH}")
-
-      # Test to run the compiled program under qemu-user
-      add_test(NAME run-qemu-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        COMMAND sh -c "${QEMU_${ARCH}} ${BINARY} ${TEST_ARGS_${TEST_NAME}_${RUN_NAME}} > ${BINARY}-run-qemu-test-${RUN_NAME}.log")
-      set_tests_properties(run-qemu-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        PROPERTIES LABELS "runtime;run-qemu-test;${TEST_NAME};${RUN_NAME};${ARCH}")
-
-      # Check the output of the translated binary corresponds to the qemu-user's
-      # one
-      add_test(NAME check-with-qemu-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        COMMAND "${DIFF}" "${BINARY}-run-translated-test-${RUN_NAME}-${ARCH}.log" "${BINARY}-run-qemu-test-${RUN_NAME}.log")
-      set(DEPS "")
-      list(APPEND DEPS "run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}")
-      list(APPEND DEPS "run-qemu-test-${TEST_NAME}-${RUN_NAME}-${ARCH}")
-      set_tests_properties(check-with-qemu-${TEST_NAME}-${RUN_NAME}-${ARCH}
-        PROPERTIES DEPENDS "${DEPS}"
-                   LABELS "runtime;check-with-qemu;${TEST_NAME};${RUN_NAME};${ARCH}")
-    endforeach()
+    # Skip the architectures the test is not meant for
+    set(ENABLED_ARCHITECTURES "${SUPPORTED_ARCHITECTURES}")
+    if(DEFINED TEST_ARCHITECTURES_${TEST_NAME})
+      set(ENABLED_ARCHITECTURES "${TEST_ARCHITECTURES_${TEST_NAME}}")
+    endif()
+    list(FIND ENABLED_ARCHITECTURES "${ARCH}" ARCH_INDEX)
+    if(NOT ARCH_INDEX EQUAL -1)
+      # Register the programs for compilation
+      register_for_compilation("${ARCH}" "${TEST_NAME}" "${TEST_SOURCES_${TEST_NAME}}" "${TEST_CFLAGS_${TEST_NAME}}" BINARY)
+
+      # Translate the compiled binary
+      set(DEBUG_INFO "ll")
+      if(DEFINED TEST_DEBUG_INFO_${TEST_NAME})
+        set(DEBUG_INFO "${TEST_DEBUG_INFO_${TEST_NAME}}")
+      endif()
+      add_test(NAME translate-${TEST_NAME}-${ARCH}
+        COMMAND sh -c "$<TARGET_FILE:revamb> --functions-boundaries --use-sections ${TEST_REVAMB_FLAGS_${TEST_NAME}} -g ${DEBUG_INFO} ${BINARY} ${BINARY}.ll")
+      set_tests_properties(translate-${TEST_NAME}-${ARCH}
+        PROPERTIES LABELS "runtime;translate;${TEST_NAME};${ARCH}")
+
+      # Compose the command line to link support.c and the translated binaries
+      string(REPLACE "-" "_" NORMALIZED_ARCH "${ARCH}")
+      compile_executable("$(${CMAKE_BINARY_DIR}/li-csv-to-ld-options ${BINARY}.ll.li.csv) ${BINARY}${CMAKE_C_OUTPUT_EXTENSION} ${CMAKE_BINARY_DIR}/support.c -DTARGET_${NORMALIZED_ARCH} -lz -lm -lrt ${TEST_LINK_FLAGS_${TEST_NAME}} -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast -g -fno-pie"
+        "${BINARY}.translated"
+        COMPILE_TRANSLATED)
+
+      # Compile the translated LLVM IR with llc and link using the previously composed command line
+      add_test(NAME compile-translated-${TEST_NAME}-${ARCH}
+        COMMAND sh -c "${LLC} -O0 -filetype=obj ${BINARY}.ll -o ${BINARY}${CMAKE_C_OUTPUT_EXTENSION} && ${COMPILE_TRANSLATED}")
+      set_tests_properties(compile-translated-${TEST_NAME}-${ARCH}
+        PROPERTIES DEPENDS translate-${TEST_NAME}-${ARCH}
+                   LABELS "runtime;compile-translated;${TEST_NAME};${ARCH}")
+
+      # For each set of arguments
+      foreach(RUN_NAME ${TEST_RUNS_${TEST_NAME}})
+        # Test to run the translated program
+        add_test(NAME run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          COMMAND sh -c "${BINARY}.translated ${TEST_ARGS_${TEST_NAME}_${RUN_NAME}} > ${BINARY}-run-translated-test-${RUN_NAME}-${ARCH}.log")
+        set_tests_properties(run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          PROPERTIES DEPENDS compile-translated-${TEST_NAME}-${ARCH}
+                     LABELS "runtime;run-translated-test;${TEST_NAME};${RUN_NAME};${ARCH}")
+
+        # Check the output of the translated binary corresponds to the native's one
+        add_test(NAME check-with-native-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          COMMAND "${DIFF}" "${BINARY}-run-translated-test-${RUN_NAME}-${ARCH}.log" "${CMAKE_CURRENT_BINARY_DIR}/tests/run-test-native-${TEST_NAME}-${RUN_NAME}.log")
+        set(DEPS "")
+        list(APPEND DEPS "run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}")
+        list(APPEND DEPS "run-test-native-${TEST_NAME}-${RUN_NAME}")
+        set_tests_properties(check-with-native-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          PROPERTIES DEPENDS "${DEPS}"
+                     LABELS "runtime;check-with-native;${TEST_NAME};${RUN_NAME};${ARCH}")
+
+        # Test to run the compiled program under qemu-user
+        add_test(NAME run-qemu-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          COMMAND sh -c "${QEMU_${ARCH}} ${BINARY} ${TEST_ARGS_${TEST_NAME}_${RUN_NAME}} > ${BINARY}-run-qemu-test-${RUN_NAME}.log")
+        set_tests_properties(run-qemu-test-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          PROPERTIES LABELS "runtime;run-qemu-test;${TEST_NAME};${RUN_NAME};${ARCH}")
+
+        # Check the output of the translated binary corresponds to the qemu-user's
+        # one
+        add_test(NAME check-with-qemu-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          COMMAND "${DIFF}" "${BINARY}-run-translated-test-${RUN_NAME}-${ARCH}.log" "${BINARY}-run-qemu-test-${RUN_NAME}.log")
+        set(DEPS "")
+        list(APPEND DEPS "run-translated-test-${TEST_NAME}-${RUN_NAME}-${ARCH}")
+        list(APPEND DEPS "run-qemu-test-${TEST_NAME}-${RUN_NAME}-${ARCH}")
+        set_tests_properties(check-with-qemu-${TEST_NAME}-${RUN_NAME}-${ARCH}
+          PROPERTIES DEPENDS "${DEPS}"
+                     LABELS "runtime;check-with-qemu;${TEST_NAME};${RUN_NAME};${ARCH}")
+      endforeach()
+    endif()
   endforeach()
 
 endforeach()
+
+# Translate a copy of the TEST_NAME binary with the translate script, passing
+# it FLAGS, and check the output of the RUN_NAME run of the translated program,
+# with the ENVIRONMENT variables set, against the native one. SUFFIX is part of
+# the names of the copy and of the tests. DEPENDS lists the tests the
+# translation depends on.
+function(add_translate_script_test ARCH TEST_NAME RUN_NAME SUFFIX FLAGS ENVIRONMENT DEPENDS)
+  set(BINARY "${INSTALL_DIR_${ARCH}}/bin/${TEST_NAME}")
+  set(INPUT "${BINARY}.${SUFFIX}")
+  add_test(NAME translate-${SUFFIX}-${TEST_NAME}-${ARCH}
+    COMMAND sh -c "cp ${BINARY} ${INPUT} && PATH=${LLVM_TOOLS_BINARY_DIR}:$PATH CC=${CMAKE_C_COMPILER} ${CMAKE_BINARY_DIR}/translate ${INPUT} ${FLAGS}")
+  set_tests_properties(translate-${SUFFIX}-${TEST_NAME}-${ARCH}
+    PROPERTIES DEPENDS "${DEPENDS}"
+               LABELS "runtime;translate-${SUFFIX};${TEST_NAME};${ARCH}")
+
+  add_test(NAME check-${SUFFIX}-with-native-${TEST_NAME}-${RUN_NAME}-${ARCH}
+    COMMAND sh -c "${ENVIRONMENT} ${INPUT}.translated ${TEST_ARGS_${TEST_NAME}_${RUN_NAME}} > ${INPUT}.log && ${DIFF} ${INPUT}.log ${CMAKE_CURRENT_BINARY_DIR}/tests/run-test-native-${TEST_NAME}-${RUN_NAME}.log")
+  set_tests_properties(check-${SUFFIX}-with-native-${TEST_NAME}-${RUN_NAME}-${ARCH}
+    PROPERTIES DEPENDS "translate-${SUFFIX}-${TEST_NAME}-${ARCH};run-test-native-${TEST_NAME}-${RUN_NAME}"
+               LABELS "runtime;check-${SUFFIX}-with-native;${TEST_NAME};${RUN_NAME};${ARCH}")
+endfunction()
+
+foreach(ARCH ${SUPPORTED_ARCHITECTURES})
+  # Translate function_call isolating the functions and compiling the
+  # partitions produced by llvm-split in parallel (-j)
+  add_translate_script_test("${ARCH}" "function_call" "default" "split"
+    "-O1 -j 2 -- --functions-boundaries --isolate-functions" "" "")
+
+  # Record a compressed trace of calc, it must be decoded successfully
+  set(TRACE "${INSTALL_DIR_${ARCH}}/bin/calc.trace")
+  add_translate_script_test("${ARCH}" "calc" "sum" "trace" "-trace"
+    "REVAMB_TRACE_PATH=${TRACE}.compressed REVAMB_TRACE_FORMAT=compressed" "")
+
+  add_test(NAME decode-trace-calc-sum-${ARCH}
+    COMMAND sh -c "${CMAKE_BINARY_DIR}/revamb-trace-decode ${TRACE}.compressed ${TRACE}.decoded && test -s ${TRACE}.decoded")
+  set_tests_properties(decode-trace-calc-sum-${ARCH}
+    PROPERTIES DEPENDS check-trace-with-native-calc-sum-${ARCH}
+               LABELS "runtime;decode-trace;calc;sum;${ARCH}")
+
+  # Translate calc again, laying out the code according to the decoded trace
+  add_translate_script_test("${ARCH}" "calc" "multiplication" "profile"
+    "-profile ${TRACE}.decoded" "" "decode-trace-calc-sum-${ARCH}")
+
+  # Run calc under the sampling profiler, which must write the profile after
+  # the translation
+  set(SAMPLES "${INSTALL_DIR_${ARCH}}/bin/calc.sampling.samples")
+  add_translate_script_test("${ARCH}" "calc" "multiplication" "sampling"
+    "-sampling" "REVAMB_PROFILE_PATH=${SAMPLES} REVAMB_PROFILE_FREQUENCY=10000" "")
+
+  add_test(NAME check-samples-calc-multiplication-${ARCH}
+    COMMAND test "${SAMPLES}" -nt "${INSTALL_DIR_${ARCH}}/bin/calc.sampling.translated")
+  set_tests_properties(check-samples-calc-multiplication-${ARCH}
+    PROPERTIES DEPENDS check-sampling-with-native-calc-multiplication-${ARCH}
+               LABELS "runtime;check-samples;calc;multiplication;${ARCH}")
+
+  # The returns of function_call_shadow_stack must go through the shadow stack
+  set(BINARY "${INSTALL_DIR_${ARCH}}/bin/function_call_shadow_stack")
+  add_test(NAME check-shadow-stack-hits-function_call_shadow_stack-${ARCH}
+    COMMAND sh -c "REVAMB_SHADOW_STACK_STATS=1 ${BINARY}.translated ${TEST_ARGS_function_call_shadow_stack_default} 2>&1 > /dev/null | grep -Eq '^shadow-stack.hits: [1-9]'")
+  set_tests_properties(check-shadow-stack-hits-function_call_shadow_stack-${ARCH}
+    PROPERTIES DEPENDS compile-translated-function_call_shadow_stack-${ARCH}
+               LABELS "runtime;check-shadow-stack-hits;function_call_shadow_stack;${ARCH}")
+endforeach()
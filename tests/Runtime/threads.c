@@ -0,0 +1,66 @@
+/*
+ * This file is distributed under the MIT License. See LICENSE.md for details.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 4
+#define ITERATIONS 100000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long counter = 0;
+static long partial[THREADS];
+
+static void *count(void *argument) {
+  long index = (long) argument;
+
+  for (long i = 0; i < ITERATIONS; i++) {
+    partial[index] += i % (index + 2);
+
+    pthread_mutex_lock(&lock);
+    counter++;
+    pthread_mutex_unlock(&lock);
+  }
+
+  return NULL;
+}
+
+static void *last(void *argument) {
+  // Wait for the main thread to give up the lock right before exiting
+  pthread_mutex_lock(&lock);
+  printf("%ld\n", counter);
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t threads[THREADS];
+
+  if (strcmp(argv[1], "join") == 0) {
+    // Let the threads run and join them, the joins rely on the clearing of
+    // the child TID at thread exit
+    for (long i = 0; i < THREADS; i++)
+      pthread_create(&threads[i], NULL, count, (void *) i);
+
+    for (long i = 0; i < THREADS; i++) {
+      pthread_join(threads[i], NULL);
+      printf("%ld\n", partial[i]);
+    }
+
+    printf("%ld\n", counter);
+  } else {
+    // The program has to go on after the main thread exits
+    pthread_mutex_lock(&lock);
+    pthread_create(&threads[0], NULL, last, NULL);
+    counter = 42;
+    printf("main exiting\n");
+    pthread_mutex_unlock(&lock);
+    pthread_exit(NULL);
+  }
+
+  return EXIT_SUCCESS;
+}
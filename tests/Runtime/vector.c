@@ -0,0 +1,63 @@
+/*
+ * This file is distributed under the MIT License. See LICENSE.md for details.
+ */
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print(const char *name, __m128i value) {
+  uint32_t words[4];
+  memcpy(words, &value, sizeof(words));
+  printf("%s: %08x %08x %08x %08x\n",
+         name, words[3], words[2], words[1], words[0]);
+}
+
+int main(int argc, char *argv[]) {
+  // Derive the inputs from the arguments, so that nothing is constant folded
+  uint32_t seed = 0x9e3779b9;
+  for (const char *c = argv[1]; *c != '\0'; c++)
+    seed = seed * 31 + *c;
+
+  uint32_t words[8];
+  for (int i = 0; i < 8; i++) {
+    seed = seed * 1103515245 + 12345;
+    words[i] = seed;
+  }
+
+  __m128i a;
+  __m128i b;
+  memcpy(&a, &words[0], sizeof(a));
+  memcpy(&b, &words[4], sizeof(b));
+
+  // Arithmetic
+  print("paddb", _mm_add_epi8(a, b));
+  print("psubw", _mm_sub_epi16(a, b));
+  print("paddq", _mm_add_epi64(a, b));
+  print("pmullw", _mm_mullo_epi16(a, b));
+  print("pmulhuw", _mm_mulhi_epu16(a, b));
+  print("pmulhw", _mm_mulhi_epi16(a, b));
+  print("pmuludq", _mm_mul_epu32(a, b));
+  print("pminub", _mm_min_epu8(a, b));
+  print("pmaxsw", _mm_max_epi16(a, b));
+  print("pavgb", _mm_avg_epu8(a, b));
+
+  // Logic and comparisons
+  print("pand", _mm_and_si128(a, b));
+  print("pandn", _mm_andnot_si128(a, b));
+  print("por", _mm_or_si128(a, b));
+  print("pxor", _mm_xor_si128(a, b));
+  print("pcmpeql", _mm_cmpeq_epi32(a, a));
+  print("pcmpgtb", _mm_cmpgt_epi8(a, b));
+
+  // Shuffles and unpacks
+  print("punpcklbw", _mm_unpacklo_epi8(a, b));
+  print("punpckhwd", _mm_unpackhi_epi16(a, b));
+  print("pshufd", _mm_shuffle_epi32(a, 0x1b));
+  print("pshuflw", _mm_shufflelo_epi16(a, 0xb1));
+  print("pshufhw", _mm_shufflehi_epi16(a, 0x4e));
+
+  return EXIT_SUCCESS;
+}
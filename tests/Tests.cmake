@@ -38,6 +38,9 @@ endmacro()
 # Give control to the various subdirectories
 include(${CMAKE_SOURCE_DIR}/tests/Runtime/RuntimeTests.cmake)
 include(${CMAKE_SOURCE_DIR}/tests/Analysis/AnalysisTests.cmake)
+include(${CMAKE_SOURCE_DIR}/tests/Benchmark/BenchmarkTests.cmake)
+include(${CMAKE_SOURCE_DIR}/tests/Artifact/ArtifactTests.cmake)
+include(${CMAKE_SOURCE_DIR}/tests/Trace/TraceTests.cmake)
 
 # Compile the requested programs
 foreach(ARCH ${SUPPORTED_ARCHITECTURES})
@@ -0,0 +1,16 @@
+#
+# This file is distributed under the MIT License. See LICENSE.md for details.
+#
+
+# Encode a compressed trace with tracecodec.h and decode it with
+# revamb-trace-decode, on the host
+add_executable(test-trace-encode
+  "${CMAKE_SOURCE_DIR}/tests/Trace/trace-encode.c")
+set_target_properties(test-trace-encode
+  PROPERTIES INCLUDE_DIRECTORIES "${CMAKE_SOURCE_DIR}")
+
+set(TRACE_PATH "${CMAKE_CURRENT_BINARY_DIR}/tests/encoded.trace")
+add_test(NAME trace-encode-decode
+  COMMAND sh -c "$<TARGET_FILE:test-trace-encode> ${TRACE_PATH} > ${TRACE_PATH}.expected && ${CMAKE_BINARY_DIR}/revamb-trace-decode --text ${TRACE_PATH} ${TRACE_PATH}.decoded && ${DIFF} ${TRACE_PATH}.expected ${TRACE_PATH}.decoded")
+set_tests_properties(trace-encode-decode
+  PROPERTIES LABELS "trace")
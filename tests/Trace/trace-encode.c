@@ -0,0 +1,68 @@
+/*
+ * This file is distributed under the MIT License. See LICENSE.md for details.
+ */
+
+/*
+ * Write a compressed trace encoding a fixed sequence of program counters to
+ * the file specified as first argument, and print the expected output of
+ * revamb-trace-decode --text on the standard output.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tracecodec.h"
+
+// Cover the deltas of each record size, their negative counterparts, zero and
+// the extremes, in particular INT64_MIN (and back), whose record is the
+// longest one
+static const uint64_t pcs[] = {
+  0x400000, 0x400000, 0x400004, 0x400000, 0x40003f, 0x400040, 0x400000,
+  0x402000, 0x200000, 0x100000000, 0x0, 0x8000000000000000,
+  0x0, 0x8000000000000000, 0xffffffffffffffff, 0x7fffffffffffffff,
+  0xffffffffffffffff, 0x0, 0x1, 0x7fffffffffffffff, 0x400000
+};
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s TRACE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *trace = fopen(argv[1], "wb");
+  if (trace == NULL) {
+    perror("Couldn't open the trace");
+    return EXIT_FAILURE;
+  }
+
+  fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace);
+
+  uint64_t last_pc = 0;
+  for (unsigned i = 0; i < sizeof(pcs) / sizeof(pcs[0]); i++) {
+    uint8_t record[TRACE_MAX_RECORD_SIZE];
+    unsigned size = trace_encode_record(last_pc, pcs[i], record);
+    last_pc = pcs[i];
+
+    // No record can start with the end marker
+    if (record[0] == 0) {
+      fprintf(stderr, "The record of 0x%llx starts with a zero byte\n",
+              (unsigned long long) pcs[i]);
+      return EXIT_FAILURE;
+    }
+
+    fwrite(record, 1, size, trace);
+    printf("0x%llx\n", (unsigned long long) pcs[i]);
+  }
+
+  // Terminate the trace, what follows must be ignored
+  static const uint8_t trailer[] = { 0, 0x42 };
+  fwrite(trailer, 1, sizeof(trailer), trace);
+
+  if (fclose(trace) != 0) {
+    perror("Couldn't write the trace");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#ifndef _TRACECODEC_H
+#define _TRACECODEC_H
+
+/*
+ * This file is distributed under the MIT License. See LICENSE.md for details.
+ */
+
+/// \file tracecodec.h
+/// \brief Encoding of the records of the compressed execution traces
+///
+/// A compressed trace starts with TRACE_MAGIC, followed by one record for each
+/// program counter and, possibly, by a zero byte marking its end. Each record
+/// is the difference from the previous program counter (the first one from 0),
+/// zigzag encoded, plus one, as an unsigned LEB128. Adding one ensures that no
+/// record starts with a zero byte. It's included by support.c, keep it C.
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "RVTRACE1"
+#define TRACE_MAGIC_SIZE 8
+
+/// The maximum size of a record: 65 bits in groups of 7
+#define TRACE_MAX_RECORD_SIZE 10
+
+/// \brief Encode in \p buffer the record for \p pc following \p last_pc
+///
+/// \return the number of bytes written, at most TRACE_MAX_RECORD_SIZE.
+static inline unsigned trace_encode_record(uint64_t last_pc,
+                                           uint64_t pc,
+                                           uint8_t *buffer) {
+  uint64_t delta = pc - last_pc;
+  uint64_t value = (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63);
+
+  // The zigzag encoding of INT64_MIN is UINT64_MAX, plus one it's 2^64, which
+  // doesn't fit: emit its LEB128 directly
+  if (value == UINT64_MAX) {
+    for (unsigned i = 0; i < TRACE_MAX_RECORD_SIZE - 1; i++)
+      buffer[i] = 0x80;
+    buffer[TRACE_MAX_RECORD_SIZE - 1] = 0x02;
+    return TRACE_MAX_RECORD_SIZE;
+  }
+
+  value++;
+  unsigned size = 0;
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0)
+      byte |= 0x80;
+    buffer[size++] = byte;
+  } while (value != 0);
+
+  return size;
+}
+
+#endif // _TRACECODEC_H
@@ -7,6 +7,7 @@
 //
 
 // Standard includes
+#include <algorithm>
 #include <cstdint>
 #include <stack>
 #include <sstream>
@@ -520,34 +521,18 @@ static std::pair<Type *, unsigned> getTypeAtOffset(const DataLayout *TheLayout,
   }
 }
 
-VariableManager::VariableManager(Module& TheModule,
-                                 Module& HelpersModule,
-                                 Architecture& TargetArchitecture) :
-  TheModule(TheModule),
-  Builder(TheModule.getContext()),
-  CPUStateType(nullptr),
-  ModuleLayout(&HelpersModule.getDataLayout()),
-  EnvOffset(0),
-  Env(nullptr),
-  AliasScopeMDKindID(TheModule.getMDKindID("alias.scope")),
-  NoAliasMDKindID(TheModule.getMDKindID("noalias")),
-  TargetArchitecture(TargetArchitecture) {
-
-  auto *CPUStateAliasDomain = MDNode::getDistinct(TheModule.getContext(),
-                                                  ArrayRef<Metadata *>());
-
-  auto *Temporary = MDNode::get(TheModule.getContext(), ArrayRef<Metadata *>());
-  auto *CPUStateScope = MDNode::getDistinct(TheModule.getContext(),
-                                            ArrayRef<Metadata *>({
-                                                Temporary,
-                                                CPUStateAliasDomain
-                                            }));
-  CPUStateScope->replaceOperandWith(0, CPUStateScope);
-
-  CPUStateScopeSet = MDNode::get(TheModule.getContext(),
-                                 ArrayRef<Metadata *>({ CPUStateScope }));
+/// \brief The CPU state types already elected, by helpers module
+static std::map<const Module *,
+                std::pair<StructType *, unsigned>> ElectedCPUStateTypes;
 
-  assert(ptc.initialized_env != nullptr);
+/// \brief Elect the type of the CPU state among the structs used by the helper
+///        functions of \p HelpersModule
+///
+/// \return the elected type and the offset of the `env` PTC variable in it.
+static std::pair<StructType *, unsigned> electCPUState(Module &HelpersModule) {
+  const DataLayout *ModuleLayout = &HelpersModule.getDataLayout();
+  StructType *CPUStateType = nullptr;
+  unsigned EnvOffset = 0;
 
   using ElectionMap = std::map<StructType *, unsigned>;
   using ElectionMapElement = std::pair<StructType * const, unsigned>;
@@ -625,6 +610,53 @@ VariableManager::VariableManager(Module& TheModule,
       }
     }
   }
+
+  return { CPUStateType, EnvOffset };
+}
+
+VariableManager::VariableManager(Module& TheModule,
+                                 Module& HelpersModule,
+                                 Architecture& TargetArchitecture) :
+  TheModule(TheModule),
+  Builder(TheModule.getContext()),
+  CPUStateType(nullptr),
+  ModuleLayout(&HelpersModule.getDataLayout()),
+  EnvOffset(0),
+  Env(nullptr),
+  AliasScopeMDKindID(TheModule.getMDKindID("alias.scope")),
+  NoAliasMDKindID(TheModule.getMDKindID("noalias")),
+  TargetArchitecture(TargetArchitecture) {
+
+  auto *CPUStateAliasDomain = MDNode::getDistinct(TheModule.getContext(),
+                                                  ArrayRef<Metadata *>());
+
+  auto *Temporary = MDNode::get(TheModule.getContext(), ArrayRef<Metadata *>());
+  auto *CPUStateScope = MDNode::getDistinct(TheModule.getContext(),
+                                            ArrayRef<Metadata *>({
+                                                Temporary,
+                                                CPUStateAliasDomain
+                                            }));
+  CPUStateScope->replaceOperandWith(0, CPUStateScope);
+
+  CPUStateScopeSet = MDNode::get(TheModule.getContext(),
+                                 ArrayRef<Metadata *>({ CPUStateScope }));
+
+  assert(ptc.initialized_env != nullptr);
+
+  auto It = ElectedCPUStateTypes.find(&HelpersModule);
+  if (It != ElectedCPUStateTypes.end())
+    std::tie(CPUStateType, EnvOffset) = It->second;
+  else
+    std::tie(CPUStateType, EnvOffset) = electCPUState(HelpersModule);
+
+  // Each byte of the CPU state can be the start of a global variable
+  CPUStateGlobals.resize(ModuleLayout->getTypeAllocSize(CPUStateType),
+                         nullptr);
+}
+
+void VariableManager::electCPUStateType(Module &HelpersModule) {
+  if (ElectedCPUStateTypes.count(&HelpersModule) == 0)
+    ElectedCPUStateTypes[&HelpersModule] = electCPUState(HelpersModule);
 }
 
 bool VariableManager::storeToCPUStateOffset(IRBuilder<> &Builder,
@@ -820,9 +852,9 @@ VariableManager::getByCPUStateOffsetInternal(intptr_t Offset,
   if (Offset == ErrorOffset)
     return { nullptr, 0 };
 
-  GlobalsMap::iterator it = CPUStateGlobals.find(Offset);
-  if (it == CPUStateGlobals.end() ||
-      (Name.size() != 0 && !it->second->getName().equals_lower(Name))) {
+  GlobalVariable *Existing = findCPUStateGlobal(Offset);
+  if (Existing == nullptr ||
+      (Name.size() != 0 && !Existing->getName().equals_lower(Name))) {
     Type *VariableType;
     unsigned Remaining;
     std::tie(VariableType, Remaining) = getTypeAtOffset(ModuleLayout,
@@ -831,9 +863,8 @@ VariableManager::getByCPUStateOffsetInternal(intptr_t Offset,
 
     // Check we're not trying to go inside an existing variable
     if (Remaining != 0) {
-      GlobalsMap::iterator it = CPUStateGlobals.find(Offset - Remaining);
-      if (it != CPUStateGlobals.end())
-        return { it->second, Remaining };
+      if (GlobalVariable *Container = findCPUStateGlobal(Offset - Remaining))
+        return { Container, Remaining };
     }
 
     // Unsupported type, let the caller handle the situation
@@ -858,17 +889,81 @@ VariableManager::getByCPUStateOffsetInternal(intptr_t Offset,
                                            Name);
     assert(NewVariable != nullptr);
 
-    if (it != CPUStateGlobals.end()) {
-      it->second->replaceAllUsesWith(NewVariable);
-      it->second->eraseFromParent();
+    if (Existing != nullptr) {
+      std::replace(GlobalTemporaries.begin(),
+                   GlobalTemporaries.end(),
+                   Existing,
+                   static_cast<GlobalVariable *>(nullptr));
+      Existing->replaceAllUsesWith(NewVariable);
+      Existing->eraseFromParent();
     }
 
+    // getTypeAtOffset fails outside of the CPU state
+    assert(Offset >= 0
+           && static_cast<uint64_t>(Offset) < CPUStateGlobals.size());
     CPUStateGlobals[Offset] = NewVariable;
 
     return { NewVariable, Remaining };
   } else {
-    return { it->second, 0 };
+    return { Existing, 0 };
+  }
+}
+
+std::pair<Type *, unsigned>
+VariableManager::getTypeByEnvOffset(intptr_t Offset) const {
+  // Mirror getByCPUStateOffsetInternal, looking up the existing variables
+  // first, but never create one
+  Offset += EnvOffset;
+  if (Offset < 0 || static_cast<uint64_t>(Offset) >= CPUStateGlobals.size())
+    return { nullptr, 0 };
+
+  if (GlobalVariable *Existing = findCPUStateGlobal(Offset))
+    return { Existing->getType()->getPointerElementType(), 0 };
+
+  Type *VariableType;
+  unsigned Remaining;
+  std::tie(VariableType, Remaining) = getTypeAtOffset(ModuleLayout,
+                                                      CPUStateType,
+                                                      Offset);
+  if (Remaining != 0) {
+    if (GlobalVariable *Container = findCPUStateGlobal(Offset - Remaining))
+      return { Container->getType()->getPointerElementType(), Remaining };
   }
+
+  if (VariableType == nullptr)
+    return { nullptr, 0 };
+
+  return { VariableType, Remaining };
+}
+
+Function *VariableManager::createCPUStateCopy(StringRef Name, bool Load) {
+  LLVMContext &Context = TheModule.getContext();
+  Type *BufferType = Type::getInt8PtrTy(Context);
+  auto *CopyType = FunctionType::get(Type::getVoidTy(Context),
+                                     { BufferType },
+                                     false);
+  auto *Copy = Function::Create(CopyType,
+                                GlobalValue::ExternalLinkage,
+                                Name,
+                                &TheModule);
+
+  IRBuilder<> CopyBuilder(BasicBlock::Create(Context, "", Copy));
+  Value *Buffer = &*Copy->arg_begin();
+  for (unsigned Offset = 0; Offset < CPUStateGlobals.size(); Offset++) {
+    GlobalVariable *Variable = CPUStateGlobals[Offset];
+    if (Variable == nullptr)
+      continue;
+
+    Value *Address = CopyBuilder.CreateConstGEP1_32(Buffer, Offset);
+    Address = CopyBuilder.CreateBitCast(Address, Variable->getType());
+    if (Load)
+      CopyBuilder.CreateStore(CopyBuilder.CreateLoad(Address), Variable);
+    else
+      CopyBuilder.CreateStore(CopyBuilder.CreateLoad(Variable), Address);
+  }
+  CopyBuilder.CreateRetVoid();
+
+  return Copy;
 }
 
 Value *VariableManager::getOrCreate(unsigned TemporaryId, bool Reading) {
@@ -881,9 +976,22 @@ Value *VariableManager::getOrCreate(unsigned TemporaryId, bool Reading) {
   if (ptc_temp_is_global(Instructions, TemporaryId)) {
     // Basically we use fixed_reg to detect "env"
     if (Temporary->fixed_reg == 0) {
-      Value *Result = getByCPUStateOffset(EnvOffset + Temporary->mem_offset,
-                                          StringRef(Temporary->name));
+      intptr_t Offset = EnvOffset + Temporary->mem_offset;
+
+      // If the variable last returned for this temporary is still the one at
+      // its offset, its name has already been checked
+      if (TemporaryId < GlobalTemporaries.size()) {
+        GlobalVariable *Cached = GlobalTemporaries[TemporaryId];
+        if (Cached != nullptr && Cached == findCPUStateGlobal(Offset))
+          return Cached;
+      } else {
+        GlobalTemporaries.resize(TemporaryId + 1, nullptr);
+      }
+
+      GlobalVariable *Result = getByCPUStateOffset(Offset,
+                                                   StringRef(Temporary->name));
       assert(Result != nullptr);
+      GlobalTemporaries[TemporaryId] = Result;
       return Result;
     } else {
       GlobalsMap::iterator it = OtherGlobals.find(TemporaryId);
@@ -907,18 +1015,16 @@ Value *VariableManager::getOrCreate(unsigned TemporaryId, bool Reading) {
       }
     }
   } else if (Temporary->temp_local) {
-    auto it = LocalTemporaries.find(TemporaryId);
-    if (it != LocalTemporaries.end()) {
-      return it->second;
+    if (AllocaInst *Existing = LocalTemporaries.get(TemporaryId)) {
+      return Existing;
     } else {
       AllocaInst *NewTemporary = Builder.CreateAlloca(VariableType);
-      LocalTemporaries[TemporaryId] = NewTemporary;
+      LocalTemporaries.set(TemporaryId, NewTemporary);
       return NewTemporary;
     }
   } else {
-    auto it = Temporaries.find(TemporaryId);
-    if (it != Temporaries.end()) {
-      return it->second;
+    if (AllocaInst *Existing = Temporaries.get(TemporaryId)) {
+      return Existing;
     } else {
       // Can't read a temporary if it has never been written, we're probably
       // translating rubbish
@@ -926,7 +1032,7 @@ Value *VariableManager::getOrCreate(unsigned TemporaryId, bool Reading) {
         return nullptr;
 
       AllocaInst *NewTemporary = Builder.CreateAlloca(VariableType);
-      Temporaries[TemporaryId] = NewTemporary;
+      Temporaries.set(TemporaryId, NewTemporary);
       return NewTemporary;
     }
   }
@@ -9,6 +9,8 @@
 #include <cstdint>
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 // LLVM includes
 #include "llvm/IR/IRBuilder.h"
@@ -30,6 +32,58 @@ class Value;
 
 class VariableManager;
 
+/// \brief Map from PTC temporary identifiers to the corresponding allocas,
+///        which can be cleared in constant time
+///
+/// The entries are stored in a vector indexed by temporary identifier. Each
+/// entry records the generation in which it has been set, clearing the table
+/// simply starts a new generation, invalidating all the existing entries.
+class TemporariesTable {
+public:
+  TemporariesTable() : Generation(1) { }
+
+  /// \return the alloca associated to \p TemporaryId in the current
+  ///         generation, or nullptr.
+  llvm::AllocaInst *get(unsigned TemporaryId) const {
+    if (TemporaryId >= Entries.size())
+      return nullptr;
+
+    const Entry &TheEntry = Entries[TemporaryId];
+    return TheEntry.first == Generation ? TheEntry.second : nullptr;
+  }
+
+  void set(unsigned TemporaryId, llvm::AllocaInst *Alloca) {
+    if (TemporaryId >= Entries.size())
+      Entries.resize(TemporaryId + 1, Entry(0, nullptr));
+    Entries[TemporaryId] = Entry(Generation, Alloca);
+  }
+
+  void clear() {
+    // Generation 0 marks the entries which have never been set, on overflow
+    // actually empty the table
+    if (++Generation == 0) {
+      Entries.clear();
+      Generation = 1;
+    }
+  }
+
+  /// \brief Return the allocas of the current generation, sorted by temporary
+  ///        identifier
+  std::vector<llvm::AllocaInst *> values() const {
+    std::vector<llvm::AllocaInst *> Result;
+    for (const Entry &TheEntry : Entries)
+      if (TheEntry.first == Generation)
+        Result.push_back(TheEntry.second);
+    return Result;
+  }
+
+private:
+  using Entry = std::pair<unsigned, llvm::AllocaInst *>;
+
+  unsigned Generation;
+  std::vector<Entry> Entries;
+};
+
 /// \brief LLVM pass to change all the access to the CPU state to the
 ///        corresponding global variables.
 ///
@@ -69,6 +123,14 @@ public:
                   llvm::Module& HelpersModule,
                   Architecture &TargetArchitecture);
 
+  /// \brief Elect in advance the CPU state type of \p HelpersModule
+  ///
+  /// The election considers the parameters of all the helper functions. The
+  /// result is cached and reused by all the VariableManager created on
+  /// \p HelpersModule, therefore the module must outlive them (e.g., the
+  /// helpers modules preloaded by the batch mode for each architecture).
+  static void electCPUStateType(llvm::Module &HelpersModule);
+
   friend class CorrectCPUStateUsagePass;
 
   /// \brief Get or create the LLVM value associated to a PTC temporary
@@ -97,6 +159,16 @@ public:
     return getByCPUStateOffsetInternal(EnvOffset + Offset, Name);
   }
 
+  /// \brief Return the type of the CPU state variable containing \p Offset
+  ///        and the offset in it, without creating the variable
+  ///
+  /// \param Offset the offset in the CPU state (the `env` PTC variable).
+  ///
+  /// \return the same type and offset the variable returned by getByEnvOffset
+  ///         would have, or nullptr if there's no supported field at
+  ///         \p Offset.
+  std::pair<llvm::Type *, unsigned> getTypeByEnvOffset(intptr_t Offset) const;
+
   /// \brief Notify VariableManager to reset all the "function"-specific
   ///        information
   ///
@@ -132,6 +204,15 @@ public:
     return new CorrectCPUStateUsagePass(this, EnvOffset);
   }
 
+  /// \brief Return the global variables representing the CPU state
+  std::vector<llvm::GlobalVariable *> cpuStateVariables() const {
+    std::vector<llvm::GlobalVariable *> Result;
+    for (llvm::GlobalVariable *Variable : CPUStateGlobals)
+      if (Variable != nullptr)
+        Result.push_back(Variable);
+    return Result;
+  }
+
   llvm::Value *computeEnvAddress(llvm::Type *TargetType,
                                  llvm::Instruction *InsertBefore,
                                  unsigned Offset = 0);
@@ -147,10 +228,7 @@ public:
   T *setNoAlias(T *Instruction);
 
   std::vector<llvm::AllocaInst *> locals() {
-    std::vector<llvm::AllocaInst *> Locals;
-    for (auto Pair : LocalTemporaries)
-      Locals.push_back(Pair.second);
-    return Locals;
+    return LocalTemporaries.values();
   }
 
   llvm::Value *loadFromEnvOffset(llvm::IRBuilder<> &Builder,
@@ -170,15 +248,37 @@ public:
   /// \brief Perform finalization steps on variables
   ///
   /// \param ExternalCSVs true if CSVs linkage should not be turned into static.
-  void finalize(bool ExternalCSVs) {
+  /// \param ThreadLocal true if each thread should have its own copy of the
+  ///        CSVs and of the other PTC globals.
+  void finalize(bool ExternalCSVs, bool ThreadLocal) {
     if (!ExternalCSVs) {
-      for (auto P : CPUStateGlobals)
-        P.second->setLinkage(llvm::GlobalValue::InternalLinkage);
+      for (llvm::GlobalVariable *Variable : cpuStateVariables())
+        Variable->setLinkage(llvm::GlobalValue::InternalLinkage);
       for (auto P : OtherGlobals)
         P.second->setLinkage(llvm::GlobalValue::InternalLinkage);
     }
+
+    if (ThreadLocal) {
+      for (llvm::GlobalVariable *Variable : cpuStateVariables())
+        Variable->setThreadLocal(true);
+      for (auto P : OtherGlobals)
+        P.second->setThreadLocal(true);
+    }
   }
 
+  /// \brief Size in bytes of the CPU state
+  uint64_t cpuStateSize() const { return CPUStateGlobals.size(); }
+
+  /// \brief Create a function copying all the CSVs from or to a buffer
+  ///
+  /// The function takes as argument a pointer to a buffer of cpuStateSize()
+  /// bytes, where each CSV lives at its offset in the CPU state.
+  ///
+  /// \param Name the name of the function.
+  /// \param Load true if the CSVs should be loaded from the buffer, false if
+  ///        they should be stored to it.
+  llvm::Function *createCPUStateCopy(llvm::StringRef Name, bool Load);
+
 private:
   llvm::Value *loadFromCPUStateOffset(llvm::IRBuilder<> &Builder,
                                       unsigned LoadSize,
@@ -195,15 +295,26 @@ private:
     getByCPUStateOffsetInternal(intptr_t Offset,
                                 std::string Name="");
 
+  /// \brief Return the global variable starting at \p Offset in the CPU
+  ///        state, or nullptr
+  llvm::GlobalVariable *findCPUStateGlobal(intptr_t Offset) const {
+    if (Offset < 0 || static_cast<uint64_t>(Offset) >= CPUStateGlobals.size())
+      return nullptr;
+    return CPUStateGlobals[Offset];
+  }
+
 private:
   llvm::Module& TheModule;
   llvm::IRBuilder<> Builder;
-  using TemporariesMap = std::map<unsigned int, llvm::AllocaInst *>;
   using GlobalsMap = std::map<intptr_t, llvm::GlobalVariable *>;
-  GlobalsMap CPUStateGlobals;
+  /// The global variable starting at each offset of the CPU state, if any
+  std::vector<llvm::GlobalVariable *> CPUStateGlobals;
+  /// The CPU state global variable last returned for each global temporary,
+  /// by temporary identifier
+  std::vector<llvm::GlobalVariable *> GlobalTemporaries;
   GlobalsMap OtherGlobals;
-  TemporariesMap Temporaries;
-  TemporariesMap LocalTemporaries;
+  TemporariesTable Temporaries;
+  TemporariesTable LocalTemporaries;
   PTCInstructionList *Instructions;
 
   llvm::StructType *CPUStateType;
@@ -0,0 +1,489 @@
+/// \file vectorhelpers.cpp
+/// \brief Lowering of the SSE and NEON helpers to LLVM vector operations
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <vector>
+
+// LLVM includes
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+
+// Local includes
+#include "ir-helpers.h"
+#include "statistics.h"
+#include "variablemanager.h"
+#include "vectorhelpers.h"
+
+using namespace llvm;
+
+enum class VectorOperation {
+  Add,
+  Sub,
+  Mul,
+  MulHighUnsigned,
+  MulHighSigned,
+  MulEvenUnsigned,
+  MinUnsigned,
+  MaxUnsigned,
+  MinSigned,
+  MaxSigned,
+  And,
+  AndNot,
+  Or,
+  Xor,
+  Equal,
+  GreaterSigned,
+  GreaterUnsigned,
+  GreaterEqualSigned,
+  GreaterEqualUnsigned,
+  AverageUnsigned,
+  UnpackLow,
+  UnpackHigh
+};
+
+struct SSEHelper {
+  const char *Name;
+  VectorOperation Operation;
+  unsigned ElementSize;
+};
+
+/// The SSE helpers taking `env` and the pointers to the destination and the
+/// source XMM registers, working element by element
+static const SSEHelper SSEHelpers[] = {
+  { "paddb", VectorOperation::Add, 8 },
+  { "paddw", VectorOperation::Add, 16 },
+  { "paddl", VectorOperation::Add, 32 },
+  { "paddq", VectorOperation::Add, 64 },
+  { "psubb", VectorOperation::Sub, 8 },
+  { "psubw", VectorOperation::Sub, 16 },
+  { "psubl", VectorOperation::Sub, 32 },
+  { "psubq", VectorOperation::Sub, 64 },
+  { "pmullw", VectorOperation::Mul, 16 },
+  { "pmulld", VectorOperation::Mul, 32 },
+  { "pmulhuw", VectorOperation::MulHighUnsigned, 16 },
+  { "pmulhw", VectorOperation::MulHighSigned, 16 },
+  { "pmuludq", VectorOperation::MulEvenUnsigned, 32 },
+  { "pminub", VectorOperation::MinUnsigned, 8 },
+  { "pminuw", VectorOperation::MinUnsigned, 16 },
+  { "pminud", VectorOperation::MinUnsigned, 32 },
+  { "pmaxub", VectorOperation::MaxUnsigned, 8 },
+  { "pmaxuw", VectorOperation::MaxUnsigned, 16 },
+  { "pmaxud", VectorOperation::MaxUnsigned, 32 },
+  { "pminsb", VectorOperation::MinSigned, 8 },
+  { "pminsw", VectorOperation::MinSigned, 16 },
+  { "pminsd", VectorOperation::MinSigned, 32 },
+  { "pmaxsb", VectorOperation::MaxSigned, 8 },
+  { "pmaxsw", VectorOperation::MaxSigned, 16 },
+  { "pmaxsd", VectorOperation::MaxSigned, 32 },
+  { "pand", VectorOperation::And, 64 },
+  { "pandn", VectorOperation::AndNot, 64 },
+  { "por", VectorOperation::Or, 64 },
+  { "pxor", VectorOperation::Xor, 64 },
+  { "pcmpeqb", VectorOperation::Equal, 8 },
+  { "pcmpeqw", VectorOperation::Equal, 16 },
+  { "pcmpeql", VectorOperation::Equal, 32 },
+  { "pcmpeqq", VectorOperation::Equal, 64 },
+  { "pcmpgtb", VectorOperation::GreaterSigned, 8 },
+  { "pcmpgtw", VectorOperation::GreaterSigned, 16 },
+  { "pcmpgtl", VectorOperation::GreaterSigned, 32 },
+  { "pcmpgtq", VectorOperation::GreaterSigned, 64 },
+  { "pavgb", VectorOperation::AverageUnsigned, 8 },
+  { "pavgw", VectorOperation::AverageUnsigned, 16 },
+  { "punpcklbw", VectorOperation::UnpackLow, 8 },
+  { "punpcklwd", VectorOperation::UnpackLow, 16 },
+  { "punpckldq", VectorOperation::UnpackLow, 32 },
+  { "punpcklqdq", VectorOperation::UnpackLow, 64 },
+  { "punpckhbw", VectorOperation::UnpackHigh, 8 },
+  { "punpckhwd", VectorOperation::UnpackHigh, 16 },
+  { "punpckhdq", VectorOperation::UnpackHigh, 32 },
+  { "punpckhqdq", VectorOperation::UnpackHigh, 64 }
+};
+
+/// \brief Follow \p V back to a constant or to `env` plus a constant
+///
+/// The temporaries are followed back to the last store to them in the basic
+/// block being translated.
+///
+/// \param IsEnvRelative set to true if `env` has been met.
+/// \param Offset incremented by the constant part of \p V.
+static bool resolve(VariableManager &Variables,
+                    Value *V,
+                    bool &IsEnvRelative,
+                    int64_t &Offset,
+                    unsigned Depth = 0) {
+  if (Depth > 8)
+    return false;
+
+  if (auto *Constant = dyn_cast<ConstantInt>(V)) {
+    Offset += Constant->getSExtValue();
+    return true;
+  }
+
+  if (Variables.isEnv(V)) {
+    if (IsEnvRelative)
+      return false;
+    IsEnvRelative = true;
+    return true;
+  }
+
+  if (auto *Load = dyn_cast<LoadInst>(V)) {
+    auto *Temporary = dyn_cast<AllocaInst>(Load->getPointerOperand());
+    if (Temporary == nullptr)
+      return false;
+
+    for (Instruction &I : backward_range(Load))
+      if (auto *Store = dyn_cast<StoreInst>(&I))
+        if (Store->getPointerOperand() == Temporary)
+          return resolve(Variables,
+                         Store->getValueOperand(),
+                         IsEnvRelative,
+                         Offset,
+                         Depth + 1);
+
+    return false;
+  }
+
+  auto *Add = dyn_cast<BinaryOperator>(V);
+  if (Add != nullptr && Add->getOpcode() == Instruction::Add)
+    return resolve(Variables, Add->getOperand(0), IsEnvRelative, Offset,
+                   Depth + 1)
+      && resolve(Variables, Add->getOperand(1), IsEnvRelative, Offset,
+                 Depth + 1);
+
+  return false;
+}
+
+static bool getEnvOffset(VariableManager &Variables,
+                         Value *Pointer,
+                         int64_t &Offset) {
+  bool IsEnvRelative = false;
+  Offset = 0;
+  return resolve(Variables, Pointer, IsEnvRelative, Offset) && IsEnvRelative;
+}
+
+static bool getConstant(VariableManager &Variables,
+                        Value *V,
+                        int64_t &Result) {
+  bool IsEnvRelative = false;
+  Result = 0;
+  return resolve(Variables, V, IsEnvRelative, Result) && !IsEnvRelative;
+}
+
+static Constant *getMask(IRBuilder<> &Builder, ArrayRef<unsigned> Indices) {
+  std::vector<Constant *> Elements;
+  for (unsigned Index : Indices)
+    Elements.push_back(Builder.getInt32(Index));
+  return ConstantVector::get(Elements);
+}
+
+/// \brief Emit \p Operation on each pair of elements of \p A and \p B
+static Value *emitOperation(IRBuilder<> &Builder,
+                            VectorOperation Operation,
+                            Value *A,
+                            Value *B) {
+  auto *Type = cast<VectorType>(A->getType());
+  unsigned Count = Type->getNumElements();
+  unsigned Size = Type->getScalarSizeInBits();
+  auto *WideType = VectorType::get(Builder.getIntNTy(Size * 2), Count);
+
+  switch (Operation) {
+  case VectorOperation::Add:
+    return Builder.CreateAdd(A, B);
+  case VectorOperation::Sub:
+    return Builder.CreateSub(A, B);
+  case VectorOperation::Mul:
+    return Builder.CreateMul(A, B);
+  case VectorOperation::MulHighUnsigned:
+    {
+      Value *Product = Builder.CreateMul(Builder.CreateZExt(A, WideType),
+                                         Builder.CreateZExt(B, WideType));
+      return Builder.CreateTrunc(Builder.CreateLShr(Product, Size), Type);
+    }
+  case VectorOperation::MulHighSigned:
+    {
+      Value *Product = Builder.CreateMul(Builder.CreateSExt(A, WideType),
+                                         Builder.CreateSExt(B, WideType));
+      return Builder.CreateTrunc(Builder.CreateAShr(Product, Size), Type);
+    }
+  case VectorOperation::MulEvenUnsigned:
+    {
+      // Multiply the even elements, the result has elements twice as large
+      std::vector<unsigned> Even;
+      for (unsigned I = 0; I < Count; I += 2)
+        Even.push_back(I);
+      Constant *Mask = getMask(Builder, Even);
+      auto *ResultType = VectorType::get(Builder.getIntNTy(Size * 2),
+                                         Count / 2);
+      Value *EvenA = Builder.CreateShuffleVector(A, UndefValue::get(Type),
+                                                 Mask);
+      Value *EvenB = Builder.CreateShuffleVector(B, UndefValue::get(Type),
+                                                 Mask);
+      return Builder.CreateMul(Builder.CreateZExt(EvenA, ResultType),
+                               Builder.CreateZExt(EvenB, ResultType));
+    }
+  case VectorOperation::MinUnsigned:
+    return Builder.CreateSelect(Builder.CreateICmpULT(A, B), A, B);
+  case VectorOperation::MaxUnsigned:
+    return Builder.CreateSelect(Builder.CreateICmpUGT(A, B), A, B);
+  case VectorOperation::MinSigned:
+    return Builder.CreateSelect(Builder.CreateICmpSLT(A, B), A, B);
+  case VectorOperation::MaxSigned:
+    return Builder.CreateSelect(Builder.CreateICmpSGT(A, B), A, B);
+  case VectorOperation::And:
+    return Builder.CreateAnd(A, B);
+  case VectorOperation::AndNot:
+    return Builder.CreateAnd(Builder.CreateNot(A), B);
+  case VectorOperation::Or:
+    return Builder.CreateOr(A, B);
+  case VectorOperation::Xor:
+    return Builder.CreateXor(A, B);
+  case VectorOperation::Equal:
+    return Builder.CreateSExt(Builder.CreateICmpEQ(A, B), Type);
+  case VectorOperation::GreaterSigned:
+    return Builder.CreateSExt(Builder.CreateICmpSGT(A, B), Type);
+  case VectorOperation::GreaterUnsigned:
+    return Builder.CreateSExt(Builder.CreateICmpUGT(A, B), Type);
+  case VectorOperation::GreaterEqualSigned:
+    return Builder.CreateSExt(Builder.CreateICmpSGE(A, B), Type);
+  case VectorOperation::GreaterEqualUnsigned:
+    return Builder.CreateSExt(Builder.CreateICmpUGE(A, B), Type);
+  case VectorOperation::AverageUnsigned:
+    {
+      Value *Sum = Builder.CreateAdd(Builder.CreateZExt(A, WideType),
+                                     Builder.CreateZExt(B, WideType));
+      Sum = Builder.CreateAdd(Sum, ConstantInt::get(WideType, 1));
+      return Builder.CreateTrunc(Builder.CreateLShr(Sum, 1), Type);
+    }
+  case VectorOperation::UnpackLow:
+  case VectorOperation::UnpackHigh:
+    {
+      // Interleave the elements of the lower (or upper) halves
+      unsigned Base = Operation == VectorOperation::UnpackLow ? 0 : Count / 2;
+      std::vector<unsigned> Indices;
+      for (unsigned I = 0; I < Count / 2; I++) {
+        Indices.push_back(Base + I);
+        Indices.push_back(Count + Base + I);
+      }
+      return Builder.CreateShuffleVector(A, B, getMask(Builder, Indices));
+    }
+  }
+
+  llvm_unreachable("Unexpected vector operation");
+}
+
+bool VectorHelpers::lower(IRBuilder<> &Builder,
+                          StringRef Name,
+                          ArrayRef<Value *> Arguments,
+                          Type *ResultType,
+                          Value *&Result) {
+  Result = nullptr;
+
+  // Vector elements are laid out in memory according to the endianess of the
+  // output architecture
+  if (!IsLittleEndian)
+    return false;
+
+  bool Lowered = false;
+  if (Name.startswith("neon_")) {
+    if (ResultType->isIntegerTy(32))
+      Lowered = lowerNEON(Builder, Name, Arguments, Result);
+  } else if (Name.endswith("_xmm")) {
+    if (ResultType->isVoidTy())
+      Lowered = lowerSSE(Builder, Name, Arguments);
+  }
+
+  if (Lowered)
+    incrementCounter("vector-helpers.lowered-calls");
+
+  return Lowered;
+}
+
+bool VectorHelpers::isXMMRegister(int64_t EnvOffset) const {
+  // Only look at the types, the variables are created if the call is lowered
+  for (unsigned Quadword = 0; Quadword < 2; Quadword++) {
+    Type *VariableType;
+    unsigned Remaining;
+    std::tie(VariableType, Remaining) =
+      Variables.getTypeByEnvOffset(EnvOffset + Quadword * 8);
+    if (VariableType == nullptr
+        || Remaining != 0
+        || !VariableType->isIntegerTy(64))
+      return false;
+  }
+
+  return true;
+}
+
+Value *VectorHelpers::loadXMM(IRBuilder<> &Builder,
+                              int64_t EnvOffset,
+                              VectorType *Type) {
+  Value *Result = UndefValue::get(VectorType::get(Builder.getInt64Ty(), 2));
+  for (unsigned Quadword = 0; Quadword < 2; Quadword++) {
+    Value *Element = Variables.loadFromEnvOffset(Builder,
+                                                 8,
+                                                 EnvOffset + Quadword * 8);
+    assert(Element != nullptr);
+    Result = Builder.CreateInsertElement(Result, Element, Quadword);
+  }
+
+  return Builder.CreateBitCast(Result, Type);
+}
+
+void VectorHelpers::storeXMM(IRBuilder<> &Builder,
+                             int64_t EnvOffset,
+                             Value *Vector) {
+  auto *QuadwordsType = VectorType::get(Builder.getInt64Ty(), 2);
+  Value *Quadwords = Builder.CreateBitCast(Vector, QuadwordsType);
+  for (unsigned Quadword = 0; Quadword < 2; Quadword++) {
+    Value *Element = Builder.CreateExtractElement(Quadwords, Quadword);
+    bool Stored = Variables.storeToEnvOffset(Builder,
+                                             8,
+                                             EnvOffset + Quadword * 8,
+                                             Element);
+    assert(Stored);
+    (void) Stored;
+  }
+}
+
+bool VectorHelpers::lowerSSE(IRBuilder<> &Builder,
+                             StringRef Name,
+                             ArrayRef<Value *> Arguments) {
+  StringRef Operation = Name.drop_back(strlen("_xmm"));
+
+  // pshufd, pshuflw and pshufhw take the destination, the source and the
+  // order of the elements
+  if (Operation == "pshufd"
+      || Operation == "pshuflw"
+      || Operation == "pshufhw") {
+    int64_t Destination, Source, Order;
+    if (Arguments.size() != 3
+        || !getEnvOffset(Variables, Arguments[0], Destination)
+        || !getEnvOffset(Variables, Arguments[1], Source)
+        || !getConstant(Variables, Arguments[2], Order)
+        || !isXMMRegister(Destination)
+        || !isXMMRegister(Source))
+      return false;
+
+    std::vector<unsigned> Indices;
+    unsigned Size;
+    if (Operation == "pshufd") {
+      Size = 32;
+      for (unsigned I = 0; I < 4; I++)
+        Indices.push_back((Order >> (I * 2)) & 3);
+    } else {
+      // Shuffle the words of a quadword, keep the other one
+      bool Low = Operation == "pshuflw";
+      Size = 16;
+      for (unsigned I = 0; I < 8; I++) {
+        if (Low == (I < 4)) {
+          unsigned Base = Low ? 0 : 4;
+          Indices.push_back(Base + ((Order >> ((I - Base) * 2)) & 3));
+        } else {
+          Indices.push_back(I);
+        }
+      }
+    }
+
+    auto *Type = VectorType::get(Builder.getIntNTy(Size), 128 / Size);
+    Value *Vector = loadXMM(Builder, Source, Type);
+    Value *Result = Builder.CreateShuffleVector(Vector,
+                                                UndefValue::get(Type),
+                                                getMask(Builder, Indices));
+    storeXMM(Builder, Destination, Result);
+    return true;
+  }
+
+  const SSEHelper *Helper = nullptr;
+  for (const SSEHelper &Candidate : SSEHelpers) {
+    if (Operation == Candidate.Name) {
+      Helper = &Candidate;
+      break;
+    }
+  }
+
+  if (Helper == nullptr)
+    return false;
+
+  // The other helpers take env, the destination and the source
+  int64_t Destination, Source;
+  if (Arguments.size() != 3
+      || !Variables.isEnv(Arguments[0])
+      || !getEnvOffset(Variables, Arguments[1], Destination)
+      || !getEnvOffset(Variables, Arguments[2], Source)
+      || !isXMMRegister(Destination)
+      || !isXMMRegister(Source))
+    return false;
+
+  unsigned Size = Helper->ElementSize;
+  auto *Type = VectorType::get(Builder.getIntNTy(Size), 128 / Size);
+  Value *A = loadXMM(Builder, Destination, Type);
+  Value *B = loadXMM(Builder, Source, Type);
+  storeXMM(Builder, Destination, emitOperation(Builder,
+                                               Helper->Operation,
+                                               A,
+                                               B));
+  return true;
+}
+
+bool VectorHelpers::lowerNEON(IRBuilder<> &Builder,
+                              StringRef Name,
+                              ArrayRef<Value *> Arguments,
+                              Value *&Result) {
+  // The name has the form neon_<operation>_<s|u><element size>
+  StringRef Operation, Suffix;
+  std::tie(Operation, Suffix) = Name.drop_front(strlen("neon_")).split('_');
+  if (Suffix.size() < 2 || (Suffix[0] != 's' && Suffix[0] != 'u'))
+    return false;
+
+  bool Signed = Suffix[0] == 's';
+  unsigned Size;
+  if (Suffix.drop_front(1).getAsInteger(10, Size)
+      || (Size != 8 && Size != 16 && Size != 32))
+    return false;
+
+  VectorOperation TheOperation;
+  if (Operation == "add")
+    TheOperation = VectorOperation::Add;
+  else if (Operation == "sub")
+    TheOperation = VectorOperation::Sub;
+  else if (Operation == "mul")
+    TheOperation = VectorOperation::Mul;
+  else if (Operation == "ceq")
+    TheOperation = VectorOperation::Equal;
+  else if (Operation == "cgt")
+    TheOperation = Signed ? VectorOperation::GreaterSigned
+                          : VectorOperation::GreaterUnsigned;
+  else if (Operation == "cge")
+    TheOperation = Signed ? VectorOperation::GreaterEqualSigned
+                          : VectorOperation::GreaterEqualUnsigned;
+  else if (Operation == "min")
+    TheOperation = Signed ? VectorOperation::MinSigned
+                          : VectorOperation::MinUnsigned;
+  else if (Operation == "max")
+    TheOperation = Signed ? VectorOperation::MaxSigned
+                          : VectorOperation::MaxUnsigned;
+  else
+    return false;
+
+  if (Arguments.size() != 2
+      || !Arguments[0]->getType()->isIntegerTy(32)
+      || !Arguments[1]->getType()->isIntegerTy(32))
+    return false;
+
+  auto *Type = VectorType::get(Builder.getIntNTy(Size), 32 / Size);
+  Value *A = Builder.CreateBitCast(Arguments[0], Type);
+  Value *B = Builder.CreateBitCast(Arguments[1], Type);
+  Result = Builder.CreateBitCast(emitOperation(Builder, TheOperation, A, B),
+                                 Builder.getInt32Ty());
+  return true;
+}
@@ -0,0 +1,95 @@
+#ifndef _VECTORHELPERS_H
+#define _VECTORHELPERS_H
+
+//
+// This file is distributed under the MIT License. See LICENSE.md for details.
+//
+
+// Standard includes
+#include <cstdint>
+
+// LLVM includes
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/IRBuilder.h"
+
+// Forward declarations
+namespace llvm {
+class Type;
+class Value;
+class VectorType;
+}
+
+class VariableManager;
+
+/// \brief Translate the calls to the most common SIMD helpers to LLVM vector
+///        operations
+///
+/// QEMU translates most SSE instructions (x86-64) to calls to helpers which
+/// take pointers to the XMM registers in the CPU state and process them an
+/// element at a time. The integer arithmetic, logical, comparison, shuffle and
+/// unpack helpers are recognized by name and replaced by loads of the CPU
+/// state variables holding the registers, an LLVM vector operation and stores
+/// to the destination register. The pointer arguments must be, at translation
+/// time, `env` plus a constant.
+///
+/// Similarly, the NEON helpers (ARM) working on the lanes of 32-bit values
+/// (e.g., `neon_add_u8`, `neon_cgt_s16`) are replaced by the corresponding
+/// operation on a vector of 8- or 16-bit elements.
+///
+/// The floating point helpers are not handled, since they depend on the
+/// rounding and exception state of the emulated CPU. Moves between registers
+/// are already translated to plain loads and stores by QEMU.
+class VectorHelpers {
+public:
+  /// \param IsLittleEndian whether the output architecture is little endian,
+  ///        the lowering is performed only in this case.
+  VectorHelpers(VariableManager &Variables, bool IsLittleEndian) :
+    Variables(Variables),
+    IsLittleEndian(IsLittleEndian) { }
+
+  /// \brief Try to emit vector code with the same effect as a call to a helper
+  ///
+  /// \param Name the name of the helper, without the `helper_` prefix.
+  /// \param Arguments the arguments of the call.
+  /// \param ResultType the type returned by the helper.
+  /// \param Result where the value computed in place of the one returned by
+  ///        the helper should be stored, nullptr if it returns `void`.
+  ///
+  /// \return true if the call has been lowered, in which case it must not be
+  ///         emitted. If false is returned, no code has been emitted.
+  bool lower(llvm::IRBuilder<> &Builder,
+             llvm::StringRef Name,
+             llvm::ArrayRef<llvm::Value *> Arguments,
+             llvm::Type *ResultType,
+             llvm::Value *&Result);
+
+private:
+  bool lowerSSE(llvm::IRBuilder<> &Builder,
+                llvm::StringRef Name,
+                llvm::ArrayRef<llvm::Value *> Arguments);
+
+  bool lowerNEON(llvm::IRBuilder<> &Builder,
+                 llvm::StringRef Name,
+                 llvm::ArrayRef<llvm::Value *> Arguments,
+                 llvm::Value *&Result);
+
+  /// \brief Check that the 16 bytes at \p EnvOffset are held by two 64-bit
+  ///        CPU state variables, without creating them
+  bool isXMMRegister(int64_t EnvOffset) const;
+
+  /// \brief Load the XMM register at \p EnvOffset as a vector of \p Type
+  llvm::Value *loadXMM(llvm::IRBuilder<> &Builder,
+                       int64_t EnvOffset,
+                       llvm::VectorType *Type);
+
+  void storeXMM(llvm::IRBuilder<> &Builder,
+                int64_t EnvOffset,
+                llvm::Value *Vector);
+
+private:
+  VariableManager &Variables;
+  bool IsLittleEndian;
+};
+
+#endif // _VECTORHELPERS_H